@@ -0,0 +1,381 @@
+#ifndef BINARY_MANIFEST_H
+#define BINARY_MANIFEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "manifest.h"
+
+/*
+Binary manifest file format (.manifest.bin), native byte order:
+
+<header>
+<entry 0><entry 1>...<entry numFiles - 1>
+<string pool>
+
+Every entry is fixed width, the file path is an offset of a '\0'
+terminated string in the pool. Entries are in the same sorted order
+as the text manifest, so a path can be found with a binary search
+directly on the mapped file, without parsing or allocating anything.
+*/
+
+#define BINARY_MANIFEST_MAGIC "WTFM"
+#define BINARY_MANIFEST_FORMAT 1
+
+static char *BINARY_MANIFEST_FILE = ".manifest.bin";
+
+typedef struct BinaryManifestHeader {
+	char magic[4];
+	uint32_t format;
+	uint32_t numFiles;
+	uint32_t projectNameOffset;
+	uint32_t versionNumberOffset;
+	uint32_t poolOffset;  // from start of file
+	uint32_t poolSize;
+	uint32_t hashAlgorithm;  // 0 (md5) in files of older builds.
+} BinaryManifestHeader;
+
+typedef struct BinaryManifestEntry {
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	uint32_t version;
+	uint32_t pathOffset;  // in string pool
+} BinaryManifestEntry;
+
+typedef struct BinaryManifest {
+	void *base;
+	size_t size;
+	BinaryManifestHeader *header;
+	BinaryManifestEntry *entries;
+	char *pool;
+} BinaryManifest;
+
+int hexCharValue(char c) {
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return 0;
+}
+
+void hexToDigest(char *hex, unsigned char digest[]) {
+	int i;
+	for(i = 0; i < MD5_DIGEST_LENGTH; i++) {
+		digest[i] = (hexCharValue(hex[2*i]) << 4) | hexCharValue(hex[2*i + 1]);
+	}
+}
+
+// hex must have space for HASH_STRING_LEN + 1 chars.
+void digestToHex(unsigned char digest[], char hex[]) {
+	encodeHex(digest, MD5_DIGEST_LENGTH, hex);
+}
+
+char *binaryManifestPath(BinaryManifest *bm, uint32_t index) {
+	return bm->pool + bm->entries[index].pathOffset;
+}
+
+char *binaryManifestProjectName(BinaryManifest *bm) {
+	return bm->pool + bm->header->projectNameOffset;
+}
+
+char *binaryManifestVersion(BinaryManifest *bm) {
+	return bm->pool + bm->header->versionNumberOffset;
+}
+
+// Write the manifest in binary format to the file descriptor.
+// returns -1 on failure.
+int writeBinaryManifest(Manifest *manifest, int fd) {
+	sortManifest(manifest);
+
+	// size the string pool first.
+	size_t poolSize = strlen(manifest->projectName) + 1 + strlen(manifest->versionNumber) + 1;
+	ManifestNode *node = manifest->head;
+	while(node != NULL) {
+		poolSize += strlen(node->filePath) + 1;
+		node = node->next;
+	}
+
+	size_t tableSize = sizeof(BinaryManifestEntry) * manifest->numFiles;
+	size_t total = sizeof(BinaryManifestHeader) + tableSize + poolSize;
+	if(total > UINT32_MAX) {
+		return -1;
+	}
+
+	char *data = calloc(1, total);
+	if(data == NULL) {
+		return -1;
+	}
+
+	BinaryManifestHeader *header = (BinaryManifestHeader *) data;
+	BinaryManifestEntry *entries = (BinaryManifestEntry *) (data + sizeof(BinaryManifestHeader));
+	char *pool = data + sizeof(BinaryManifestHeader) + tableSize;
+
+	memcpy(header->magic, BINARY_MANIFEST_MAGIC, 4);
+	header->format = BINARY_MANIFEST_FORMAT;
+	header->numFiles = manifest->numFiles;
+	header->poolOffset = sizeof(BinaryManifestHeader) + tableSize;
+	header->poolSize = poolSize;
+	header->hashAlgorithm = manifest->hashAlgorithm;
+
+	uint32_t used = 0;
+	header->projectNameOffset = used;
+	strcpy(pool + used, manifest->projectName);
+	used += strlen(manifest->projectName) + 1;
+
+	header->versionNumberOffset = used;
+	strcpy(pool + used, manifest->versionNumber);
+	used += strlen(manifest->versionNumber) + 1;
+
+	int i = 0;
+	node = manifest->head;
+	while(node != NULL) {
+		hexToDigest(node->md5, entries[i].digest);
+		entries[i].version = strtoul(node->version, NULL, 10);
+		entries[i].pathOffset = used;
+		strcpy(pool + used, node->filePath);
+		used += strlen(node->filePath) + 1;
+
+		i++;
+		node = node->next;
+	}
+
+	size_t written = 0;
+	while(written < total) {
+		ssize_t n = write(fd, data + written, total - written);
+		if(n <= 0) {
+			free(data);
+			return -1;
+		}
+		written += n;
+	}
+
+	free(data);
+	return 0;
+}
+
+// Map binary manifest from the disk. Returns NULL if the file does
+// not exist or is not a valid binary manifest.
+BinaryManifest *mapBinaryManifest(char *path) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size < sizeof(BinaryManifestHeader)) {
+		close(fd);
+		return NULL;
+	}
+
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED) {
+		return NULL;
+	}
+
+	BinaryManifestHeader *header = (BinaryManifestHeader *) base;
+	size_t tableEnd = sizeof(BinaryManifestHeader) + sizeof(BinaryManifestEntry) * (size_t) header->numFiles;
+	if(memcmp(header->magic, BINARY_MANIFEST_MAGIC, 4) != 0
+		|| header->format != BINARY_MANIFEST_FORMAT
+		|| header->poolOffset != tableEnd
+		|| (size_t) header->poolOffset + header->poolSize != (size_t) st.st_size) {
+		munmap(base, st.st_size);
+		return NULL;
+	}
+
+	BinaryManifest *bm = malloc(sizeof(BinaryManifest));
+	bm->base = base;
+	bm->size = st.st_size;
+	bm->header = header;
+	bm->entries = (BinaryManifestEntry *) ((char *) base + sizeof(BinaryManifestHeader));
+	bm->pool = (char *) base + header->poolOffset;
+	return bm;
+}
+
+void unmapBinaryManifest(BinaryManifest *bm) {
+	munmap(bm->base, bm->size);
+	free(bm);
+}
+
+// Binary search on the sorted entry table, returns NULL if not found.
+BinaryManifestEntry *searchBinaryManifest(BinaryManifest *bm, char *filePath) {
+	long low = 0, high = (long) bm->header->numFiles - 1;
+
+	while(low <= high) {
+		long mid = low + (high - low) / 2;
+		int cmp = strcmp(binaryManifestPath(bm, mid), filePath);
+		if(cmp == 0) {
+			return &bm->entries[mid];
+		} else if(cmp < 0) {
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+	return NULL;
+}
+
+// Convert to the regular (text format) manifest structure.
+// Built as a single block, same as a parsed text manifest.
+Manifest *binaryToManifest(BinaryManifest *bm) {
+	uint32_t numFiles = bm->header->numFiles;
+	
+	// strings: pool as is, plus hex hash and version for each entry.
+	size_t stringsSize = bm->header->poolSize + numFiles * (HASH_STRING_LEN + 1 + 11);
+	size_t nodesOffset = (stringsSize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	size_t blockSize = nodesOffset + sizeof(ManifestNode) * numFiles;
+	
+	char *block = malloc(blockSize);
+	memcpy(block, bm->pool, bm->header->poolSize);
+	char *cursor = block + bm->header->poolSize;
+	ManifestNode *nodes = (ManifestNode *) (block + nodesOffset);
+	
+	Manifest *manifest = createEmptyManifest(block + bm->header->projectNameOffset, block + bm->header->versionNumberOffset);
+	manifest->hashAlgorithm = bm->header->hashAlgorithm;
+	manifest->block = block;
+	manifest->blockSize = blockSize;
+	
+	uint32_t i;
+	for(i = 0; i < numFiles; i++) {
+		ManifestNode *node = &nodes[i];
+		
+		node->md5 = cursor;
+		digestToHex(bm->entries[i].digest, cursor);
+		cursor += HASH_STRING_LEN + 1;
+		
+		node->version = cursor;
+		cursor += sprintf(cursor, "%u", bm->entries[i].version) + 1;
+		
+		node->filePath = block + bm->entries[i].pathOffset;
+		node->code = '\0';
+		node->shared = 1;
+		node->pathId = internPath(node->filePath);
+		appendManifestNode(manifest, node);
+	}
+	return manifest;
+}
+
+void writeBinaryDeltaEntry(int fd, char *code, BinaryManifest *bm, uint32_t index) {
+	char hex[HASH_STRING_LEN + 1];
+	char version[20];
+	digestToHex(bm->entries[index].digest, hex);
+	sprintf(version, "%u", bm->entries[index].version);
+	writeManifestEntry(fd, code, version, hex, binaryManifestPath(bm, index));
+}
+
+// Merge-join of two sorted binary manifests. Counts the entries which
+// changed from base to head, and writes them if fd is valid:
+// A for new or modified files, D for removed ones.
+// NULL base is an empty manifest, so all files of head are written.
+long binaryManifestDeltaPass(BinaryManifest *base, BinaryManifest *head, int fd) {
+	uint32_t numBase = base == NULL ? 0 : base->header->numFiles;
+	uint32_t numHead = head->header->numFiles;
+	uint32_t b = 0, h = 0;
+	long count = 0;
+	
+	while(b < numBase || h < numHead) {
+		int cmp;
+		if(b == numBase) {
+			cmp = 1;
+		} else if(h == numHead) {
+			cmp = -1;
+		} else {
+			cmp = strcmp(binaryManifestPath(base, b), binaryManifestPath(head, h));
+		}
+		
+		if(cmp < 0) {
+			if(fd >= 0) {
+				writeBinaryDeltaEntry(fd, "D", base, b);
+			}
+			count++;
+			b++;
+		} else if(cmp > 0) {
+			if(fd >= 0) {
+				writeBinaryDeltaEntry(fd, "A", head, h);
+			}
+			count++;
+			h++;
+		} else {
+			if(base->entries[b].version != head->entries[h].version
+				|| memcmp(base->entries[b].digest, head->entries[h].digest, MD5_DIGEST_LENGTH) != 0) {
+				if(fd >= 0) {
+					writeBinaryDeltaEntry(fd, "A", head, h);
+				}
+				count++;
+			}
+			b++;
+			h++;
+		}
+	}
+	return count;
+}
+
+// Writes the changes from base to head, in below format:
+// <projectName>
+// <head version>
+// <numEntries>[<space><hash algorithm>]
+// <code><space><version><space><md5hash><space><file path>
+// ..
+void writeBinaryManifestDelta(BinaryManifest *base, BinaryManifest *head, int fd) {
+	char buffer[50];
+	char *projectName = binaryManifestProjectName(head);
+	char *version = binaryManifestVersion(head);
+	
+	write(fd, projectName, strlen(projectName));
+	write(fd, "\n", 1);
+	write(fd, version, strlen(version));
+	write(fd, "\n", 1);
+	long numEntries = binaryManifestDeltaPass(base, head, -1);
+	if(head->header->hashAlgorithm == HASH_MD5) {
+		sprintf(buffer, "%ld\n", numEntries);
+	} else {
+		sprintf(buffer, "%ld %s\n", numEntries, hashAlgorithmName(head->header->hashAlgorithm));
+	}
+	write(fd, buffer, strlen(buffer));
+	
+	binaryManifestDeltaPass(base, head, fd);
+}
+
+// Converts text manifest file to binary manifest file, returns -1 on failure.
+int convertTextToBinaryManifest(char *textPath, char *binaryPath) {
+	int textFd = open(textPath, O_RDONLY);
+	if(textFd < 0) {
+		return -1;
+	}
+	Manifest *manifest = readManifestContents(textFd);
+	close(textFd);
+
+	// Written to a temp file first, others may map it meanwhile.
+	char *tmpPath = malloc(sizeof(char) * (strlen(binaryPath) + 50));
+	sprintf(tmpPath, "%s.tmp%lld_%d", binaryPath, current_timestamp_millis(), rand());
+	int binaryFd = open(tmpPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	int status = writeBinaryManifest(manifest, binaryFd);
+	close(binaryFd);
+	if(status == 0) {
+		rename(tmpPath, binaryPath);
+	} else {
+		unlink(tmpPath);
+	}
+	free(tmpPath);
+
+	freeManifest(manifest);
+	return status;
+}
+
+// Converts binary manifest file to text manifest file, returns -1 on failure.
+int convertBinaryToTextManifest(char *binaryPath, char *textPath) {
+	BinaryManifest *bm = mapBinaryManifest(binaryPath);
+	if(bm == NULL) {
+		return -1;
+	}
+	Manifest *manifest = binaryToManifest(bm);
+	unmapBinaryManifest(bm);
+
+	int textFd = open(textPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	writeManifestToFile(manifest, textFd);
+	close(textFd);
+
+	freeManifest(manifest);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,452 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <openssl/evp.h>
+
+/*
+Content defined chunking (FastCDC). Chunk edges are found from the
+bytes themselves with a rolling gear hash, so an insert only changes
+the chunks around it, and the same bytes in other files or versions
+cut into the same chunks. Chunks are named by their hash (SHA-256 cut
+like file hashes), and stored once in a chunk store:
+<store>/<first 2 chars of hash>/<hash>
+each as <raw length (uint32)><stored length (uint32)><data>, the data
+zlib compressed unless that did not make it smaller.
+
+Chunk lists of files are cached in <dir>/.chunkindex, by size and
+modified time (ns) of the file, sorted by path:
+<size> <modified time> <numChunks> <file path>
+<hash> <length>
+..
+*/
+
+#define CHUNK_MIN_LENGTH (16 * 1024)
+#define CHUNK_AVG_LENGTH (64 * 1024)
+#define CHUNK_MAX_LENGTH (256 * 1024)
+
+static char *CHUNK_INDEX_FILE = ".chunkindex";
+
+typedef struct ChunkList {
+	char *filePath;
+	long long size;
+	long long modified;
+	int count;
+	int capacity;
+	long long *offset;
+	uint32_t *length;
+	char *hashes;   // HASH_STRING_LEN + 1 chars per chunk.
+	int fd;         // open while chunks are read from the file, else -1.
+} ChunkList;
+
+typedef struct ChunkIndex {
+	ChunkList **files; // sorted by filePath.
+	int count;
+	int capacity;
+	int changed;
+} ChunkIndex;
+
+static uint64_t gearTable[256];
+static uint64_t chunkMaskSmall, chunkMaskLarge;
+static pthread_once_t gearTableOnce = PTHREAD_ONCE_INIT;
+
+// Mask of n bits, spread over the high half where the gear hash has
+// seen the most bytes.
+static uint64_t spreadChunkMask(int n)
+{
+	uint64_t mask = 0;
+	int i;
+	for(i = 0; i < n; i++) {
+		mask |= 1ULL << (63 - (i * 32) / n);
+	}
+	return mask;
+}
+
+// Same table on every build, chunk edges must agree on both sides.
+static void initGearTable()
+{
+	uint64_t state = 0x5741c0de5741c0deULL;
+	int i;
+	for(i = 0; i < 256; i++) {
+		uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gearTable[i] = z ^ (z >> 31);
+	}
+
+	// Normalized chunking: harder to cut before the average length,
+	// easier after it, so chunk lengths stay close to it.
+	chunkMaskSmall = spreadChunkMask(18);
+	chunkMaskLarge = spreadChunkMask(14);
+}
+
+// Length of the chunk at the start of data.
+static size_t nextChunkLength(const unsigned char *data, size_t length)
+{
+	if(length <= CHUNK_MIN_LENGTH) {
+		return length;
+	}
+	size_t end = length < CHUNK_MAX_LENGTH ? length : CHUNK_MAX_LENGTH;
+	size_t normal = end < CHUNK_AVG_LENGTH ? end : CHUNK_AVG_LENGTH;
+
+	uint64_t hash = 0;
+	size_t i = CHUNK_MIN_LENGTH;
+	for(; i < normal; i++) {
+		hash = (hash << 1) + gearTable[data[i]];
+		if(!(hash & chunkMaskSmall)) {
+			return i + 1;
+		}
+	}
+	for(; i < end; i++) {
+		hash = (hash << 1) + gearTable[data[i]];
+		if(!(hash & chunkMaskLarge)) {
+			return i + 1;
+		}
+	}
+	return end;
+}
+
+// hash must have space for HASH_STRING_LEN + 1 chars.
+static void hashChunk(const unsigned char *data, size_t length, char *hash)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	EVP_Digest(data, length, digest, NULL, EVP_sha256(), NULL);
+	encodeHex(digest, MD5_DIGEST_LENGTH, hash);
+}
+
+static ChunkList *createChunkList(char *filePath)
+{
+	ChunkList *list = malloc(sizeof(ChunkList));
+	memset(list, 0, sizeof(ChunkList));
+	list->filePath = strdup(filePath);
+	list->fd = -1;
+	return list;
+}
+
+static void addChunk(ChunkList *list, long long offset, uint32_t length, const char *hash)
+{
+	if(list->count == list->capacity) {
+		list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+		list->offset = realloc(list->offset, sizeof(long long) * list->capacity);
+		list->length = realloc(list->length, sizeof(uint32_t) * list->capacity);
+		list->hashes = realloc(list->hashes, (HASH_STRING_LEN + 1) * list->capacity);
+	}
+	list->offset[list->count] = offset;
+	list->length[list->count] = length;
+	memcpy(list->hashes + list->count * (HASH_STRING_LEN + 1), hash, HASH_STRING_LEN + 1);
+	list->count++;
+}
+
+static void freeChunkList(ChunkList *list)
+{
+	if(list == NULL) {
+		return;
+	}
+	if(list->fd >= 0) {
+		close(list->fd);
+	}
+	free(list->filePath);
+	free(list->offset);
+	free(list->length);
+	free(list->hashes);
+	free(list);
+}
+
+static char *chunkStorePath(char *storeDir, const char *hash)
+{
+	char *path = malloc(sizeof(char) * (strlen(storeDir) + HASH_STRING_LEN + 10));
+	sprintf(path, "%s/%.2s/%.*s", storeDir, hash, HASH_STRING_LEN, hash);
+	return path;
+}
+
+static int hasStoredChunk(char *storeDir, const char *hash)
+{
+	char *path = chunkStorePath(storeDir, hash);
+	int exists = checkFileExists(path);
+	free(path);
+	return exists;
+}
+
+// Written aside and renamed, so a chunk is never seen half written.
+static void storeChunk(char *storeDir, const char *hash, const unsigned char *data, size_t length)
+{
+	if(hasStoredChunk(storeDir, hash)) {
+		return;
+	}
+
+	size_t capacity = zlibBound(length);
+	unsigned char *out = malloc(capacity);
+	size_t outLength = zlibCompressBlock(data, length, out, capacity, Z_DEFAULT_COMPRESSION);
+	if(outLength == 0 || outLength >= length) {
+		memcpy(out, data, length);
+		outLength = length;
+	}
+
+	char *path = chunkStorePath(storeDir, hash);
+	char *tmpPath = malloc(sizeof(char) * (strlen(path) + 50));
+	sprintf(tmpPath, "%s.tmp%lld_%d", path, current_timestamp_millis(), rand());
+	createDirStructureIfNeeded(tmpPath);
+
+	int fd = open(tmpPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	uint32_t header[2] = { length, outLength };
+	write(fd, header, sizeof(header));
+	write(fd, out, outLength);
+	close(fd);
+	rename(tmpPath, path);
+
+	free(tmpPath);
+	free(path);
+	free(out);
+}
+
+// Reads the chunk into buffer (CHUNK_MAX_LENGTH bytes).
+// Returns its length, -1 if it is not in the store.
+static long loadStoredChunk(char *storeDir, const char *hash, unsigned char *buffer)
+{
+	char *path = chunkStorePath(storeDir, hash);
+	int fd = open(path, O_RDONLY, 0777);
+	free(path);
+	if(fd < 0) {
+		return -1;
+	}
+
+	long result = -1;
+	uint32_t header[2];
+	if(readFully(fd, header, sizeof(header)) == sizeof(header)
+			&& header[0] <= CHUNK_MAX_LENGTH && header[1] <= zlibBound(CHUNK_MAX_LENGTH)) {
+		if(header[0] == header[1]) {
+			result = readFully(fd, buffer, header[0]) == header[0] ? header[0] : -1;
+		} else {
+			unsigned char *in = malloc(header[1]);
+			if(readFully(fd, in, header[1]) == header[1] && zlibDecompressBlock(in, header[1], buffer, header[0]) == 0) {
+				result = header[0];
+			}
+			free(in);
+		}
+	}
+	close(fd);
+	return result;
+}
+
+// Chunks the file. With a store (may be NULL), chunks are saved in it.
+// NULL if the file can not be read.
+static ChunkList *chunkFile(char *path, char *filePath, char *storeDir)
+{
+	pthread_once(&gearTableOnce, initGearTable);
+
+	int fd = open(path, O_RDONLY, 0777);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0) {
+		if(fd >= 0) {
+			close(fd);
+		}
+		return NULL;
+	}
+
+	ChunkList *list = createChunkList(filePath);
+	list->size = st.st_size;
+	list->modified = (long long) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+	const unsigned char *data = NULL;
+	if(st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED) {
+			close(fd);
+			freeChunkList(list);
+			return NULL;
+		}
+		madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	char hash[HASH_STRING_LEN + 1];
+	long long pos = 0;
+	while(pos < st.st_size) {
+		size_t length = nextChunkLength(data + pos, st.st_size - pos);
+		hashChunk(data + pos, length, hash);
+		addChunk(list, pos, length, hash);
+		if(storeDir != NULL) {
+			storeChunk(storeDir, hash, data + pos, length);
+		}
+		pos += length;
+	}
+
+	if(data != NULL) {
+		munmap((void *) data, st.st_size);
+	}
+	close(fd);
+	return list;
+}
+
+static void freeChunkIndex(ChunkIndex *index)
+{
+	if(index == NULL) {
+		return;
+	}
+	int i;
+	for(i = 0; i < index->count; i++) {
+		freeChunkList(index->files[i]);
+	}
+	free(index->files);
+	free(index);
+}
+
+static int compareChunkLists(const void *a, const void *b)
+{
+	return strcmp((*(ChunkList **) a)->filePath, (*(ChunkList **) b)->filePath);
+}
+
+// Position of the file's list in the index, or where it would go.
+// found is set if it is there.
+static int findChunkListPosition(ChunkIndex *index, char *filePath, int *found)
+{
+	int low = 0, high = index->count;
+	while(low < high) {
+		int mid = (low + high) / 2;
+		int cmp = strcmp(index->files[mid]->filePath, filePath);
+		if(cmp == 0) {
+			*found = 1;
+			return mid;
+		}
+		if(cmp < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	*found = 0;
+	return low;
+}
+
+// Empty index if there is no file yet.
+static ChunkIndex *loadChunkIndex(char *dir)
+{
+	ChunkIndex *index = malloc(sizeof(ChunkIndex));
+	memset(index, 0, sizeof(ChunkIndex));
+
+	char *path = malloc(sizeof(char) * (strlen(dir) + strlen(CHUNK_INDEX_FILE) + 2));
+	sprintf(path, "%s/%s", dir, CHUNK_INDEX_FILE);
+	FILE *file = fopen(path, "r");
+	free(path);
+	if(file == NULL) {
+		return index;
+	}
+
+	char *line = NULL;
+	size_t lineCapacity = 0;
+	// Hashes are read up to HASH_STRING_LEN chars.
+	char hashFormat[20];
+	sprintf(hashFormat, "%%%ds %%u", HASH_STRING_LEN);
+	ssize_t lineLength;
+	while((lineLength = getline(&line, &lineCapacity, file)) > 0) {
+		long long size, modified;
+		int numChunks, pathStart;
+		if(line[lineLength - 1] == '\n') {
+			line[--lineLength] = '\0';
+		}
+		if(sscanf(line, "%lld %lld %d %n", &size, &modified, &numChunks, &pathStart) != 3) {
+			break;
+		}
+
+		ChunkList *list = createChunkList(line + pathStart);
+		list->size = size;
+		list->modified = modified;
+		long long offset = 0;
+		int i;
+		for(i = 0; i < numChunks && getline(&line, &lineCapacity, file) > 0; i++) {
+			char hash[HASH_STRING_LEN + 1];
+			unsigned int length;
+			if(sscanf(line, hashFormat, hash, &length) != 2 || strlen(hash) != HASH_STRING_LEN) {
+				break;
+			}
+			addChunk(list, offset, length, hash);
+			offset += length;
+		}
+		if(i < numChunks || offset != size) {
+			freeChunkList(list);
+			break; // Cut short, rest is chunked again.
+		}
+
+		if(index->count == index->capacity) {
+			index->capacity = index->capacity == 0 ? 16 : index->capacity * 2;
+			index->files = realloc(index->files, sizeof(ChunkList *) * index->capacity);
+		}
+		index->files[index->count++] = list;
+	}
+	free(line);
+	fclose(file);
+
+	// Indexes of older builds are not sorted.
+	qsort(index->files, index->count, sizeof(ChunkList *), compareChunkLists);
+	return index;
+}
+
+static void saveChunkIndex(ChunkIndex *index, char *dir)
+{
+	char *path = malloc(sizeof(char) * (strlen(dir) + strlen(CHUNK_INDEX_FILE) + 2));
+	sprintf(path, "%s/%s", dir, CHUNK_INDEX_FILE);
+	char *tmpPath = malloc(sizeof(char) * (strlen(path) + 50));
+	sprintf(tmpPath, "%s.tmp%lld_%d", path, current_timestamp_millis(), rand());
+
+	FILE *file = fopen(tmpPath, "w");
+	if(file != NULL) {
+		int i, j;
+		for(i = 0; i < index->count; i++) {
+			ChunkList *list = index->files[i];
+			fprintf(file, "%lld %lld %d %s\n", list->size, list->modified, list->count, list->filePath);
+			for(j = 0; j < list->count; j++) {
+				fprintf(file, "%s %u\n", list->hashes + j * (HASH_STRING_LEN + 1), list->length[j]);
+			}
+		}
+		fclose(file);
+		rename(tmpPath, path);
+	}
+	index->changed = 0;
+
+	free(tmpPath);
+	free(path);
+}
+
+// Chunk list of the file (relative to dir), from the index if the file
+// did not change since, else chunked now and put in the index.
+// NULL if the file can not be read.
+static ChunkList *findFileChunks(ChunkIndex *index, char *dir, char *filePath, char *storeDir)
+{
+	char *path = malloc(sizeof(char) * (strlen(dir) + strlen(filePath) + 2));
+	sprintf(path, "%s/%s", dir, filePath);
+	struct stat st;
+	if(stat(path, &st) != 0) {
+		free(path);
+		return NULL;
+	}
+
+	int found;
+	int i = findChunkListPosition(index, filePath, &found);
+	long long modified = (long long) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	if(found && index->files[i]->size == st.st_size && index->files[i]->modified == modified) {
+		free(path);
+		return index->files[i];
+	}
+
+	ChunkList *list = chunkFile(path, filePath, storeDir);
+	free(path);
+	if(list == NULL) {
+		return NULL;
+	}
+
+	if(found) {
+		freeChunkList(index->files[i]);
+	} else {
+		if(index->count == index->capacity) {
+			index->capacity = index->capacity == 0 ? 16 : index->capacity * 2;
+			index->files = realloc(index->files, sizeof(ChunkList *) * index->capacity);
+		}
+		memmove(index->files + i + 1, index->files + i, sizeof(ChunkList *) * (index->count - i));
+		index->count++;
+	}
+	index->files[i] = list;
+	index->changed = 1;
+	return list;
+}
+
+#endif
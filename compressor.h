@@ -4,6 +4,15 @@
 #include <zlib.h>
 #include <assert.h>
 
+#ifdef WTF_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#ifdef WTF_LZ4
+#include <lz4frame.h>
+#endif
+
 #if defined(MSDOS) || defined(OS2) || defined(WIN32) || defined(__CYGWIN__)
 #  include <fcntl.h>
 #  include <io.h>
@@ -14,73 +23,145 @@
 
 #define CHUNK 16384
 
-// Compress the input file and write data on output file
-static void compressFile(char *inFile, char *outFile)
+/*
+Compression codecs. A compressed file (transfer or archived version)
+starts with CODEC_MAGIC and one byte of codec id. With CODEC_BLOCKS set
+in that byte, blocks follow:
+<raw length (uint32)><compressed length (uint32)><compressed block>
+..
+<0 (uint32)><0 (uint32)>
+
+Blocks are compressed independently, so all cores work on one payload,
+on both sides. A block with CODEC_STORED set in its compressed length
+is not compressed. With CODEC_DICT also set, blocks are compressed with
+a dictionary, and before them come
+<dictionary id (uint32)><length (uint32)><dictionary>
+where length is 0 if the receiver has that dictionary already.
+Without the flag, the codec's own stream follows (files
+of older builds), and files without the magic are zlib streams.
+zstd and lz4 are built in with make ZSTD=1 / LZ4=1.
+*/
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
+#define CODEC_ZSTD 2
+#define CODEC_LZ4 3
+
+#define CODEC_MAGIC "WTFC"
+#define CODEC_MAGIC_LEN 4
+#define CODEC_BLOCKS 0x80
+#define CODEC_DICT 0x40
+
+#define CODEC_BLOCK_SIZE (1024 * 1024)
+
+/*
+Dictionary of a project, file format:
+<id>[ <version trained at>]
+<dictionary bytes>
+
+The id is made from the bytes, so one id is always one dictionary.
+*/
+typedef struct Dictionary {
+	uint32_t id;
+	unsigned char *data;
+	size_t length;
+	int send; // also written in compressed files.
+} Dictionary;
+
+// Dictionaries sent with compressed files can not be longer.
+#define DICT_MAX_LENGTH (1024 * 1024)
+
+typedef struct Codec {
+	int id;
+	const char *name;
+	int transferLevel; // for checkout/push payloads.
+	int archiveLevel;  // for archived versions, compressed once.
+	// Most bytes a compressed block of given length can take.
+	size_t (*bound)(size_t length);
+	// Returns compressed length, 0 on error.
+	size_t (*compressBlock)(const unsigned char *in, size_t length, unsigned char *out, size_t capacity, int level);
+	// Returns 0 if exactly rawLength bytes came out.
+	int (*decompressBlock)(const unsigned char *in, size_t length, unsigned char *out, size_t rawLength);
+	// Whole stream, in files of older builds.
+	int (*decompress)(int readFd, int writeFd);
+	// Dictionary support, NULL if the codec has none. prepareDict makes
+	// the codec's own form of a dictionary once for all blocks, it can
+	// also be NULL.
+	void *(*prepareDict)(Dictionary *dict, int level, int compress);
+	void (*freeDict)(void *prepared, int compress);
+	size_t (*compressBlockDict)(const unsigned char *in, size_t length, unsigned char *out, size_t capacity, int level,
+		Dictionary *dict, void *prepared);
+	int (*decompressBlockDict)(const unsigned char *in, size_t length, unsigned char *out, size_t rawLength,
+		Dictionary *dict, void *prepared);
+} Codec;
+
+static size_t zlibBound(size_t length)
 {
-	int readFd = open(inFile, O_RDONLY, 0777);
-	int writeFd = open(outFile, O_CREAT | O_WRONLY | O_TRUNC, 0777);	
-	
-    int ret, flush;
-    unsigned numBytes;
-    z_stream strm;
-    unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
+	return compressBound(length);
+}
 
-    /* allocate deflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    ret = deflateInit(&strm, Z_DEFAULT_COMPRESSION);
-    if (ret != Z_OK) {
-		printf("Error in ZLIB\n");
-		close(readFd);
-		close(writeFd);
-        return;
+static size_t zlibCompressBlock(const unsigned char *in, size_t length, unsigned char *out, size_t capacity, int level)
+{
+	uLongf outLength = capacity;
+	if(compress2(out, &outLength, in, length, level) != Z_OK) {
+		return 0;
 	}
+	return outLength;
+}
 
-    /* compress until end of file */
-    do {
-        strm.avail_in = read(readFd, in, CHUNK);
-        if (strm.avail_in < 0) {
-            (void)deflateEnd(&strm);
-			printf("Error in Reading file %s\n", inFile);
-			close(readFd);
-			close(writeFd);
-            return;
-        }
-        flush = (strm.avail_in == 0) ? Z_FINISH : Z_NO_FLUSH;
-        strm.next_in = in;
-
-        /* run deflate() on input until output buffer not full, finish
-           compression if all of source has been read in */
-        do {
-            strm.avail_out = CHUNK;
-            strm.next_out = out;
-            ret = deflate(&strm, flush);    /* no bad return value */
-            assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-            numBytes = CHUNK - strm.avail_out;   // numBytes to write on output.
-			write(writeFd, out, numBytes);
-			
-        } while (strm.avail_out == 0);
+static int zlibDecompressBlock(const unsigned char *in, size_t length, unsigned char *out, size_t rawLength)
+{
+	uLongf outLength = rawLength;
+	return uncompress(out, &outLength, in, length) == Z_OK && outLength == rawLength ? 0 : -1;
+}
 
-        /* done when last data in file processed */
-    } while (flush != Z_FINISH);
-    assert(ret == Z_STREAM_END);        /* stream will be complete */
+// zlib uses the last 32 KB of the dictionary as a preset window.
+static size_t zlibCompressBlockDict(const unsigned char *in, size_t length, unsigned char *out, size_t capacity, int level,
+	Dictionary *dict, void *prepared)
+{
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if(deflateInit(&strm, level) != Z_OK) {
+		return 0;
+	}
 
-    /* clean up and return */
-    (void)deflateEnd(&strm);
-	
-	close(readFd);
-	close(writeFd);
+	size_t result = 0;
+	if(deflateSetDictionary(&strm, dict->data, dict->length) == Z_OK) {
+		strm.next_in = (unsigned char *) in;
+		strm.avail_in = length;
+		strm.next_out = out;
+		strm.avail_out = capacity;
+		if(deflate(&strm, Z_FINISH) == Z_STREAM_END) {
+			result = strm.total_out;
+		}
+	}
+	deflateEnd(&strm);
+	return result;
 }
 
+static int zlibDecompressBlockDict(const unsigned char *in, size_t length, unsigned char *out, size_t rawLength,
+	Dictionary *dict, void *prepared)
+{
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if(inflateInit(&strm) != Z_OK) {
+		return -1;
+	}
+
+	strm.next_in = (unsigned char *) in;
+	strm.avail_in = length;
+	strm.next_out = out;
+	strm.avail_out = rawLength;
+	int ret = inflate(&strm, Z_FINISH);
+	if(ret == Z_NEED_DICT && inflateSetDictionary(&strm, dict->data, dict->length) == Z_OK) {
+		ret = inflate(&strm, Z_FINISH);
+	}
+	int result = ret == Z_STREAM_END && strm.total_out == rawLength ? 0 : -1;
+	inflateEnd(&strm);
+	return result;
+}
 
-// DeCompress the input file and write data on output file
-static void decompressFile(char *inFile, char *outFile)
+static int zlibDecompress(int readFd, int writeFd)
 {
-	int readFd = open(inFile, O_RDONLY, 0777);
-	int writeFd = open(outFile, O_CREAT | O_WRONLY | O_TRUNC, 0777);	
-	
     int ret;
     unsigned numBytes;
     z_stream strm;
@@ -96,24 +177,21 @@ static void decompressFile(char *inFile, char *outFile)
     ret = inflateInit(&strm);
     if (ret != Z_OK) {
 		printf("Error in ZLIB\n");
-		close(readFd);
-		close(writeFd);
-        return;
+        return -1;
 	}
 
     /* decompress until deflate stream ends or end of file */
     do {
-        strm.avail_in = read(readFd, in, CHUNK);
-        if (strm.avail_in < 0) {
-            (void)deflateEnd(&strm);
-			printf("Error in Reading file %s\n", inFile);
-			close(readFd);
-			close(writeFd);
-            return;
+        ssize_t n = read(readFd, in, CHUNK);
+        if (n < 0) {
+            (void)inflateEnd(&strm);
+			printf("Error in Reading file\n");
+            return -1;
         }
-		
-        if (strm.avail_in == 0)
+
+        if (n == 0)
             break;
+        strm.avail_in = n;
         strm.next_in = in;
 
         /* run inflate() on input until output buffer not full */
@@ -129,9 +207,7 @@ static void decompressFile(char *inFile, char *outFile)
             case Z_MEM_ERROR:
 				printf("Error in ZLIB: Memory issue.\n");
                 (void)inflateEnd(&strm);
-				close(readFd);
-				close(writeFd);
-                return;
+                return -1;
             }
             numBytes = CHUNK - strm.avail_out;
 			write(writeFd, out, numBytes);
@@ -142,9 +218,844 @@ static void decompressFile(char *inFile, char *outFile)
 
     /* clean up and return */
     (void)inflateEnd(&strm);
-	
+	return ret == Z_STREAM_END ? 0 : -1;
+}
+
+// Stored as is, for data which does not compress, or fast links.
+static size_t copyBound(size_t length)
+{
+	return length;
+}
+
+static size_t copyCompressBlock(const unsigned char *in, size_t length, unsigned char *out, size_t capacity, int level)
+{
+	memcpy(out, in, length);
+	return length;
+}
+
+static int copyDecompressBlock(const unsigned char *in, size_t length, unsigned char *out, size_t rawLength)
+{
+	if(length != rawLength) {
+		return -1;
+	}
+	memcpy(out, in, length);
+	return 0;
+}
+
+static int copyDecompress(int readFd, int writeFd)
+{
+	unsigned char buffer[CHUNK];
+	ssize_t n;
+	while((n = read(readFd, buffer, CHUNK)) > 0) {
+		write(writeFd, buffer, n);
+	}
+	return n < 0 ? -1 : 0;
+}
+
+#ifdef WTF_ZSTD
+static size_t zstdBound(size_t length)
+{
+	return ZSTD_compressBound(length);
+}
+
+static size_t zstdCompressBlock(const unsigned char *in, size_t length, unsigned char *out, size_t capacity, int level)
+{
+	size_t result = ZSTD_compress(out, capacity, in, length, level);
+	return ZSTD_isError(result) ? 0 : result;
+}
+
+static int zstdDecompressBlock(const unsigned char *in, size_t length, unsigned char *out, size_t rawLength)
+{
+	return ZSTD_decompress(out, rawLength, in, length) == rawLength ? 0 : -1;
+}
+
+// Digested dictionaries, so it is not loaded again for every block.
+static void *zstdPrepareDict(Dictionary *dict, int level, int compress)
+{
+	if(compress) {
+		return ZSTD_createCDict(dict->data, dict->length, level);
+	}
+	return ZSTD_createDDict(dict->data, dict->length);
+}
+
+static void zstdFreeDict(void *prepared, int compress)
+{
+	if(compress) {
+		ZSTD_freeCDict((ZSTD_CDict *) prepared);
+	} else {
+		ZSTD_freeDDict((ZSTD_DDict *) prepared);
+	}
+}
+
+static size_t zstdCompressBlockDict(const unsigned char *in, size_t length, unsigned char *out, size_t capacity, int level,
+	Dictionary *dict, void *prepared)
+{
+	if(prepared == NULL) {
+		return 0;
+	}
+	ZSTD_CCtx *cctx = ZSTD_createCCtx();
+	size_t result = ZSTD_compress_usingCDict(cctx, out, capacity, in, length, (ZSTD_CDict *) prepared);
+	ZSTD_freeCCtx(cctx);
+	return ZSTD_isError(result) ? 0 : result;
+}
+
+static int zstdDecompressBlockDict(const unsigned char *in, size_t length, unsigned char *out, size_t rawLength,
+	Dictionary *dict, void *prepared)
+{
+	if(prepared == NULL) {
+		return -1;
+	}
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+	size_t result = ZSTD_decompress_usingDDict(dctx, out, rawLength, in, length, (ZSTD_DDict *) prepared);
+	ZSTD_freeDCtx(dctx);
+	return result == rawLength ? 0 : -1;
+}
+
+static int zstdDecompress(int readFd, int writeFd)
+{
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+	if(dctx == NULL) {
+		printf("Error in ZSTD\n");
+		return -1;
+	}
+
+	size_t inSize = ZSTD_DStreamInSize();
+	size_t outSize = ZSTD_DStreamOutSize();
+	char *in = malloc(inSize);
+	char *out = malloc(outSize);
+	size_t last = 0;
+	int result = 0;
+
+	ssize_t n;
+	while(result == 0 && (n = read(readFd, in, inSize)) > 0) {
+		ZSTD_inBuffer input = { in, n, 0 };
+		while(input.pos < input.size) {
+			ZSTD_outBuffer output = { out, outSize, 0 };
+			last = ZSTD_decompressStream(dctx, &output, &input);
+			if(ZSTD_isError(last)) {
+				printf("Error in ZSTD: %s\n", ZSTD_getErrorName(last));
+				result = -1;
+				break;
+			}
+			write(writeFd, out, output.pos);
+		}
+	}
+
+	free(in);
+	free(out);
+	ZSTD_freeDCtx(dctx);
+
+	// last is 0 once a frame is complete.
+	return result == 0 && last == 0 ? 0 : -1;
+}
+#endif
+
+#ifdef WTF_LZ4
+static size_t lz4Bound(size_t length)
+{
+	return LZ4F_compressFrameBound(length, NULL);
+}
+
+static size_t lz4CompressBlock(const unsigned char *in, size_t length, unsigned char *out, size_t capacity, int level)
+{
+	LZ4F_preferences_t prefs;
+	memset(&prefs, 0, sizeof(prefs));
+	prefs.compressionLevel = level;
+	size_t result = LZ4F_compressFrame(out, capacity, in, length, &prefs);
+	return LZ4F_isError(result) ? 0 : result;
+}
+
+static int lz4DecompressBlock(const unsigned char *in, size_t length, unsigned char *out, size_t rawLength)
+{
+	LZ4F_dctx *dctx;
+	if(LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+		return -1;
+	}
+
+	size_t inPos = 0, outPos = 0, last = 1;
+	while(last != 0 && inPos < length) {
+		size_t outLength = rawLength - outPos;
+		size_t inLength = length - inPos;
+		last = LZ4F_decompress(dctx, out + outPos, &outLength, in + inPos, &inLength, NULL);
+		if(LZ4F_isError(last) || (inLength == 0 && outLength == 0)) {
+			break;
+		}
+		inPos += inLength;
+		outPos += outLength;
+	}
+
+	LZ4F_freeDecompressionContext(dctx);
+	return last == 0 && outPos == rawLength ? 0 : -1;
+}
+
+static int lz4Decompress(int readFd, int writeFd)
+{
+	LZ4F_dctx *dctx;
+	if(LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+		printf("Error in LZ4\n");
+		return -1;
+	}
+
+	char *in = malloc(CHUNK);
+	char *out = malloc(4 * CHUNK);
+	size_t last = 1;
+	int result = 0;
+
+	ssize_t n;
+	while(result == 0 && (n = read(readFd, in, CHUNK)) > 0) {
+		size_t pos = 0;
+		while(pos < (size_t) n) {
+			size_t outLen = 4 * CHUNK;
+			size_t inLen = n - pos;
+			last = LZ4F_decompress(dctx, out, &outLen, in + pos, &inLen, NULL);
+			if(LZ4F_isError(last)) {
+				printf("Error in LZ4: %s\n", LZ4F_getErrorName(last));
+				result = -1;
+				break;
+			}
+			write(writeFd, out, outLen);
+			pos += inLen;
+		}
+	}
+
+	free(in);
+	free(out);
+	LZ4F_freeDecompressionContext(dctx);
+
+	// last is 0 once a frame is complete.
+	return result == 0 && last == 0 ? 0 : -1;
+}
+#endif
+
+// In order of preference, when the other side supports them too.
+static Codec codecs[] = {
+#ifdef WTF_ZSTD
+	{ CODEC_ZSTD, "zstd", 3, 19, zstdBound, zstdCompressBlock, zstdDecompressBlock, zstdDecompress,
+		zstdPrepareDict, zstdFreeDict, zstdCompressBlockDict, zstdDecompressBlockDict },
+#endif
+	{ CODEC_ZLIB, "zlib", Z_DEFAULT_COMPRESSION, Z_BEST_COMPRESSION, zlibBound, zlibCompressBlock, zlibDecompressBlock, zlibDecompress,
+		NULL, NULL, zlibCompressBlockDict, zlibDecompressBlockDict },
+#ifdef WTF_LZ4
+	{ CODEC_LZ4, "lz4", 0, 9, lz4Bound, lz4CompressBlock, lz4DecompressBlock, lz4Decompress,
+		NULL, NULL, NULL, NULL },
+#endif
+	{ CODEC_NONE, "none", 0, 0, copyBound, copyCompressBlock, copyDecompressBlock, copyDecompress,
+		NULL, NULL, NULL, NULL },
+};
+
+#define NUM_CODECS ((int) (sizeof(codecs) / sizeof(codecs[0])))
+
+// NULL if the codec is not built in.
+static Codec *findCodec(int id)
+{
+	int i;
+	for(i = 0; i < NUM_CODECS; i++) {
+		if(codecs[i].id == id) {
+			return &codecs[i];
+		}
+	}
+	return NULL;
+}
+
+// Helpers only some includers use are inline, so the rest get no
+// unused function warnings.
+static inline Codec *findCodecByName(const char *name)
+{
+	int i;
+	for(i = 0; i < NUM_CODECS; i++) {
+		if(strcmp(codecs[i].name, name) == 0) {
+			return &codecs[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+Blocks which would not get smaller are stored as they are, the top bit
+of their compressed length is set then (compressed length is the raw
+length). Already compressed content (archives, images, media) is
+found by name before compression (see BlockRanges), other blocks are
+sampled, and a block is also stored if compressing it did not help.
+*/
+#define CODEC_STORED 0x80000000u
+
+// Pieces sampled from a block, blocks smaller than all of them are always tried.
+#define ENTROPY_SAMPLES 4
+#define ENTROPY_SAMPLE_SIZE 4096
+
+// Byte ranges of a file which start and end on block edges, in order.
+// Stored ones are not compressed.
+typedef struct BlockRanges {
+	long long *start;
+	long long *end;
+	char *stored;
+	int count;
+	int capacity;
+} BlockRanges;
+
+static inline void addBlockRange(BlockRanges *ranges, long long start, long long end, int stored)
+{
+	if(ranges->count == ranges->capacity) {
+		ranges->capacity = ranges->capacity == 0 ? 16 : ranges->capacity * 2;
+		ranges->start = realloc(ranges->start, sizeof(long long) * ranges->capacity);
+		ranges->end = realloc(ranges->end, sizeof(long long) * ranges->capacity);
+		ranges->stored = realloc(ranges->stored, ranges->capacity);
+	}
+	ranges->start[ranges->count] = start;
+	ranges->end[ranges->count] = end;
+	ranges->stored[ranges->count] = stored;
+	ranges->count++;
+}
+
+static inline void freeBlockRanges(BlockRanges *ranges)
+{
+	free(ranges->start);
+	free(ranges->end);
+	free(ranges->stored);
+}
+
+/*
+Samples a few pieces of the block. Compressed or encrypted data has
+near uniform byte counts, and almost every pair of bytes in it is new.
+Text, tables and code fail at least one of the two: their bytes are
+skewed, or (like a repeated run of all byte values) the pairs repeat.
+*/
+static int looksIncompressible(const unsigned char *data, size_t length)
+{
+	if(length < ENTROPY_SAMPLES * ENTROPY_SAMPLE_SIZE) {
+		return 0;
+	}
+
+	unsigned int counts[256];
+	unsigned char pairs[65536 / 8];
+	memset(counts, 0, sizeof(counts));
+	memset(pairs, 0, sizeof(pairs));
+
+	long long numBytes = 0, numPairs = 0, newPairs = 0;
+	int s;
+	for(s = 0; s < ENTROPY_SAMPLES; s++) {
+		const unsigned char *sample = data + (length - ENTROPY_SAMPLE_SIZE) / (ENTROPY_SAMPLES - 1) * s;
+		int i;
+		for(i = 0; i < ENTROPY_SAMPLE_SIZE; i++) {
+			counts[sample[i]]++;
+			if(i > 0) {
+				unsigned int pair = (sample[i - 1] << 8) | sample[i];
+				if(!(pairs[pair >> 3] & (1 << (pair & 7)))) {
+					pairs[pair >> 3] |= 1 << (pair & 7);
+					newPairs++;
+				}
+				numPairs++;
+			}
+		}
+		numBytes += ENTROPY_SAMPLE_SIZE;
+	}
+
+	// Sum of squared counts is numBytes^2 / 256 for uniform bytes,
+	// allow 10% over that.
+	long long squares = 0;
+	int c;
+	for(c = 0; c < 256; c++) {
+		squares += (long long) counts[c] * counts[c];
+	}
+	// Random pairs: about 88% of them are new in the sample, text: < 15%.
+	return squares * 256 < numBytes * numBytes * 11 / 10 && newPairs * 4 > numPairs * 3;
+}
+
+/*
+Blocks of one window, worked on by a pool of threads. Each worker keeps
+taking the next block, the calling thread then writes them in order.
+*/
+typedef struct BlockJob {
+	Codec *codec;
+	int level;
+	int compress;
+	int readFd;   // compress: blocks are read from here.
+	off_t *start; // compress: file offset of each block.
+	int numBlocks;
+	unsigned char **in;
+	size_t *inLength;  // compress: raw length, set before.
+	unsigned char **out;
+	size_t *outLength; // decompress: raw length, set before.
+	char *stored;      // set before, compress: also set by workers.
+	Dictionary *dict;  // NULL if blocks are compressed without one.
+	void *prepared;    // codec's own form of dict.
+	int failed;
+	int next; // next block to be picked, taken atomically.
+} BlockJob;
+
+static void *blockWorker(void *arg)
+{
+	BlockJob *job = (BlockJob *) arg;
+	while(1) {
+		int i = __sync_fetch_and_add(&job->next, 1);
+		if(i >= job->numBlocks) {
+			break;
+		}
+
+		if(job->compress) {
+			ssize_t n = pread(job->readFd, job->in[i], job->inLength[i], job->start[i]);
+			if(n != job->inLength[i]) {
+				job->failed = 1;
+				continue;
+			}
+			if(!job->stored[i] && job->codec->id != CODEC_NONE && looksIncompressible(job->in[i], n)) {
+				job->stored[i] = 1;
+			}
+			if(!job->stored[i]) {
+				if(job->dict != NULL) {
+					job->outLength[i] = job->codec->compressBlockDict(job->in[i], n, job->out[i],
+						job->codec->bound(CODEC_BLOCK_SIZE), job->level, job->dict, job->prepared);
+				} else {
+					job->outLength[i] = job->codec->compressBlock(job->in[i], n, job->out[i],
+						job->codec->bound(CODEC_BLOCK_SIZE), job->level);
+				}
+				// Stored also when it did not get smaller.
+				job->stored[i] = job->outLength[i] == 0 || job->outLength[i] >= n;
+			}
+			if(job->stored[i]) {
+				job->outLength[i] = n;
+			}
+		} else if(job->stored[i]) {
+			if(job->inLength[i] != job->outLength[i]) {
+				job->failed = 1;
+			} else {
+				memcpy(job->out[i], job->in[i], job->outLength[i]);
+			}
+		} else if(job->dict != NULL) {
+			if(job->codec->decompressBlockDict(job->in[i], job->inLength[i], job->out[i], job->outLength[i],
+				job->dict, job->prepared) != 0) {
+				job->failed = 1;
+			}
+		} else if(job->codec->decompressBlock(job->in[i], job->inLength[i], job->out[i], job->outLength[i]) != 0) {
+			job->failed = 1;
+		}
+	}
+	return NULL;
+}
+
+static void runBlockJob(BlockJob *job, int numThreads)
+{
+	job->next = 0;
+	if(numThreads > job->numBlocks) {
+		numThreads = job->numBlocks;
+	}
+
+	pthread_t tid[32];
+	int started = 0;
+	int i;
+	// Calling thread is also a worker.
+	for(i = 1; i < numThreads; i++) {
+		if(pthread_create(&tid[started], NULL, blockWorker, job) == 0) {
+			started++;
+		}
+	}
+
+	// Also covers the case of no thread started.
+	blockWorker(job);
+
+	for(i = 0; i < started; i++) {
+		pthread_join(tid[i], NULL);
+	}
+}
+
+static int codecThreads()
+{
+	long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(numThreads > 32) {
+		numThreads = 32;
+	}
+	return numThreads < 1 ? 1 : numThreads;
+}
+
+static ssize_t readFully(int fd, void *buffer, size_t length)
+{
+	size_t done = 0;
+	while(done < length) {
+		ssize_t n = read(fd, (char *) buffer + done, length - done);
+		if(n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+static void writeBlockHeader(int writeFd, uint32_t rawLength, uint32_t length)
+{
+	uint32_t header[2] = { rawLength, length };
+	write(writeFd, header, sizeof(header));
+}
+
+// Cuts the file in blocks, stored ranges start and end on block edges.
+// Returns the number of blocks, arrays are allocated.
+static long long planBlocks(long long size, BlockRanges *ranges, off_t **start, size_t **length, char **blockStored)
+{
+	long long capacity = size / CODEC_BLOCK_SIZE + 2 * (ranges != NULL ? ranges->count : 0) + 2;
+	*start = malloc(sizeof(off_t) * capacity);
+	*length = malloc(sizeof(size_t) * capacity);
+	*blockStored = malloc(capacity);
+
+	long long numBlocks = 0, pos = 0;
+	int r = 0;
+	while(pos < size) {
+		while(ranges != NULL && r < ranges->count && ranges->end[r] <= pos) {
+			r++;
+		}
+
+		long long end = size;
+		int stored = 0;
+		if(ranges != NULL && r < ranges->count) {
+			if(ranges->start[r] <= pos) {
+				stored = ranges->stored[r];
+				end = ranges->end[r];
+			} else {
+				end = ranges->start[r];
+			}
+			end = end < size ? end : size;
+		}
+
+		for(; pos < end; numBlocks++) {
+			(*start)[numBlocks] = pos;
+			(*length)[numBlocks] = end - pos < CODEC_BLOCK_SIZE ? end - pos : CODEC_BLOCK_SIZE;
+			(*blockStored)[numBlocks] = stored;
+			pos += (*length)[numBlocks];
+		}
+	}
+	return numBlocks;
+}
+
+// Compress the input file with the codec and write on output file.
+// Archives are compressed at the codec's higher level. Ranges (may be
+// NULL) start and end on block edges. The dictionary (may be NULL) is
+// not used if the codec has no support for it. Returns -1 if the input
+// could not be read or compressed; the output then has no end block, so
+// it does not decompress either.
+static inline int compressFile(char *inFile, char *outFile, int codecId, int archive, BlockRanges *ranges, Dictionary *dict)
+{
+	Codec *codec = findCodec(codecId);
+	if(codec == NULL) {
+		codec = findCodec(CODEC_ZLIB);
+	}
+	if(codec->compressBlockDict == NULL) {
+		dict = NULL;
+	}
+
+	int readFd = open(inFile, O_RDONLY, 0777);
+	int writeFd = open(outFile, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+
+	unsigned char header[CODEC_MAGIC_LEN + 1];
+	memcpy(header, CODEC_MAGIC, CODEC_MAGIC_LEN);
+	header[CODEC_MAGIC_LEN] = codec->id | CODEC_BLOCKS | (dict != NULL ? CODEC_DICT : 0);
+	write(writeFd, header, sizeof(header));
+
+	if(dict != NULL) {
+		uint32_t dictHeader[2] = { dict->id, dict->send ? dict->length : 0 };
+		write(writeFd, dictHeader, sizeof(dictHeader));
+		if(dict->send) {
+			write(writeFd, dict->data, dict->length);
+		}
+	}
+
+	struct stat st;
+	long long size = fstat(readFd, &st) == 0 ? st.st_size : 0;
+	off_t *blockStart;
+	size_t *blockLength;
+	char *blockStored;
+	long long numBlocks = planBlocks(size, ranges, &blockStart, &blockLength, &blockStored);
+
+	// Two blocks per thread in memory at a time.
+	int numThreads = codecThreads();
+	int window = numBlocks < 2 * numThreads ? (numBlocks > 0 ? numBlocks : 1) : 2 * numThreads;
+
+	BlockJob job;
+	job.codec = codec;
+	job.level = archive ? codec->archiveLevel : codec->transferLevel;
+	job.compress = 1;
+	job.readFd = readFd;
+	job.dict = dict;
+	job.prepared = dict != NULL && codec->prepareDict != NULL ? codec->prepareDict(dict, job.level, 1) : NULL;
+	job.failed = readFd < 0;
+	job.in = malloc(sizeof(unsigned char *) * window);
+	job.out = malloc(sizeof(unsigned char *) * window);
+	job.inLength = malloc(sizeof(size_t) * window);
+	job.outLength = malloc(sizeof(size_t) * window);
+	job.stored = malloc(window);
+
+	int i;
+	for(i = 0; i < window; i++) {
+		job.in[i] = malloc(CODEC_BLOCK_SIZE);
+		job.out[i] = malloc(codec->bound(CODEC_BLOCK_SIZE));
+	}
+
+	long long first;
+	for(first = 0; first < numBlocks && !job.failed; first += window) {
+		job.start = blockStart + first;
+		job.numBlocks = numBlocks - first < window ? numBlocks - first : window;
+		memcpy(job.inLength, blockLength + first, sizeof(size_t) * job.numBlocks);
+		memcpy(job.stored, blockStored + first, job.numBlocks);
+		runBlockJob(&job, numThreads);
+
+		for(i = 0; i < job.numBlocks && !job.failed; i++) {
+			if(job.stored[i]) {
+				writeBlockHeader(writeFd, job.inLength[i], job.inLength[i] | CODEC_STORED);
+				write(writeFd, job.in[i], job.inLength[i]);
+			} else {
+				writeBlockHeader(writeFd, job.inLength[i], job.outLength[i]);
+				write(writeFd, job.out[i], job.outLength[i]);
+			}
+		}
+	}
+	if(job.failed) {
+		printf("Error in compressing file %s with %s\n", inFile, codec->name);
+	} else {
+		writeBlockHeader(writeFd, 0, 0);
+	}
+
+	for(i = 0; i < window; i++) {
+		free(job.in[i]);
+		free(job.out[i]);
+	}
+	free(job.in);
+	free(job.out);
+	free(job.inLength);
+	free(job.outLength);
+	free(job.stored);
+	free(blockStart);
+	free(blockLength);
+	free(blockStored);
+	if(job.prepared != NULL) {
+		codec->freeDict(job.prepared, 1);
+	}
+
+	close(readFd);
+	close(writeFd);
+	return job.failed ? -1 : 0;
+}
+
+// Reads windows of blocks, and decompresses each window on the pool.
+static int decompressBlocks(Codec *codec, int readFd, int writeFd, Dictionary *dict)
+{
+	int numThreads = codecThreads();
+	int window = 2 * numThreads;
+
+	BlockJob job;
+	job.codec = codec;
+	job.compress = 0;
+	job.dict = dict;
+	job.prepared = dict != NULL && codec->prepareDict != NULL ? codec->prepareDict(dict, 0, 0) : NULL;
+	job.failed = 0;
+	job.in = malloc(sizeof(unsigned char *) * window);
+	job.out = malloc(sizeof(unsigned char *) * window);
+	job.inLength = malloc(sizeof(size_t) * window);
+	job.outLength = malloc(sizeof(size_t) * window);
+	job.stored = malloc(window);
+	size_t *inCapacity = malloc(sizeof(size_t) * window);
+
+	int i;
+	for(i = 0; i < window; i++) {
+		job.in[i] = NULL;
+		inCapacity[i] = 0;
+		job.out[i] = malloc(CODEC_BLOCK_SIZE);
+	}
+
+	int done = 0;
+	while(!done && !job.failed) {
+		job.numBlocks = 0;
+		while(job.numBlocks < window) {
+			uint32_t header[2];
+			if(readFully(readFd, header, sizeof(header)) != sizeof(header)
+				|| header[0] > CODEC_BLOCK_SIZE) {
+				job.failed = 1; // cut short or damaged.
+				break;
+			}
+			if(header[0] == 0) {
+				done = 1;
+				break;
+			}
+
+			i = job.numBlocks;
+			job.stored[i] = (header[1] & CODEC_STORED) != 0;
+			header[1] &= ~CODEC_STORED;
+			if(job.stored[i] ? header[1] != header[0] : header[1] > codec->bound(CODEC_BLOCK_SIZE)) {
+				job.failed = 1; // a length no block of ours has.
+				break;
+			}
+			if(inCapacity[i] < header[1]) {
+				job.in[i] = realloc(job.in[i], header[1]);
+				inCapacity[i] = header[1];
+			}
+			if(readFully(readFd, job.in[i], header[1]) != header[1]) {
+				job.failed = 1;
+				break;
+			}
+			job.inLength[i] = header[1];
+			job.outLength[i] = header[0];
+			job.numBlocks++;
+		}
+		if(job.failed) {
+			break;
+		}
+
+		runBlockJob(&job, numThreads);
+		for(i = 0; i < job.numBlocks && !job.failed; i++) {
+			write(writeFd, job.out[i], job.outLength[i]);
+		}
+	}
+
+	for(i = 0; i < window; i++) {
+		free(job.in[i]);
+		free(job.out[i]);
+	}
+	free(job.in);
+	free(job.out);
+	free(job.inLength);
+	free(job.outLength);
+	free(job.stored);
+	free(inCapacity);
+	if(job.prepared != NULL) {
+		codec->freeDict(job.prepared, 0);
+	}
+	return job.failed ? -1 : 0;
+}
+
+
+static void freeDictionary(Dictionary *dict)
+{
+	if(dict != NULL) {
+		free(dict->data);
+		free(dict);
+	}
+}
+
+// NULL if the file does not exist, or is damaged.
+static Dictionary *loadDictionary(char *path)
+{
+	int fd = open(path, O_RDONLY, 0777);
+	if(fd < 0) {
+		return NULL;
+	}
+
+	char line[100];
+	ssize_t n = pread(fd, line, sizeof(line) - 1, 0);
+	line[n > 0 ? n : 0] = '\0';
+	char *nl = strchr(line, '\n');
+	struct stat st;
+	if(nl == NULL || fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	Dictionary *dict = malloc(sizeof(Dictionary));
+	dict->id = strtoul(line, NULL, 10);
+	dict->length = st.st_size - (nl + 1 - line);
+	dict->data = malloc(dict->length > 0 ? dict->length : 1);
+	dict->send = 0;
+	lseek(fd, nl + 1 - line, SEEK_SET);
+	if(dict->id == 0 || readFully(fd, dict->data, dict->length) != dict->length) {
+		freeDictionary(dict);
+		dict = NULL;
+	}
+	close(fd);
+	return dict;
+}
+
+// Version is the one it was trained at, -1 to leave it out. Written to
+// a temp file first, so readers see the old or new one.
+static void saveDictionary(char *path, Dictionary *dict, int version)
+{
+	char *tmpPath = malloc(sizeof(char) * (strlen(path) + 10));
+	sprintf(tmpPath, "%s.tmp", path);
+	createDirStructureIfNeeded(tmpPath);
+
+	char line[100];
+	if(version >= 0) {
+		sprintf(line, "%u %d\n", dict->id, version);
+	} else {
+		sprintf(line, "%u\n", dict->id);
+	}
+	int fd = open(tmpPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	write(fd, line, strlen(line));
+	write(fd, dict->data, dict->length);
+	close(fd);
+	rename(tmpPath, path);
+	free(tmpPath);
+}
+
+// Reads the dictionary part of a compressed file. A sent dictionary is
+// cached at dictionaryFile, otherwise the cached one is used.
+static Dictionary *readFileDictionary(int readFd, char *dictionaryFile)
+{
+	uint32_t header[2];
+	if(readFully(readFd, header, sizeof(header)) != sizeof(header) || header[1] > DICT_MAX_LENGTH) {
+		return NULL;
+	}
+
+	Dictionary *dict;
+	if(header[1] > 0) {
+		dict = malloc(sizeof(Dictionary));
+		dict->id = header[0];
+		dict->length = header[1];
+		dict->data = malloc(dict->length);
+		dict->send = 0;
+		if(readFully(readFd, dict->data, dict->length) != dict->length) {
+			freeDictionary(dict);
+			return NULL;
+		}
+		if(dictionaryFile != NULL) {
+			saveDictionary(dictionaryFile, dict, -1);
+		}
+	} else {
+		dict = dictionaryFile != NULL ? loadDictionary(dictionaryFile) : NULL;
+		if(dict == NULL || dict->id != header[0]) {
+			printf("Error: Dictionary %u is needed, and not cached.\n", header[0]);
+			freeDictionary(dict);
+			return NULL;
+		}
+	}
+	return dict;
+}
+
+// DeCompress the input file and write data on output file.
+// dictionaryFile is where the dictionary of the data is cached, NULL
+// if it has none. Returns -1 if the data could not be decompressed.
+static int decompressFile(char *inFile, char *outFile, char *dictionaryFile)
+{
+	int readFd = open(inFile, O_RDONLY, 0777);
+	int writeFd = open(outFile, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+
+	// Files of older builds have no header, and are zlib.
+	unsigned char header[CODEC_MAGIC_LEN + 1];
+	Codec *codec = findCodec(CODEC_ZLIB);
+	int blocks = 0, hasDict = 0;
+	if(read(readFd, header, sizeof(header)) == sizeof(header)
+		&& memcmp(header, CODEC_MAGIC, CODEC_MAGIC_LEN) == 0) {
+		codec = findCodec(header[CODEC_MAGIC_LEN] & ~(CODEC_BLOCKS | CODEC_DICT));
+		blocks = (header[CODEC_MAGIC_LEN] & CODEC_BLOCKS) != 0;
+		hasDict = (header[CODEC_MAGIC_LEN] & CODEC_DICT) != 0;
+	} else {
+		lseek(readFd, 0, SEEK_SET);
+	}
+
+	int result = 0;
+	if(codec == NULL) {
+		printf("Error: File %s uses codec %d, which is not built in.\n", inFile, header[CODEC_MAGIC_LEN] & ~(CODEC_BLOCKS | CODEC_DICT));
+		result = -1;
+	} else if(hasDict) {
+		Dictionary *dict = codec->decompressBlockDict != NULL ? readFileDictionary(readFd, dictionaryFile) : NULL;
+		result = dict != NULL ? decompressBlocks(codec, readFd, writeFd, dict) : -1;
+		freeDictionary(dict);
+	} else if(blocks) {
+		result = decompressBlocks(codec, readFd, writeFd, NULL);
+	} else {
+		result = codec->decompress(readFd, writeFd);
+	}
+	if(result != 0 && codec != NULL) {
+		printf("Error in decompressing file %s with %s\n", inFile, codec->name);
+	}
+
 	close(readFd);
 	close(writeFd);
+	return result;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,433 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <openssl/evp.h>
+
+/*
+rsync style delta of a file, against an older copy which only the
+receiver has. The receiver first sends the signature of its copy:
+<block length (uint32)><numBlocks (uint32)>
+<weak checksum (uint32)><MD5 of block>
+..
+for each full block. The sender finds those blocks anywhere in the new
+file with a rolling checksum, so inserted and removed bytes only cost
+themselves, and sends:
+<block length (uint32)>
+'C'<first block (uint32)><numBlocks (uint32)>   copied from receiver's copy
+'L'<length (uint32)><bytes>                     new bytes
+..
+The whole file is hashed by the receiver as usual, so a wrong block
+match is found like a damaged transfer.
+*/
+
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (64 * 1024)
+
+// Longer new runs are sent in parts.
+#define DELTA_MAX_LITERAL (1024 * 1024)
+
+#define DELTA_STRONG_LENGTH 16
+
+typedef struct DeltaSignature {
+	uint32_t blockLength;
+	uint32_t numBlocks;
+	uint32_t *weak;
+	unsigned char *strong;  // DELTA_STRONG_LENGTH bytes per block.
+	int *table;             // first block by weak checksum, -1 if none.
+	int *next;              // next block of same table slot.
+	uint32_t tableMask;
+} DeltaSignature;
+
+// About sqrt(size), as rsync does. Signatures stay small for huge
+// files, and one changed byte costs one block.
+static uint32_t deltaBlockLength(long long size)
+{
+	uint32_t length = DELTA_MIN_BLOCK;
+	while(length < DELTA_MAX_BLOCK && (long long) length * length < size) {
+		length *= 2;
+	}
+	return length;
+}
+
+// Adler-32 like sums of rsync: low half is the sum of the bytes, high
+// half the sum of the bytes weighted by their distance from the end.
+static uint32_t deltaWeakChecksum(const unsigned char *data, uint32_t length)
+{
+	uint32_t a = 0, b = 0, i;
+	for(i = 0; i < length; i++) {
+		a += data[i];
+		b += (length - i) * data[i];
+	}
+	return (a & 0xffff) | (b << 16);
+}
+
+static void deltaStrongChecksum(const unsigned char *data, uint32_t length, unsigned char *digest)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	EVP_Digest(data, length, md, NULL, EVP_md5(), NULL);
+	memcpy(digest, md, DELTA_STRONG_LENGTH);
+}
+
+static ssize_t deltaReadFully(int fd, void *buffer, size_t length)
+{
+	size_t done = 0;
+	while(done < length) {
+		ssize_t n = read(fd, (char *) buffer + done, length - done);
+		if(n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+// Writes the signature of the file. Returns -1 if it can not be read.
+static int writeDeltaSignature(char *path, int writeFd)
+{
+	int fd = open(path, O_RDONLY, 0777);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0) {
+		if(fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	uint32_t header[2];
+	header[0] = deltaBlockLength(st.st_size);
+	header[1] = st.st_size / header[0];
+	write(writeFd, header, sizeof(header));
+
+	// Entries of many blocks are written at once.
+	int perWrite = 256;
+	unsigned char *block = malloc(header[0]);
+	unsigned char *entries = malloc(perWrite * (4 + DELTA_STRONG_LENGTH));
+	int pending = 0;
+	uint32_t i;
+	for(i = 0; i < header[1]; i++) {
+		if(deltaReadFully(fd, block, header[0]) != header[0]) {
+			memset(block, 0, header[0]); // Changed while read, hash mismatch shows it.
+		}
+		unsigned char *entry = entries + pending * (4 + DELTA_STRONG_LENGTH);
+		uint32_t weak = deltaWeakChecksum(block, header[0]);
+		memcpy(entry, &weak, 4);
+		deltaStrongChecksum(block, header[0], entry + 4);
+		if(++pending == perWrite || i + 1 == header[1]) {
+			write(writeFd, entries, pending * (4 + DELTA_STRONG_LENGTH));
+			pending = 0;
+		}
+	}
+
+	free(entries);
+	free(block);
+	close(fd);
+	return 0;
+}
+
+static void freeDeltaSignature(DeltaSignature *sig)
+{
+	if(sig == NULL) {
+		return;
+	}
+	free(sig->weak);
+	free(sig->strong);
+	free(sig->table);
+	free(sig->next);
+	free(sig);
+}
+
+// NULL if the file is not a signature.
+static DeltaSignature *loadDeltaSignature(char *path)
+{
+	int fd = open(path, O_RDONLY, 0777);
+	if(fd < 0) {
+		return NULL;
+	}
+	uint32_t header[2];
+	struct stat st;
+	if(deltaReadFully(fd, header, sizeof(header)) != sizeof(header) || fstat(fd, &st) != 0
+			|| header[0] < DELTA_MIN_BLOCK || header[0] > DELTA_MAX_BLOCK
+			|| st.st_size != sizeof(header) + (long long) header[1] * (4 + DELTA_STRONG_LENGTH)) {
+		close(fd);
+		return NULL;
+	}
+
+	DeltaSignature *sig = malloc(sizeof(DeltaSignature));
+	sig->blockLength = header[0];
+	sig->numBlocks = header[1];
+	sig->weak = malloc(sizeof(uint32_t) * (sig->numBlocks + 1));
+	sig->strong = malloc(DELTA_STRONG_LENGTH * (sig->numBlocks + 1));
+	sig->next = malloc(sizeof(int) * (sig->numBlocks + 1));
+
+	uint32_t tableSize = 1024;
+	while(tableSize < 2 * sig->numBlocks) {
+		tableSize *= 2;
+	}
+	sig->tableMask = tableSize - 1;
+	sig->table = malloc(sizeof(int) * tableSize);
+	memset(sig->table, -1, sizeof(int) * tableSize);
+
+	unsigned char entry[4 + DELTA_STRONG_LENGTH];
+	int i;
+	for(i = 0; i < sig->numBlocks; i++) {
+		deltaReadFully(fd, entry, sizeof(entry));
+		memcpy(&sig->weak[i], entry, 4);
+		memcpy(sig->strong + i * DELTA_STRONG_LENGTH, entry + 4, DELTA_STRONG_LENGTH);
+	}
+	close(fd);
+
+	// Chained from the end, so each slot lists the earliest block first.
+	for(i = sig->numBlocks - 1; i >= 0; i--) {
+		uint32_t slot = (sig->weak[i] ^ (sig->weak[i] >> 16)) & sig->tableMask;
+		sig->next[i] = sig->table[slot];
+		sig->table[slot] = i;
+	}
+	return sig;
+}
+
+// Block of the receiver's copy which is the same as data, -1 if none.
+// The expected one (following the last copied block) is tried first.
+static int findDeltaBlock(DeltaSignature *sig, uint32_t weak, const unsigned char *data, int expected)
+{
+	int slot = sig->table[(weak ^ (weak >> 16)) & sig->tableMask];
+	if(slot < 0) {
+		return -1;
+	}
+
+	unsigned char digest[DELTA_STRONG_LENGTH];
+	int hashed = 0;
+	if(expected >= 0 && expected < sig->numBlocks && sig->weak[expected] == weak) {
+		deltaStrongChecksum(data, sig->blockLength, digest);
+		hashed = 1;
+		if(memcmp(digest, sig->strong + expected * DELTA_STRONG_LENGTH, DELTA_STRONG_LENGTH) == 0) {
+			return expected;
+		}
+	}
+
+	for(; slot >= 0; slot = sig->next[slot]) {
+		if(sig->weak[slot] != weak) {
+			continue;
+		}
+		if(!hashed) {
+			deltaStrongChecksum(data, sig->blockLength, digest);
+			hashed = 1;
+		}
+		if(memcmp(digest, sig->strong + slot * DELTA_STRONG_LENGTH, DELTA_STRONG_LENGTH) == 0) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+static void writeDeltaCopy(int writeFd, uint32_t first, uint32_t count)
+{
+	unsigned char op[9];
+	op[0] = 'C';
+	memcpy(op + 1, &first, 4);
+	memcpy(op + 5, &count, 4);
+	write(writeFd, op, sizeof(op));
+}
+
+static void writeDeltaLiteral(int writeFd, const unsigned char *data, uint32_t length)
+{
+	unsigned char op[5];
+	op[0] = 'L';
+	memcpy(op + 1, &length, 4);
+	write(writeFd, op, sizeof(op));
+	write(writeFd, data, length);
+}
+
+// Writes the delta of the file against the signature.
+// Returns -1 if the file can not be read.
+static int writeDelta(char *path, DeltaSignature *sig, int writeFd)
+{
+	int fd = open(path, O_RDONLY, 0777);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0) {
+		if(fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	long long size = st.st_size;
+	const unsigned char *data = NULL;
+	if(size > 0) {
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		madvise((void *) data, size, MADV_SEQUENTIAL);
+	}
+
+	uint32_t blockLength = sig->blockLength;
+	write(writeFd, &blockLength, sizeof(blockLength));
+
+	long long pos = 0, literalStart = 0;
+	long long copyFirst = -1, copyCount = 0;
+	uint32_t a = 0, b = 0;
+	if(size >= blockLength && sig->numBlocks > 0) {
+		uint32_t weak = deltaWeakChecksum(data, blockLength);
+		a = weak & 0xffff;
+		b = weak >> 16;
+	}
+
+	while(sig->numBlocks > 0 && pos + blockLength <= size) {
+		uint32_t weak = (a & 0xffff) | (b << 16);
+		int block = findDeltaBlock(sig, weak, data + pos, copyFirst >= 0 ? copyFirst + copyCount : -1);
+		if(block >= 0) {
+			if(pos > literalStart) {
+				if(copyFirst >= 0) {
+					writeDeltaCopy(writeFd, copyFirst, copyCount);
+					copyFirst = -1;
+				}
+				writeDeltaLiteral(writeFd, data + literalStart, pos - literalStart);
+			}
+			if(copyFirst >= 0 && block == copyFirst + copyCount) {
+				copyCount++;
+			} else {
+				if(copyFirst >= 0) {
+					writeDeltaCopy(writeFd, copyFirst, copyCount);
+				}
+				copyFirst = block;
+				copyCount = 1;
+			}
+
+			pos += blockLength;
+			literalStart = pos;
+			if(pos + blockLength <= size) {
+				weak = deltaWeakChecksum(data + pos, blockLength);
+				a = weak & 0xffff;
+				b = weak >> 16;
+			}
+			continue;
+		}
+
+		// Roll the window one byte on.
+		if(pos + blockLength < size) {
+			a += data[pos + blockLength] - data[pos];
+			b += a - blockLength * data[pos];
+		}
+		pos++;
+
+		if(pos - literalStart >= DELTA_MAX_LITERAL) {
+			if(copyFirst >= 0) {
+				writeDeltaCopy(writeFd, copyFirst, copyCount);
+				copyFirst = -1;
+			}
+			writeDeltaLiteral(writeFd, data + literalStart, pos - literalStart);
+			literalStart = pos;
+		}
+	}
+
+	if(copyFirst >= 0) {
+		writeDeltaCopy(writeFd, copyFirst, copyCount);
+	}
+	while(literalStart < size) {
+		long long length = size - literalStart < DELTA_MAX_LITERAL ? size - literalStart : DELTA_MAX_LITERAL;
+		writeDeltaLiteral(writeFd, data + literalStart, length);
+		literalStart += length;
+	}
+
+	if(data != NULL) {
+		munmap((void *) data, size);
+	}
+	close(fd);
+	return 0;
+}
+
+static void writeDeltaOutput(int writeFd, EVP_MD_CTX *mdContext, const unsigned char *data, size_t length)
+{
+	write(writeFd, data, length);
+	if(mdContext != NULL) {
+		EVP_DigestUpdate(mdContext, data, length);
+	}
+}
+
+// Reads a delta of deltaLength bytes, and writes the new file built from
+// it and the old copy at basePath. The written bytes are also hashed
+// into mdContext (may be NULL). Returns -1 if the delta is not valid.
+static int applyDelta(int readFd, long long deltaLength, char *basePath, int writeFd, EVP_MD_CTX *mdContext)
+{
+	uint32_t blockLength = 0;
+	if(deltaLength < sizeof(blockLength) || deltaReadFully(readFd, &blockLength, sizeof(blockLength)) != sizeof(blockLength)) {
+		return -1;
+	}
+	deltaLength -= sizeof(blockLength);
+
+	// Blocks are of a length loadDeltaSignature takes, else it is skipped.
+	int status = blockLength < DELTA_MIN_BLOCK || blockLength > DELTA_MAX_BLOCK ? -1 : 0;
+	int baseFd = open(basePath, O_RDONLY, 0777);
+	size_t capacity = status == 0 && blockLength > DELTA_MAX_LITERAL ? blockLength : DELTA_MAX_LITERAL;
+	unsigned char *buffer = malloc(capacity);
+
+	while(deltaLength > 0 && status == 0) {
+		unsigned char op[9];
+		if(deltaReadFully(readFd, op, 5) != 5) {
+			status = -1;
+			break;
+		}
+		uint32_t value;
+		memcpy(&value, op + 1, 4);
+		deltaLength -= 5;
+
+		if(op[0] == 'L') {
+			if(value > deltaLength || value > capacity) {
+				status = -1;
+				break;
+			}
+			ssize_t n = deltaReadFully(readFd, buffer, value);
+			deltaLength -= n;
+			if(n != value) {
+				status = -1;
+				break;
+			}
+			writeDeltaOutput(writeFd, mdContext, buffer, value);
+
+		} else if(op[0] == 'C') {
+			uint32_t count;
+			if(deltaLength < 4 || deltaReadFully(readFd, &count, 4) != 4) {
+				status = -1;
+				break;
+			}
+			deltaLength -= 4;
+
+			off_t offset = (off_t) value * blockLength;
+			long long remaining = (long long) count * blockLength;
+			while(remaining > 0) {
+				size_t length = remaining < capacity ? remaining : capacity;
+				ssize_t n = baseFd >= 0 ? pread(baseFd, buffer, length, offset) : -1;
+				if(n <= 0) {
+					status = -1; // Old copy is gone or shorter.
+					break;
+				}
+				writeDeltaOutput(writeFd, mdContext, buffer, n);
+				offset += n;
+				remaining -= n;
+			}
+
+		} else {
+			status = -1;
+		}
+	}
+
+	// Rest of a bad delta is skipped, the next file starts after it.
+	while(deltaLength > 0) {
+		size_t length = deltaLength < capacity ? deltaLength : capacity;
+		ssize_t n = read(readFd, buffer, length);
+		if(n <= 0) {
+			break;
+		}
+		deltaLength -= n;
+	}
+
+	free(buffer);
+	if(baseFd >= 0) {
+		close(baseFd);
+	}
+	return status;
+}
+
+#endif
@@ -0,0 +1,247 @@
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "util.h"
+#include "compressor.h"
+
+/*
+Compression dictionary of a project, trained by the server from the
+small files of a version. Checkout and upgrade compress every file on
+its own with it, so source files share their common text (license
+headers, includes, boilerplate) without being in one stream.
+
+With zstd built in, zstd's trainer is used. Otherwise lines common to
+many files are collected, the most useful at the end, as zlib only
+keeps the last 32 KB of a dictionary.
+*/
+
+#define DICT_CAPACITY (110 * 1024)
+#define DICT_LINE_CAPACITY (32 * 1024)
+
+// Larger files compress well enough by themselves.
+#define DICT_SAMPLE_MAX_FILE (64 * 1024)
+#define DICT_SAMPLE_BUDGET (8 * 1024 * 1024)
+#define DICT_MIN_SAMPLES 8
+
+// Dictionary is trained again after these many new versions.
+#define DICT_RETRAIN_VERSIONS 10
+
+#define DICT_MIN_LINE 2
+#define DICT_MAX_LINE 400
+
+typedef struct DictLine {
+	const unsigned char *start;
+	int length;
+	int count;      // number of samples it is in.
+	int lastSample;
+} DictLine;
+
+// Version the dictionary file was trained at, -1 if there is none.
+int dictionaryTrainedVersion(char *path) {
+	int fd = open(path, O_RDONLY, 0777);
+	if(fd < 0) {
+		return -1;
+	}
+	char line[100];
+	ssize_t n = read(fd, line, sizeof(line) - 1);
+	close(fd);
+	line[n > 0 ? n : 0] = '\0';
+
+	char *space = strchr(line, ' ');
+	char *nl = strchr(line, '\n');
+	if(space == NULL || nl == NULL || space > nl) {
+		return -1;
+	}
+	return atoi(space + 1);
+}
+
+int compareDictLineScore(const void *a, const void *b) {
+	const DictLine *x = (const DictLine *) a;
+	const DictLine *y = (const DictLine *) b;
+	long long scoreX = (long long) (x->count - 1) * x->length;
+	long long scoreY = (long long) (y->count - 1) * y->length;
+	return scoreX < scoreY ? 1 : (scoreX > scoreY ? -1 : 0);
+}
+
+uint32_t hashDictLine(const unsigned char *start, int length) {
+	uint32_t hash = 2166136261u;
+	int i;
+	for(i = 0; i < length; i++) {
+		hash = (hash ^ start[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// Lines found in at least two samples, scored by the bytes they save.
+unsigned char *trainLineDictionary(unsigned char *samples, size_t *sampleSizes, int numSamples, size_t *length) {
+	size_t total = 0, numLines = 0, i;
+	int s;
+	for(s = 0; s < numSamples; s++) {
+		total += sampleSizes[s];
+	}
+	for(i = 0; i < total; i++) {
+		numLines += samples[i] == '\n';
+	}
+
+	size_t tableSize = 1024;
+	while(tableSize < 2 * (numLines + numSamples)) {
+		tableSize *= 2;
+	}
+	int *table = malloc(sizeof(int) * tableSize);
+	memset(table, -1, sizeof(int) * tableSize);
+	DictLine *lines = malloc(sizeof(DictLine) * (numLines + numSamples + 1));
+	int count = 0;
+
+	unsigned char *sample = samples;
+	for(s = 0; s < numSamples; sample += sampleSizes[s], s++) {
+		size_t pos = 0;
+		while(pos < sampleSizes[s]) {
+			unsigned char *nl = memchr(sample + pos, '\n', sampleSizes[s] - pos);
+			size_t end = nl != NULL ? nl + 1 - sample : sampleSizes[s];
+			int lineLength = end - pos;
+			unsigned char *start = sample + pos;
+			pos = end;
+			if(lineLength < DICT_MIN_LINE || lineLength > DICT_MAX_LINE) {
+				continue;
+			}
+
+			size_t slot = hashDictLine(start, lineLength) & (tableSize - 1);
+			while(table[slot] >= 0) {
+				DictLine *line = &lines[table[slot]];
+				if(line->length == lineLength && memcmp(line->start, start, lineLength) == 0) {
+					break;
+				}
+				slot = (slot + 1) & (tableSize - 1);
+			}
+
+			if(table[slot] < 0) {
+				table[slot] = count;
+				lines[count].start = start;
+				lines[count].length = lineLength;
+				lines[count].count = 1;
+				lines[count].lastSample = s;
+				count++;
+			} else if(lines[table[slot]].lastSample != s) {
+				lines[table[slot]].count++;
+				lines[table[slot]].lastSample = s;
+			}
+		}
+	}
+	free(table);
+
+	qsort(lines, count, sizeof(DictLine), compareDictLineScore);
+
+	// Take the best ones that fit, and write them best last.
+	int taken = 0;
+	size_t used = 0;
+	int l;
+	for(l = 0; l < count && lines[l].count > 1; l++) {
+		if(used + lines[l].length <= DICT_LINE_CAPACITY) {
+			lines[taken++] = lines[l];
+			used += lines[l].length;
+		}
+	}
+
+	unsigned char *data = malloc(used > 0 ? used : 1);
+	*length = 0;
+	for(l = taken - 1; l >= 0; l--) {
+		memcpy(data + *length, lines[l].start, lines[l].length);
+		*length += lines[l].length;
+	}
+	free(lines);
+	return data;
+}
+
+// Trains from the files (paths relative to baseDir) which are small
+// enough. NULL if there are too few of them, or nothing in common.
+Dictionary *trainDictionary(char *baseDir, char **filePaths, int numFiles) {
+	char *path = malloc(sizeof(char) * (strlen(baseDir) + 10));
+	size_t pathCapacity = strlen(baseDir) + 10;
+	long *fileSizes = malloc(sizeof(long) * (numFiles > 0 ? numFiles : 1));
+	long long candidateBytes = 0;
+
+	int i, numCandidates = 0;
+	for(i = 0; i < numFiles; i++) {
+		if(strlen(baseDir) + strlen(filePaths[i]) + 2 > pathCapacity) {
+			pathCapacity = strlen(baseDir) + strlen(filePaths[i]) + 2;
+			path = realloc(path, pathCapacity);
+		}
+		sprintf(path, "%s/%s", baseDir, filePaths[i]);
+		struct stat st;
+		fileSizes[i] = stat(path, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0;
+		if(fileSizes[i] > 0 && fileSizes[i] <= DICT_SAMPLE_MAX_FILE) {
+			candidateBytes += fileSizes[i];
+			numCandidates++;
+		} else {
+			fileSizes[i] = 0;
+		}
+	}
+
+	if(numCandidates < DICT_MIN_SAMPLES) {
+		free(fileSizes);
+		free(path);
+		return NULL;
+	}
+
+	// Every step'th file, when all of them are too many bytes.
+	int step = candidateBytes / DICT_SAMPLE_BUDGET + 1;
+	unsigned char *samples = malloc(candidateBytes / step + DICT_SAMPLE_MAX_FILE);
+	size_t *sampleSizes = malloc(sizeof(size_t) * numCandidates);
+	size_t total = 0;
+	int numSamples = 0, seen = 0;
+	for(i = 0; i < numFiles; i++) {
+		if(fileSizes[i] == 0 || seen++ % step != 0 || total + fileSizes[i] > candidateBytes / step + DICT_SAMPLE_MAX_FILE) {
+			continue;
+		}
+		sprintf(path, "%s/%s", baseDir, filePaths[i]);
+		int fd = open(path, O_RDONLY, 0777);
+		ssize_t n = fd >= 0 ? readFully(fd, samples + total, fileSizes[i]) : 0;
+		if(fd >= 0) {
+			close(fd);
+		}
+		if(n > 0) {
+			sampleSizes[numSamples++] = n;
+			total += n;
+		}
+	}
+	free(fileSizes);
+	free(path);
+
+	unsigned char *data = NULL;
+	size_t length = 0;
+#ifdef WTF_ZSTD
+	data = malloc(DICT_CAPACITY);
+	length = ZDICT_trainFromBuffer(data, DICT_CAPACITY, samples, sampleSizes, numSamples);
+	if(ZDICT_isError(length)) {
+		free(data);
+		data = NULL;
+		length = 0;
+	}
+#endif
+	if(data == NULL) {
+		data = trainLineDictionary(samples, sampleSizes, numSamples, &length);
+	}
+	free(samples);
+	free(sampleSizes);
+
+	// Too little in common to be worth it.
+	if(length < 256) {
+		free(data);
+		return NULL;
+	}
+
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	EVP_Digest(data, length, digest, NULL, EVP_md5(), NULL);
+
+	Dictionary *dict = malloc(sizeof(Dictionary));
+	dict->id = ((uint32_t) digest[0] << 24) | (digest[1] << 16) | (digest[2] << 8) | digest[3];
+	dict->id = dict->id == 0 ? 1 : dict->id; // 0 is no dictionary.
+	dict->data = data;
+	dict->length = length;
+	dict->send = 0;
+	return dict;
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <fnmatch.h>
 #include "socketBuffer.h"
 
 
@@ -10,44 +11,303 @@
 Manifest file format:
 <project Name>
 <project Version>
-<numFiles>
+<numFiles>[<space><hash algorithm>]
 <md5hash><space><last modified time in ms><space><file path>
 <md5hash><space><last modified time in ms><space><file path>
 <md5hash><space><last modified time in ms><space><file path>
 ..
 
 The filePaths are relative to the manifest file.
+
+Entries are always written sorted by filePath (byte order, as strcmp),
+so two manifests can be diffed in a single merge-join pass. Manifests
+written by older builds may be unsorted, they are sorted once on read.
+
+The hash algorithm (see util.h) is left out for md5, so manifests of
+older builds are md5 manifests. The hashes are still written in the
+md5hash column whatever the algorithm.
 */
 
 typedef struct ManifestNode {
+	char code; // Only used for .commit/.update entries, '\0' otherwise.
+	char shared; // 1 if node and its strings live in the manifest's block.
+	int pathId; // Interned filePath, same path has same id in all manifests.
 	char *md5;
 	char *version;
 	char *filePath;
 	struct ManifestNode *next;
 } ManifestNode;
 
+// A parsed manifest is one allocation (block): the manifest text,
+// tokenized in place, followed by the array of its nodes. Nodes added
+// later are allocated one by one as before.
 typedef struct Manifest {
 	char *projectName;
 	char *versionNumber;
 	int numFiles;
+	int hashAlgorithm; // of all the hashes in this manifest.
+	int sorted; // 1 while the list is known to be in filePath order.
 	ManifestNode *head;
 	ManifestNode *tail;
+	ManifestNode **nodesById; // first node of each path, hashed on pathId.
+	int nodesByIdSize; // slots, a power of 2.
+	int nodesByIdCount;
+	char *block;
+	size_t blockSize;
 } Manifest;
 
 void freeManifestNode(ManifestNode *d);
 
-void addFileToManifest(Manifest *manifest, char *md5, char *version, char *filePath) {
+/*
+Path interning.
+Every file path is given an id, which is same for all manifests in this
+process. So equal paths from server and client manifests can be matched
+by comparing ids, instead of comparing strings.
+
+Manifests, indexes and dir sets keep the pool while they hold ids. Once
+the last of them is freed the pool is emptied, so a server does not keep
+every path it has seen for its whole life.
+*/
+typedef struct PathPool {
+	char **paths;     // id -> path
+	int count;
+	int capacity;
+	int *table;       // open addressing hash table of (id + 1), 0 if empty.
+	int tableSize;
+} PathPool;
+
+static PathPool pathPool = {NULL, 0, 0, NULL, 0};
+static int pathPoolUsers = 0;
+
+// Server threads read manifests at the same time.
+static pthread_mutex_t pathPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned int hashPath(const char *path) {
+	// FNV-1a
+	unsigned int h = 2166136261u;
+	while(*path) {
+		h ^= (unsigned char) *path++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void growPathPool(PathPool *pool) {
+	int newSize = pool->tableSize == 0 ? 1024 : pool->tableSize * 2;
+	int *table = calloc(newSize, sizeof(int));
 	
-	ManifestNode *node = malloc(sizeof(ManifestNode));
-	node->md5 = md5;
-	node->version = version;
-	node->filePath = filePath;
+	int i;
+	for(i = 0; i < pool->count; i++) {
+		unsigned int slot = hashPath(pool->paths[i]) & (newSize - 1);
+		while(table[slot] != 0) {
+			slot = (slot + 1) & (newSize - 1);
+		}
+		table[slot] = i + 1;
+	}
+	
+	free(pool->table);
+	pool->table = table;
+	pool->tableSize = newSize;
+}
+
+// Returns the id of the path in the pool, -1 if not present. Path is
+// added first if add is set.
+int findPathInPool(PathPool *pool, const char *path, int add) {
+	// keep load factor under 1/2
+	if(add && 2 * (pool->count + 1) > pool->tableSize) {
+		growPathPool(pool);
+	}
+	if(pool->tableSize == 0) {
+		return -1;
+	}
+	
+	unsigned int slot = hashPath(path) & (pool->tableSize - 1);
+	while(pool->table[slot] != 0) {
+		int id = pool->table[slot] - 1;
+		if(strcmp(pool->paths[id], path) == 0) {
+			return id;
+		}
+		slot = (slot + 1) & (pool->tableSize - 1);
+	}
+	if(!add) {
+		return -1;
+	}
+	
+	if(pool->count == pool->capacity) {
+		pool->capacity = pool->capacity == 0 ? 1024 : pool->capacity * 2;
+		pool->paths = realloc(pool->paths, sizeof(char *) * pool->capacity);
+	}
+	pool->paths[pool->count] = strdup(path);
+	pool->table[slot] = pool->count + 1;
+	return pool->count++;
+}
+
+void clearPathPool(PathPool *pool) {
+	int i;
+	for(i = 0; i < pool->count; i++) {
+		free(pool->paths[i]);
+	}
+	free(pool->paths);
+	free(pool->table);
+	memset(pool, 0, sizeof(PathPool));
+}
+
+void retainPathPool() {
+	pthread_mutex_lock(&pathPoolLock);
+	pathPoolUsers++;
+	pthread_mutex_unlock(&pathPoolLock);
+}
+
+// Ids given out so far are reused once nobody holds them.
+void releasePathPool() {
+	pthread_mutex_lock(&pathPoolLock);
+	if(--pathPoolUsers == 0) {
+		clearPathPool(&pathPool);
+	}
+	pthread_mutex_unlock(&pathPoolLock);
+}
+
+// Returns the id of the path, adds it to the pool if not present.
+int internPath(const char *path) {
+	pthread_mutex_lock(&pathPoolLock);
+	int id = findPathInPool(&pathPool, path, 1);
+	pthread_mutex_unlock(&pathPoolLock);
+	return id;
+}
+
+// Returns the id of the path, or -1 if path was never seen.
+int findInternedPath(const char *path) {
+	pthread_mutex_lock(&pathPoolLock);
+	int id = findPathInPool(&pathPool, path, 0);
+	pthread_mutex_unlock(&pathPoolLock);
+	return id;
+}
+
+Manifest *createEmptyManifest(char *projectName, char *versionNumber) {
+	Manifest *manifest = malloc(sizeof(Manifest));
+	manifest->projectName = projectName;
+	manifest->versionNumber = versionNumber;
+	manifest->numFiles = 0;
+	manifest->hashAlgorithm = HASH_MD5;
+	manifest->sorted = 1;
+	manifest->head = NULL;
+	manifest->tail = NULL;
+	manifest->nodesById = NULL;
+	manifest->nodesByIdSize = 0;
+	manifest->nodesByIdCount = 0;
+	manifest->block = NULL;
+	manifest->blockSize = 0;
+	retainPathPool();
+	return manifest;
+}
+
+int isInManifestBlock(Manifest *manifest, char *ptr) {
+	return manifest->block != NULL && ptr >= manifest->block 
+		&& ptr < manifest->block + manifest->blockSize;
+}
+
+// Replaces the project version string, which may live in the block.
+void setManifestVersion(Manifest *manifest, char *versionNumber) {
+	if(manifest->versionNumber != NULL && !isInManifestBlock(manifest, manifest->versionNumber)) {
+		free(manifest->versionNumber);
+	}
+	manifest->versionNumber = versionNumber;
+}
+
+/*
+Nodes by path id. Path ids are of the whole process, so the table is
+sized by the manifest's own paths instead: open addressing on the id,
+with linear probing, and backward shift on delete so no tombstones are
+left.
+*/
+int manifestNodeHome(Manifest *manifest, int pathId) {
+	return ((unsigned int) pathId * 2654435761u) & (manifest->nodesByIdSize - 1);
+}
+
+// Slot of the path's node, or the empty slot it would go in.
+int findManifestNodeSlot(Manifest *manifest, int pathId) {
+	int mask = manifest->nodesByIdSize - 1;
+	int slot = manifestNodeHome(manifest, pathId);
+	while(manifest->nodesById[slot] != NULL && manifest->nodesById[slot]->pathId != pathId) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+// The first node of a path is kept, as a scan from head finds it.
+void indexManifestNode(Manifest *manifest, ManifestNode *node) {
+	// At most 3/4 full.
+	if(4 * (manifest->nodesByIdCount + 1) > 3 * manifest->nodesByIdSize) {
+		ManifestNode **old = manifest->nodesById;
+		int oldSize = manifest->nodesByIdSize;
+		manifest->nodesByIdSize = oldSize == 0 ? 64 : oldSize * 2;
+		manifest->nodesById = calloc(manifest->nodesByIdSize, sizeof(ManifestNode *));
+		int i;
+		for(i = 0; i < oldSize; i++) {
+			if(old[i] != NULL) {
+				manifest->nodesById[findManifestNodeSlot(manifest, old[i]->pathId)] = old[i];
+			}
+		}
+		free(old);
+	}
+	
+	int slot = findManifestNodeSlot(manifest, node->pathId);
+	if(manifest->nodesById[slot] == NULL) {
+		manifest->nodesById[slot] = node;
+		manifest->nodesByIdCount++;
+	}
+}
+
+// Removes the path's slot, and moves back the ones probed past it.
+void unindexManifestNode(Manifest *manifest, int pathId) {
+	int mask = manifest->nodesByIdSize - 1;
+	int empty = findManifestNodeSlot(manifest, pathId);
+	if(manifest->nodesById[empty] == NULL) {
+		return;
+	}
+	
+	int slot = empty;
+	while(1) {
+		slot = (slot + 1) & mask;
+		ManifestNode *node = manifest->nodesById[slot];
+		if(node == NULL) {
+			break;
+		}
+		// Stays if its home is cyclically in (empty, slot].
+		int home = manifestNodeHome(manifest, node->pathId);
+		if(empty <= slot ? (empty < home && home <= slot) : (empty < home || home <= slot)) {
+			continue;
+		}
+		manifest->nodesById[empty] = node;
+		empty = slot;
+	}
+	manifest->nodesById[empty] = NULL;
+	manifest->nodesByIdCount--;
+}
+
+// Empties the list without freeing the nodes, caller moves them.
+void clearManifestList(Manifest *manifest) {
+	manifest->head = NULL;
+	manifest->tail = NULL;
+	manifest->numFiles = 0;
+	if(manifest->nodesById != NULL) {
+		memset(manifest->nodesById, 0, sizeof(ManifestNode *) * manifest->nodesByIdSize);
+	}
+	manifest->nodesByIdCount = 0;
+}
+
+void appendManifestNode(Manifest *manifest, ManifestNode *node) {
 	node->next = NULL;
+	indexManifestNode(manifest, node);
 	
 	if(manifest->tail == NULL) {
 		manifest->tail = node;
 		manifest->head = node;
 	} else {
+		// Appending out of order, list has to be sorted before next diff/write.
+		if(strcmp(manifest->tail->filePath, node->filePath) > 0) {
+			manifest->sorted = 0;
+		}
 		manifest->tail->next = node;
 		manifest->tail = node;
 	}
@@ -55,68 +315,280 @@ void addFileToManifest(Manifest *manifest, char *md5, char *version, char *fileP
 	manifest->numFiles += 1;
 }
 
-// Read Manifest only reads the manifest content into the structure..
-// No error checking is part of this.. We should do it before calling this method.
-Manifest *readManifestContents(int fd) {
+void addFileToManifest(Manifest *manifest, char *md5, char *version, char *filePath) {
 	
-	SocketBuffer *socketBuffer = createBuffer();
+	ManifestNode *node = malloc(sizeof(ManifestNode));
+	node->code = '\0';
+	node->shared = 0;
+	node->pathId = internPath(filePath);
+	node->md5 = md5;
+	node->version = version;
+	node->filePath = filePath;
 	
-	Manifest *manifest = malloc(sizeof(Manifest));
-	manifest->head = NULL;
-	manifest->tail = NULL;
-	manifest->numFiles = 0;
+	appendManifestNode(manifest, node);
+}
+
+// Merge two sorted lists of nodes, returns the new head.
+ManifestNode *mergeManifestLists(ManifestNode *a, ManifestNode *b) {
+	ManifestNode dummy;
+	ManifestNode *tail = &dummy;
+	
+	while(a != NULL && b != NULL) {
+		// <= keeps the sort stable.
+		if(strcmp(a->filePath, b->filePath) <= 0) {
+			tail->next = a;
+			a = a->next;
+		} else {
+			tail->next = b;
+			b = b->next;
+		}
+		tail = tail->next;
+	}
+	tail->next = (a != NULL) ? a : b;
+	return dummy.next;
+}
+
+// Bottom-up merge sort on the linked list, O(n log n) and no extra memory.
+void sortManifest(Manifest *manifest) {
+	if(manifest->sorted || manifest->head == NULL) {
+		manifest->sorted = 1;
+		return;
+	}
+	
+	ManifestNode *head = manifest->head;
+	int width;
+	for(width = 1; ; width *= 2) {
+		ManifestNode *remaining = head;
+		ManifestNode *result = NULL, *resultTail = NULL;
+		int merges = 0;
+		
+		while(remaining != NULL) {
+			merges++;
+			
+			// cut two runs of length width.
+			ManifestNode *a = remaining, *b, *node = remaining;
+			int i;
+			for(i = 1; i < width && node->next != NULL; i++) {
+				node = node->next;
+			}
+			b = node->next;
+			node->next = NULL;
+			
+			node = b;
+			for(i = 1; i < width && node != NULL && node->next != NULL; i++) {
+				node = node->next;
+			}
+			if(node != NULL) {
+				remaining = node->next;
+				node->next = NULL;
+			} else {
+				remaining = NULL;
+			}
+			
+			ManifestNode *merged = mergeManifestLists(a, b);
+			if(result == NULL) {
+				result = merged;
+			} else {
+				resultTail->next = merged;
+			}
+			resultTail = merged;
+			while(resultTail->next != NULL) {
+				resultTail = resultTail->next;
+			}
+		}
+		
+		head = result;
+		manifest->tail = resultTail;
+		if(merges <= 1) {
+			break;
+		}
+	}
 	
-	///////////////////// MANIFEST CONTENTS BEGIN NOW ////////////////
+	manifest->head = head;
+	manifest->sorted = 1;
+}
+
+// Tokenizes the manifest text in place. data must have been allocated
+// with room for (numFiles from the header) nodes after len + 1 bytes,
+// see readManifestContents. Takes ownership of data.
+Manifest *parseManifestText(char *data, long len) {
+	Manifest *manifest = createEmptyManifest(NULL, NULL);
+	char *end = data + len;
+	*end = '\0';
 	
-	// first line is projectName
-	readTillDelimiter(socketBuffer, fd, '\n');
-	manifest->projectName = readAllBuffer(socketBuffer);
+	// next line of text, '\n' replaced by '\0'.
+	char *cursor = data;
+	char *lines[3];
+	int i;
+	for(i = 0; i < 3; i++) {
+		lines[i] = cursor;
+		char *nl = memchr(cursor, '\n', end - cursor);
+		if(nl == NULL) {
+			cursor = end;
+		} else {
+			*nl = '\0';
+			cursor = nl + 1;
+		}
+	}
+	manifest->projectName = lines[0];
+	manifest->versionNumber = lines[1];
+	int numFiles = atoi(lines[2]);
 	
-	// second line is projectVersion
-	readTillDelimiter(socketBuffer, fd, '\n');
-	manifest->versionNumber = readAllBuffer(socketBuffer);
+	char *algorithm = strchr(lines[2], ' ');
+	if(algorithm != NULL) {
+		manifest->hashAlgorithm = hashAlgorithmFromName(algorithm + 1);
+		if(manifest->hashAlgorithm < 0) {
+			printf("Unknown hash algorithm in manifest: %s\n", algorithm + 1);
+			manifest->hashAlgorithm = HASH_MD5;
+		}
+	}
 	
-	// third line is numFiles
-	readTillDelimiter(socketBuffer, fd, '\n');
-	char *x = readAllBuffer(socketBuffer);
-	int numFiles = atoi(x);
-	free(x); // free the string given by buffer.
+	// nodes start after the text, pointer aligned.
+	size_t nodesOffset = (len + 1 + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	ManifestNode *nodes = (ManifestNode *) (data + nodesOffset);
+	manifest->block = data;
+	manifest->blockSize = nodesOffset + sizeof(ManifestNode) * numFiles;
 	
 	// Now read n files.
-	int i = 0;
-	while(i++ < numFiles) {
-		char *md5, *version, *filePath;
+	// <md5hash><space><version><space><file path>
+	int count = 0;
+	while(count < numFiles && cursor < end) {
+		ManifestNode *node = &nodes[count++];
+		char *nl = memchr(cursor, '\n', end - cursor);
+		if(nl == NULL) {
+			nl = end;
+		}
+		*nl = '\0';
 		
-		readTillDelimiter(socketBuffer, fd, ' ');
-		md5 = readAllBuffer(socketBuffer);
+		node->md5 = cursor;
+		char *sp = strchr(cursor, ' ');
+		if(sp != NULL) {
+			*sp = '\0';
+			cursor = sp + 1;
+		} else {
+			cursor = nl;
+		}
 		
-		readTillDelimiter(socketBuffer, fd, ' ');
-		version = readAllBuffer(socketBuffer);
+		node->version = cursor;
+		sp = strchr(cursor, ' ');
+		if(sp != NULL) {
+			*sp = '\0';
+			cursor = sp + 1;
+		} else {
+			cursor = nl;
+		}
 		
-		readTillDelimiter(socketBuffer, fd, '\n');
-		filePath = readAllBuffer(socketBuffer);
-
-		addFileToManifest(manifest, md5, version, filePath);
+		node->filePath = cursor;
+		node->code = '\0';
+		node->shared = 1;
+		node->pathId = internPath(node->filePath);
+		appendManifestNode(manifest, node);
+		
+		cursor = (nl < end) ? nl + 1 : end;
 	}
 	
-	// Now buffer's work is over, delete it.
-	freeSocketBuffer(socketBuffer);
+	// Manifests from older builds may not be sorted.
+	sortManifest(manifest);
 	
 	return manifest;
 }
 
+// Header is three lines, third one has numFiles.
+int manifestHeaderNumFiles(char *data, long len) {
+	int lines = 0;
+	long i;
+	for(i = 0; i < len; i++) {
+		if(data[i] == '\n' && ++lines == 2) {
+			return atoi(data + i + 1);
+		}
+	}
+	return 0;
+}
+
+// Makes space for node array after the text, and parses.
+Manifest *parseManifestData(char *data, long len) {
+	int numFiles = manifestHeaderNumFiles(data, len);
+	if(numFiles < 0) {
+		numFiles = 0;
+	}
+	size_t nodesOffset = (len + 1 + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	data = realloc(data, nodesOffset + sizeof(ManifestNode) * numFiles);
+	return parseManifestText(data, len);
+}
+
+// Reads numBytes of manifest text from a file/socket in one go, and parses it.
+Manifest *readManifestBytes(int fd, long numBytes) {
+	char *data = malloc(numBytes + 1);
+	long done = 0;
+	while(done < numBytes) {
+		ssize_t n = read(fd, data + done, numBytes - done);
+		if(n <= 0) {
+			break; // Disconnected.
+		}
+		done += n;
+	}
+	return parseManifestData(data, done);
+}
+
+// Read Manifest only reads the manifest content into the structure..
+// No error checking is part of this.. We should do it before calling this method.
+//
+// A regular file is read in one go. For a socket, size is not known, so
+// it is read till the header and all numFiles lines have arrived.
+Manifest *readManifestContents(int fd) {
+	struct stat st;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		off_t offset = lseek(fd, 0, SEEK_CUR);
+		return readManifestBytes(fd, st.st_size - offset);
+	}
+	
+	long capacity = 4096, len = 0;
+	char *data = malloc(capacity);
+	long linesNeeded = 3;
+	long lines = 0;
+	char c;
+	
+	while(lines < linesNeeded && read(fd, &c, 1) == 1) {
+		if(c == '\0') {
+			break; // Client disconnected.
+		}
+		if(len + 1 >= capacity) {
+			capacity *= 2;
+			data = realloc(data, capacity);
+		}
+		data[len++] = c;
+		
+		if(c == '\n') {
+			lines++;
+			if(lines == 3) {
+				data[len] = '\0';
+				linesNeeded += manifestHeaderNumFiles(data, len);
+			}
+		}
+	}
+	
+	return parseManifestData(data, len);
+}
+
 
 // This method writes the given manifest to a socket/file descriptor.
+// Entries are always written in sorted order.
 void writeManifestToFile(Manifest *manifest, int fd) {
 	
 	char buffer[100];
 	
+	sortManifest(manifest);
+	
 	write(fd, manifest->projectName, strlen(manifest->projectName));
 	write(fd, "\n", 1);
 	write(fd, manifest->versionNumber, strlen(manifest->versionNumber));
 	write(fd, "\n", 1);
 	
-	sprintf(buffer, "%d", manifest->numFiles);	
+	if(manifest->hashAlgorithm == HASH_MD5) {
+		sprintf(buffer, "%d", manifest->numFiles);
+	} else {
+		sprintf(buffer, "%d %s", manifest->numFiles, hashAlgorithmName(manifest->hashAlgorithm));
+	}
 	write(fd, buffer, strlen(buffer));
 	write(fd, "\n", 1);
 	
@@ -135,53 +607,55 @@ void writeManifestToFile(Manifest *manifest, int fd) {
 
 ManifestNode* searchFile(Manifest *manifest, char *filePath) {
 	
-	ManifestNode *node = manifest->head;
-	
-	int i = 0;
-	while(node != NULL) {
-		if(strcmp(node->filePath, filePath) == 0) {
-			return node;
-		}
-		node = node->next;
+	// Every node's path is interned, so unknown path is in no manifest.
+	int pathId = findInternedPath(filePath);
+	if(pathId < 0 || manifest->nodesByIdSize == 0) {
+		return NULL;
 	}
-	
-	return NULL;
+	return manifest->nodesById[findManifestNodeSlot(manifest, pathId)];
 }
 
 void removeFileFromManifest(Manifest *manifest, char *filePath) {
 	
-	if(manifest->numFiles == 0) {
-		return;
-	}
-	
+	ManifestNode *prev = NULL;
 	ManifestNode *node = manifest->head;
 	
-	if(strcmp(node->filePath, filePath) == 0) {
-		manifest->head = node->next;
-		freeManifestNode(node);
-		manifest->numFiles -= 1;
-		if(manifest->numFiles == 0) {
-			manifest->tail = NULL;
-		}
-	}
-	
-	ManifestNode *prev = node;
-	node = node->next;
 	while(node != NULL) {
 		if(strcmp(node->filePath, filePath) == 0) {
-			prev->next = node->next;
+			if(prev == NULL) {
+				manifest->head = node->next;
+			} else {
+				prev->next = node->next;
+			}
 			if(node == manifest->tail) {
 				manifest->tail = prev;
 			}
+			
+			// A later node of the same path is found by searchFile now.
+			ManifestNode *same = node->next;
+			while(same != NULL && same->pathId != node->pathId) {
+				same = same->next;
+			}
+			if(same != NULL) {
+				manifest->nodesById[findManifestNodeSlot(manifest, node->pathId)] = same;
+			} else {
+				unindexManifestNode(manifest, node->pathId);
+			}
+			
 			freeManifestNode(node);
 			manifest->numFiles -= 1;
 			return;
 		}
+		prev = node;
 		node = node->next;
 	}
 }
 
 void freeManifestNode(ManifestNode *d) {
+	// Released along with the manifest's block.
+	if(d->shared) {
+		return;
+	}
 	if(d->md5 != NULL) {
 		free(d->md5);
 	}
@@ -202,121 +676,775 @@ void freeManifest(Manifest *manifest) {
 		node = node->next;
 		freeManifestNode(d);
 	}
-	if(manifest->projectName != NULL) {
+	if(manifest->projectName != NULL && !isInManifestBlock(manifest, manifest->projectName)) {
 		free(manifest->projectName);
 	}
-	if(manifest->versionNumber != NULL) {
+	if(manifest->versionNumber != NULL && !isInManifestBlock(manifest, manifest->versionNumber)) {
 		free(manifest->versionNumber);
 	}
+	if(manifest->block != NULL) {
+		free(manifest->block);
+	}
+	free(manifest->nodesById);
 	free(manifest);
+	releasePathPool();
 }
 
-// Compare and write differences to .update file descriptor
-// returns -1 if conflicts are found.
-int compareManifests(Manifest *server, Manifest *client, int updateFd) {
-	int error = 0;
-	int numUpdates = 0;
-	char liveHash[100];
+void writeManifestEntry(int fd, char *code, char *version, char *md5, char *filePath) {
+	write(fd, code, strlen(code));
+	write(fd, " ", 1);
+	write(fd, version, strlen(version));
+	write(fd, " ", 1);
+	write(fd, md5, strlen(md5));
+	write(fd, " ", 1);
+	write(fd, filePath, strlen(filePath));
+	write(fd, "\n", 1);
+}
+
+/*
+Stat cache (.index) of the client, format:
+#<space><hash algorithm>[<space>watch<space><watcher pid><space><.dirty offset><space><.dirty generation>]
+<size><space><mtime ns><space><ctime ns><space><inode><space><md5hash><space><file path>
+..
+
+A file whose stat data is same as recorded is not read again, its
+recorded hash is used. Files modified at or after the time the index
+was written are hashed anyway (racy timestamps): they could have been
+changed again within the same timestamp tick.
+While a watcher runs (watcher.h), entries of files it did not see
+change are used without stat. A mtime of -1 marks an entry to be
+hashed again.
+*/
+static char *INDEX_FILE = ".index";
+
+typedef struct IndexEntry {
+	long long size;
+	long long mtimeNs;
+	long long ctimeNs;
+	unsigned long long inode;
+	char hash[HASH_STRING_LEN + 1];
+	int pathId;
+	char used; // looked up or updated by this run.
+} IndexEntry;
+
+typedef struct FileIndex {
+	char *project;
+	int hashAlgorithm;
+	long long writtenNs; // mtime of the .index file when loaded.
+	IndexEntry *entries;
+	int numEntries;
+	int capacity;
+	int *positions; // pathId -> entry position + 1, 0 if not present.
+	int numPositions;
+	int changed;
+	int watcherPid; // watcher whose .dirty was read, 0 if none.
+	long long dirtyOffset; // .dirty was read up to here.
+	int dirtyGeneration; // times the watcher dropped the read part of .dirty.
+	int watched; // entries are good without stat, this run.
+	int watchStarted; // entries not looked at could be stale.
+	char **unwatched; // paths the watcher does not see, looked at with stat.
+	int numUnwatched;
+} FileIndex;
+
+// Index used by computeProjectFileHash, NULL if none is loaded.
+static FileIndex *fileIndex = NULL;
+
+long long statTimeNs(struct timespec *ts) {
+	return (long long) ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+IndexEntry *findIndexEntry(FileIndex *index, int pathId) {
+	if(pathId < 0 || pathId >= index->numPositions || index->positions[pathId] == 0) {
+		return NULL;
+	}
+	return &index->entries[index->positions[pathId] - 1];
+}
+
+IndexEntry *addIndexEntry(FileIndex *index, char *filePath) {
+	int pathId = internPath(filePath);
+	IndexEntry *entry = findIndexEntry(index, pathId);
+	if(entry != NULL) {
+		return entry;
+	}
+	
+	if(index->numEntries == index->capacity) {
+		index->capacity = index->capacity == 0 ? 1024 : index->capacity * 2;
+		index->entries = realloc(index->entries, sizeof(IndexEntry) * index->capacity);
+	}
+	if(pathId >= index->numPositions) {
+		int newSize = (pathId + 1) * 2;
+		index->positions = realloc(index->positions, sizeof(int) * newSize);
+		memset(index->positions + index->numPositions, 0, sizeof(int) * (newSize - index->numPositions));
+		index->numPositions = newSize;
+	}
+	
+	entry = &index->entries[index->numEntries++];
+	memset(entry, 0, sizeof(IndexEntry));
+	entry->pathId = pathId;
+	index->positions[pathId] = index->numEntries;
+	return entry;
+}
+
+// Loads the project's index, empty if there is none yet, or if its
+// hashes are not of the given algorithm.
+FileIndex *loadFileIndex(char *project, int hashAlgorithm) {
+	FileIndex *index = malloc(sizeof(FileIndex));
+	index->project = strdup(project);
+	index->hashAlgorithm = hashAlgorithm;
+	index->writtenNs = 0;
+	index->entries = NULL;
+	index->numEntries = 0;
+	index->capacity = 0;
+	index->positions = NULL;
+	index->numPositions = 0;
+	index->changed = 0;
+	index->watcherPid = 0;
+	index->dirtyOffset = 0;
+	index->dirtyGeneration = 0;
+	index->watched = 0;
+	index->watchStarted = 0;
+	index->unwatched = NULL;
+	index->numUnwatched = 0;
+	retainPathPool();
 	
-	ManifestNode* serverFileNode;
-	ManifestNode *clientFileNode = client->head;
-	while(clientFileNode != NULL) {
+	char *path = malloc(sizeof(char) * (strlen(project) + strlen(INDEX_FILE) + 5));
+	sprintf(path, "%s/%s", project, INDEX_FILE);
+	
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if(fd < 0) {
+		return index;
+	}
+	
+	struct stat st;
+	fstat(fd, &st);
+	index->writtenNs = statTimeNs(&st.st_mtim);
+	
+	char *data = malloc(st.st_size + 1);
+	long done = 0;
+	while(done < st.st_size) {
+		ssize_t n = read(fd, data + done, st.st_size - done);
+		if(n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	data[done] = '\0';
+	close(fd);
+	
+	// Index without header has md5 hashes.
+	int indexAlgorithm = HASH_MD5;
+	if(data[0] == '#' && data[1] == ' ') {
+		char *nl = strchr(data, '\n');
+		if(nl != NULL) {
+			*nl = '\0';
+			char name[32];
+			if(sscanf(data + 2, "%31s watch %d %lld %d", name, &index->watcherPid, &index->dirtyOffset,
+					&index->dirtyGeneration) != 4) {
+				index->watcherPid = 0;
+				index->dirtyOffset = 0;
+				index->dirtyGeneration = 0;
+			}
+			indexAlgorithm = hashAlgorithmFromName(name);
+			*nl = '\n';
+		}
+	}
+	
+	// Hashes are read up to HASH_STRING_LEN chars.
+	char format[50];
+	sprintf(format, "%%lld %%lld %%lld %%llu %%%ds %%n", HASH_STRING_LEN);
+	
+	char *line = data;
+	while(*line != '\0' && indexAlgorithm == hashAlgorithm) {
+		char *nl = strchr(line, '\n');
+		if(nl == NULL) {
+			break; // partially written line.
+		}
+		*nl = '\0';
+		
+		IndexEntry fields;
+		int pathStart = 0;
+		if(sscanf(line, format, &fields.size, &fields.mtimeNs,
+				&fields.ctimeNs, &fields.inode, fields.hash, &pathStart) == 5 && pathStart > 0) {
+			IndexEntry *entry = addIndexEntry(index, line + pathStart);
+			fields.pathId = entry->pathId;
+			fields.used = 0;
+			*entry = fields;
+		}
+		line = nl + 1;
+	}
+	
+	free(data);
+	return index;
+}
+
+// Writes the index aside and renames it. Entries which were not used by
+// this run are dropped if prune is set (files no longer tracked).
+void saveFileIndex(FileIndex *index, int prune) {
+	if(!index->changed && !prune) {
+		return;
+	}
+	
+	char *path = malloc(sizeof(char) * (strlen(index->project) + strlen(INDEX_FILE) + 10));
+	char *indexPath = malloc(sizeof(char) * (strlen(index->project) + strlen(INDEX_FILE) + 5));
+	sprintf(path, "%s/%s.tmp", index->project, INDEX_FILE);
+	sprintf(indexPath, "%s/%s", index->project, INDEX_FILE);
+	
+	FILE *fp = fopen(path, "w");
+	if(fp != NULL) {
+		if(index->watcherPid != 0) {
+			fprintf(fp, "# %s watch %d %lld %d\n", hashAlgorithmName(index->hashAlgorithm),
+				index->watcherPid, index->dirtyOffset, index->dirtyGeneration);
+		} else {
+			fprintf(fp, "# %s\n", hashAlgorithmName(index->hashAlgorithm));
+		}
+		int i;
+		for(i = 0; i < index->numEntries; i++) {
+			IndexEntry *entry = &index->entries[i];
+			if(prune && !entry->used) {
+				continue;
+			}
 			
-		// Search client file in Server
-		serverFileNode = searchFile(server, clientFileNode->filePath);
+			// Files not checked since the watcher started could have
+			// been changed before it.
+			if(index->watchStarted && !entry->used) {
+				entry->mtimeNs = -1;
+			}
+			fprintf(fp, "%lld %lld %lld %llu %s %s\n", entry->size, entry->mtimeNs,
+				entry->ctimeNs, entry->inode, entry->hash, pathPool.paths[entry->pathId]);
+		}
+		fclose(fp);
+		rename(path, indexPath);
+	}
+	
+	free(indexPath);
+	free(path);
+}
+
+void freeFileIndex(FileIndex *index) {
+	free(index->project);
+	free(index->entries);
+	free(index->positions);
+	int i;
+	for(i = 0; i < index->numUnwatched; i++) {
+		free(index->unwatched[i]);
+	}
+	free(index->unwatched);
+	free(index);
+	releasePathPool();
+}
+
+void addUnwatchedPath(FileIndex *index, char *path) {
+	index->unwatched = realloc(index->unwatched, sizeof(char *) * (index->numUnwatched + 1));
+	index->unwatched[index->numUnwatched++] = strdup(path);
+}
+
+// The path, or a directory above it, is not watched.
+int isUnwatchedPath(FileIndex *index, char *filePath) {
+	int i;
+	for(i = 0; i < index->numUnwatched; i++) {
+		int len = strlen(index->unwatched[i]);
+		if(len == 0 || (strncmp(filePath, index->unwatched[i], len) == 0
+				&& (filePath[len] == '\0' || filePath[len] == '/'))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Gives the recorded hash if the file is unchanged since it was recorded.
+// Returns 1 if liveHash was filled.
+int lookupFileIndex(FileIndex *index, char *filePath, struct stat *st, char liveHash[]) {
+	IndexEntry *entry = findIndexEntry(index, findInternedPath(filePath));
+	if(entry == NULL) {
+		return 0;
+	}
+	entry->used = 1;
+	
+	if(entry->size != st->st_size
+		|| entry->mtimeNs != statTimeNs(&st->st_mtim)
+		|| entry->ctimeNs != statTimeNs(&st->st_ctim)
+		|| entry->inode != st->st_ino
+		|| entry->mtimeNs >= index->writtenNs) {
+		return 0;
+	}
+	
+	strcpy(liveHash, entry->hash);
+	return 1;
+}
+
+void updateFileIndex(FileIndex *index, char *filePath, struct stat *st, char *hash) {
+	IndexEntry *entry = addIndexEntry(index, filePath);
+	entry->size = st->st_size;
+	entry->mtimeNs = statTimeNs(&st->st_mtim);
+	entry->ctimeNs = statTimeNs(&st->st_ctim);
+	entry->inode = st->st_ino;
+	strncpy(entry->hash, hash, HASH_STRING_LEN);
+	entry->hash[HASH_STRING_LEN] = '\0';
+	entry->used = 1;
+	index->changed = 1;
+}
+
+/*
+Live hashes of tracked files in the client's project directory.
+Files whose live hash is needed are first collected, then hashed all
+together on the worker pool, and their hashes are taken back in the
+same order. Files unchanged in the loaded stat cache are not read.
+*/
+typedef struct HashBatch {
+	char *project;
+	int hashAlgorithm;
+	char **filePaths;
+	char **hashes;
+	char *hashBlock; // all the hashes, in one allocation.
+	int count;
+	int capacity;
+	int next; // next hash to be taken.
+} HashBatch;
+
+void initHashBatch(HashBatch *batch, char *project, int hashAlgorithm) {
+	batch->project = project;
+	batch->hashAlgorithm = hashAlgorithm;
+	batch->filePaths = NULL;
+	batch->hashes = NULL;
+	batch->hashBlock = NULL;
+	batch->count = 0;
+	batch->capacity = 0;
+	batch->next = 0;
+}
+
+void addToHashBatch(HashBatch *batch, char *filePath) {
+	if(batch->count == batch->capacity) {
+		batch->capacity = batch->capacity == 0 ? 256 : batch->capacity * 2;
+		batch->filePaths = realloc(batch->filePaths, sizeof(char *) * batch->capacity);
+	}
+	batch->filePaths[batch->count++] = filePath;
+}
+
+void runHashBatch(HashBatch *batch) {
+	int n = batch->count;
+	int useIndex = fileIndex != NULL && strcmp(fileIndex->project, batch->project) == 0
+		&& fileIndex->hashAlgorithm == batch->hashAlgorithm;
+	int watched = useIndex && fileIndex->watched;
+	
+	batch->hashes = malloc(sizeof(char *) * (n + 1));
+	batch->hashBlock = malloc(sizeof(char) * (HASH_STRING_LEN + 1) * (n + 1));
+	
+	char **toHash = malloc(sizeof(char *) * (n + 1));
+	char **toHashResults = malloc(sizeof(char *) * (n + 1));
+	int *toHashIds = malloc(sizeof(int) * (n + 1));
+	struct stat *stats = malloc(sizeof(struct stat) * (n + 1));
+	int numToHash = 0;
+	
+	int i;
+	for(i = 0; i < n; i++) {
+		batch->hashes[i] = batch->hashBlock + i * (HASH_STRING_LEN + 1);
 		
-		// client's file live hash
-		char *path = malloc(sizeof(char) * (strlen(clientFileNode->filePath) + strlen(client->projectName) + 25));
-		sprintf(path, "%s/%s", client->projectName, clientFileNode->filePath);
-		computeFileHash(path, liveHash);
-		free(path);
-		liveHash[HASH_STRING_LEN] = '\0';
+		// Watcher saw no change of the file, no need to stat it.
+		if(watched && !isUnwatchedPath(fileIndex, batch->filePaths[i])) {
+			IndexEntry *entry = findIndexEntry(fileIndex, findInternedPath(batch->filePaths[i]));
+			if(entry != NULL && entry->mtimeNs >= 0) {
+				entry->used = 1;
+				strcpy(batch->hashes[i], entry->hash);
+				continue;
+			}
+		}
 		
-		// check for update. 
-		// Currently ignoring Update files
-		/* if((serverFileNode == NULL 
-				&& strcmp(server->versionNumber, client->versionNumber) == 0) ||
-			(serverFileNode != NULL 
-				&& strcmp(serverFileNode->md5, liveHash) != 0
-				&& strcmp(server->versionNumber, client->versionNumber) == 0)) {
-			write(updateFd, "U", 1);
-			write(updateFd, " ", 1);
-			write(updateFd, clientFileNode->version, strlen(clientFileNode->version));
-			write(updateFd, " ", 1);
-			write(updateFd, liveHash, strlen(liveHash));
-			write(updateFd, " ", 1);
-			write(updateFd, clientFileNode->filePath, strlen(clientFileNode->filePath));
-			write(updateFd, "\n", 1);
-			numUpdates++;
-		} else */
+		char *path = malloc(sizeof(char) * (strlen(batch->filePaths[i]) + strlen(batch->project) + 2));
+		sprintf(path, "%s/%s", batch->project, batch->filePaths[i]);
 		
-		// check for Modify
-		if(serverFileNode != NULL 
-			&& strcmp(serverFileNode->version, clientFileNode->version) != 0
-			&& strcmp(server->versionNumber, client->versionNumber) != 0
-			&& strcmp(clientFileNode->md5, liveHash) == 0) {
-			write(updateFd, "M", 1);
-			write(updateFd, " ", 1);
-			write(updateFd, serverFileNode->version, strlen(serverFileNode->version));
-			write(updateFd, " ", 1);
-			write(updateFd, serverFileNode->md5, strlen(serverFileNode->md5));
-			write(updateFd, " ", 1);
-			write(updateFd, serverFileNode->filePath, strlen(serverFileNode->filePath));
-			write(updateFd, "\n", 1);
-			numUpdates++;
+		int hasStat = useIndex && stat(path, &stats[numToHash]) == 0;
+		if(hasStat && lookupFileIndex(fileIndex, batch->filePaths[i], &stats[numToHash], batch->hashes[i])) {
+			free(path);
+			continue;
 		}
-		
-		// check for Deletion
-		else if(serverFileNode == NULL 
-			&& strcmp(server->versionNumber, client->versionNumber) != 0) {
-			write(updateFd, "D", 1);
-			write(updateFd, " ", 1);
-			write(updateFd, clientFileNode->version, strlen(clientFileNode->version));
-			write(updateFd, " ", 1);
-			write(updateFd, liveHash, strlen(liveHash));
-			write(updateFd, " ", 1);
-			write(updateFd, clientFileNode->filePath, strlen(clientFileNode->filePath));
-			write(updateFd, "\n", 1);
-			numUpdates++;
+		if(!hasStat) {
+			stats[numToHash].st_ino = 0;
 		}
 		
-		// check for error case.
-		else if(serverFileNode != NULL
-			&& strcmp(serverFileNode->version, clientFileNode->version) != 0
-			&& strcmp(server->versionNumber, client->versionNumber) != 0
-			&& strcmp(clientFileNode->md5, liveHash) != 0) {
-			error = -1;
-			printf("Conflict: %s\n", clientFileNode->filePath);
+		// same as unreadable file: stays empty.
+		batch->hashes[i][0] = '\0';
+		toHash[numToHash] = path;
+		toHashResults[numToHash] = batch->hashes[i];
+		toHashIds[numToHash] = i;
+		numToHash++;
+	}
+	
+	computeFileHashes(toHash, toHashResults, numToHash, batch->hashAlgorithm);
+	
+	for(i = 0; i < numToHash; i++) {
+		if(useIndex && stats[i].st_ino != 0 && strlen(toHashResults[i]) == HASH_STRING_LEN) {
+			updateFileIndex(fileIndex, batch->filePaths[toHashIds[i]], &stats[i], toHashResults[i]);
 		}
-		
-		clientFileNode = clientFileNode->next;
+		free(toHash[i]);
 	}
 	
-	if(error) {
-		return error;
+	free(stats);
+	free(toHashIds);
+	free(toHashResults);
+	free(toHash);
+}
+
+// Hashes are taken in the order files were added.
+char *nextBatchHash(HashBatch *batch) {
+	return batch->hashes[batch->next++];
+}
+
+void freeHashBatch(HashBatch *batch) {
+	free(batch->hashBlock);
+	free(batch->hashes);
+	free(batch->filePaths);
+}
+
+// Replaces the hash of a node, in place when it has the same length.
+void setManifestNodeHash(ManifestNode *node, char *hash) {
+	if(node->md5 != NULL && strlen(node->md5) == strlen(hash)) {
+		strcpy(node->md5, hash);
+	} else if(!node->shared) {
+		free(node->md5);
+		node->md5 = strdup(hash);
+	} else {
+		// Block strings can not be freed, a leak of one short string.
+		node->md5 = strdup(hash);
+	}
+}
+
+// Rehashes all files of the manifest, from baseDir, with the algorithm.
+// Used to move a project from an older algorithm.
+void rehashManifest(Manifest *manifest, char *baseDir, int hashAlgorithm) {
+	int n = manifest->numFiles;
+	char **paths = malloc(sizeof(char *) * (n + 1));
+	char **hashes = malloc(sizeof(char *) * (n + 1));
+	char *hashBlock = malloc(sizeof(char) * (HASH_STRING_LEN + 1) * (n + 1));
+	
+	int i = 0;
+	ManifestNode *node = manifest->head;
+	while(node != NULL && i < n) {
+		paths[i] = malloc(sizeof(char) * (strlen(baseDir) + strlen(node->filePath) + 2));
+		sprintf(paths[i], "%s/%s", baseDir, node->filePath);
+		hashes[i] = hashBlock + i * (HASH_STRING_LEN + 1);
+		hashes[i][0] = '\0';
+		i++;
+		node = node->next;
+	}
+	
+	computeFileHashes(paths, hashes, i, hashAlgorithm);
+	
+	i = 0;
+	node = manifest->head;
+	while(node != NULL && i < n) {
+		if(strlen(hashes[i]) == HASH_STRING_LEN) {
+			setManifestNodeHash(node, hashes[i]);
+		}
+		free(paths[i]);
+		i++;
+		node = node->next;
 	}
+	manifest->hashAlgorithm = hashAlgorithm;
 	
-	serverFileNode = server->head;
-	while(serverFileNode != NULL) {
+	free(hashBlock);
+	free(hashes);
+	free(paths);
+}
+
+/*
+Sparse checkouts. <project>/.sparse names the part of the project the
+working copy has, one pattern per line:
+include <pattern>
+exclude <pattern>
+A pattern matches the path equal to it, the paths under it, and the
+paths it or one of their leading directories match as a shell glob.
+'*' does not match '/': 'src/x*' takes the files of src whose names
+start with x, and the directories of src which do, with everything
+under them. A glob without '/', like '*.bin', matches a name at any
+depth. A path is in the checkout if it matches an include (or there
+are none) and no exclude. The .manifest still has all files, so versions and commits
+are of the whole project, others are just not looked at.
+
+A lazy checkout has the line
+lazy
+and then without includes, none of the files are in it. Files are
+fetched on demand by hydrate, which adds their includes.
+*/
+static char *SPARSE_FILE = ".sparse";
+
+typedef struct SparseSpec {
+	char **patterns;
+	char *excludes; // 1 if the pattern is an exclude.
+	int count;
+	int numIncludes;
+	int lazy;
+} SparseSpec;
+
+// Spec of the client's project, used by compareManifests and
+// createCommitFromManifests. NULL for all files.
+static SparseSpec *sparseSpec = NULL;
+
+SparseSpec *createSparseSpec() {
+	SparseSpec *spec = malloc(sizeof(SparseSpec));
+	spec->patterns = NULL;
+	spec->excludes = NULL;
+	spec->count = 0;
+	spec->numIncludes = 0;
+	spec->lazy = 0;
+	return spec;
+}
+
+void addSparsePattern(SparseSpec *spec, char *pattern, int exclude) {
+	// Trailing slashes name the same directory.
+	int len = strlen(pattern);
+	while(len > 1 && pattern[len - 1] == '/') {
+		len--;
+	}
+	if(len == 0) {
+		return;
+	}
+	spec->patterns = realloc(spec->patterns, sizeof(char *) * (spec->count + 1));
+	spec->excludes = realloc(spec->excludes, sizeof(char) * (spec->count + 1));
+	spec->patterns[spec->count] = strndup(pattern, len);
+	spec->excludes[spec->count] = exclude;
+	spec->count++;
+	if(!exclude) {
+		spec->numIncludes++;
+	}
+}
+
+void freeSparseSpec(SparseSpec *spec) {
+	if(spec == NULL) {
+		return;
+	}
+	int i;
+	for(i = 0; i < spec->count; i++) {
+		free(spec->patterns[i]);
+	}
+	free(spec->patterns);
+	free(spec->excludes);
+	free(spec);
+}
+
+// Reads the lines of a .sparse file. Returns NULL if it has no patterns.
+SparseSpec *parseSparseSpec(char *text) {
+	SparseSpec *spec = createSparseSpec();
+	char *line = text;
+	while(line != NULL && *line != '\0') {
+		char *end = strchr(line, '\n');
+		if(end != NULL) {
+			*end = '\0';
+		}
+		if(strcmp(line, "lazy") == 0) {
+			spec->lazy = 1;
+		} else if(strncmp(line, "include ", 8) == 0) {
+			addSparsePattern(spec, line + 8, 0);
+		} else if(strncmp(line, "exclude ", 8) == 0) {
+			addSparsePattern(spec, line + 8, 1);
+		}
+		if(end != NULL) {
+			*end = '\n';
+			end++;
+		}
+		line = end;
+	}
+	if(spec->count == 0 && !spec->lazy) {
+		freeSparseSpec(spec);
+		return NULL;
+	}
+	return spec;
+}
+
+// Returns the lines of the .sparse file, delete yourself.
+char *formatSparseSpec(SparseSpec *spec) {
+	int i, len = 10;
+	for(i = 0; i < spec->count; i++) {
+		len += strlen(spec->patterns[i]) + 9;
+	}
+	char *text = malloc(sizeof(char) * len);
+	strcpy(text, spec->lazy ? "lazy\n" : "");
+	for(i = 0; i < spec->count; i++) {
+		strcat(text, spec->excludes[i] ? "exclude " : "include ");
+		strcat(text, spec->patterns[i]);
+		strcat(text, "\n");
+	}
+	return text;
+}
+
+// Spec of the project, NULL if it is not a sparse checkout.
+SparseSpec *loadSparseSpec(char *project) {
+	char *path = malloc(sizeof(char) * (strlen(project) + strlen(SPARSE_FILE) + 2));
+	sprintf(path, "%s/%s", project, SPARSE_FILE);
+	SparseSpec *spec = NULL;
+	if(checkFileExists(path)) {
+		char *text = readFileContents(path);
+		spec = parseSparseSpec(text);
+		free(text);
+	}
+	free(path);
+	return spec;
+}
+
+void saveSparseSpec(char *project, SparseSpec *spec) {
+	char *path = malloc(sizeof(char) * (strlen(project) + strlen(SPARSE_FILE) + 2));
+	sprintf(path, "%s/%s", project, SPARSE_FILE);
+	char *text = formatSparseSpec(spec);
+	int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	write(fd, text, strlen(text));
+	close(fd);
+	free(text);
+	free(path);
+}
+
+int sparsePatternMatches(const char *pattern, const char *filePath) {
+	int len = strlen(pattern);
+	if(strncmp(filePath, pattern, len) == 0 && (filePath[len] == '\0' || filePath[len] == '/')) {
+		return 1;
+	}
+	if(strpbrk(pattern, "*?[") == NULL) {
+		return 0;
+	}
+	
+	// Without '/', any name of the path. Else the path itself, then its
+	// leading directories.
+	char *path = strdup(filePath);
+	char *slash;
+	int matched = 0;
+	if(strchr(pattern, '/') == NULL) {
+		char *name = path;
+		while(!matched && name != NULL) {
+			slash = strchr(name, '/');
+			if(slash != NULL) {
+				*slash = '\0';
+			}
+			matched = fnmatch(pattern, name, 0) == 0;
+			name = slash != NULL ? slash + 1 : NULL;
+		}
+	} else {
+		matched = fnmatch(pattern, path, FNM_PATHNAME) == 0;
+		while(!matched && (slash = strrchr(path, '/')) != NULL) {
+			*slash = '\0';
+			matched = fnmatch(pattern, path, FNM_PATHNAME) == 0;
+		}
+	}
+	free(path);
+	return matched;
+}
+
+// Whether the path is in the checkout, always if spec is NULL.
+int isInSparseSpec(SparseSpec *spec, const char *filePath) {
+	if(spec == NULL) {
+		return 1;
+	}
+	int included = spec->numIncludes == 0 && !spec->lazy, i;
+	for(i = 0; i < spec->count; i++) {
+		if(sparsePatternMatches(spec->patterns[i], filePath)) {
+			if(spec->excludes[i]) {
+				return 0;
+			}
+			included = 1;
+		}
+	}
+	return included;
+}
+
+// Merge-join step over two sorted manifests.
+// Returns <0 if only server node is current, >0 if only client node, 0 if both.
+int compareManifestNodes(ManifestNode *server, ManifestNode *client) {
+	if(server == NULL) {
+		return 1;
+	}
+	if(client == NULL) {
+		return -1;
+	}
+	if(server->pathId == client->pathId) {
+		return 0;
+	}
+	return strcmp(server->filePath, client->filePath);
+}
+
+// Compare and write differences to .update file descriptor
+// returns -1 if conflicts are found.
+//
+// Both manifests are walked side by side in path order, so no lookups
+// are needed. The first walk collects the files whose live hash decides
+// the outcome, they are hashed together, and the second walk writes.
+int compareManifests(Manifest *server, Manifest *client, int updateFd) {
+	int error = 0;
+	int numUpdates = 0;
+	char *liveHash;
+	
+	// Currently ignoring Update files, nothing to report for same version.
+	int versionsDiffer = strcmp(server->versionNumber, client->versionNumber) != 0;
+	
+	sortManifest(server);
+	sortManifest(client);
+	
+	HashBatch batch;
+	initHashBatch(&batch, client->projectName, client->hashAlgorithm);
+	
+	int pass;
+	for(pass = 0; pass < 2; pass++) {
+		if(pass == 1) {
+			runHashBatch(&batch);
+		}
 		
-		// Search server file in Client now
-		clientFileNode = searchFile(client, serverFileNode->filePath);
+		ManifestNode *serverFileNode = server->head;
+		ManifestNode *clientFileNode = client->head;
+		while(serverFileNode != NULL || clientFileNode != NULL) {
+			int cmp = compareManifestNodes(serverFileNode, clientFileNode);
 			
-		// check for Addition
-		if(clientFileNode == NULL 
-			&& strcmp(server->versionNumber, client->versionNumber) != 0) {
-			write(updateFd, "A", 1);
-			write(updateFd, " ", 1);
-			write(updateFd, serverFileNode->version, strlen(serverFileNode->version));
-			write(updateFd, " ", 1);
-			write(updateFd, serverFileNode->md5, strlen(serverFileNode->md5));
-			write(updateFd, " ", 1);
-			write(updateFd, serverFileNode->filePath, strlen(serverFileNode->filePath));
-			write(updateFd, "\n", 1);
-			numUpdates++;
+			// Files out of a sparse checkout are not updated.
+			if(!isInSparseSpec(sparseSpec, cmp <= 0 ? serverFileNode->filePath : clientFileNode->filePath)) {
+				serverFileNode = cmp <= 0 ? serverFileNode->next : serverFileNode;
+				clientFileNode = cmp >= 0 ? clientFileNode->next : clientFileNode;
+				continue;
+			}
+			
+			if(cmp < 0) {
+				// check for Addition
+				if(versionsDiffer && pass == 1) {
+					writeManifestEntry(updateFd, "A", serverFileNode->version, serverFileNode->md5, serverFileNode->filePath);
+					numUpdates++;
+				}
+				serverFileNode = serverFileNode->next;
+				
+			} else if(cmp > 0) {
+				// check for Deletion
+				if(versionsDiffer && pass == 0) {
+					addToHashBatch(&batch, clientFileNode->filePath);
+				} else if(versionsDiffer) {
+					liveHash = nextBatchHash(&batch);
+					writeManifestEntry(updateFd, "D", clientFileNode->version, liveHash, clientFileNode->filePath);
+					numUpdates++;
+				}
+				clientFileNode = clientFileNode->next;
+				
+			} else {
+				if(versionsDiffer && strcmp(serverFileNode->version, clientFileNode->version) != 0) {
+					if(pass == 0) {
+						addToHashBatch(&batch, clientFileNode->filePath);
+						
+					// check for Modify. A file which has the server's contents
+					// already is too, e.g. when an upgrade which did not
+					// complete wrote it but kept the old manifest.
+					} else if(strcmp(clientFileNode->md5, (liveHash = nextBatchHash(&batch))) == 0
+						|| strcmp(serverFileNode->md5, liveHash) == 0) {
+						writeManifestEntry(updateFd, "M", serverFileNode->version, serverFileNode->md5, serverFileNode->filePath);
+						numUpdates++;
+						
+					} else {
+						// check for error case.
+						error = -1;
+						printf("Conflict: %s\n", clientFileNode->filePath);
+					}
+				}
+				serverFileNode = serverFileNode->next;
+				clientFileNode = clientFileNode->next;
+			}
 		}
-		
-		serverFileNode = serverFileNode->next;
+	}
+	
+	freeHashBatch(&batch);
+	
+	if(error) {
+		return error;
 	}
 	
 	if(numUpdates == 0) {		
@@ -326,9 +1454,241 @@ int compareManifests(Manifest *server, Manifest *client, int updateFd) {
 	return error;
 }
 
+// Compare the server manifest with client's live files, and write
+// the .commit entries. Returns -1 if client must sync first.
+// Two walks, same as compareManifests. Conflicts are found in the first
+// one, before any file is read.
+int createCommitFromManifests(Manifest *server, Manifest *client, int commitFd) {
+	char *liveHash;
+	char version[20];
+	
+	sortManifest(server);
+	sortManifest(client);
+	
+	HashBatch batch;
+	initHashBatch(&batch, client->projectName, client->hashAlgorithm);
+	
+	int pass;
+	for(pass = 0; pass < 2; pass++) {
+		if(pass == 1) {
+			runHashBatch(&batch);
+		}
+		
+		ManifestNode *serverFileNode = server->head;
+		ManifestNode *clientFileNode = client->head;
+		while(serverFileNode != NULL || clientFileNode != NULL) {
+			int cmp = compareManifestNodes(serverFileNode, clientFileNode);
+			
+			// Files out of a sparse checkout are not here to commit.
+			if(!isInSparseSpec(sparseSpec, cmp <= 0 ? serverFileNode->filePath : clientFileNode->filePath)) {
+				if(cmp > 0 && pass == 1) {
+					printf("Skipped %s, it is out of the sparse checkout.\n", clientFileNode->filePath);
+				}
+				serverFileNode = cmp <= 0 ? serverFileNode->next : serverFileNode;
+				clientFileNode = cmp >= 0 ? clientFileNode->next : clientFileNode;
+				continue;
+			}
+			
+			if(cmp < 0) {
+				// client has deleted this file.
+				if(pass == 1) {
+					writeManifestEntry(commitFd, "D", serverFileNode->version, serverFileNode->md5, serverFileNode->filePath);
+				}
+				serverFileNode = serverFileNode->next;
+				
+			} else if(cmp > 0) {
+				// files that need to be added.
+				if(pass == 0) {
+					addToHashBatch(&batch, clientFileNode->filePath);
+				} else {
+					liveHash = nextBatchHash(&batch);
+					writeManifestEntry(commitFd, "A", "1", liveHash, clientFileNode->filePath);
+				}
+				clientFileNode = clientFileNode->next;
+				
+			} else {
+				if(pass == 0) {
+					// check for conflict case.
+					// if server has different hashcode, and has higher version.
+					if(strcmp(serverFileNode->md5, clientFileNode->md5) != 0
+						&& atoi(serverFileNode->version) > atoi(clientFileNode->version)) {
+						freeHashBatch(&batch);
+						return -1; // Client must sync first.
+					}
+					addToHashBatch(&batch, clientFileNode->filePath);
+					
+				} else {
+					liveHash = nextBatchHash(&batch);
+					if(strcmp(clientFileNode->md5, liveHash) != 0) {
+						// File is in both, but client's version is better
+						// Add entry to commit file with newer version
+						sprintf(version, "%d", atoi(clientFileNode->version) + 1);
+						writeManifestEntry(commitFd, "U", version, liveHash, clientFileNode->filePath);
+					}
+				}
+				serverFileNode = serverFileNode->next;
+				clientFileNode = clientFileNode->next;
+			}
+		}
+	}
+	
+	freeHashBatch(&batch);
+	return 0;
+}
+
+// .commit entries of files whose directories are the same on the server
+// as in the client's manifest. Only local edits are left there, they are
+// written as U with the next version.
+void createCommitFromLocalChanges(Manifest *manifest, int commitFd) {
+	char version[20];
+	ManifestNode *node;
+	
+	HashBatch batch;
+	initHashBatch(&batch, manifest->projectName, manifest->hashAlgorithm);
+	
+	int pass;
+	for(pass = 0; pass < 2; pass++) {
+		if(pass == 1) {
+			runHashBatch(&batch);
+		}
+		
+		for(node = manifest->head; node != NULL; node = node->next) {
+			// Files out of a sparse checkout are not here to commit.
+			if(!isInSparseSpec(sparseSpec, node->filePath)) {
+				continue;
+			}
+			
+			if(pass == 0) {
+				addToHashBatch(&batch, node->filePath);
+			} else {
+				char *liveHash = nextBatchHash(&batch);
+				if(strcmp(node->md5, liveHash) != 0) {
+					sprintf(version, "%d", atoi(node->version) + 1);
+					writeManifestEntry(commitFd, "U", version, liveHash, node->filePath);
+				}
+			}
+		}
+	}
+	
+	freeHashBatch(&batch);
+}
 
+// Reads .commit/.update entries:
+// <code><space><version><space><md5hash><space><file path>
+// into a manifest, sorted by path.
+Manifest *readManifestEntries(int fd) {
+	SocketBuffer *socketBuffer = createBuffer();
+	Manifest *entries = createEmptyManifest(NULL, NULL);
+	
+	while(1) {
+		readTillDelimiter(socketBuffer, fd, ' ');
+		char *code = readAllBuffer(socketBuffer);
+		if(strlen(code) == 0) {
+			free(code);
+			break;
+		}
+		
+		readTillDelimiter(socketBuffer, fd, ' ');
+		char *version = readAllBuffer(socketBuffer);
+		
+		readTillDelimiter(socketBuffer, fd, ' ');
+		char *md5 = readAllBuffer(socketBuffer);
+		
+		readTillDelimiter(socketBuffer, fd, '\n');
+		char *filePath = readAllBuffer(socketBuffer);
+		
+		addFileToManifest(entries, md5, version, filePath);
+		entries->tail->code = code[0];
+		free(code);
+	}
+	
+	freeSocketBuffer(socketBuffer);
+	sortManifest(entries);
+	return entries;
+}
 
+// Apply sorted commit entries on the manifest in one merge-join pass.
+// A/U/M entries replace or insert the file, D (or journal's R) entries drop it.
+// Entries are moved out of the commit list, which is left empty.
+void applyCommitEntries(Manifest *manifest, Manifest *commit) {
+	sortManifest(manifest);
+	sortManifest(commit);
+	
+	ManifestNode *node = manifest->head;
+	ManifestNode *entry = commit->head;
+	
+	clearManifestList(manifest);
+	clearManifestList(commit);
+	
+	while(node != NULL || entry != NULL) {
+		int cmp = compareManifestNodes(node, entry);
+		
+		if(cmp < 0) {
+			ManifestNode *next = node->next;
+			appendManifestNode(manifest, node);
+			node = next;
+			
+		} else {
+			ManifestNode *next = entry->next;
+			
+			// Same file in both, commit entry wins.
+			if(cmp == 0) {
+				ManifestNode *d = node;
+				node = node->next;
+				freeManifestNode(d);
+			}
+			
+			if(entry->code == 'D' || entry->code == 'R') {
+				freeManifestNode(entry);
+			} else {
+				entry->code = '\0';
+				appendManifestNode(manifest, entry);
+			}
+			entry = next;
+		}
+	}
+}
 
+/*
+Manifest journal (.manifest.log) format:
+A<space>1<space><md5hash><space><file path>
+R<space>0<space>0<space><file path>
+..
+Records are only appended, and applied on top of the manifest in the
+same order. A later record for a path wins over an earlier one.
+*/
 
+// Keep only the last entry for each path. The sort is stable, so
+// entries for the same path are still in the journal order.
+void keepLastManifestEntries(Manifest *entries) {
+	sortManifest(entries);
+	
+	ManifestNode *node = entries->head;
+	while(node != NULL && node->next != NULL) {
+		if(node->pathId == node->next->pathId) {
+			// Drop this one, copy the later entry over it.
+			ManifestNode *later = node->next;
+			ManifestNode tmp = *node;
+			*node = *later;
+			*later = tmp;
+			later->next = NULL;
+			if(entries->tail == later) {
+				entries->tail = node;
+			}
+			freeManifestNode(later);
+			entries->numFiles -= 1;
+		} else {
+			node = node->next;
+		}
+	}
+}
+
+// Applies the journal records on the manifest, in memory.
+void applyManifestJournal(Manifest *manifest, int journalFd) {
+	Manifest *entries = readManifestEntries(journalFd);
+	keepLastManifestEntries(entries);
+	applyCommitEntries(manifest, entries);
+	freeManifest(entries);
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,347 @@
+#ifndef MANIFEST_TREE_H
+#define MANIFEST_TREE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "manifest.h"
+
+/*
+Directory hash tree of a manifest (.manifest.tree), format:
+<numDirs>
+<dirHash><space><dir path>
+<dirHash><space><dir path>
+..
+
+Root directory is ".". The hash of a directory covers its files
+(name, md5 and version) and the hashes of its sub directories, so two
+manifests have the same hash for a directory only when everything
+under it is the same. Comparing the trees of server and client gives
+the directories that differ, only their files need to be looked at.
+The server keeps the tree of every version (MANIFEST_TREE_FILE).
+*/
+
+typedef struct DirHash {
+	char *path;
+	char hash[HASH_STRING_LEN + 1];
+} DirHash;
+
+typedef struct ManifestTree {
+	int numDirs;
+	DirHash *dirs;  // sorted by path
+} ManifestTree;
+
+// Set of directories, marked by the interned id of their path.
+typedef struct DirSet {
+	char *marks;
+	int size;
+	int count;
+} DirSet;
+
+// One open directory while building the tree.
+typedef struct OpenDir {
+	char *path;
+	int pathLen;
+	EVP_MD_CTX *ctx;
+} OpenDir;
+
+// Tree hashes stay md5, whatever the manifest's algorithm.
+EVP_MD_CTX *createTreeDirContext() {
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
+	return ctx;
+}
+
+// Frees the context.
+void addDirToTree(ManifestTree *tree, int *capacity, char *path, EVP_MD_CTX *ctx) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	EVP_DigestFinal_ex(ctx, digest, NULL);
+	EVP_MD_CTX_free(ctx);
+
+	if(tree->numDirs == *capacity) {
+		*capacity = *capacity == 0 ? 64 : *capacity * 2;
+		tree->dirs = realloc(tree->dirs, sizeof(DirHash) * (*capacity));
+	}
+	DirHash *dir = &tree->dirs[tree->numDirs++];
+	dir->path = path;
+	encodeHex(digest, MD5_DIGEST_LENGTH, dir->hash);
+}
+
+int compareDirHash(const void *a, const void *b) {
+	return strcmp(((DirHash *) a)->path, ((DirHash *) b)->path);
+}
+
+// Closes the innermost open directory, and feeds its hash to the parent.
+void closeTreeDir(ManifestTree *tree, int *capacity, OpenDir *stack, int *depth) {
+	OpenDir *dir = &stack[--(*depth)];
+	addDirToTree(tree, capacity, dir->path, dir->ctx);
+
+	if(*depth > 0) {
+		char *name = dir->path + (stack[*depth - 1].pathLen == 0 ? 0 : stack[*depth - 1].pathLen + 1);
+		DirHash *added = &tree->dirs[tree->numDirs - 1];
+		EVP_DigestUpdate(stack[*depth - 1].ctx, "d ", 2);
+		EVP_DigestUpdate(stack[*depth - 1].ctx, name, strlen(name));
+		EVP_DigestUpdate(stack[*depth - 1].ctx, " ", 1);
+		EVP_DigestUpdate(stack[*depth - 1].ctx, added->hash, HASH_STRING_LEN);
+		EVP_DigestUpdate(stack[*depth - 1].ctx, "\n", 1);
+	}
+}
+
+// The manifest is sorted, so all files under a directory come one after
+// another. A stack of open directories is enough, each directory is
+// closed as soon as the next file is outside it.
+ManifestTree *buildManifestTree(Manifest *manifest) {
+	sortManifest(manifest);
+
+	ManifestTree *tree = malloc(sizeof(ManifestTree));
+	tree->numDirs = 0;
+	tree->dirs = NULL;
+	int capacity = 0;
+
+	int stackSize = 16, depth = 1;
+	OpenDir *stack = malloc(sizeof(OpenDir) * stackSize);
+	stack[0].path = strdup(".");
+	stack[0].pathLen = 0; // root is prefix of everything
+	stack[0].ctx = createTreeDirContext();
+
+	ManifestNode *node = manifest->head;
+	while(node != NULL) {
+		char *filePath = node->filePath;
+
+		// close directories which are not parent of this file.
+		while(depth > 1) {
+			OpenDir *top = &stack[depth - 1];
+			if(strncmp(filePath, top->path, top->pathLen) == 0 && filePath[top->pathLen] == '/') {
+				break;
+			}
+			closeTreeDir(tree, &capacity, stack, &depth);
+		}
+
+		// open the remaining directories of this file.
+		char *slash = strchr(filePath + (stack[depth - 1].pathLen == 0 ? 0 : stack[depth - 1].pathLen + 1), '/');
+		while(slash != NULL) {
+			if(depth == stackSize) {
+				stackSize *= 2;
+				stack = realloc(stack, sizeof(OpenDir) * stackSize);
+			}
+			OpenDir *dir = &stack[depth++];
+			dir->pathLen = slash - filePath;
+			dir->path = malloc(dir->pathLen + 1);
+			memcpy(dir->path, filePath, dir->pathLen);
+			dir->path[dir->pathLen] = '\0';
+			dir->ctx = createTreeDirContext();
+			slash = strchr(slash + 1, '/');
+		}
+
+		OpenDir *top = &stack[depth - 1];
+		char *name = filePath + (top->pathLen == 0 ? 0 : top->pathLen + 1);
+		EVP_DigestUpdate(top->ctx, "f ", 2);
+		EVP_DigestUpdate(top->ctx, name, strlen(name));
+		EVP_DigestUpdate(top->ctx, " ", 1);
+		EVP_DigestUpdate(top->ctx, node->md5, strlen(node->md5));
+		EVP_DigestUpdate(top->ctx, " ", 1);
+		EVP_DigestUpdate(top->ctx, node->version, strlen(node->version));
+		EVP_DigestUpdate(top->ctx, "\n", 1);
+
+		node = node->next;
+	}
+
+	while(depth > 0) {
+		closeTreeDir(tree, &capacity, stack, &depth);
+	}
+	free(stack);
+
+	qsort(tree->dirs, tree->numDirs, sizeof(DirHash), compareDirHash);
+	return tree;
+}
+
+// Binary search of the sorted directories, NULL if path is not there.
+DirHash *findDirHash(ManifestTree *tree, char *path) {
+	DirHash key;
+	key.path = path;
+	return bsearch(&key, tree->dirs, tree->numDirs, sizeof(DirHash), compareDirHash);
+}
+
+void writeManifestTree(ManifestTree *tree, int fd) {
+	char buffer[100];
+	sprintf(buffer, "%d\n", tree->numDirs);
+	write(fd, buffer, strlen(buffer));
+
+	int i;
+	for(i = 0; i < tree->numDirs; i++) {
+		write(fd, tree->dirs[i].hash, HASH_STRING_LEN);
+		write(fd, " ", 1);
+		write(fd, tree->dirs[i].path, strlen(tree->dirs[i].path));
+		write(fd, "\n", 1);
+	}
+}
+
+// Reads numBytes of tree text from a file/socket.
+ManifestTree *readManifestTreeBytes(int fd, long numBytes) {
+	char *data = malloc(numBytes + 1);
+	long done = 0;
+	while(done < numBytes) {
+		ssize_t n = read(fd, data + done, numBytes - done);
+		if(n <= 0) {
+			break; // Disconnected.
+		}
+		done += n;
+	}
+	data[done] = '\0';
+
+	ManifestTree *tree = malloc(sizeof(ManifestTree));
+	tree->numDirs = 0;
+
+	char *line = data;
+	char *nl = strchr(line, '\n');
+	int numDirs = atoi(line);
+	tree->dirs = malloc(sizeof(DirHash) * (numDirs > 0 ? numDirs : 1));
+
+	while(nl != NULL && tree->numDirs < numDirs) {
+		line = nl + 1;
+		nl = strchr(line, '\n');
+		if(nl != NULL) {
+			*nl = '\0';
+		}
+		if(strlen(line) < HASH_STRING_LEN + 2) {
+			break;
+		}
+		DirHash *dir = &tree->dirs[tree->numDirs++];
+		memcpy(dir->hash, line, HASH_STRING_LEN);
+		dir->hash[HASH_STRING_LEN] = '\0';
+		dir->path = strdup(line + HASH_STRING_LEN + 1);
+	}
+
+	free(data);
+	return tree;
+}
+
+void freeManifestTree(ManifestTree *tree) {
+	int i;
+	for(i = 0; i < tree->numDirs; i++) {
+		free(tree->dirs[i].path);
+	}
+	free(tree->dirs);
+	free(tree);
+}
+
+DirSet *createDirSet() {
+	DirSet *set = malloc(sizeof(DirSet));
+	set->marks = NULL;
+	set->size = 0;
+	set->count = 0;
+	retainPathPool();
+	return set;
+}
+
+void addToDirSet(DirSet *set, char *dirPath) {
+	int id = internPath(dirPath);
+	if(id >= set->size) {
+		int newSize = (id + 1) * 2;
+		set->marks = realloc(set->marks, newSize);
+		memset(set->marks + set->size, 0, newSize - set->size);
+		set->size = newSize;
+	}
+	if(!set->marks[id]) {
+		set->marks[id] = 1;
+		set->count++;
+	}
+}
+
+int dirSetContainsDir(DirSet *set, char *dirPath) {
+	int id = findInternedPath(dirPath);
+	return id >= 0 && id < set->size && set->marks[id];
+}
+
+// Checks if the file's own directory is in the set.
+int dirSetContainsFile(DirSet *set, char *filePath) {
+	char *slash = strrchr(filePath, '/');
+	if(slash == NULL) {
+		return dirSetContainsDir(set, ".");
+	}
+	*slash = '\0';
+	int result = dirSetContainsDir(set, filePath);
+	*slash = '/';
+	return result;
+}
+
+void freeDirSet(DirSet *set) {
+	free(set->marks);
+	free(set);
+	releasePathPool();
+}
+
+// Merge-join of the sorted trees, directories which are not on both
+// sides with same hash are put in the set.
+DirSet *findChangedDirs(ManifestTree *server, ManifestTree *client) {
+	DirSet *set = createDirSet();
+	int s = 0, c = 0;
+
+	while(s < server->numDirs || c < client->numDirs) {
+		int cmp;
+		if(s == server->numDirs) {
+			cmp = 1;
+		} else if(c == client->numDirs) {
+			cmp = -1;
+		} else {
+			cmp = strcmp(server->dirs[s].path, client->dirs[c].path);
+		}
+
+		if(cmp < 0) {
+			addToDirSet(set, server->dirs[s++].path);
+		} else if(cmp > 0) {
+			addToDirSet(set, client->dirs[c++].path);
+		} else {
+			if(strcmp(server->dirs[s].hash, client->dirs[c].hash) != 0) {
+				addToDirSet(set, server->dirs[s].path);
+			}
+			s++;
+			c++;
+		}
+	}
+	return set;
+}
+
+// Splits the manifest: files of directories in the set stay, others
+// are moved into the returned manifest (with same project and version).
+Manifest *splitManifestByDirs(Manifest *manifest, DirSet *set) {
+	sortManifest(manifest);
+
+	Manifest *others = createEmptyManifest(strdup(manifest->projectName), strdup(manifest->versionNumber));
+	others->hashAlgorithm = manifest->hashAlgorithm;
+	ManifestNode *node = manifest->head;
+
+	clearManifestList(manifest);
+
+	while(node != NULL) {
+		ManifestNode *next = node->next;
+		if(dirSetContainsFile(set, node->filePath)) {
+			appendManifestNode(manifest, node);
+		} else {
+			appendManifestNode(others, node);
+		}
+		node = next;
+	}
+	return others;
+}
+
+// Moves the nodes of a split manifest back, both lists are sorted.
+void joinManifests(Manifest *manifest, Manifest *others) {
+	ManifestNode *a = manifest->head;
+	ManifestNode *b = others->head;
+	int numFiles = manifest->numFiles + others->numFiles;
+
+	clearManifestList(manifest);
+	clearManifestList(others);
+	manifest->head = mergeManifestLists(a, b);
+	manifest->tail = manifest->head;
+	while(manifest->tail != NULL) {
+		indexManifestNode(manifest, manifest->tail);
+		if(manifest->tail->next == NULL) {
+			break;
+		}
+		manifest->tail = manifest->tail->next;
+	}
+	manifest->numFiles = numFiles;
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef OBJECTS_H
+#define OBJECTS_H
+
+/*
+Object store. Whole files are kept by their content hash, so a file
+the receiver had before (reverts, renames, copies in other projects)
+is not sent again:
+<store>/<hash algorithm>/<first 2 chars of hash>/<hash>
+Files which are not changed in place (server's) are hard linked in,
+so keeping one does not copy it. Others are cloned where the file
+system can, else copied.
+
+Bytes of all objects are counted in <store>/.bytes. Once they are
+more than allowed, the objects kept first are removed.
+*/
+
+static char *OBJECT_BYTES_FILE = ".bytes";
+
+typedef struct StoredObject {
+	char *path;
+	long long size;
+	long long ctime;
+} StoredObject;
+
+static char *objectPath(char *storeDir, int hashAlgorithm, const char *hash)
+{
+	const char *algorithm = hashAlgorithmName(hashAlgorithm);
+	char *path = malloc(sizeof(char) * (strlen(storeDir) + strlen(algorithm) + HASH_STRING_LEN + 10));
+	sprintf(path, "%s/%s/%.2s/%.*s", storeDir, algorithm, hash, HASH_STRING_LEN, hash);
+	return path;
+}
+
+// Keeps the file as the object with the hash, hard linked if linkFile
+// is set. Returns the bytes added, 0 if the store had it already.
+static long long storeObject(char *storeDir, char *path, int hashAlgorithm, const char *hash, int linkFile)
+{
+	if(hashAlgorithm < 0 || strlen(hash) != HASH_STRING_LEN) {
+		return 0;
+	}
+
+	char *objPath = objectPath(storeDir, hashAlgorithm, hash);
+	long long added = 0;
+	struct stat st;
+	if(stat(objPath, &st) != 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+		createDirStructureIfNeeded(objPath);
+		if(linkFile && link(path, objPath) == 0) {
+			added = st.st_size;
+		} else {
+			// Store is on another file system, or the file can change.
+			char *tmpPath = malloc(sizeof(char) * (strlen(objPath) + 50));
+			sprintf(tmpPath, "%s.tmp%lld_%d", objPath, current_timestamp_millis(), rand());
+			if(!cloneFile(path, tmpPath)) {
+				copyFile(path, tmpPath);
+			}
+			rename(tmpPath, objPath);
+			free(tmpPath);
+			added = st.st_size;
+		}
+	}
+	free(objPath);
+	return added;
+}
+
+static int compareStoredObjects(const void *a, const void *b)
+{
+	const StoredObject *x = (const StoredObject *) a;
+	const StoredObject *y = (const StoredObject *) b;
+	return x->ctime < y->ctime ? -1 : (x->ctime > y->ctime ? 1 : 0);
+}
+
+// Adds the objects under dir, which is depth levels above them.
+static void collectStoredObjects(char *dir, int depth, StoredObject **objects, int *count, int *capacity)
+{
+	DIR *d = opendir(dir);
+	if(d == NULL) {
+		return;
+	}
+	struct dirent *entry;
+	while((entry = readdir(d)) != NULL) {
+		if(entry->d_name[0] == '.') {
+			continue;
+		}
+		char *path = malloc(sizeof(char) * (strlen(dir) + strlen(entry->d_name) + 2));
+		sprintf(path, "%s/%s", dir, entry->d_name);
+		struct stat st;
+		if(depth > 0) {
+			collectStoredObjects(path, depth - 1, objects, count, capacity);
+			free(path);
+		} else if(stat(path, &st) == 0 && S_ISREG(st.st_mode) && strstr(entry->d_name, ".tmp") == NULL) {
+			if(*count == *capacity) {
+				*capacity = *capacity == 0 ? 1024 : *capacity * 2;
+				*objects = realloc(*objects, sizeof(StoredObject) * *capacity);
+			}
+			(*objects)[*count].path = path;
+			(*objects)[*count].size = st.st_size;
+			(*objects)[*count].ctime = st.st_ctime;
+			(*count)++;
+		} else {
+			free(path);
+		}
+	}
+	closedir(d);
+}
+
+// Counts the added bytes, and removes the objects kept first if there
+// are more than maxBytes. Those go down to 3/4 of it, so the store is
+// not walked again on the next few additions.
+static void trimObjects(char *storeDir, long long added, long long maxBytes)
+{
+	char *bytesPath = malloc(sizeof(char) * (strlen(storeDir) + strlen(OBJECT_BYTES_FILE) + 2));
+	sprintf(bytesPath, "%s/%s", storeDir, OBJECT_BYTES_FILE);
+
+	long long total = 0;
+	FILE *file = fopen(bytesPath, "r");
+	if(file != NULL) {
+		if(fscanf(file, "%lld", &total) != 1) {
+			total = 0;
+		}
+		fclose(file);
+	}
+	total += added;
+
+	int walked = total > maxBytes;
+	if(walked) {
+		StoredObject *objects = NULL;
+		int count = 0, capacity = 0, i;
+		collectStoredObjects(storeDir, 2, &objects, &count, &capacity);
+		total = 0;
+		for(i = 0; i < count; i++) {
+			total += objects[i].size;
+		}
+
+		qsort(objects, count, sizeof(StoredObject), compareStoredObjects);
+		for(i = 0; i < count; i++) {
+			if(total > maxBytes / 4 * 3 && unlink(objects[i].path) == 0) {
+				total -= objects[i].size;
+			}
+			free(objects[i].path);
+		}
+		free(objects);
+	}
+
+	if(added != 0 || walked) {
+		createDirStructureIfNeeded(bytesPath);
+		file = fopen(bytesPath, "w");
+		if(file != NULL) {
+			fprintf(file, "%lld\n", total);
+			fclose(file);
+		}
+	}
+	free(bytesPath);
+}
+
+#endif
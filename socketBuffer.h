@@ -62,7 +62,9 @@ static void readNBytes(SocketBuffer *socketBuffer, int sockfd, long int numBytes
 	char c;
 	long int i = 0;
 	while(i++ < numBytes) {
-		read(sockfd, &c, 1);
+		if(read(sockfd, &c, 1) != 1) {
+			break; // EOF or error.
+		}
 		if(c == '\0') {			
 			break; // Client disconnected.
 		}
@@ -73,7 +75,9 @@ static void readNBytes(SocketBuffer *socketBuffer, int sockfd, long int numBytes
 static void readTillDelimiter(SocketBuffer *socketBuffer, int sockfd, char delimiter) {
 	char c;
 	while(1) {
-		read(sockfd, &c, 1);
+		if(read(sockfd, &c, 1) != 1) {
+			break; // EOF or error, c would be stale otherwise.
+		}
 		
 		// for files,if EOF is reached, we get \0
 		if(c == '\0') {
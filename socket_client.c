@@ -9,17 +9,42 @@
 #include <errno.h>
 #include <arpa/inet.h> 
 #include <err.h>
+#include <fnmatch.h>
+#include <signal.h>
 
 #include "util.h"
 #include "manifest.h"
+#include "manifestTree.h"
+#include "watcher.h"
 #include "socketBuffer.h"
 
 
 char *CONFIG_FILE = ".configure";
 char *UPDATE_FILE = ".update";
 char *COMMIT_FILE = ".commit";
+
+// Id of a checkout or push which did not get through, kept to resume it.
+char *TRANSFER_FILE = ".transfer";
+
+// Checkout fetches shards of the files over this many connections, so
+// links with a long round trip are filled.
+#define CHECKOUT_CONNECTIONS 4
 char *REQUEST_FILE = ".request";
 char *RESPONSE_FILE = ".response";
+char *MANIFEST_LOG_FILE = ".manifest.log";
+char *SERVER_MANIFEST_FILE = ".server_manifest";
+char *DELTA_FILE = ".delta";
+
+// Files are kept by hash in a content cache shared by the working
+// copies of the user, so checkouts and upgrades of any project, branch
+// or version fetch only files which are not in it. WTF_CACHE names
+// another directory, without a home it is kept in the project.
+char *USER_CACHE_DIR = ".wtfcache";
+char *OBJECT_CACHE_DIR = ".objects";
+#define OBJECT_CACHE_MAX_BYTES (4LL * 1024 * 1024 * 1024)
+
+// Files of a lazy checkout are asked for this many at a time.
+#define HYDRATE_BATCH_FILES 1000
 
 /*
  * The function get_sockaddr converts the server's address and port into a form usable to create a 
@@ -48,7 +73,7 @@ struct addrinfo* get_sockaddr(const char* hostname, const char *port) {
 /*
  * The function open_connection establishes a connection to the server
 */
-int open_connection(struct addrinfo* addr_list) {
+int try_open_connection(struct addrinfo* addr_list) {
 	struct addrinfo* p;
 	int sockfd;
 	//Iterate through each addr info in the list; Stop when we successully connect to one
@@ -62,14 +87,22 @@ int open_connection(struct addrinfo* addr_list) {
 		//Stop iterating of we are able to connect to the server
 
 		if (connect(sockfd,p->ai_addr, p->ai_addrlen) != -1) break;
+		close(sockfd);
 	}
 
 	freeaddrinfo(addr_list);
 
-	if (p == NULL)
+	return p == NULL ? -1 : sockfd;
+}
+
+/*
+ * Same, and exits if no connection could be made.
+*/
+int open_connection(struct addrinfo* addr_list) {
+	int sockfd = try_open_connection(addr_list);
+	if (sockfd == -1)
 		err(EXIT_FAILURE, "%s", "Unable to connect");
-	else
-		return sockfd;
+	return sockfd;
 }
 
 int isProjectConfiguredLocally(char *project) {
@@ -94,7 +127,167 @@ int isProjectConfiguredLocally(char *project) {
 }
 
 
+// Tells the server which codecs can be used, preferred one first, and
+// uses the one it picks for compressed data on this connection.
+// Format: codecs:<name>,<name>..: and response codec:<name>:
+void negotiateCodec(int socket, char *preferred) {
+	char buffer[150];
+	char names[100];
+	listCodecs(strlen(preferred) > 0 ? preferred : NULL, names);
+	sprintf(buffer, "codecs:%s:", names);
+	write(socket, buffer, strlen(buffer));
+	
+	SocketBuffer *socketBuffer = createBuffer();
+	readTillDelimiter(socketBuffer, socket, ':');
+	char *responseCode = readAllBuffer(socketBuffer);
+	readTillDelimiter(socketBuffer, socket, ':');
+	char *name = readAllBuffer(socketBuffer);
+	
+	int codec = codecFromName(name);
+	if(strcmp(responseCode, "codec") != 0 || codec < 0) {
+		codec = codecFromName("zlib");
+	}
+	setTransferCodec(codec);
+	setTransferNegotiated(strcmp(responseCode, "codec") == 0);
+	
+	free(name);
+	free(responseCode);
+	freeSocketBuffer(socketBuffer);
+}
+
+// Reads the id of the transfer kept in the file. Returns 0 if there
+// is none, a new one is kept then.
+int loadTransferId(char *statePath, char id[]) {
+	SocketBuffer *socketBuffer = createBuffer();
+	int fd = open(statePath, O_RDONLY, 0777);
+	if(fd >= 0) {
+		readTillDelimiter(socketBuffer, fd, '\n');
+		close(fd);
+	}
+	char *kept = readAllBuffer(socketBuffer);
+	freeSocketBuffer(socketBuffer);
+	
+	int found = isTransferId(kept);
+	if(found) {
+		strcpy(id, kept);
+	} else {
+		createTransferId(id);
+		createDirStructureIfNeeded(statePath);
+		fd = open(statePath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+		write(fd, id, strlen(id));
+		write(fd, "\n", 1);
+		close(fd);
+	}
+	free(kept);
+	return found;
+}
+
+// Tells the server all of the transfer came, so it drops its copy.
+// Format: received:<id>:
+void acknowledgeTransfer(int socket, char *transferId) {
+	char buffer[100];
+	sprintf(buffer, "received:%s:", transferId);
+	write(socket, buffer, strlen(buffer));
+}
+
+// Directory of the content cache, delete yourself.
+char *objectCacheDir(char *project) {
+	char *dir = getenv("WTF_CACHE");
+	if(dir != NULL && strlen(dir) > 0) {
+		return strdup(dir);
+	}
+	char *home = getenv("HOME");
+	if(home != NULL && strlen(home) > 0) {
+		dir = malloc(sizeof(char) * (strlen(home) + strlen(USER_CACHE_DIR) + 2));
+		sprintf(dir, "%s/%s", home, USER_CACHE_DIR);
+	} else {
+		dir = malloc(sizeof(char) * (strlen(project) + strlen(OBJECT_CACHE_DIR) + 2));
+		sprintf(dir, "%s/%s", project, OBJECT_CACHE_DIR);
+	}
+	return dir;
+}
+
+// Hashes of the files of the manifest (in the sparse checkout) which
+// the content cache has.
+HashSet *findCachedObjects(Manifest *manifest) {
+	char *hashes = malloc(manifest->numFiles * HASH_STRING_LEN + 1);
+	long count = 0;
+	ManifestNode *node = manifest->head;
+	while(node != NULL) {
+		if(isInSparseSpec(sparseSpec, node->filePath) && hasObject(manifest->hashAlgorithm, node->md5)) {
+			memcpy(hashes + count++ * HASH_STRING_LEN, node->md5, HASH_STRING_LEN);
+		}
+		node = node->next;
+	}
+	return createHashSet(hashes, count);
+}
+
+// Names the files the content cache has before checkout, the server
+// sends those as just their hash.
+// Format: objects:<hash algorithm>:<numHashes>:<Hash1><Hash2>..
+void announceCachedObjects(int socket, HashSet *objects, int hashAlgorithm) {
+	if(objects == NULL || objects->count == 0) {
+		return;
+	}
+	char buffer[100];
+	sprintf(buffer, "objects:%s:", hashAlgorithmName(hashAlgorithm));
+	write(socket, buffer, strlen(buffer));
+	writeHashSet(objects, socket);
+}
+
+// Names the id of the project's cached dictionary (0 if none) before
+// checkout and upgrade, the server sends its own one with the files if
+// they differ. Format: dictionary:<id>:
+// Returns the dictionary path, which stays in use till the response is
+// read, delete yourself.
+char *announceDictionary(int socket, char *project) {
+	char buffer[100];
+	char *path = malloc(sizeof(char) * (strlen(project) + strlen(DICTIONARY_FILE) + 5));
+	sprintf(path, "%s/%s", project, DICTIONARY_FILE);
+	
+	sprintf(buffer, "dictionary:%u:", dictionaryId(path));
+	write(socket, buffer, strlen(buffer));
+	setTransferDictionary(path, 0);
+	return path;
+}
+
+// Names the spec of a sparse checkout, if this is one, after the
+// dictionary and transfer, the server sends no files out of it.
+// Format: sparse:<specLen>:<spec>
+void announceSparseSpec(int socket) {
+	if(sparseSpec == NULL) {
+		return;
+	}
+	char buffer[100];
+	char *text = formatSparseSpec(sparseSpec);
+	sprintf(buffer, "sparse:%d:", strlen(text));
+	write(socket, buffer, strlen(buffer));
+	write(socket, text, strlen(text));
+	free(text);
+}
+
+// Reads the file header sent by server:
+// <FileNameLen>:<FileName><FileLenBytes>:
+// and returns FileLenBytes, so the contents can be read in one go.
+long readFileHeaderFromSocket(SocketBuffer *socketBuffer, int socket) {
+	readTillDelimiter(socketBuffer, socket, ':');
+	char *nameLenStr = readAllBuffer(socketBuffer);
+	long nameLen = atol(nameLenStr);
+	free(nameLenStr);
+	
+	readNBytes(socketBuffer, socket, nameLen);
+	clearSocketBuffer(socketBuffer);
+	
+	readTillDelimiter(socketBuffer, socket, ':');
+	char *contentLenStr = readAllBuffer(socketBuffer);
+	long contentLen = atol(contentLenStr);
+	free(contentLenStr);
+	
+	return contentLen;
+}
+
 // returns dynamically created Manifest, Delete yourself.
+// Pending records of the manifest journal are applied on it.
 Manifest* readClientProjectManifest(char *project) {
 	char *path = malloc(sizeof(char) * (strlen(project) + 50));
 	
@@ -108,10 +301,55 @@ Manifest* readClientProjectManifest(char *project) {
 	Manifest *manifest = readManifestContents(manifestFd);
 	close(manifestFd);
 	
+	sprintf(path, "%s/%s", project, MANIFEST_LOG_FILE);
+	int journalFd = open(path, O_RDONLY, 0777);
+	if(journalFd >= 0) {
+		applyManifestJournal(manifest, journalFd);
+		close(journalFd);
+	}
+	
 	free(path);
 	return manifest;
 }
 
+// Writes the journal records into the .manifest, and removes the journal.
+void foldManifestJournal(char *project) {
+	char *path = malloc(sizeof(char) * (strlen(project) + 50));
+	
+	sprintf(path, "%s/%s", project, MANIFEST_LOG_FILE);
+	if(!checkFileExists(path)) {
+		free(path);
+		return;
+	}
+	
+	Manifest *manifest = readClientProjectManifest(project);
+	
+	// Write new manifest aside, and rename it, so a crash leaves either version.
+	sprintf(path, "%s/%s.tmp", project, MANIFEST_FILE);
+	int manifestFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	writeManifestToFile(manifest, manifestFd);
+	close(manifestFd);
+	
+	char *manifestPath = malloc(sizeof(char) * (strlen(project) + 50));
+	sprintf(manifestPath, "%s/%s", project, MANIFEST_FILE);
+	rename(path, manifestPath);
+	free(manifestPath);
+	
+	sprintf(path, "%s/%s", project, MANIFEST_LOG_FILE);
+	unlink(path);
+	
+	freeManifest(manifest);
+	free(path);
+}
+
+// Drops the journal, used when the .manifest is replaced by server's.
+void clearManifestJournal(char *project) {
+	char *path = malloc(sizeof(char) * (strlen(project) + 50));
+	sprintf(path, "%s/%s", project, MANIFEST_LOG_FILE);
+	unlink(path);
+	free(path);
+}
+
 Manifest* readServerProjectManifest(char *project, int socket) {
 	
 	// Make Request.
@@ -146,19 +384,386 @@ Manifest* readServerProjectManifest(char *project, int socket) {
 	
 	// If server gave manifest
 	if(contentLen != -1) {
-		serverManifest = readManifestContents(socket);
+		serverManifest = readManifestBytes(socket, contentLen);
 	}
 	
 	freeSocketBuffer(socketBuffer);
 	return serverManifest;
 }
 
+// Keeps a copy of the server's manifest of the last sync, so next time
+// only the changes since that version need to be downloaded.
+void cacheServerManifest(char *project, Manifest *manifest) {
+	char *path = malloc(sizeof(char) * (strlen(project) + 50));
+	char *cachePath = malloc(sizeof(char) * (strlen(project) + 50));
+	
+	sprintf(path, "%s/%s.tmp", project, SERVER_MANIFEST_FILE);
+	sprintf(cachePath, "%s/%s", project, SERVER_MANIFEST_FILE);
+	
+	int manifestFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	writeManifestToFile(manifest, manifestFd);
+	close(manifestFd);
+	rename(path, cachePath);
+	
+	free(cachePath);
+	free(path);
+}
+
+// Same, when the .manifest was just downloaded from the server as is.
+void cacheServerManifestFile(char *project) {
+	char *path = malloc(sizeof(char) * (strlen(project) + 50));
+	char *cachePath = malloc(sizeof(char) * (strlen(project) + 50));
+	
+	sprintf(path, "%s/%s", project, MANIFEST_FILE);
+	sprintf(cachePath, "%s/%s", project, SERVER_MANIFEST_FILE);
+	if(checkFileExists(path)) {
+		copyFile(path, cachePath);
+	}
+	
+	free(cachePath);
+	free(path);
+}
+
+// Saves the files of checkout/upgrade responses, read from each fd in
+// turn, the .manifest comes first in the first one. Each file is hashed
+// while it is written and checked against the received manifest, good
+// files go into the stat cache so they are not read again. Returns the
+// number of files which did not match.
+int receiveProjectShards(int *fds, long *numFiles, int numShards, char *project) {
+	char hash[HASH_STRING_LEN + 1];
+	Manifest *manifest = NULL;
+	int mismatches = 0;
+	
+	int shard;
+	for(shard = 0; shard < numShards; shard++) {
+		int fd = fds[shard];
+		long left = numFiles[shard];
+		while(left-- > 0) {
+			int algorithm = manifest == NULL ? -1 : manifest->hashAlgorithm;
+			char *filePath = receiveFileFromSocket(fd, project, algorithm, hash);
+			char *fullPath = malloc(sizeof(char) * (strlen(project) + strlen(filePath) + 2));
+			sprintf(fullPath, "%s/%s", project, filePath);
+			
+			if(manifest == NULL) {
+				if(strcmp(filePath, MANIFEST_FILE) == 0) {
+					int manifestFd = open(fullPath, O_RDONLY, 0777);
+					manifest = readManifestContents(manifestFd);
+					close(manifestFd);
+					fileIndex = loadFileIndex(project, manifest->hashAlgorithm);
+				}
+			} else {
+				ManifestNode *node = searchFile(manifest, filePath);
+				struct stat st;
+			
+				if(node == NULL || strcmp(node->md5, hash) != 0) {
+					printf("Error: %s does not match its hash in the manifest, damaged in transfer.\n", filePath);
+					mismatches++;
+				} else if(stat(fullPath, &st) == 0) {
+					updateFileIndex(fileIndex, filePath, &st, hash);
+					keepObject(fullPath, manifest->hashAlgorithm, hash);
+				}
+			}
+			free(fullPath);
+			free(filePath);
+		}
+	}
+	
+	if(manifest != NULL) {
+		saveFileIndex(fileIndex, 0);
+		freeFileIndex(fileIndex);
+		fileIndex = NULL;
+		freeManifest(manifest);
+	}
+	return mismatches;
+}
+
+int receiveProjectFiles(int fd, char *project, long numFiles) {
+	return receiveProjectShards(&fd, &numFiles, 1, project);
+}
+
+// Reads the server response for a single file request:
+// sendfile:<body of <FileNameLen>:<FileName><FileLenBytes>:<FileContents>>
+// Returns FileLenBytes, and the contents are read from *bodyFd, which
+// must be closed. Returns -1 after printing the error if server failed.
+long readSendFileResponse(SocketBuffer *socketBuffer, int socket, int *bodyFd) {
+	readTillDelimiter(socketBuffer, socket, ':');
+	char *responseCode = readAllBuffer(socketBuffer);
+	
+	long numBytes = -1;
+	if(strcmp(responseCode, "sendfile") == 0) {
+		*bodyFd = openBodyFromSocket(socket, ".");
+		numBytes = readFileHeaderFromSocket(socketBuffer, *bodyFd);
+	} else {
+		printf("Server sent error message.\n");		
+		readTillDelimiter(socketBuffer, socket, ':');
+		char *reason = readAllBuffer(socketBuffer);
+		printf("ResponseCode: %s\n", responseCode);
+		printf("Reason: %s\n", reason);
+		free(reason);
+	}
+	
+	free(responseCode);
+	return numBytes;
+}
+
+// Brings the cached server manifest to server's current version, by
+// downloading only the entries which changed since the cached version.
+// Returns NULL if there is no cache, or server failed.
+Manifest *readServerManifestDelta(char *project, int socket) {
+	char *path = malloc(sizeof(char) * (strlen(project) + 50));
+	sprintf(path, "%s/%s", project, SERVER_MANIFEST_FILE);
+	if(!checkFileExists(path)) {
+		free(path);
+		return NULL;
+	}
+	
+	int manifestFd = open(path, O_RDONLY, 0777);
+	Manifest *manifest = readManifestContents(manifestFd);
+	close(manifestFd);
+	
+	// manifestdelta:<projectNameLength>:<projectName><baseVersion>:
+	char *command = malloc(sizeof(char) * (strlen(project) + strlen(manifest->versionNumber) + 50));
+	sprintf(command, "%s:%d:%s%s:", "manifestdelta", strlen(project), project, manifest->versionNumber);
+	write(socket, command, strlen(command));
+	free(command);
+	
+	// Server responds back
+	// delta:<FileNameLen>:<file name><numBytes>:<changes>
+	// or full:<FileNameLen>:<file name><numBytes>:<changes> if it does not have our version.
+	// In case of error, Response comes as "failed:<fail Reason>:"
+	SocketBuffer *socketBuffer = createBuffer();
+	readTillDelimiter(socketBuffer, socket, ':');
+	char *responseCode = readAllBuffer(socketBuffer);
+	
+	if(strcmp(responseCode, "delta") == 0 || strcmp(responseCode, "full") == 0) {
+		int bodyFd = openBodyFromSocket(socket, project);
+		long numBytes = readFileHeaderFromSocket(socketBuffer, bodyFd);
+		
+		// Save the changes first, then read them like .update entries.
+		sprintf(path, "%s/%s", project, DELTA_FILE);
+		int deltaFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+		writeNBytesToFile(numBytes, bodyFd, deltaFd);
+		close(deltaFd);
+		close(bodyFd);
+		
+		deltaFd = open(path, O_RDONLY, 0777);
+		readTillDelimiter(socketBuffer, deltaFd, '\n');
+		clearSocketBuffer(socketBuffer); // project name
+		readTillDelimiter(socketBuffer, deltaFd, '\n');
+		char *version = readAllBuffer(socketBuffer);
+		readTillDelimiter(socketBuffer, deltaFd, '\n');
+		char *numEntries = readAllBuffer(socketBuffer);
+		char *algorithmName = strchr(numEntries, ' ');
+		int hashAlgorithm = algorithmName == NULL ? HASH_MD5 : hashAlgorithmFromName(algorithmName + 1);
+		free(numEntries);
+		
+		Manifest *changes = readManifestEntries(deltaFd);
+		close(deltaFd);
+		unlink(path);
+		
+		int changed = changes->numFiles > 0 || strcmp(version, manifest->versionNumber) != 0;
+		if(strcmp(responseCode, "full") == 0) {
+			Manifest *empty = createEmptyManifest(strdup(manifest->projectName), NULL);
+			freeManifest(manifest);
+			manifest = empty;
+			changed = 1;
+		}
+		
+		printf("%d manifest entries changed since last sync.\n", changes->numFiles);
+		fflush(stdout);
+		
+		applyCommitEntries(manifest, changes);
+		setManifestVersion(manifest, version);
+		manifest->hashAlgorithm = hashAlgorithm;
+		freeManifest(changes);
+		
+		if(changed) {
+			cacheServerManifest(project, manifest);
+		}
+		
+	} else {
+		printf("Server sent error message.\n");		
+		readTillDelimiter(socketBuffer, socket, ':');
+		char *reason = readAllBuffer(socketBuffer);
+		printf("ResponseCode: %s\n", responseCode);
+		printf("Reason: %s\n", reason);
+		free(reason);
+		
+		freeManifest(manifest);
+		manifest = NULL;
+	}
+	
+	free(responseCode);
+	freeSocketBuffer(socketBuffer);
+	free(path);
+	return manifest;
+}
+
+// Writes <numDirs>:<dir1Len>:<dir1><dir2Len>:<dir2>..
+void writeDirList(int socket, char **dirs, int numDirs) {
+	char buffer[50];
+	sprintf(buffer, "%d:", numDirs);
+	write(socket, buffer, strlen(buffer));
+	
+	int i;
+	for(i = 0; i < numDirs; i++) {
+		sprintf(buffer, "%d:", strlen(dirs[i]));
+		write(socket, buffer, strlen(buffer));
+		write(socket, dirs[i], strlen(dirs[i]));
+	}
+}
+
+// Hashes of the server's directories in dirs and of their direct sub
+// directories. NULL if the server failed.
+ManifestTree *readServerTreeLevel(char *project, int socket, SocketBuffer *socketBuffer, char **dirs, int numDirs) {
+	// treelevel:<projectNameLength>:<projectName><numDirs>:<dir1Len>:<dir1>..
+	char *command = malloc(sizeof(char) * (strlen(project) + 50));
+	sprintf(command, "%s:%d:%s", "treelevel", strlen(project), project);
+	write(socket, command, strlen(command));
+	writeDirList(socket, dirs, numDirs);
+	free(command);
+	
+	int bodyFd;
+	long numBytes = readSendFileResponse(socketBuffer, socket, &bodyFd);
+	if(numBytes < 0) {
+		return NULL;
+	}
+	ManifestTree *tree = readManifestTreeBytes(bodyFd, numBytes);
+	close(bodyFd);
+	return tree;
+}
+
+// Compares directory hashes with the server, and downloads server's
+// manifest entries only for directories which differ.
+// The local manifest is split the same way: it keeps the files of the
+// changed directories, the rest (same on both sides) is put in *unchanged.
+// When the server manifest of last sync is cached, it is brought up to
+// date with a delta and the directory hashes are compared locally.
+// Returns NULL if server failed.
+Manifest *readChangedServerEntries(char *project, int socket, Manifest *localManifest, Manifest **unchanged) {
+	
+	char *path = malloc(sizeof(char) * (strlen(project) + 50));
+	sprintf(path, "%s/%s", project, SERVER_MANIFEST_FILE);
+	int hasCache = checkFileExists(path);
+	free(path);
+	
+	if(hasCache) {
+		Manifest *serverManifest = readServerManifestDelta(project, socket);
+		if(serverManifest == NULL) {
+			return NULL;
+		}
+		
+		ManifestTree *serverTree = buildManifestTree(serverManifest);
+		ManifestTree *localTree = buildManifestTree(localManifest);
+		DirSet *changedDirs = findChangedDirs(serverTree, localTree);
+		
+		printf("%d of %d directories differ.\n", changedDirs->count, localTree->numDirs);
+		fflush(stdout);
+		
+		freeManifest(splitManifestByDirs(serverManifest, changedDirs));
+		*unchanged = splitManifestByDirs(localManifest, changedDirs);
+		
+		freeDirSet(changedDirs);
+		freeManifestTree(localTree);
+		freeManifestTree(serverTree);
+		return serverManifest;
+	}
+	
+	// The server's tree is walked from the root, a level per request,
+	// and only below directories whose hash differs from the local one.
+	SocketBuffer *socketBuffer = createBuffer();
+	ManifestTree *localTree = buildManifestTree(localManifest);
+	DirSet *changedDirs = createDirSet();
+	DirSet *serverDirs = createDirSet();
+	
+	// Changed server directories, each level is appended.
+	char **changed = NULL;
+	int numChanged = 0, capacity = 0, failed = 0, i;
+	
+	char *root = ".";
+	char **levelDirs = &root;
+	int numLevelDirs = 1;
+	while(numLevelDirs > 0) {
+		ManifestTree *serverLevel = readServerTreeLevel(project, socket, socketBuffer, levelDirs, numLevelDirs);
+		if(serverLevel == NULL) {
+			failed = 1;
+			break;
+		}
+		
+		// Directories asked for come again, they were looked at already.
+		int levelStart = numChanged;
+		for(i = 0; i < serverLevel->numDirs; i++) {
+			DirHash *dir = &serverLevel->dirs[i];
+			if(dirSetContainsDir(serverDirs, dir->path)) {
+				continue;
+			}
+			addToDirSet(serverDirs, dir->path);
+			
+			DirHash *localDir = findDirHash(localTree, dir->path);
+			if(localDir == NULL || strcmp(localDir->hash, dir->hash) != 0) {
+				addToDirSet(changedDirs, dir->path);
+				if(numChanged == capacity) {
+					capacity = capacity == 0 ? 64 : capacity * 2;
+					changed = realloc(changed, sizeof(char *) * capacity);
+				}
+				changed[numChanged++] = strdup(dir->path);
+			}
+		}
+		freeManifestTree(serverLevel);
+		
+		levelDirs = changed + levelStart;
+		numLevelDirs = numChanged - levelStart;
+	}
+	
+	Manifest *serverEntries = NULL;
+	if(!failed) {
+		// Local only directories are under a changed parent, which the
+		// server did not list them in. Parents sort before their children.
+		for(i = 0; i < localTree->numDirs; i++) {
+			char *dir = localTree->dirs[i].path;
+			if(!dirSetContainsDir(serverDirs, dir) && dirSetContainsFile(changedDirs, dir)) {
+				addToDirSet(changedDirs, dir);
+			}
+		}
+		
+		printf("%d of %d directories differ.\n", changedDirs->count, localTree->numDirs);
+		fflush(stdout);
+		
+		// entries:<projectNameLength>:<projectName><numDirs>:<dir1Len>:<dir1>..
+		// Local only directories are not needed.
+		char *command = malloc(sizeof(char) * (strlen(project) + 50));
+		sprintf(command, "%s:%d:%s", "entries", strlen(project), project);
+		write(socket, command, strlen(command));
+		writeDirList(socket, changed, numChanged);
+		free(command);
+		
+		int bodyFd;
+		long numBytes = readSendFileResponse(socketBuffer, socket, &bodyFd);
+		if(numBytes >= 0) {
+			serverEntries = readManifestBytes(bodyFd, numBytes);
+			*unchanged = splitManifestByDirs(localManifest, changedDirs);
+			close(bodyFd);
+		}
+	}
+	
+	for(i = 0; i < numChanged; i++) {
+		free(changed[i]);
+	}
+	free(changed);
+	freeDirSet(serverDirs);
+	freeDirSet(changedDirs);
+	freeManifestTree(localTree);
+	freeSocketBuffer(socketBuffer);
+	return serverEntries;
+}
+
 //////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////
 
 // Compession required as multiple files may come.
-void checkoutProject(char *project, int socket) {
+// Files of the cached set are built from the content cache.
+void checkoutProject(char *project, int socket, HashSet *cached, int hashAlgorithm) {
 	printf("Trying to checkout Project: %s.\n", project);
 	fflush(stdout);
 	
@@ -168,16 +773,34 @@ void checkoutProject(char *project, int socket) {
 		return;
 	}
 	
+	// What came of a checkout which dropped is kept next to the project,
+	// and only the rest is asked for.
+	char *statePath = malloc(sizeof(char) * (strlen(project) + strlen(TRANSFER_FILE) + 10));
+	sprintf(statePath, ".%s%s", project, TRANSFER_FILE);
+	char *partPath = malloc(sizeof(char) * (strlen(statePath) + 10));
+	sprintf(partPath, "%s.part", statePath);
+	
+	char transferId[TRANSFER_ID_LEN + 1];
+	long offset = 0;
+	if(loadTransferId(statePath, transferId) && checkFileExists(partPath)) {
+		offset = findFileSize(partPath);
+	}
+	
 	// Make Request.
-	// checkout:<projectNameLength>:<projectName>
-	char *command = malloc(sizeof(char) * (strlen(project) + 50));;
+	// transfer:<id>:<offset>:checkout:<projectNameLength>:<projectName>
+	char *dictPath = announceDictionary(socket, project);
+	char *command = malloc(sizeof(char) * (strlen(project) + 100));;
+	sprintf(command, "transfer:%s:%ld:", transferId, offset);
+	write(socket, command, strlen(command));
+	announceSparseSpec(socket);
+	announceCachedObjects(socket, cached, hashAlgorithm);
 	sprintf(command, "%s:%d:%s", "checkout", strlen(project), project);
 	write(socket, command, strlen(command));
 	free(command);
 	
 	
 	// Server Sends back 
-	// sendfile:<compressed data bytes><compressed data>
+	// sendfile:<compressed data bytes>:<offset>:<compressed data from offset>
 	// 
 	// <numFiles>:
 	//		<File1NameLen>:<File1Name><File1LenBytes>:<File1Contents>
@@ -191,12 +814,37 @@ void checkoutProject(char *project, int socket) {
 	
 	if(strcmp(responseCode, "sendfile") == 0) {
 		
+		if(!readStagedFromSocket(socket, partPath)) {
+			printf("Connection lost after %ld bytes. Checkout again to resume.\n", findFileSize(partPath));
+			setTransferDictionary(NULL, 0);
+			free(dictPath);
+			free(statePath);
+			free(partPath);
+			free(responseCode);
+			freeSocketBuffer(socketBuffer);
+			return;
+		}
+		acknowledgeTransfer(socket, transferId);
+		
 		// REMEMBER: COMPRESSED ZLIB RESPONSE
 		char *serverRespPath = malloc(sizeof(char) * (strlen(project) + strlen(RESPONSE_FILE) + 50));
 		
 		// Now, store N bytes unencrypted into the response file.
 		sprintf(serverRespPath, "%s_%lld_%d", RESPONSE_FILE, current_timestamp_millis(), rand());
-		convertZlibToResponse(socket, serverRespPath, ".");
+		if(unstageTransfer(partPath, serverRespPath, ".") != 0) {
+			printf("Error: The checkout did not decompress. Please checkout again.\n");
+			unlink(serverRespPath);
+			unlink(partPath);
+			unlink(statePath);
+			setTransferDictionary(NULL, 0);
+			free(serverRespPath);
+			free(dictPath);
+			free(statePath);
+			free(partPath);
+			free(responseCode);
+			freeSocketBuffer(socketBuffer);
+			return;
+		}
 		
 		int responseFd = open(serverRespPath, O_RDONLY, 0777);
 		
@@ -208,15 +856,21 @@ void checkoutProject(char *project, int socket) {
 		free(numFilesStr);
 		
 		// Now read N files, and save them
-		while(numFiles-- > 0) {
-			writeFileFromSocket(responseFd, project);
+		int mismatches = receiveProjectFiles(responseFd, project, numFiles);
+		cacheServerManifestFile(project);
+		if(sparseSpec != NULL) {
+			saveSparseSpec(project, sparseSpec);
 		}
 		
 		/* Core logic ends here */
 		close(responseFd);
 		unlink(serverRespPath);
 		free(serverRespPath);
-		printf("Done.\n");
+		if(mismatches > 0) {
+			printf("Checkout done, but %d files were damaged. Please checkout again.\n", mismatches);
+		} else {
+			printf("Done.\n");
+		}
 		
 	} else {
 		printf("Project checkout failed on server.\n");		
@@ -226,18 +880,333 @@ void checkoutProject(char *project, int socket) {
 		printf("Reason: %s\n", reason);
 		free(reason);
 	}
+	unlink(partPath);
+	unlink(statePath);
+	free(statePath);
+	free(partPath);
+	setTransferDictionary(NULL, 0);
+	free(dictPath);
 	free(responseCode);
 	freeSocketBuffer(socketBuffer);
 }
 
-// Compession Not required for this step, as just single file
-// is sent over the network
-void createProject(char *project, int socket) {
-	printf("Trying to create Project: %s.\n", project);
-	fflush(stdout);
-	
-	if(checkDirectoryExists(project)) {
-		printf("Error: The project already exists locally.\n");
+// State of a shard of a parallel checkout, files of each are kept next
+// to the project with its name and the version, and the shard number.
+typedef struct CheckoutShard {
+	char *ipAddress;
+	char *port;
+	char *codec;
+	char *project;
+	char *version;
+	int shard;
+	int numShards;
+	char *statePath;    // transfer id
+	char *partPath;     // compressed response, as it comes
+	char *donePath;     // same, once all of it came
+	char *dictPath;     // dictionary sent with it
+	char *respPath;     // decompressed response
+	HashSet *cached;    // files in the content cache
+	int hashAlgorithm;
+	int status;
+	char *reason;       // why the server failed it
+} CheckoutShard;
+
+#define SHARD_DONE 0
+#define SHARD_DROPPED 1
+#define SHARD_FAILED 2
+
+// Decompresses the shard which came whole.
+void finishCheckoutShard(CheckoutShard *shard) {
+	if(unstageTransfer(shard->donePath, shard->respPath, ".") == 0) {
+		shard->status = SHARD_DONE;
+	} else {
+		shard->reason = strdup("The checkout did not decompress.");
+		shard->status = SHARD_FAILED;
+	}
+}
+
+// Fetches the shard on a connection of its own, and decompresses it.
+// A dropped one is resumed the next time.
+void *fetchCheckoutShard(void *arg) {
+	CheckoutShard *shard = (CheckoutShard *) arg;
+	shard->status = SHARD_DROPPED;
+	
+	// Came whole before, other shards did not.
+	if(checkFileExists(shard->donePath)) {
+		finishCheckoutShard(shard);
+		return NULL;
+	}
+	
+	int socket = try_open_connection(get_sockaddr(shard->ipAddress, shard->port));
+	if(socket < 0) {
+		return NULL;
+	}
+	keepConnectionAlive(socket);
+	negotiateCodec(socket, shard->codec);
+	
+	char transferId[TRANSFER_ID_LEN + 1];
+	long offset = 0;
+	if(loadTransferId(shard->statePath, transferId) && checkFileExists(shard->partPath)) {
+		offset = findFileSize(shard->partPath);
+	}
+	
+	// There is no cached dictionary yet, server sends its one.
+	// transfer:<id>:<offset>:checkoutshard:<projectNameLength>:<projectName><version>:<shard>:<numShards>:
+	char *command = malloc(sizeof(char) * (strlen(shard->project) + strlen(shard->version) + 200));
+	sprintf(command, "dictionary:0:transfer:%s:%ld:", transferId, offset);
+	write(socket, command, strlen(command));
+	announceSparseSpec(socket);
+	announceCachedObjects(socket, shard->cached, shard->hashAlgorithm);
+	sprintf(command, "checkoutshard:%d:%s%s:%d:%d:", (int) strlen(shard->project), shard->project,
+		shard->version, shard->shard, shard->numShards);
+	write(socket, command, strlen(command));
+	free(command);
+	setTransferDictionary(shard->dictPath, 0);
+	
+	SocketBuffer *socketBuffer = createBuffer();
+	readTillDelimiter(socketBuffer, socket, ':');
+	char *responseCode = readAllBuffer(socketBuffer);
+	
+	if(strcmp(responseCode, "sendfile") == 0) {
+		if(readStagedFromSocket(socket, shard->partPath)) {
+			acknowledgeTransfer(socket, transferId);
+			rename(shard->partPath, shard->donePath);
+			finishCheckoutShard(shard);
+		}
+	} else if(strlen(responseCode) > 0) {
+		readTillDelimiter(socketBuffer, socket, ':');
+		shard->reason = readAllBuffer(socketBuffer);
+		shard->status = SHARD_FAILED;
+	}
+	
+	setTransferDictionary(NULL, 0);
+	free(responseCode);
+	freeSocketBuffer(socketBuffer);
+	close(socket);
+	return NULL;
+}
+
+// Removes the files of the shard, but the decompressed response.
+void removeShardFiles(CheckoutShard *shard) {
+	unlink(shard->statePath);
+	unlink(shard->partPath);
+	unlink(shard->donePath);
+	unlink(shard->dictPath);
+}
+
+// Checkout over numConnections connections. The files are split in
+// shards of about the same bytes on the server, each is fetched on a
+// connection of its own, and they are saved and checked against the
+// manifest once all came. Small projects go over the one connection.
+void checkoutProjectParallel(char *project, int socket, char *ipAddress, char *port, char *codec, int numConnections) {
+	
+	// Check if project already exists locally, then fail.
+	if(checkDirectoryExists(project)) {
+		printf("Error: The project already exists locally.\n");
+		return;
+	}
+	
+	// Current manifest of the server, shards must be of its version.
+	// currentversion:<projectNameLength>:<projectName>
+	char *command = malloc(sizeof(char) * (strlen(project) + 50));
+	sprintf(command, "%s:%d:%s", "currentversion", strlen(project), project);
+	write(socket, command, strlen(command));
+	free(command);
+	
+	SocketBuffer *socketBuffer = createBuffer();
+	readTillDelimiter(socketBuffer, socket, ':');
+	char *responseCode = readAllBuffer(socketBuffer);
+	
+	if(strcmp(responseCode, "sendfile") != 0) {
+		printf("Project checkout failed on server.\n");		
+		readTillDelimiter(socketBuffer, socket, ':');
+		char *reason = readAllBuffer(socketBuffer);
+		printf("ResponseCode: %s\n", responseCode);
+		printf("Reason: %s\n", reason);
+		free(reason);
+		free(responseCode);
+		freeSocketBuffer(socketBuffer);
+		return;
+	}
+	free(responseCode);
+	
+	int bodyFd = openBodyFromSocket(socket, ".");
+	
+	// ignore numFiles
+	readTillDelimiter(socketBuffer, bodyFd, ':');
+	clearSocketBuffer(socketBuffer);
+	long numBytes = readFileHeaderFromSocket(socketBuffer, bodyFd);
+	Manifest *serverManifest = readManifestBytes(bodyFd, numBytes);
+	close(bodyFd);
+	freeSocketBuffer(socketBuffer);
+	
+	// Only files in a sparse checkout come.
+	long numWanted = 0;
+	ManifestNode *node = serverManifest->head;
+	while(node != NULL) {
+		numWanted += isInSparseSpec(sparseSpec, node->filePath);
+		node = node->next;
+	}
+	
+	// Files in the content cache are not downloaded.
+	char *cacheDir = objectCacheDir(project);
+	setObjectStore(cacheDir, 0);
+	HashSet *cached = findCachedObjects(serverManifest);
+	if(cached->count > 0) {
+		printf("%ld of %ld files are in the cache.\n", cached->count, numWanted);
+	}
+	
+	int numShards = numConnections;
+	if(numShards > MAX_CHECKOUT_SHARDS) {
+		numShards = MAX_CHECKOUT_SHARDS;
+	}
+	if(numShards > numWanted) {
+		numShards = numWanted;
+	}
+	if(numShards <= 1) {
+		checkoutProject(project, socket, cached, serverManifest->hashAlgorithm);
+		trimObjectStore(OBJECT_CACHE_MAX_BYTES);
+		setObjectStore(NULL, 0);
+		free(cacheDir);
+		freeHashSet(cached);
+		freeManifest(serverManifest);
+		return;
+	}
+	
+	printf("Trying to checkout Project: %s over %d connections.\n", project, numShards);
+	fflush(stdout);
+	
+	CheckoutShard *shards = calloc(numShards, sizeof(CheckoutShard));
+	pthread_t *tid = malloc(sizeof(pthread_t) * numShards);
+	int i;
+	for(i = 0; i < numShards; i++) {
+		CheckoutShard *shard = &shards[i];
+		shard->ipAddress = ipAddress;
+		shard->port = port;
+		shard->codec = codec;
+		shard->project = project;
+		shard->version = serverManifest->versionNumber;
+		shard->shard = i;
+		shard->numShards = numShards;
+		shard->cached = cached;
+		shard->hashAlgorithm = serverManifest->hashAlgorithm;
+		
+		shard->statePath = malloc(sizeof(char) * (strlen(project) + strlen(TRANSFER_FILE) + strlen(shard->version) + 50));
+		sprintf(shard->statePath, ".%s%s.v%s.%dof%d", project, TRANSFER_FILE, shard->version, i, numShards);
+		shard->partPath = malloc(sizeof(char) * (strlen(shard->statePath) + 20));
+		sprintf(shard->partPath, "%s.part", shard->statePath);
+		shard->donePath = malloc(sizeof(char) * (strlen(shard->statePath) + 20));
+		sprintf(shard->donePath, "%s.done", shard->statePath);
+		shard->dictPath = malloc(sizeof(char) * (strlen(shard->statePath) + 20));
+		sprintf(shard->dictPath, "%s%s", shard->statePath, DICTIONARY_FILE);
+		shard->respPath = malloc(sizeof(char) * (strlen(RESPONSE_FILE) + 50));
+		sprintf(shard->respPath, "%s_%lld_%d", RESPONSE_FILE, current_timestamp_millis(), rand());
+		
+		if(pthread_create(&tid[i], NULL, fetchCheckoutShard, shard) != 0) {
+			fetchCheckoutShard(shard);
+			tid[i] = 0;
+		}
+	}
+	
+	int dropped = 0;
+	CheckoutShard *failed = NULL;
+	for(i = 0; i < numShards; i++) {
+		if(tid[i] != 0) {
+			pthread_join(tid[i], NULL);
+		}
+		if(shards[i].status == SHARD_DROPPED) {
+			dropped++;
+		} else if(shards[i].status == SHARD_FAILED && failed == NULL) {
+			failed = &shards[i];
+		}
+	}
+	
+	if(failed != NULL) {
+		printf("Project checkout failed on server.\n");		
+		printf("Reason: %s\n", failed->reason);
+		for(i = 0; i < numShards; i++) {
+			removeShardFiles(&shards[i]);
+		}
+	} else if(dropped > 0) {
+		printf("Connection lost on %d of %d connections. Checkout again to resume.\n", dropped, numShards);
+		
+	} else {
+		// Shard 0 has the .manifest first, which the others are checked with.
+		int *fds = malloc(sizeof(int) * numShards);
+		long *numFiles = malloc(sizeof(long) * numShards);
+		long total = 0;
+		socketBuffer = createBuffer();
+		for(i = 0; i < numShards; i++) {
+			fds[i] = open(shards[i].respPath, O_RDONLY, 0777);
+			readTillDelimiter(socketBuffer, fds[i], ':');
+			char *numFilesStr = readAllBuffer(socketBuffer);
+			numFiles[i] = atol(numFilesStr);
+			total += numFiles[i];
+			free(numFilesStr);
+		}
+		freeSocketBuffer(socketBuffer);
+		
+		int mismatches = receiveProjectShards(fds, numFiles, numShards, project);
+		cacheServerManifestFile(project);
+		if(sparseSpec != NULL) {
+			saveSparseSpec(project, sparseSpec);
+		}
+		
+		// Every shard sent the same dictionary.
+		char *path = malloc(sizeof(char) * (strlen(project) + strlen(DICTIONARY_FILE) + 5));
+		sprintf(path, "%s/%s", project, DICTIONARY_FILE);
+		rename(shards[0].dictPath, path);
+		free(path);
+		
+		for(i = 0; i < numShards; i++) {
+			close(fds[i]);
+			removeShardFiles(&shards[i]);
+		}
+		free(numFiles);
+		free(fds);
+		
+		// Shards of earlier versions, which never completed.
+		char *prefix = malloc(sizeof(char) * (strlen(project) + strlen(TRANSFER_FILE) + 5));
+		sprintf(prefix, ".%s%s.v", project, TRANSFER_FILE);
+		deleteFilesWithPrefix(".", prefix);
+		free(prefix);
+		
+		// .manifest and each file of it came once.
+		if(total != numWanted + 1) {
+			printf("Checkout done, but %ld of %ld files came. Please checkout again.\n", total - 1, numWanted);
+		} else if(mismatches > 0) {
+			printf("Checkout done, but %d files were damaged. Please checkout again.\n", mismatches);
+		} else {
+			printf("Done.\n");
+		}
+	}
+	
+	for(i = 0; i < numShards; i++) {
+		unlink(shards[i].respPath);
+		free(shards[i].statePath);
+		free(shards[i].partPath);
+		free(shards[i].donePath);
+		free(shards[i].dictPath);
+		free(shards[i].respPath);
+		free(shards[i].reason);
+	}
+	free(shards);
+	free(tid);
+	trimObjectStore(OBJECT_CACHE_MAX_BYTES);
+	setObjectStore(NULL, 0);
+	free(cacheDir);
+	freeHashSet(cached);
+	freeManifest(serverManifest);
+}
+
+// Compession Not required for this step, as just single file
+// is sent over the network
+void createProject(char *project, int socket) {
+	printf("Trying to create Project: %s.\n", project);
+	fflush(stdout);
+	
+	if(checkDirectoryExists(project)) {
+		printf("Error: The project already exists locally.\n");
 		return;
 	}
 	
@@ -263,15 +1232,17 @@ void createProject(char *project, int socket) {
 	char *responseCode = readAllBuffer(socketBuffer);
 	
 	if(strcmp(responseCode, "sendfile") == 0) {
-		readTillDelimiter(socketBuffer, socket, ':');
+		int bodyFd = openBodyFromSocket(socket, ".");
+		readTillDelimiter(socketBuffer, bodyFd, ':');
 		char *numFilesStr = readAllBuffer(socketBuffer);
 		long numFiles = atol(numFilesStr);
 		
 		// Now read N files, and save them
 		// BTW, for create case, only 1 file of manifest will come.
 		while(numFiles-- > 0) {
-			writeFileFromSocket(socket, project);
+			writeFileFromSocket(bodyFd, project);
 		}
+		close(bodyFd);
 		printf("Done.\n");
 		free(numFilesStr);
 		
@@ -325,9 +1296,161 @@ void destroyProject(char *project, int socket) {
 	free(responseCode);
 }
 
+typedef struct FileList {
+	char **paths;
+	int count;
+	int capacity;
+} FileList;
+
+void addToFileList(FileList *list, char *path) {
+	if(list->count == list->capacity) {
+		list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+		list->paths = realloc(list->paths, sizeof(char *) * list->capacity);
+	}
+	list->paths[list->count++] = path;
+}
+
+void freeFileList(FileList *list) {
+	int i;
+	for(i = 0; i < list->count; i++) {
+		free(list->paths[i]);
+	}
+	free(list->paths);
+}
+
+int isGlobPattern(char *arg) {
+	return strpbrk(arg, "*?[") != NULL;
+}
+
+// Recursively collect regular files under the directory, opened as dirFd.
+// relDir is the path of this directory relative to project, "" for project itself.
+// Paths are matched with fnmatch if pattern is given, wildcards do not
+// match '/'.
+void walkProjectDirectory(int dirFd, char *relDir, char *pattern, FileList *list) {
+	DIR *d = fdopendir(dirFd);
+	if(d == NULL) {
+		close(dirFd);
+		return;
+	}
+	
+	struct dirent *entry;
+	while((entry = readdir(d)) != NULL) {
+		char *name = entry->d_name;
+		if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
+		}
+		
+		// .manifest, .update etc. at the project root are not project files.
+		if(relDir[0] == '\0' && name[0] == '.') {
+			continue;
+		}
+		
+		struct stat st;
+		if(fstatat(dirfd(d), name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			continue;
+		}
+		
+		char *relPath = malloc(sizeof(char) * (strlen(relDir) + strlen(name) + 2));
+		if(relDir[0] == '\0') {
+			strcpy(relPath, name);
+		} else {
+			sprintf(relPath, "%s/%s", relDir, name);
+		}
+		
+		if(S_ISDIR(st.st_mode)) {
+			int childFd = openat(dirfd(d), name, O_RDONLY | O_DIRECTORY);
+			if(childFd >= 0) {
+				walkProjectDirectory(childFd, relPath, pattern, list);
+			}
+			free(relPath);
+			
+		} else if(S_ISREG(st.st_mode) && (pattern == NULL || fnmatch(pattern, relPath, FNM_PATHNAME) == 0)) {
+			addToFileList(list, relPath);
+			
+		} else {
+			free(relPath);
+		}
+	}
+	
+	closedir(d);
+}
+
+// Expand one add argument into project relative file paths.
+// The argument can be a file, a directory (added recursively) or
+// a glob pattern like 'src/*.c' (quoted, so that shell does not expand it).
+// As in the shell, a wildcard matches within one directory: 'src/*.c' is
+// the .c files directly in src, 'src/*/*.c' those one level below.
+void collectFilesToAdd(char *project, char *arg, FileList *list) {
+	int projectFd = open(project, O_RDONLY | O_DIRECTORY);
+	if(projectFd < 0) {
+		return;
+	}
+	
+	// Only walk the directory part before the first wildcard.
+	char *walkDir = strdup(arg);
+	char *pattern = NULL;
+	if(isGlobPattern(arg)) {
+		pattern = arg;
+		char *slash = NULL;
+		char *c = walkDir;
+		while(*c && strchr("*?[", *c) == NULL) {
+			if(*c == '/') {
+				slash = c;
+			}
+			c++;
+		}
+		if(slash == NULL) {
+			walkDir[0] = '\0';
+		} else {
+			*slash = '\0';
+		}
+	}
+	
+	// strip trailing slashes of a directory argument.
+	int len = strlen(walkDir);
+	while(len > 0 && walkDir[len - 1] == '/') {
+		walkDir[--len] = '\0';
+	}
+	
+	struct stat st;
+	if(walkDir[0] == '\0') {
+		walkProjectDirectory(projectFd, "", pattern, list);
+		projectFd = -1; // closed by walk
+		
+	} else if(fstatat(projectFd, walkDir, &st, 0) != 0) {
+		printf("Error: File does not exist locally in project.\n");
+		printf("Unable to find: %s/%s\n", project, arg);
+		
+	} else if(S_ISDIR(st.st_mode)) {
+		int dirFd = openat(projectFd, walkDir, O_RDONLY | O_DIRECTORY);
+		if(dirFd >= 0) {
+			walkProjectDirectory(dirFd, walkDir, pattern, list);
+		}
+		
+	} else if(pattern == NULL) {
+		addToFileList(list, strdup(arg));
+	}
+	
+	if(projectFd >= 0) {
+		close(projectFd);
+	}
+	free(walkDir);
+}
+
+// Above this many files, it is cheaper to write .manifest once, than
+// appending the records to the journal.
+#define BULK_ADD_THRESHOLD 256
+
 // Compession Not required for this step, as no file
 // is sent over the network
-void addFileToProject(char *project, char *filePath) {
+//
+// Files are not written in .manifest directly. One record per file is
+// appended to the manifest journal, so adding many files does not rewrite
+// the manifest again and again. The journal is folded at commit time.
+//
+// Arguments can be files, directories or glob patterns. New files are
+// hashed in parallel. For bulk imports, .manifest is written once instead.
+void addFilesToProject(char *project, char **args, int numArgs) {
 	// This command, just makes the changes to local manifest
 	
 	// Check if project exists
@@ -336,61 +1459,137 @@ void addFileToProject(char *project, char *filePath) {
 		return;
 	}
 	
-	char *path = malloc(sizeof(char) * (strlen(project) + 50));
+	Manifest *manifest = readClientProjectManifest(project);
 	
-	// check if given file exists
-	sprintf(path, "%s/%s", project, filePath);
-	if(!checkFileExists(path)) {
-		printf("Error: File does not exist locally in project.\n");
-		printf("Unable to find: %s\n", path);
-		free(path);
-		return;
+	FileList files = {NULL, 0, 0};
+	int i;
+	for(i = 0; i < numArgs; i++) {
+		collectFilesToAdd(project, args[i], &files);
 	}
 	
-	// check if project directory contains manifest
-	sprintf(path, "%s/%s", project, MANIFEST_FILE);
-	
-	// Make changes to manifest
-	int manifestFd = open(path, O_RDONLY, 0777);
-	Manifest *manifest = readManifestContents(manifestFd);
-	ManifestNode *manifestNode = searchFile(manifest, filePath);
-	close(manifestFd);
-	
-	char buffer[100];
+	// Keep only files not in manifest yet.
+	FileList newFiles = {NULL, 0, 0};
+	ManifestNode **newNodes = malloc(sizeof(ManifestNode *) * (files.count + 1));
+	for(i = 0; i < files.count; i++) {
+		if(searchFile(manifest, files.paths[i]) != NULL) {
+			printf("File is already present in manifest: %s\n", files.paths[i]);
+			free(files.paths[i]);
+			continue;
+		}
+		
+		// Also keep it in manifest, in case same file is given twice.
+		addFileToManifest(manifest, strdup("-"), strdup("1"), strdup(files.paths[i]));
+		newNodes[newFiles.count] = manifest->tail;
+		addToFileList(&newFiles, files.paths[i]);
+	}
+	free(files.paths);
+	
+	// Hash all new files on worker threads.
+	char **fullPaths = malloc(sizeof(char *) * (newFiles.count + 1));
+	char **hashes = malloc(sizeof(char *) * (newFiles.count + 1));
+	for(i = 0; i < newFiles.count; i++) {
+		fullPaths[i] = malloc(sizeof(char) * (strlen(project) + strlen(newFiles.paths[i]) + 2));
+		sprintf(fullPaths[i], "%s/%s", project, newFiles.paths[i]);
+		hashes[i] = malloc(sizeof(char) * (HASH_STRING_LEN + 1));
+	}
 	
-	sprintf(path, "%s/%s", project, filePath);
-	computeFileHash(path, buffer);
-	buffer[HASH_STRING_LEN] = '\0';
+	// Stat before hashing, so a change during hashing is seen next time.
+	struct stat *stats = malloc(sizeof(struct stat) * (newFiles.count + 1));
+	for(i = 0; i < newFiles.count; i++) {
+		if(stat(fullPaths[i], &stats[i]) != 0) {
+			stats[i].st_ino = 0;
+		}
+	}
+	computeFileHashes(fullPaths, hashes, newFiles.count, manifest->hashAlgorithm);
+	
+	// Files which could not be read have no hash, they are not added.
+	int numHashed = 0;
+	for(i = 0; i < newFiles.count; i++) {
+		if(strlen(hashes[i]) != HASH_STRING_LEN) {
+			printf("Error: Could not read %s, it is not added.\n", newFiles.paths[i]);
+			removeFileFromManifest(manifest, newFiles.paths[i]);
+			free(newFiles.paths[i]);
+			free(fullPaths[i]);
+			free(hashes[i]);
+			continue;
+		}
+		newFiles.paths[numHashed] = newFiles.paths[i];
+		newNodes[numHashed] = newNodes[i];
+		fullPaths[numHashed] = fullPaths[i];
+		hashes[numHashed] = hashes[i];
+		stats[numHashed] = stats[i];
+		numHashed++;
+	}
+	newFiles.count = numHashed;
 	
-	char *md5 = strdup(buffer);
+	// Record the hashes, so commit does not read these files again.
+	fileIndex = loadFileIndex(project, manifest->hashAlgorithm);
+	for(i = 0; i < newFiles.count; i++) {
+		if(stats[i].st_ino != 0) {
+			updateFileIndex(fileIndex, newFiles.paths[i], &stats[i], hashes[i]);
+		}
+	}
+	saveFileIndex(fileIndex, 0);
+	freeFileIndex(fileIndex);
+	fileIndex = NULL;
+	free(stats);
 	
-	// start with version 1.
-	char *version = strdup("1");
+	char *path = malloc(sizeof(char) * (strlen(project) + 50));
 	
-	if(manifestNode == NULL) {		
-		addFileToManifest(manifest, md5, version, strdup(filePath));
+	if(newFiles.count >= BULK_ADD_THRESHOLD) {
+		// Put the real hashes in manifest, and write it once.
+		for(i = 0; i < newFiles.count; i++) {
+			free(newNodes[i]->md5);
+			newNodes[i]->md5 = strdup(hashes[i]);
+		}
 		
-		// Reopen the file, and put changes.
-		sprintf(path, "%s/%s", project, MANIFEST_FILE);
-		createDirStructureIfNeeded(path);
-		manifestFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+		sprintf(path, "%s/%s.tmp", project, MANIFEST_FILE);
+		int manifestFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
 		writeManifestToFile(manifest, manifestFd);
 		close(manifestFd);
-		printf("File added to manifest.\n");
 		
-	} else {
-		printf("File is already present in manifest\n");
+		char *manifestPath = malloc(sizeof(char) * (strlen(project) + 50));
+		sprintf(manifestPath, "%s/%s", project, MANIFEST_FILE);
+		rename(path, manifestPath);
+		free(manifestPath);
+		
+		// Journal records are part of written manifest now.
+		clearManifestJournal(project);
+		
+	} else if(newFiles.count > 0) {
+		// Records are buffered, and appended in few writes.
+		sprintf(path, "%s/%s", project, MANIFEST_LOG_FILE);
+		FILE *journal = fopen(path, "a");
+		for(i = 0; i < newFiles.count; i++) {
+			// start with version 1.
+			fprintf(journal, "A 1 %s %s\n", hashes[i], newFiles.paths[i]);
+		}
+		fclose(journal);
 	}
 	
+	if(files.count == 1 && newFiles.count == 1) {
+		printf("File added to manifest.\n");
+	} else if(files.count > 1) {
+		printf("%d files added to manifest.\n", newFiles.count);
+	}
 	
+	for(i = 0; i < newFiles.count; i++) {
+		free(fullPaths[i]);
+		free(hashes[i]);
+	}
+	free(fullPaths);
+	free(hashes);
+	free(newNodes);
 	free(path);
+	freeFileList(&newFiles);
 	freeManifest(manifest);
 }
 
 
 // Compession Not required for this step, as no file
 // is sent over the network
-void removeFileInProject(char *project, char *filePath) {
+// Same as add, only a journal record is appended for each file.
+void removeFilesInProject(char *project, char **filePaths, int numFiles) {
 	// This command, just makes the changes to local manifest
 	
 	// Check if project exists
@@ -399,29 +1598,41 @@ void removeFileInProject(char *project, char *filePath) {
 		return;
 	}
 	
-	char *path = malloc(sizeof(char) * (strlen(project) + 50));
+	Manifest *manifest = readClientProjectManifest(project);
+	
+	char *journalPath = malloc(sizeof(char) * (strlen(project) + 50));
+	sprintf(journalPath, "%s/%s", project, MANIFEST_LOG_FILE);
+	FILE *journal = NULL;
+	int removed = 0;
+	int i;
+	
+	for(i = 0; i < numFiles; i++) {
+		char *filePath = filePaths[i];
 		
-	// check if project directory contains manifest
-	sprintf(path, "%s/%s", project, MANIFEST_FILE);
-	if(!checkFileExists(path)) {
-		printf("Error: Please create project first.\n");
-		free(path);
-		return;
+		if(searchFile(manifest, filePath) == NULL) {
+			printf("File is not present in manifest: %s\n", filePath);
+			continue;
+		}
+		removeFileFromManifest(manifest, filePath);
+		
+		if(journal == NULL) {
+			journal = fopen(journalPath, "a");
+		}
+		fprintf(journal, "R 0 0 %s\n", filePath);
+		removed++;
 	}
 	
-	// Make changes to manifest
-	int manifestFd = open(path, O_RDONLY, 0777);
-	Manifest *manifest = readManifestContents(manifestFd);
-	removeFileFromManifest(manifest, filePath);
-	close(manifestFd);
+	if(journal != NULL) {
+		fclose(journal);
+	}
 	
-	createDirStructureIfNeeded(path);
-	manifestFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
-	writeManifestToFile(manifest, manifestFd);
-	close(manifestFd);
-	printf("File removed from manifest.\n");
+	if(numFiles == 1 && removed == 1) {
+		printf("File removed from manifest.\n");
+	} else if(numFiles > 1) {
+		printf("%d files removed from manifest.\n", removed);
+	}
 	
-	free(path);
+	free(journalPath);
 	freeManifest(manifest);
 }
 
@@ -453,15 +1664,16 @@ void getProjectCurrentVersion(char *project, int socket) {
 	char *responseCode = readAllBuffer(socketBuffer);
 	
 	if(strcmp(responseCode, "sendfile") == 0) {	
+		int bodyFd = openBodyFromSocket(socket, ".");
 		
-		// ignore till numBytes
-		readTillDelimiter(socketBuffer, socket, ':');
-		readTillDelimiter(socketBuffer, socket, ':');
-		readTillDelimiter(socketBuffer, socket, ':');
+		// ignore numFiles
+		readTillDelimiter(socketBuffer, bodyFd, ':');
 		clearSocketBuffer(socketBuffer);
 		
 		// First download the server manifest.
-		Manifest *serverManifest = readManifestContents(socket);
+		long numBytes = readFileHeaderFromSocket(socketBuffer, bodyFd);
+		Manifest *serverManifest = readManifestBytes(bodyFd, numBytes);
+		close(bodyFd);
 		
 		// Just iterate on manifest and show contents.
 		printf("Project: %s\n", serverManifest->projectName);
@@ -516,17 +1728,16 @@ void getProjectHistory(char *project, int socket) {
 	char *responseCode = readAllBuffer(socketBuffer);
 	
 	if(strcmp(responseCode, "ok") == 0) {
+		int bodyFd = openBodyFromSocket(socket, ".");
 		
-		readTillDelimiter(socketBuffer, socket, ':');
+		readTillDelimiter(socketBuffer, bodyFd, ':');
 		char *contentLenStr = readAllBuffer(socketBuffer);
 		long contentLen = atol(contentLenStr);
 		
 		// Now read contentLen chars and display
-		while(contentLen-- > 0) {
-			char c;
-			read(socket, &c, 1);
-			printf("%c", c);
-		}
+		fflush(stdout);
+		writeNBytesToFile(contentLen, bodyFd, STDOUT_FILENO);
+		close(bodyFd);
 		
 		free(contentLenStr);
 		printf("Done.\n");
@@ -591,8 +1802,8 @@ void rollbackProject(char *project, char *version, int socket) {
 // Compession Not required for this step, as just single file
 // is sent over the network
 void createUpdateFile(char *project, int socket) {
-	// Issue command for server to create project.
-	// IF successul, server sends back manifest.
+	// Compare directory hashes with server, and get only the manifest
+	// entries of directories which differ.
 	printf("Trying to create .update files: %s\n", project);
 	fflush(stdout);
 	
@@ -605,40 +1816,18 @@ void createUpdateFile(char *project, int socket) {
 	}
 	
 	char *path = malloc(sizeof(char) * (strlen(project) + 50));
-	sprintf(path, "%s/%s", project, MANIFEST_FILE);
-	
-	
-	// Make Request.
-	// update:<projectNameLength>:<projectName>
-	char *command = malloc(sizeof(char) * (strlen(project) + 50));;
-	sprintf(command, "%s:%d:%s", "update", strlen(project), project);
-	write(socket, command, strlen(command));
-	free(command);
 	
-	// Server responds back
-	// sendfile:<ManifestNameLen>:<manifest name><numBytes>:<contents>
-	// ..
+	// Server responds back to treelevel and entries requests with
+	// sendfile:<FileNameLen>:<file name><numBytes>:<contents>
 	// In case of error, Response comes as "failed:<fail Reason>:"
+	Manifest *localManifest = readClientProjectManifest(project);
+	Manifest *unchangedManifest = NULL;
+	Manifest *serverManifest = readChangedServerEntries(project, socket, localManifest, &unchangedManifest);
 	
-	SocketBuffer *socketBuffer = createBuffer();
-	
-	readTillDelimiter(socketBuffer, socket, ':');
-	char *responseCode = readAllBuffer(socketBuffer);
-	
-	if(strcmp(responseCode, "sendfile") == 0) {
-		
-		// ignore till numBytes
-		readTillDelimiter(socketBuffer, socket, ':');
-		readTillDelimiter(socketBuffer, socket, ':');
-		clearSocketBuffer(socketBuffer);
-		
-		// First download the server manifest.
-		Manifest *serverManifest = readManifestContents(socket);
-		
-		sprintf(path, "%s/%s", project, MANIFEST_FILE);
-		int manifestFd = open(path, O_RDONLY, 0777);
-		Manifest *localManifest = readManifestContents(manifestFd);
-		close(manifestFd);
+	if(serverManifest != NULL) {
+		SocketBuffer *socketBuffer = createBuffer();
+		fileIndex = loadFileIndex(project, localManifest->hashAlgorithm);
+		loadWatcherDirtySet(fileIndex);
 		
 		// Now compare both manifests.
 		printf("Comparing manifests.\n");
@@ -658,8 +1847,6 @@ void createUpdateFile(char *project, int socket) {
 			close(updateFd);
 			updateFd = open(path, O_RDONLY, 0777);
 			
-			clearSocketBuffer(socketBuffer);
-			
 			while(1) {
 				readTillDelimiter(socketBuffer, updateFd, ' ');
 				char *code = readAllBuffer(socketBuffer);
@@ -687,21 +1874,16 @@ void createUpdateFile(char *project, int socket) {
 		
 		printf("Done.\n");
 		
-		freeManifest(serverManifest);
-		freeManifest(localManifest);
+		saveFileIndex(fileIndex, 0);
+		freeFileIndex(fileIndex);
+		fileIndex = NULL;
 		
-	} else {
-		printf("Server sent error message.\n");		
-		readTillDelimiter(socketBuffer, socket, ':');
-		char *reason = readAllBuffer(socketBuffer);
-		printf("ResponseCode: %s\n", responseCode);
-		printf("Reason: %s\n", reason);
-		free(reason);
+		freeSocketBuffer(socketBuffer);
+		freeManifest(unchangedManifest);
+		freeManifest(serverManifest);
 	}
 	
-	// Now delete the manifest, and its contents
-	free(responseCode);
-	freeSocketBuffer(socketBuffer);
+	freeManifest(localManifest);
 	free(path);
 }
 
@@ -734,7 +1916,23 @@ void upgradeProject(char *project, int socket) {
 	// First process entries for deleting the files locally
 	int updateFd = open(path, O_RDONLY, 0777);
 	
+	// Big modified files are sent as changes against our copies.
+	FileList modified = { NULL, 0, 0 };
+	
+	// Deleted files are removed after the upgrade, their chunks can
+	// still be used by the files which come.
+	FileList deleted = { NULL, 0, 0 };
+	
+	// Old copies of deleted and modified files are kept in the content
+	// cache, files which come with a hash kept there are not sent.
+	Manifest *clientManifest = readClientProjectManifest(project);
+	char *cacheDir = objectCacheDir(project);
+	setObjectStore(cacheDir, 0);
+	char *cachedHashes = NULL;
+	long numCached = 0, cachedCapacity = 0;
+	
 	int filesProcessed = 0;
+	long numExpected = 0;
 	while(1) {
 		readTillDelimiter(socketBuffer, updateFd, ' ');
 		char *code = readAllBuffer(socketBuffer);
@@ -743,23 +1941,43 @@ void upgradeProject(char *project, int socket) {
 			break;
 		}
 		
-		// ignore file version and new hash
-		readTillDelimiter(socketBuffer, updateFd, ' ');
+		// ignore file version, keep hash
 		readTillDelimiter(socketBuffer, updateFd, ' ');
 		clearSocketBuffer(socketBuffer);
+		readTillDelimiter(socketBuffer, updateFd, ' ');
+		char *hash = readAllBuffer(socketBuffer);
 		
 		readTillDelimiter(socketBuffer, updateFd, '\n');
 		char *filePath = readAllBuffer(socketBuffer);
+		char *fullPath = malloc(sizeof(char) * (strlen(project) + strlen(filePath) + 2));
+		sprintf(fullPath, "%s/%s", project, filePath);
 		
 		// We now have fileCode and filePath from UPDATE_FILE
+		// D entries have the hash of our copy, others the new hash.
 		if(strcmp(code, "D") == 0) {
 			filesProcessed++;
-						
-			char *fullPath = malloc(sizeof(char) * (strlen(project) + strlen(filePath) + 50));
-			sprintf(fullPath, "%s/%s", project, filePath);
-			unlink(fullPath);
-			free(fullPath);
+			addToFileList(&deleted, strdup(filePath));
+			keepObject(fullPath, clientManifest->hashAlgorithm, hash);
+		} else if(strcmp(code, "M") == 0) {
+			addToFileList(&modified, strdup(filePath));
+			ManifestNode *node = searchFile(clientManifest, filePath);
+			if(node != NULL) {
+				keepObject(fullPath, clientManifest->hashAlgorithm, node->md5);
+			}
+		}
+		
+		if(strcmp(code, "D") != 0) {
+			numExpected++;
 		}
+		if(strcmp(code, "D") != 0 && hasObject(clientManifest->hashAlgorithm, hash)) {
+			if(numCached == cachedCapacity) {
+				cachedCapacity = cachedCapacity == 0 ? 1024 : cachedCapacity * 2;
+				cachedHashes = realloc(cachedHashes, cachedCapacity * HASH_STRING_LEN + 1);
+			}
+			memcpy(cachedHashes + numCached++ * HASH_STRING_LEN, hash, HASH_STRING_LEN);
+		}
+		free(fullPath);
+		free(hash);
 		free(code);
 		free(filePath);
 	}	
@@ -780,16 +1998,53 @@ void upgradeProject(char *project, int socket) {
 	// In case of error, Response comes as "failed:<fail Reason>:"
 	
 	// Make Request.
+	char *dictPath = announceDictionary(socket, project);
+	announceSparseSpec(socket);
 	char *command = malloc(sizeof(char) * (strlen(project) + 50));
 	sprintf(command, "%s:%d:%s", "upgrade", strlen(project), project);
 	write(socket, command, strlen(command));
-	writeFileDetailsToSocket(UPDATE_FILE, project, socket); // defined in util.h
 	free(command);
 	
+	char *bodyPath;
+	int bodyFd = createBodyFile(project, &bodyPath);
+	writeFileDetailsToSocket(UPDATE_FILE, project, bodyFd); // defined in util.h
+	if(isTransferNegotiated()) {
+		writeSignaturesToSocket(modified.paths, modified.count, project, bodyFd);
+		
+		// Chunks of all our big files, server sends only the others.
+		FileList tracked = { NULL, 0, 0 };
+		ManifestNode *node = clientManifest->head;
+		while(node != NULL) {
+			if(isChunkedFile(project, node->filePath)) {
+				addToFileList(&tracked, strdup(node->filePath));
+			}
+			node = node->next;
+		}
+		HashSet *haveChunks = chunkFiles(project, tracked.paths, tracked.count);
+		writeHashSet(haveChunks, bodyFd);
+		freeHashSet(haveChunks);
+		freeFileList(&tracked);
+		
+		// Then the new hashes we have kept.
+		const char *algorithm = hashAlgorithmName(clientManifest->hashAlgorithm);
+		write(bodyFd, algorithm, strlen(algorithm));
+		write(bodyFd, ":", 1);
+		HashSet *haveObjects = createHashSet(cachedHashes, numCached);
+		writeHashSet(haveObjects, bodyFd);
+		freeHashSet(haveObjects);
+	} else {
+		free(cachedHashes);
+	}
+	freeManifest(clientManifest);
+	close(bodyFd);
+	writeBodyToSocket(socket, bodyPath, project);
+	freeFileList(&modified);
+	
 	
 	// Read response now.	
 	readTillDelimiter(socketBuffer, socket, ':');
 	char *responseCode = readAllBuffer(socketBuffer);
+	int upgraded = 0;
 	
 	if(strcmp(responseCode, "sendfile") == 0) {
 		// REMEMBER: COMPRESSED ZLIB RESPONSE
@@ -798,7 +2053,7 @@ void upgradeProject(char *project, int socket) {
 		
 		// Now, store N bytes unencrypted into the response file.
 		sprintf(serverRespPath, "%s_%lld_%d", RESPONSE_FILE, current_timestamp_millis(), rand());
-		convertZlibToResponse(socket, serverRespPath, ".");
+		int decoded = convertZlibToResponse(socket, serverRespPath, ".") == 0;
 		
 		int responseFd = open(serverRespPath, O_RDONLY, 0777);
 		
@@ -810,17 +2065,39 @@ void upgradeProject(char *project, int socket) {
 		free(numFilesStr);
 		filesProcessed += numFiles;
 		
+		// The new .manifest comes first, it is only kept if every file
+		// of the .update came with it. Else the old files would be taken
+		// for the new version.
+		char *manifestPath = malloc(sizeof(char) * (strlen(project) + strlen(MANIFEST_FILE) + 20));
+		sprintf(manifestPath, "%s/%s", project, MANIFEST_FILE);
+		char *oldManifestPath = malloc(sizeof(char) * (strlen(manifestPath) + 20));
+		sprintf(oldManifestPath, "%s.upgrade", manifestPath);
+		copyFile(manifestPath, oldManifestPath);
+		
 		// Now read N files, and save them
-		while(numFiles-- > 0) {
-			writeFileFromSocket(responseFd, project);
-		}
+		int mismatches = receiveProjectFiles(responseFd, project, numFiles);
 		
-		// Manifest file always comes from server.
-		if(filesProcessed == 1) {
-			printf("Project Up-to-date.\n");
+		if(!decoded || numFiles != numExpected + 1 || mismatches > 0) {
+			rename(oldManifestPath, manifestPath);
+			if(mismatches > 0) {
+				printf("%d files were damaged in transfer.\n", mismatches);
+			}
+			printf("%ld of %ld files came, project is left at its version. Please upgrade again.\n",
+				numFiles > 0 ? numFiles - 1 : 0, numExpected);
 		} else {
-			printf("%d files updated.\n", filesProcessed);
+			unlink(oldManifestPath);
+			cacheServerManifestFile(project);
+			upgraded = 1;
+			
+			// Manifest file always comes from server.
+			if(filesProcessed == 1) {
+				printf("Project Up-to-date.\n");
+			} else {
+				printf("%d files updated.\n", filesProcessed);
+			}
 		}
+		free(oldManifestPath);
+		free(manifestPath);
 		/* Core logic ends here */
 		
 		close(responseFd);
@@ -838,16 +2115,197 @@ void upgradeProject(char *project, int socket) {
 	
 	printf("Done.\n");
 	
-	// Once done, delete UPDATE_FILE
-	sprintf(path, "%s/%s", project, UPDATE_FILE);
-	unlink(path);
+	int i;
+	for(i = 0; i < deleted.count && upgraded; i++) {
+		char *fullPath = malloc(sizeof(char) * (strlen(project) + strlen(deleted.paths[i]) + 2));
+		sprintf(fullPath, "%s/%s", project, deleted.paths[i]);
+		unlink(fullPath);
+		free(fullPath);
+	}
+	freeFileList(&deleted);
+	releaseChunkFiles();
+	trimObjectStore(OBJECT_CACHE_MAX_BYTES);
+	setObjectStore(NULL, 0);
+	free(cacheDir);
+	
+	// Once done, delete UPDATE_FILE. It is kept to upgrade again.
+	if(upgraded) {
+		sprintf(path, "%s/%s", project, UPDATE_FILE);
+		unlink(path);
+	}
 
 	// Now delete the manifest, and its contents
+	setTransferDictionary(NULL, 0);
+	free(dictPath);
 	free(responseCode);
 	freeSocketBuffer(socketBuffer);
 	free(path);
 }
 
+// Asks for the files (nodes of the client manifest) in one request, and
+// saves them. They are kept in the content cache too.
+// Returns the number of files which came good, -1 if server failed.
+int fetchHydrateBatch(char *project, int socket, Manifest *manifest, ManifestNode **nodes, int count) {
+	// hydrate:<projectNameLength>:<projectName><version>:<numFiles>:<File1NameLen>:<File1Name>..
+	int i, len = strlen(project) + strlen(manifest->versionNumber) + 100;
+	for(i = 0; i < count; i++) {
+		len += strlen(nodes[i]->filePath) + 20;
+	}
+	char *command = malloc(sizeof(char) * len);
+	int n = sprintf(command, "hydrate:%d:%s%s:%d:", strlen(project), project, manifest->versionNumber, count);
+	for(i = 0; i < count; i++) {
+		n += sprintf(command + n, "%d:%s", strlen(nodes[i]->filePath), nodes[i]->filePath);
+	}
+	write(socket, command, n);
+	free(command);
+	
+	// Server Sends back 
+	// sendfile:<compressed data bytes>:<compressed data>
+	// with the files like checkout, without .manifest.
+	SocketBuffer *socketBuffer = createBuffer();
+	readTillDelimiter(socketBuffer, socket, ':');
+	char *responseCode = readAllBuffer(socketBuffer);
+	int good = -1;
+	
+	if(strcmp(responseCode, "sendfile") == 0) {
+		char *serverRespPath = malloc(sizeof(char) * (strlen(RESPONSE_FILE) + 50));
+		sprintf(serverRespPath, "%s_%lld_%d", RESPONSE_FILE, current_timestamp_millis(), rand());
+		convertZlibToResponse(socket, serverRespPath, ".");
+		int responseFd = open(serverRespPath, O_RDONLY, 0777);
+		
+		readTillDelimiter(socketBuffer, responseFd, ':');
+		char *numFilesStr = readAllBuffer(socketBuffer);
+		long numFiles = atol(numFilesStr);
+		free(numFilesStr);
+		
+		char hash[HASH_STRING_LEN + 1];
+		good = 0;
+		while(numFiles-- > 0) {
+			char *filePath = receiveFileFromSocket(responseFd, project, manifest->hashAlgorithm, hash);
+			char *fullPath = malloc(sizeof(char) * (strlen(project) + strlen(filePath) + 2));
+			sprintf(fullPath, "%s/%s", project, filePath);
+			
+			ManifestNode *node = searchFile(manifest, filePath);
+			struct stat st;
+			if(node == NULL || strcmp(node->md5, hash) != 0) {
+				printf("Error: %s does not match its hash in the manifest, damaged in transfer.\n", filePath);
+				unlink(fullPath);
+			} else {
+				keepObject(fullPath, manifest->hashAlgorithm, hash);
+				if(stat(fullPath, &st) == 0) {
+					updateFileIndex(fileIndex, filePath, &st, hash);
+				}
+				good++;
+			}
+			free(fullPath);
+			free(filePath);
+		}
+		
+		close(responseFd);
+		unlink(serverRespPath);
+		free(serverRespPath);
+		
+	} else {
+		printf("Project hydrate failed on server.\n");		
+		readTillDelimiter(socketBuffer, socket, ':');
+		char *reason = readAllBuffer(socketBuffer);
+		printf("ResponseCode: %s\n", responseCode);
+		printf("Reason: %s\n", reason);
+		free(reason);
+	}
+	
+	free(responseCode);
+	freeSocketBuffer(socketBuffer);
+	return good;
+}
+
+// Fetches the files of a lazy (or sparse) checkout which match the
+// paths, as the sparse patterns do. Those in the content cache are
+// copied from it, the others are asked for in batches. Once all came,
+// the paths are included in the .sparse file, so update, upgrade and
+// commit look at them from then on.
+void hydrateProject(char *project, int socket, char **paths, int numPaths) {
+	printf("Trying to hydrate project: %s\n", project);
+	fflush(stdout);
+	
+	if(!isProjectConfiguredLocally(project)) {
+		printf("Error: Please configure the project correctly.\n");
+		return;
+	}
+	if(sparseSpec == NULL) {
+		printf("Project has all its files.\n");
+		return;
+	}
+	
+	// Spec with the paths, files which it adds are fetched.
+	SparseSpec *hydrated = createSparseSpec();
+	hydrated->lazy = sparseSpec->lazy;
+	int i;
+	for(i = 0; i < sparseSpec->count; i++) {
+		addSparsePattern(hydrated, sparseSpec->patterns[i], sparseSpec->excludes[i]);
+	}
+	for(i = 0; i < numPaths; i++) {
+		addSparsePattern(hydrated, paths[i], 0);
+	}
+	
+	Manifest *manifest = readClientProjectManifest(project);
+	fileIndex = loadFileIndex(project, manifest->hashAlgorithm);
+	char *cacheDir = objectCacheDir(project);
+	setObjectStore(cacheDir, 0);
+	
+	ManifestNode **wanted = malloc(sizeof(ManifestNode *) * (manifest->numFiles > 0 ? manifest->numFiles : 1));
+	int numWanted = 0, numCached = 0;
+	ManifestNode *node = manifest->head;
+	while(node != NULL) {
+		if(isInSparseSpec(hydrated, node->filePath) && !isInSparseSpec(sparseSpec, node->filePath)) {
+			char *fullPath = malloc(sizeof(char) * (strlen(project) + strlen(node->filePath) + 2));
+			sprintf(fullPath, "%s/%s", project, node->filePath);
+			if(restoreObject(fullPath, manifest->hashAlgorithm, node->md5)) {
+				numCached++;
+			} else {
+				wanted[numWanted++] = node;
+			}
+			free(fullPath);
+		}
+		node = node->next;
+	}
+	
+	int numFetched = 0, failed = 0;
+	char *dictPath = NULL;
+	for(i = 0; i < numWanted && !failed; i += HYDRATE_BATCH_FILES) {
+		int count = numWanted - i < HYDRATE_BATCH_FILES ? numWanted - i : HYDRATE_BATCH_FILES;
+		
+		// The first response may bring the dictionary, so it is named again.
+		free(dictPath);
+		dictPath = announceDictionary(socket, project);
+		int good = fetchHydrateBatch(project, socket, manifest, &wanted[i], count);
+		if(good < 0) {
+			failed = 1;
+		} else {
+			numFetched += good;
+		}
+	}
+	
+	if(!failed && numFetched == numWanted) {
+		saveSparseSpec(project, hydrated);
+		printf("%d files hydrated, %d of them from the cache.\n", numFetched + numCached, numCached);
+	} else if(!failed) {
+		printf("%d of %d files came. Please hydrate again.\n", numFetched + numCached, numWanted + numCached);
+	}
+	printf("Done.\n");
+	
+	saveFileIndex(fileIndex, 0);
+	freeFileIndex(fileIndex);
+	fileIndex = NULL;
+	trimObjectStore(OBJECT_CACHE_MAX_BYTES);
+	setObjectStore(NULL, 0);
+	setTransferDictionary(NULL, 0);
+	free(dictPath);
+	free(cacheDir);
+	free(wanted);
+	freeManifest(manifest);
+	freeSparseSpec(hydrated);
+}
 
 // Compession Not required for this step, as just single file
 // is sent over the network
@@ -871,138 +2329,56 @@ void commitProject(char *project, int socket) {
 		return;
 	}
 	
-	// Make Request.
-	// commit:<projectNameLength>:<projectName>
-	char *command = malloc(sizeof(char) * (strlen(project) + 50));;
-	sprintf(command, "%s:%d:%s", "commit", strlen(project), project);
-	write(socket, command, strlen(command));
-	free(command);
+	// Pending adds/removes go into .manifest now.
+	foldManifestJournal(project);
+	Manifest* clientManifest = readClientProjectManifest(project);
 	
-	// Server responds back
-	// sendfile:<ManifestNameLen>:<manifest name><numBytes>:<contents>
-	// ..
+	// Only the server entries of directories which differ are downloaded,
 	// In case of error, Response comes as "failed:<fail Reason>:"
-	SocketBuffer *socketBuffer = createBuffer();
+	Manifest *unchangedManifest = NULL;
+	Manifest *serverManifest = readChangedServerEntries(project, socket, clientManifest, &unchangedManifest);
 	
-	readTillDelimiter(socketBuffer, socket, ':');
-	char *responseCode = readAllBuffer(socketBuffer);
-	
-	if(strcmp(responseCode, "sendfile") == 0) {
-		// ignore till numBytes
-		readTillDelimiter(socketBuffer, socket, ':');
-		readTillDelimiter(socketBuffer, socket, ':');
-		clearSocketBuffer(socketBuffer);
-		
-		// First download the server manifest.
-		Manifest *serverManifest = readManifestContents(socket);
+	if(serverManifest != NULL) {
+		char *command;
 		
-		Manifest* clientManifest = readClientProjectManifest(project);
-			
-		if(strcmp(clientManifest->versionNumber, serverManifest->versionNumber) != 0) {
+		if(strcmp(clientManifest->versionNumber, serverManifest->versionNumber) != 0
+			|| clientManifest->hashAlgorithm != serverManifest->hashAlgorithm) {
 			printf("Error: Manifest version mismatch. please update project first.\n");
 			fflush(stdout);
 			
-			free(responseCode);
-			freeSocketBuffer(socketBuffer);
+			freeManifest(unchangedManifest);
 			freeManifest(clientManifest);
 			freeManifest(serverManifest);
 			free(path);
 			return;
 		}
 		
+		// A push staged for the last commit is not sent any more.
+		sprintf(path, "%s/%s", project, TRANSFER_FILE);
+		unlink(path);
+		sprintf(path, "%s/%s.push", project, TRANSFER_FILE);
+		unlink(path);
+		
 		// Open .COMMIT_FILE
 		sprintf(path, "%s/%s", project, COMMIT_FILE);	
 		createDirStructureIfNeeded(path);
 		int commitFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);	
 		
-		char liveHash[100];
-		int error = 0;
-		
-		ManifestNode* serverFileNode;
-		ManifestNode *clientFileNode;
-		
-		clientFileNode = clientManifest->head;
-		while(clientFileNode != NULL && error == 0) {
-			
-			// find live hash of file.
-			char *filepath = malloc(sizeof(char) * (strlen(project) + strlen(clientFileNode->filePath) + 50));
-			sprintf(filepath, "%s/%s", project, clientFileNode->filePath);
-			computeFileHash(filepath, liveHash);
-			free(filepath);
-			liveHash[HASH_STRING_LEN] = '\0';
-			
-			// Search client file in Server
-			serverFileNode = searchFile(serverManifest, clientFileNode->filePath);
-			
-			// files that need to be added.
-			if(serverFileNode == NULL) {
-				
-				write(commitFd, "A", 1);
-				write(commitFd, " ", 1);
-				write(commitFd, "1", 1);
-				write(commitFd, " ", 1);
-				write(commitFd, liveHash, strlen(liveHash));
-				write(commitFd, " ", 1);
-				write(commitFd, clientFileNode->filePath, strlen(clientFileNode->filePath));
-				write(commitFd, "\n", 1);
-				
-			} else {
-				
-				// check for conflict case.
-				// if server has different hashcode, and has higher version.
-				if(strcmp(serverFileNode->md5, clientFileNode->md5) != 0) {
-					int clientVersion = atoi(clientFileNode->version);
-					int serverVersion = atoi(serverFileNode->version);
-					
-					if(serverVersion > clientVersion) {
-						error = 1; // Client must sync first.
-					}
-				}
-				
-				if((strcmp(clientFileNode->md5, liveHash) != 0) && (error != 1)) {
-				
-					// File is in both, but client's version is better
-					// Add entry to commit file with newer version
-					// increment current version
-					int currentVersion = atoi(clientFileNode->version);
-					char version[20];
-					sprintf(version, "%d", currentVersion + 1);
-					
-					write(commitFd, "U", 1);
-					write(commitFd, " ", 1);
-					write(commitFd, version, strlen(version));
-					write(commitFd, " ", 1);
-					write(commitFd, liveHash, strlen(liveHash));
-					write(commitFd, " ", 1);
-					write(commitFd, clientFileNode->filePath, strlen(clientFileNode->filePath));
-					write(commitFd, "\n", 1);
-				}
-			}	
-			
-			clientFileNode = clientFileNode->next;
+		// Single merge-join pass over both manifests. Unchanged directories
+		// are same on server, only local modifications are looked for there.
+		// Files with same stat data as in .index are not read again,
+		// and with a watcher running, only changed files are looked at.
+		fileIndex = loadFileIndex(project, clientManifest->hashAlgorithm);
+		loadWatcherDirtySet(fileIndex);
+		int error = createCommitFromManifests(serverManifest, clientManifest, commitFd);
+		if(error == 0) {
+			createCommitFromLocalChanges(unchangedManifest, commitFd);
 		}
 		
-		// check for deleted files.
-		serverFileNode = serverManifest->head;
-		while(serverFileNode != NULL && error == 0) {
-			
-			// Search client file in Server
-			clientFileNode = searchFile(clientManifest, serverFileNode->filePath);
-			
-			// client has deleted this file.
-			if(clientFileNode == NULL) {
-				write(commitFd, "D", 1);
-				write(commitFd, " ", 1);
-				write(commitFd, serverFileNode->version, strlen(serverFileNode->version));
-				write(commitFd, " ", 1);
-				write(commitFd, serverFileNode->md5, strlen(serverFileNode->md5));
-				write(commitFd, " ", 1);
-				write(commitFd, serverFileNode->filePath, strlen(serverFileNode->filePath));
-				write(commitFd, "\n", 1);				
-			}
-			
-			serverFileNode = serverFileNode->next;
-		}
+		// All tracked files were looked at, if there was no error.
+		saveFileIndex(fileIndex, error == 0);
+		freeFileIndex(fileIndex);
+		fileIndex = NULL;
 		
 		close(commitFd);
 		
@@ -1026,9 +2402,14 @@ void commitProject(char *project, int socket) {
 			command = malloc(sizeof(char) * (strlen(project) + 50));;
 			sprintf(command, "%s:%d:%s", "commitfile", strlen(project), project);
 			write(socket, command, strlen(command));
-			write(socket, "1:", 2);
-			writeFileDetailsToSocket(COMMIT_FILE, project, socket);
 			free(command);
+			
+			char *bodyPath;
+			int bodyFd = createBodyFile(project, &bodyPath);
+			write(bodyFd, "1:", 2);
+			writeFileDetailsToSocket(COMMIT_FILE, project, bodyFd);
+			close(bodyFd);
+			writeBodyToSocket(socket, bodyPath, project);
 
 			
 			// Again check the response from server.
@@ -1049,87 +2430,179 @@ void commitProject(char *project, int socket) {
 		
 		printf("Done.\n");
 		
+		freeManifest(unchangedManifest);
 		freeManifest(serverManifest);
-		freeManifest(clientManifest);
-		
+	}
+	
+	freeManifest(clientManifest);
+	free(path);
+}
+
+// This step required ZLIB compression.
+// Asks the server for signatures of its copies of the files, to push
+// only their changes. Returns the temp directory with them, NULL if none.
+char *requestServerSignatures(char *project, int socket, FileList *files) {
+	if(files->count == 0 || !isTransferNegotiated()) {
+		return NULL;
+	}
+	
+	// signatures:<projectNameLength>:<projectName><body of <numFiles>:<file1Len>:<file1>..>
+	// server responds: sendfile:<body of signatures>
+	// In case of error, Response comes as "failed:<fail Reason>:"
+	char *command = malloc(sizeof(char) * (strlen(project) + 50));
+	sprintf(command, "signatures:%d:%s", strlen(project), project);
+	write(socket, command, strlen(command));
+	free(command);
+	
+	char *bodyPath;
+	int bodyFd = createBodyFile(project, &bodyPath);
+	char buffer[100];
+	sprintf(buffer, "%d:", files->count);
+	write(bodyFd, buffer, strlen(buffer));
+	int i;
+	for(i = 0; i < files->count; i++) {
+		sprintf(buffer, "%d:", strlen(files->paths[i]));
+		write(bodyFd, buffer, strlen(buffer));
+		write(bodyFd, files->paths[i], strlen(files->paths[i]));
+	}
+	close(bodyFd);
+	writeBodyToSocket(socket, bodyPath, project);
+	
+	SocketBuffer *socketBuffer = createBuffer();
+	readTillDelimiter(socketBuffer, socket, ':');
+	char *responseCode = readAllBuffer(socketBuffer);
+	
+	char *signatureDir = NULL;
+	if(strcmp(responseCode, "sendfile") == 0) {
+		bodyFd = openBodyFromSocket(socket, project);
+		signatureDir = readSignaturesFromSocket(bodyFd, project);
+		close(bodyFd);
 	} else {
-		printf("Server sent error message.\n");		
+		// Files are just pushed whole then.
 		readTillDelimiter(socketBuffer, socket, ':');
-		char *reason = readAllBuffer(socketBuffer);
-		printf("ResponseCode: %s\n", responseCode);
-		printf("Reason: %s\n", reason);
-		free(reason);
+		clearSocketBuffer(socketBuffer);
 	}
 	
 	free(responseCode);
 	freeSocketBuffer(socketBuffer);
-	free(path);
+	return signatureDir;
 }
 
-// This step required ZLIB compression.
-void pushProject(char *project, int socket) {
-	printf("Trying to push project: %s\n", project);
-	fflush(stdout);
-	
-	// Check if project exists
-	if(!isProjectConfiguredLocally(project)) {
-		printf("Error: Please configure the project correctly.\n");
-		return;
+// Asks the server which of the files (by hash) it has already, those
+// are pushed as just their hash. NULL if all are to be pushed. Takes
+// the set.
+HashSet *requestServerObjects(char *project, int socket, HashSet *offered) {
+	if(offered->count == 0 || !isTransferNegotiated()) {
+		freeHashSet(offered);
+		return NULL;
 	}
+	Manifest *clientManifest = readClientProjectManifest(project);
+	const char *algorithm = hashAlgorithmName(clientManifest->hashAlgorithm);
 	
-	char *path = malloc(sizeof(char) * (strlen(project) + 50));
+	// have:<projectNameLength>:<projectName><body of <hashAlgorithm>:<numHashes>:<hash1><hash2>..>
+	// server responds: sendfile:<body of the hashes it has>
+	// In case of error, Response comes as "failed:<fail Reason>:"
+	char *command = malloc(sizeof(char) * (strlen(project) + 50));
+	sprintf(command, "have:%d:%s", strlen(project), project);
+	write(socket, command, strlen(command));
+	free(command);
 	
-	// check if .COMMIT_FILE file exists.
-	sprintf(path, "%s/%s", project, COMMIT_FILE);
-	if(!checkFileExists(path)) {
-		printf("Error: .Commit file does not exist.\n");
-		free(path);
-		return;
+	char *bodyPath;
+	int bodyFd = createBodyFile(project, &bodyPath);
+	write(bodyFd, algorithm, strlen(algorithm));
+	write(bodyFd, ":", 1);
+	writeHashSet(offered, bodyFd);
+	close(bodyFd);
+	writeBodyToSocket(socket, bodyPath, project);
+	freeHashSet(offered);
+	freeManifest(clientManifest);
+	
+	SocketBuffer *socketBuffer = createBuffer();
+	readTillDelimiter(socketBuffer, socket, ':');
+	char *responseCode = readAllBuffer(socketBuffer);
+	
+	HashSet *serverObjects = NULL;
+	if(strcmp(responseCode, "sendfile") == 0) {
+		bodyFd = openBodyFromSocket(socket, project);
+		serverObjects = readHashSet(bodyFd);
+		close(bodyFd);
+	} else {
+		// Files are just pushed then.
+		readTillDelimiter(socketBuffer, socket, ':');
+		clearSocketBuffer(socketBuffer);
+	}
+	
+	free(responseCode);
+	freeSocketBuffer(socketBuffer);
+	return serverObjects;
+}
+
+// Asks the server which chunks of the big files it has already, to
+// push only the others. NULL if files are to be pushed whole.
+HashSet *requestServerChunks(char *project, int socket, FileList *files) {
+	if(files->count == 0 || !isTransferNegotiated()) {
+		return NULL;
 	}
+	HashSet *chunks = chunkFiles(project, files->paths, files->count);
+	
+	// chunks:<projectNameLength>:<projectName><body of <numHashes>:<hash1><hash2>..>
+	// server responds: sendfile:<body of the hashes it has>
+	// In case of error, Response comes as "failed:<fail Reason>:"
+	char *command = malloc(sizeof(char) * (strlen(project) + 50));
+	sprintf(command, "chunks:%d:%s", strlen(project), project);
+	write(socket, command, strlen(command));
+	free(command);
+	
+	char *bodyPath;
+	int bodyFd = createBodyFile(project, &bodyPath);
+	writeHashSet(chunks, bodyFd);
+	close(bodyFd);
+	writeBodyToSocket(socket, bodyPath, project);
+	freeHashSet(chunks);
 	
 	SocketBuffer *socketBuffer = createBuffer();
+	readTillDelimiter(socketBuffer, socket, ':');
+	char *responseCode = readAllBuffer(socketBuffer);
 	
-	// check if update file present and not empty
-	sprintf(path, "%s/%s", project, UPDATE_FILE);
-	if(checkFileExists(path) && findFileSize(path) != 0) {
-		
-		// check if update file has any Modify Codes.
-		int updateFd = open(path, O_RDONLY, 0777);
-		
-		while(1) {
-			readTillDelimiter(socketBuffer, updateFd, ' ');
-			char *code = readAllBuffer(socketBuffer);
-			if(strlen(code) == 0) {
-				free(code);
-				break;
-			}
-			
-			// ignore file version, hash and path		
-			readTillDelimiter(socketBuffer, updateFd, '\n');
-			clearSocketBuffer(socketBuffer);
-			
-			// We now have fileCode from UPDATE_FILE
-			if(strcmp(code, "M") == 0) {
-				printf("Error: Update file has some files pending for modification\n");
-				free(code);
-				free(path);
-				close(updateFd);
-				freeSocketBuffer(socketBuffer);
-				return;
-			}
-			free(code);
-		}
-		close(updateFd);
+	HashSet *serverChunks = NULL;
+	if(strcmp(responseCode, "sendfile") == 0) {
+		bodyFd = openBodyFromSocket(socket, project);
+		serverChunks = readHashSet(bodyFd);
+		close(bodyFd);
+	} else {
+		// Files are just pushed whole then.
+		readTillDelimiter(socketBuffer, socket, ':');
+		clearSocketBuffer(socketBuffer);
 	}
 	
+	free(responseCode);
+	freeSocketBuffer(socketBuffer);
+	return serverChunks;
+}
+
+// Builds the request of the committed A and U files, and stages it
+// compressed in stagedPath. Server is first asked which of them, or
+// of their chunks, it has, and for signatures of its older copies.
+// Returns -1 if it could not be compressed, nothing is staged then.
+int stagePushRequest(char *project, int socket, char *stagedPath) {
+	char *path = malloc(sizeof(char) * (strlen(project) + 50));
+	SocketBuffer *socketBuffer = createBuffer();
+	
 	// We are now ready to send our files.
 	typedef struct FileNode {
 		char *filePath;
+		char code;
+		char hash[HASH_STRING_LEN + 1];
+		int chunked;
+		int object;
 		struct FileNode *next;
 	} FileNode;
 	
 	FileNode *listOfFiles = NULL;
 	int numFiles = 0;
+	FileList modified = { NULL, 0, 0 };
+	FileList chunked = { NULL, 0, 0 };
+	char *offeredHashes = NULL;
 	
 	// Read how many files from .Commit file need to be shipped..
 	// Only A and U types.
@@ -1147,45 +2620,73 @@ void pushProject(char *project, int socket) {
 			break;
 		}
 		
-		// ignore file version, hash	
-		readTillDelimiter(socketBuffer, commitFd, ' ');
+		// ignore file version, keep hash
 		readTillDelimiter(socketBuffer, commitFd, ' ');
 		clearSocketBuffer(socketBuffer);
+		readTillDelimiter(socketBuffer, commitFd, ' ');
+		char *hash = readAllBuffer(socketBuffer);
 		
 		// read filePath
 		readTillDelimiter(socketBuffer, commitFd, '\n');
 		char *fPath = readAllBuffer(socketBuffer);
 		
 		// If it is a A or U file.
-		if(strcmp(code, "D") != 0) {
+		if(strcmp(code, "D") != 0 && strlen(hash) == HASH_STRING_LEN) {
 			FileNode *tmp = malloc(sizeof(FileNode));
 			tmp->next = listOfFiles;
 			listOfFiles = tmp;
 			tmp->filePath = strdup(fPath);
+			tmp->code = code[0];
+			strcpy(tmp->hash, hash);
+			tmp->chunked = 0;
+			tmp->object = 0;
+			
+			offeredHashes = realloc(offeredHashes, (numFiles + 1) * HASH_STRING_LEN + 1);
+			memcpy(offeredHashes + numFiles * HASH_STRING_LEN, hash, HASH_STRING_LEN);
 			numFiles++;
 		}
+		free(hash);
 		free(code);
 		free(fPath);
 	}
 	close(commitFd);
 	
+	// Server may have some of the files already (reverts, renames,
+	// copies from other projects), only their hashes are sent.
+	HashSet *serverObjects = requestServerObjects(project, socket, createHashSet(offeredHashes, numFiles));
+	
+	// Server has older copies of the U files, their changes are sent.
+	// New big files are sent as chunks, server may have some of them.
+	FileNode *node;
+	for(node = listOfFiles; node != NULL; node = node->next) {
+		if(hashSetContains(serverObjects, node->hash)) {
+			node->object = 1;
+		} else if(node->code == 'A' && isChunkedFile(project, node->filePath)) {
+			node->chunked = 1;
+			addToFileList(&chunked, strdup(node->filePath));
+		} else if(node->code == 'U') {
+			char *fullPath = malloc(sizeof(char) * (strlen(project) + strlen(node->filePath) + 2));
+			sprintf(fullPath, "%s/%s", project, node->filePath);
+			if(findFileSize(fullPath) >= DELTA_MIN_SIZE) {
+				addToFileList(&modified, strdup(node->filePath));
+			}
+			free(fullPath);
+		}
+	}
+	
+	HashSet *serverChunks = requestServerChunks(project, socket, &chunked);
+	char *signatureDir = requestServerSignatures(project, socket, &modified);
+	freeFileList(&modified);
+	
 
 	// We now have required files to be sent to the server.
-	// We can start making the command now.	
-	
-	// Make Request.
-	// pushfiles:<projectNameLength>:<projectName><compressed data>
+	// We can start making the request now.	
 	// 
 	// compressed data format:
 	//		<numFiles>:
 	//		<File1NameLen>:<File1Name><File1LenBytes>:<File1Contents>
 	//		<File2NameLen>:<File2Name><File2LenBytes>:<File2Contents>
 	char buffer[100];
-	char *command = malloc(sizeof(char) * (strlen(project) + 50));
-	sprintf(command, "%s:", "pushfiles");
-	write(socket, command, strlen(command));
-	sprintf(command, "%d:%s", strlen(project), project);
-	write(socket, command, strlen(command));
 	
 	// REMEMBER: COMPRESSED ZLIB RESPONSE
 	////////////////////////////////////////////////////
@@ -1201,48 +2702,195 @@ void pushProject(char *project, int socket) {
 	/* Core logic for compression starts now */	
 	sprintf(buffer, "%d:", (numFiles + 1)); // +1 for commit file.
 	write(requestFd, buffer, strlen(buffer));
-	free(command);
 	
 	// Now write commit file.
 	writeFileDetailsToSocket(COMMIT_FILE, project, requestFd);
 	
-	// Now write the A or U files:
+	// Now write the A or U files, only changes of those with signatures.
 	FileNode *start = listOfFiles;
 	while(start != NULL) {
 		FileNode *curr = start;
-		writeFileDetailsToSocket(curr->filePath, project, requestFd);
+		if(curr->object) {
+			writeObjectRefToSocket(curr->filePath, curr->hash, requestFd);
+		} else if(serverChunks != NULL && curr->chunked) {
+			writeFileChunksToSocket(curr->filePath, project, serverChunks, requestFd);
+		} else if(signatureDir != NULL) {
+			writeFileDeltaDetailsToSocket(curr->filePath, project, signatureDir, requestFd);
+		} else {
+			writeFileDetailsToSocket(curr->filePath, project, requestFd);
+		}
 		start = start->next;
 		free(curr->filePath);
 		free(curr);
 	}
 	
 	close(requestFd);
-	
-	convertResponseToZlib(socket, clientReqPath, ".");
+	if(signatureDir != NULL) {
+		removeDirectoryCompletely(signatureDir);
+		free(signatureDir);
+	}
+	freeHashSet(serverObjects);
+	freeHashSet(serverChunks);
+	freeFileList(&chunked);
+	releaseChunkFiles();
+	
+	// Renamed when complete, so a partly staged one is never sent.
+	char *tmpPath = malloc(sizeof(char) * (strlen(stagedPath) + 50));
+	sprintf(tmpPath, "%s.tmp%lld_%d", stagedPath, current_timestamp_millis(), rand());
+	int stagedFd = open(tmpPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	int result = convertResponseToZlib(stagedFd, clientReqPath, ".");
+	close(stagedFd);
+	if(result == 0) {
+		rename(tmpPath, stagedPath);
+	} else {
+		unlink(tmpPath);
+	}
+	free(tmpPath);
 	unlink(clientReqPath);
 	free(clientReqPath);
 	
 	////////////////////////////////////////////////////
 	// Compression is done now, 
 	
+	freeSocketBuffer(socketBuffer);
+	free(path);
+	return result;
+}
+
+void pushProject(char *project, int socket) {
+	printf("Trying to push project: %s\n", project);
+	fflush(stdout);
+	
+	// Check if project exists
+	if(!isProjectConfiguredLocally(project)) {
+		printf("Error: Please configure the project correctly.\n");
+		return;
+	}
 	
+	char *path = malloc(sizeof(char) * (strlen(project) + 50));
+	
+	// check if .COMMIT_FILE file exists.
+	sprintf(path, "%s/%s", project, COMMIT_FILE);
+	if(!checkFileExists(path)) {
+		printf("Error: .Commit file does not exist.\n");
+		free(path);
+		return;
+	}
+	
+	SocketBuffer *socketBuffer = createBuffer();
+	
+	// check if update file present and not empty
+	sprintf(path, "%s/%s", project, UPDATE_FILE);
+	if(checkFileExists(path) && findFileSize(path) != 0) {
+		
+		// check if update file has any Modify Codes.
+		int updateFd = open(path, O_RDONLY, 0777);
+		
+		while(1) {
+			readTillDelimiter(socketBuffer, updateFd, ' ');
+			char *code = readAllBuffer(socketBuffer);
+			if(strlen(code) == 0) {
+				free(code);
+				break;
+			}
+			
+			// ignore file version, hash and path		
+			readTillDelimiter(socketBuffer, updateFd, '\n');
+			clearSocketBuffer(socketBuffer);
+			
+			// We now have fileCode from UPDATE_FILE
+			if(strcmp(code, "M") == 0) {
+				printf("Error: Update file has some files pending for modification\n");
+				free(code);
+				free(path);
+				close(updateFd);
+				freeSocketBuffer(socketBuffer);
+				return;
+			}
+			free(code);
+		}
+		close(updateFd);
+	}
+	
+	// A push staged before, which did not get through, is sent again
+	// from where it stopped. Otherwise stage the request now.
+	char *statePath = malloc(sizeof(char) * (strlen(project) + strlen(TRANSFER_FILE) + 10));
+	sprintf(statePath, "%s/%s", project, TRANSFER_FILE);
+	char *stagedPath = malloc(sizeof(char) * (strlen(statePath) + 10));
+	sprintf(stagedPath, "%s.push", statePath);
+	
+	char transferId[TRANSFER_ID_LEN + 1];
+	if(!(loadTransferId(statePath, transferId) && checkFileExists(stagedPath))) {
+		if(stagePushRequest(project, socket, stagedPath) != 0) {
+			printf("Error: Could not compress the push request.\n");
+			unlink(statePath);
+			free(statePath);
+			free(stagedPath);
+			freeSocketBuffer(socketBuffer);
+			free(path);
+			return;
+		}
+	} else {
+		printf("Resuming push staged before.\n");
+	}
+	
+	// Make Request.
+	// transfer:<id>:0:pushfiles:<projectNameLength>:<projectName>
+	// Server answers how much of it came before.
+	char *command = malloc(sizeof(char) * (strlen(project) + 100));
+	sprintf(command, "transfer:%s:0:", transferId);
+	write(socket, command, strlen(command));
+	sprintf(command, "%s:%d:%s", "pushfiles", strlen(project), project);
+	write(socket, command, strlen(command));
+	free(command);
 	
-	// Server responds back
-	// sendfile:<ManifestNameLen>:<manifest name><numBytes>:<contents>
-	// ..
-	// In case of error, Response comes as "failed:<fail Reason>:"
 	clearSocketBuffer(socketBuffer);
 	readTillDelimiter(socketBuffer, socket, ':');
 	char *responseCode = readAllBuffer(socketBuffer);
-	
-	if(strcmp(responseCode, "sendfile") == 0) {
-		// ignore till numBytes
-		readTillDelimiter(socketBuffer, socket, ':');
+	if(strcmp(responseCode, "sendfrom") == 0) {
 		readTillDelimiter(socketBuffer, socket, ':');
-		clearSocketBuffer(socketBuffer);
+		char *offsetStr = readAllBuffer(socketBuffer);
+		long offset = atol(offsetStr);
+		free(offsetStr);
+		free(responseCode);
 		
+		if(offset > 0) {
+			printf("Server has %ld bytes of it, sending the rest.\n", offset);
+		}
+		int sent = writeStagedToSocket(socket, stagedPath, offset);
+		
+		// Server responds back
+		// sendfile:<ManifestNameLen>:<manifest name><numBytes>:<contents>
+		// ..
+		// In case of error, Response comes as "failed:<fail Reason>:"
+		responseCode = NULL;
+		if(sent) {
+			readTillDelimiter(socketBuffer, socket, ':');
+			responseCode = readAllBuffer(socketBuffer);
+		}
+		if(responseCode == NULL || strlen(responseCode) == 0) {
+			printf("Connection lost. Push again to resume.\n");
+			free(responseCode);
+			free(statePath);
+			free(stagedPath);
+			freeSocketBuffer(socketBuffer);
+			free(path);
+			return;
+		}
+	}
+	
+	// Server took it, or failed it, it is not sent again.
+	unlink(stagedPath);
+	unlink(statePath);
+	free(statePath);
+	free(stagedPath);
+	
+	if(strcmp(responseCode, "sendfile") == 0) {
 		// First download the server manifest.
-		Manifest *serverManifest = readManifestContents(socket);
+		int bodyFd = openBodyFromSocket(socket, project);
+		long numBytes = readFileHeaderFromSocket(socketBuffer, bodyFd);
+		Manifest *serverManifest = readManifestBytes(bodyFd, numBytes);
+		close(bodyFd);
 		
 		// We need to write the server's manifest now into local
 		// So that versions are in synch now.
@@ -1251,6 +2899,10 @@ void pushProject(char *project, int socket) {
 		int clientManifestFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
 		writeManifestToFile(serverManifest, clientManifestFd);
 		close(clientManifestFd);
+		cacheServerManifest(project, serverManifest);
+		
+		// Journal was folded by commit, and is part of the push now.
+		clearManifestJournal(project);
 		
 		printf("Done.\n");
 		
@@ -1274,6 +2926,46 @@ void pushProject(char *project, int socket) {
 }
 
 
+// Starts a background watcher of the project directory, so commit and
+// update look only at files changed since their last run.
+void watchProject(char *project) {
+	if(!isProjectConfiguredLocally(project)) {
+		return;
+	}
+	
+	int pid = readWatcherPid(project);
+	if(pid != 0) {
+		printf("Project is already watched, pid %d.\n", pid);
+		return;
+	}
+	
+	pid = startWatcher(project);
+	if(pid < 0) {
+		printf("Error: Could not start watcher.\n");
+	} else {
+		printf("Watching project %s, pid %d.\n", project, pid);
+	}
+}
+
+void unwatchProject(char *project) {
+	int pid = readWatcherPid(project);
+	if(pid == 0) {
+		printf("Project is not watched.\n");
+		return;
+	}
+	kill(pid, SIGTERM);
+	
+	char *path = malloc(sizeof(char) * (strlen(project) + 50));
+	sprintf(path, "%s/%s", project, WATCH_FILE);
+	unlink(path);
+	sprintf(path, "%s/%s", project, DIRTY_FILE);
+	unlink(path);
+	sprintf(path, "%s/%s", project, WATCH_SYNC_FILE);
+	unlink(path);
+	free(path);
+	printf("Stopped watching project %s.\n", project);
+}
+
 int main(int argc, char *argv[]) {
 	srand(current_timestamp());
 	if(argc < 2) {
@@ -1284,19 +2976,38 @@ int main(int argc, char *argv[]) {
 	if(strcmp(argv[1], "configure") == 0) {
 		if(argc < 4) {
 			printf("Error: Params missing\n");
+		} else if(argc > 4 && codecFromName(argv[4]) < 0) {
+			printf("Error: Unknown codec %s\n", argv[4]);
 		} else {
 			
+			// configure <IP> <port> [<preferred codec>]
 			int fd = open(CONFIG_FILE, O_WRONLY | O_TRUNC | O_CREAT, 0777);
 			write(fd, argv[2], strlen(argv[2]));
 			write(fd, " ", 1);
 			write(fd, argv[3], strlen(argv[3]));
 			write(fd, " ", 1);
+			if(argc > 4) {
+				write(fd, argv[4], strlen(argv[4]));
+				write(fd, " ", 1);
+			}
 			close(fd);
 			printf("Done!\n");
 		}
 		return 0;
 	}
 	
+	// Watcher needs no server, and must not keep the connection open.
+	if(strcmp(argv[1], "watch") == 0 || strcmp(argv[1], "unwatch") == 0) {
+		if(argc < 3) {
+			printf("Error: Params missing\n");
+		} else if(strcmp(argv[1], "watch") == 0) {
+			watchProject(argv[2]);
+		} else {
+			unwatchProject(argv[2]);
+		}
+		return 0;
+	}
+	
 	if(!checkFileExists(CONFIG_FILE)) {
 		printf("Error: Run configure command first.\n");
 		return 0;
@@ -1309,21 +3020,85 @@ int main(int argc, char *argv[]) {
 	char *ipAddress = readAllBuffer(socketBuffer);
 	readTillDelimiter(socketBuffer, fd, ' ');
 	char *port = readAllBuffer(socketBuffer);
+	readTillDelimiter(socketBuffer, fd, ' ');
+	char *codec = readAllBuffer(socketBuffer);
 	freeSocketBuffer(socketBuffer);
 	close(fd);
 	
 	// We got IP and PORT from file.
     struct addrinfo* results = get_sockaddr(ipAddress, port);
     int sockfd = open_connection(results);
+	keepConnectionAlive(sockfd);
+	
+	// A dropped server is seen as a failed write, not a signal.
+	signal(SIGPIPE, SIG_IGN);
+	negotiateCodec(sockfd, codec);
 
 	// Socket, always wait till the time, we close the connection.
 	
+	// Other commands on a sparse checkout only look at the files in it.
+	if(argc > 2 && strcmp(argv[1], "checkout") != 0) {
+		sparseSpec = loadSparseSpec(argv[2]);
+	}
+	
 	// Now check the commands.
 	if(strcmp(argv[1], "checkout") == 0) {
 		if(argc < 3) {
 			printf("Error: Params missing\n");
 		} else {
-			checkoutProject(argv[2], sockfd);
+			// checkout <project> [<connections>] [--lazy] [--include <path>].. [--exclude <path>]..
+			// Paths may be globs, the spec is kept for update, upgrade and commit.
+			// A lazy checkout has just the .manifest, and the included files.
+			int connections = CHECKOUT_CONNECTIONS;
+			SparseSpec *spec = createSparseSpec();
+			int i;
+			for(i = 3; i < argc; i++) {
+				if(strcmp(argv[i], "--lazy") == 0) {
+					spec->lazy = 1;
+				} else if((strcmp(argv[i], "--include") == 0 || strcmp(argv[i], "--exclude") == 0) && i + 1 < argc) {
+					addSparsePattern(spec, argv[i + 1], strcmp(argv[i], "--exclude") == 0);
+					i++;
+				} else {
+					connections = atoi(argv[i]);
+				}
+			}
+			if(spec->count > 0 || spec->lazy) {
+				sparseSpec = spec;
+			} else {
+				freeSparseSpec(spec);
+			}
+			checkoutProjectParallel(argv[2], sockfd, ipAddress, port, codec, connections);
+		}
+		
+	} else if(strcmp(argv[1], "hydrate") == 0) {
+		if(argc < 4) {
+			printf("Error: Params missing\n");
+		} else {
+			// hydrate <project> <file|dir|'glob'|-> [..]
+			// With '-', paths are read from stdin too, one per line, so a
+			// build can name the files it needs (from its dependency files).
+			FileList paths = { NULL, 0, 0 };
+			int i;
+			for(i = 3; i < argc; i++) {
+				if(strcmp(argv[i], "-") != 0) {
+					addToFileList(&paths, strdup(argv[i]));
+					continue;
+				}
+				char *line = NULL;
+				size_t size = 0;
+				ssize_t len;
+				while((len = getline(&line, &size, stdin)) > 0) {
+					while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+						line[--len] = '\0';
+					}
+					if(len > 0) {
+						addToFileList(&paths, strdup(line));
+					}
+				}
+				free(line);
+			}
+			hydrateProject(argv[2], sockfd, paths.paths, paths.count);
+			freeFileList(&paths);
 		}
 		
 	} else if(strcmp(argv[1], "update") == 0) {
@@ -1372,14 +3147,16 @@ int main(int argc, char *argv[]) {
 		if(argc < 4) {
 			printf("Error: Params missing\n");
 		} else {
-			addFileToProject(argv[2], argv[3]);
+			// add <project> <file|dir|'glob'> [..]
+			addFilesToProject(argv[2], &argv[3], argc - 3);
 		}
 		
 	} else if(strcmp(argv[1], "remove") == 0) {
 		if(argc < 4) {
 			printf("Error: Params missing\n");
 		} else {
-			removeFileInProject(argv[2], argv[3]);
+			// remove <project> <file1> [<file2> ..]
+			removeFilesInProject(argv[2], &argv[3], argc - 3);
 		}
 		
 	} else if(strcmp(argv[1], "currentversion") == 0) {
@@ -1406,8 +3183,10 @@ int main(int argc, char *argv[]) {
 		printf("Invalid command. Please check.\n");
 	}
 	
+	freeSparseSpec(sparseSpec);
 	free(ipAddress);
 	free(port);
+	free(codec);
 	close(sockfd);
     
     return 0;
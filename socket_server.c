@@ -7,27 +7,48 @@
 #include <fcntl.h> // for open
 #include <unistd.h> // for close
 #include <pthread.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "util.h"
 #include "socketBuffer.h"
 #include "manifest.h"
+#include "binaryManifest.h"
+#include "manifestTree.h"
 #include "compressor.h"
+#include "dictionary.h"
 
 char client_message[MAX_MSG_SIZE];
 char buffer[MAX_MSG_SIZE];
 
 char BASE_DIRECTORY[] = "./server_repo";
+char CHUNK_STORE_DIRECTORY[] = "./server_repo/.chunks";
+char OBJECT_STORE_DIRECTORY[] = "./server_repo/.objects";
+
+// Files of past versions are kept for reverts till the store has more.
+#define OBJECT_STORE_MAX_BYTES (4LL * 1024 * 1024 * 1024)
+
+// Staged checkouts, and parts of pushes, are kept this long after
+// their last use, for clients to resume them.
+char TRANSFER_DIRECTORY[] = "./server_repo/.transfers";
+#define TRANSFER_KEEP_SECONDS (24 * 60 * 60)
 char VERSION_FILE[] = ".version";
 char UPDATE_FILE[] = ".update";
 char COMMIT_FILE[] = ".commit";
 char HISTORY_FILE[] = ".history";
+char MANIFEST_TREE_FILE[] = ".manifest.tree"; // see manifestTree.h
 
 char *REQUEST_FILE = ".request";
 char *RESPONSE_FILE = ".response";
 
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Commands which only read projects share the lock, and hold it just
+// while they run. Others hold it alone till the connection is closed,
+// so the commands of a commit or push see no changes between them.
+pthread_rwlock_t lock;
+#define LOCK_READ 1
+#define LOCK_WRITE 2
+static __thread int heldLock = 0;
 
 int checkProject(char *projectName) {
 	if(!checkDirectoryExists(BASE_DIRECTORY)) {
@@ -78,11 +99,8 @@ void writeFileToSocket(int sockfd, char *projectName, const char *filePath) {
 		sprintf(path, "%d:%s%ld:", strlen(filePath), filePath, fileSize);
 		write(sockfd, path, strlen(path));
 		
-		// Now write file char by char on the socket	
-		char c;
-		while (read(fileFd, &c, 1) == 1) {
-			write(sockfd, &c, 1);
-		}
+		// Now write file on the socket	
+		writeNBytesToFile(fileSize, fileFd, sockfd);
 		
 		close(fileFd);
 	}
@@ -90,9 +108,378 @@ void writeFileToSocket(int sockfd, char *projectName, const char *filePath) {
 	free(path);
 }
 
+// Precodition: project exists.
+// Maps the binary copy of the current manifest, which is created from the
+// text manifest if it is not there yet (older versions, rollbacks).
+BinaryManifest *mapCurrentServerManifest(char *projectName) {
+	
+	char *path = malloc(sizeof(char) * (strlen(projectName) + strlen(BINARY_MANIFEST_FILE) + 50 + strlen(BASE_DIRECTORY)));
+	char *textPath = malloc(sizeof(char) * (strlen(projectName) + strlen(MANIFEST_FILE) + 50 + strlen(BASE_DIRECTORY)));
+	
+	// Read current version of project.
+	char *version = readCurrentVersion(projectName);
+	
+	sprintf(path, "%s/%s/%s/%s", BASE_DIRECTORY, projectName, version, BINARY_MANIFEST_FILE);
+	sprintf(textPath, "%s/%s/%s/%s", BASE_DIRECTORY, projectName, version, MANIFEST_FILE);
+	
+	BinaryManifest *result = mapBinaryManifest(path);
+	if(result == NULL && convertTextToBinaryManifest(textPath, path) == 0) {
+		result = mapBinaryManifest(path);
+	}
+	
+	free(version);
+	free(textPath);
+	free(path);
+	
+	return result;
+}
+
+// Sends a file of the project's current version as the body of a
+// response: [1:]<FileNameLen>:<FileName><FileLenBytes>:<FileContents>
+void writeFileBodyToSocket(int sockfd, char *projectName, const char *filePath, int withCount) {
+	char *bodyPath;
+	int bodyFd = createBodyFile(BASE_DIRECTORY, &bodyPath);
+	if(withCount) {
+		write(bodyFd, "1:", 2);
+	}
+	writeFileToSocket(bodyFd, projectName, filePath);
+	close(bodyFd);
+	writeBodyToSocket(sockfd, bodyPath, BASE_DIRECTORY);
+}
+
+// Dictionary file of the project, trained again from the current
+// version every DICT_RETRAIN_VERSIONS versions. NULL if the project is
+// too small to have one, delete yourself.
+char *projectDictionary(char *projectName) {
+	char *path = malloc(sizeof(char) * (strlen(BASE_DIRECTORY) + strlen(projectName) + strlen(DICTIONARY_FILE) + 5));
+	sprintf(path, "%s/%s/%s", BASE_DIRECTORY, projectName, DICTIONARY_FILE);
+	
+	char *version = readCurrentVersion(projectName);
+	int currentVersion = atoi(version);
+	int trainedVersion = dictionaryTrainedVersion(path);
+	
+	BinaryManifest *bm = NULL;
+	if((trainedVersion < 0 || currentVersion - trainedVersion >= DICT_RETRAIN_VERSIONS)
+		&& (bm = mapCurrentServerManifest(projectName)) != NULL) {
+		
+		char *versionDir = malloc(sizeof(char) * (strlen(BASE_DIRECTORY) + strlen(projectName) + strlen(version) + 5));
+		sprintf(versionDir, "%s/%s/%s", BASE_DIRECTORY, projectName, version);
+		
+		char **paths = malloc(sizeof(char *) * (bm->header->numFiles + 1));
+		uint32_t i;
+		for(i = 0; i < bm->header->numFiles; i++) {
+			paths[i] = binaryManifestPath(bm, i);
+		}
+		
+		Dictionary *dict = trainDictionary(versionDir, paths, bm->header->numFiles);
+		if(dict != NULL) {
+			printf("Trained dictionary %u of %ld bytes for project %s\n", dict->id, (long) dict->length, projectName);
+			saveDictionary(path, dict, currentVersion);
+			freeDictionary(dict);
+		}
+		
+		free(paths);
+		free(versionDir);
+		unmapBinaryManifest(bm);
+	}
+	free(version);
+	
+	if(!checkFileExists(path)) {
+		free(path);
+		return NULL;
+	}
+	return path;
+}
+
+// Compresses the response with the project's dictionary, if the client
+// announced its own one. The dictionary is sent when they differ.
+// Returns -1 if it could not be compressed.
+int convertResponseWithDictionary(int sockfd, char *responseFile, char *projectName, long clientDictionary) {
+	char *dictPath = clientDictionary >= 0 ? projectDictionary(projectName) : NULL;
+	if(dictPath != NULL) {
+		setTransferDictionary(dictPath, dictionaryId(dictPath) != clientDictionary);
+	}
+	
+	int result = convertResponseToZlib(sockfd, responseFile, BASE_DIRECTORY);
+	
+	setTransferDictionary(NULL, 0);
+	free(dictPath);
+	return result;
+}
+
+// Returns the path of the staged transfer, delete yourself.
+char *transferPath(char *transferId) {
+	char *path = malloc(sizeof(char) * (strlen(TRANSFER_DIRECTORY) + strlen(transferId) + 2));
+	sprintf(path, "%s/%s", TRANSFER_DIRECTORY, transferId);
+	return path;
+}
+
+// Removes the transfers which were not used for TRANSFER_KEEP_SECONDS.
+void removeExpiredTransfers() {
+	DIR *d = opendir(TRANSFER_DIRECTORY);
+	if(d == NULL) {
+		return;
+	}
+	long long now = current_timestamp();
+	struct dirent *entry;
+	while((entry = readdir(d)) != NULL) {
+		if(entry->d_name[0] == '.') {
+			continue;
+		}
+		char *path = transferPath(entry->d_name);
+		if(now - getLastModifiedTime(path) > TRANSFER_KEEP_SECONDS) {
+			unlink(path);
+		}
+		free(path);
+	}
+	closedir(d);
+}
+
+// Sends the rest of a checkout staged before, from the offset the client
+// has. Returns 0 if there is no such transfer.
+int resumeTransfer(int sockfd, char *transferId, long offset) {
+	if(transferId == NULL) {
+		return 0;
+	}
+	
+	char *path = transferPath(transferId);
+	long size = findFileSize(path);
+	if(size < 0 || offset > size) {
+		free(path);
+		return 0;
+	}
+	
+	// Kept for longer while it is in use.
+	utimes(path, NULL);
+	printf("Resuming transfer %s at %ld of %ld bytes\n", transferId, offset, size);
+	
+	write(sockfd, "sendfile:", strlen("sendfile:"));
+	writeStagedToSocket(sockfd, path, offset);
+	free(path);
+	return 1;
+}
+
+// Compresses the response into a staged transfer, and sends it. It is
+// kept till the client says it has all of it, or it expires. Bytes
+// the server wrote may still be lost with the connection.
+void sendStagedResponse(int sockfd, char *responseFile, char *projectName, long clientDictionary, char *transferId) {
+	removeExpiredTransfers();
+	
+	char *path = transferPath(transferId);
+	char *tmpPath = malloc(sizeof(char) * (strlen(path) + 50));
+	sprintf(tmpPath, "%s.tmp%lld_%d", path, current_timestamp_millis(), rand());
+	createDirStructureIfNeeded(tmpPath);
+	
+	// Renamed when complete, so a partly staged one is never resumed.
+	int stagedFd = open(tmpPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	int result = convertResponseWithDictionary(stagedFd, responseFile, projectName, clientDictionary);
+	close(stagedFd);
+	rename(tmpPath, path);
+	
+	writeStagedToSocket(sockfd, path, 0);
+	
+	// The client fails to read it, and must not resume it.
+	if(result != 0) {
+		unlink(path);
+	}
+	free(tmpPath);
+	free(path);
+}
+
+// Reads the compressed request of a client into a new file of the
+// project, returns its path (delete yourself). With a transfer id, the
+// client is told how much of it came before, and only the rest is read.
+// Returns NULL if the connection dropped, what came is kept.
+char *receiveRequestBody(int sockfd, char *projectName, char *transferId) {
+	char *clientReqPath = malloc(sizeof(char) * (strlen(projectName) + strlen(BASE_DIRECTORY) + 50));
+	sprintf(clientReqPath, "%s/%s/%s%lld_%d", BASE_DIRECTORY, projectName, REQUEST_FILE, current_timestamp_millis(), rand());
+	
+	if(transferId == NULL) {
+		convertZlibToResponse(sockfd, clientReqPath, BASE_DIRECTORY);
+		return clientReqPath;
+	}
+	
+	removeExpiredTransfers();
+	char *path = transferPath(transferId);
+	long size = findFileSize(path);
+	
+	char buffer[100];
+	sprintf(buffer, "sendfrom:%ld:", size > 0 ? size : 0);
+	write(sockfd, buffer, strlen(buffer));
+	
+	if(!readStagedFromSocket(sockfd, path)) {
+		printf("Transfer %s stopped at %ld bytes, kept for resume\n", transferId, findFileSize(path));
+		free(clientReqPath);
+		free(path);
+		return NULL;
+	}
+	
+	unstageTransfer(path, clientReqPath, BASE_DIRECTORY);
+	unlink(path);
+	free(path);
+	return clientReqPath;
+}
+
+int isReadOnlyCommand(char *command) {
+	return strcmp(command, "checkout") == 0 || strcmp(command, "checkoutshard") == 0
+		|| strcmp(command, "currentversion") == 0 || strcmp(command, "history") == 0
+		|| strcmp(command, "update") == 0 || strcmp(command, "entries") == 0
+		|| strcmp(command, "treelevel") == 0
+		|| strcmp(command, "manifestdelta") == 0 || strcmp(command, "received") == 0
+		|| strcmp(command, "hydrate") == 0;
+}
+
+// Takes the lock the command needs, if the connection does not hold it.
+void lockForCommand(char *command) {
+	int mode = isReadOnlyCommand(command) ? LOCK_READ : LOCK_WRITE;
+	if(heldLock >= mode) {
+		return;
+	}
+	if(heldLock == LOCK_READ) {
+		pthread_rwlock_unlock(&lock);
+	}
+	if(mode == LOCK_READ) {
+		pthread_rwlock_rdlock(&lock);
+	} else {
+		pthread_rwlock_wrlock(&lock);
+	}
+	heldLock = mode;
+}
+
+// Read lock is not kept while the client is idle.
+void unlockAfterCommand(int closing) {
+	if(heldLock == LOCK_READ || (heldLock != 0 && closing)) {
+		pthread_rwlock_unlock(&lock);
+		heldLock = 0;
+	}
+}
+
+typedef struct ShardFile {
+	uint32_t index;
+	long size;
+} ShardFile;
+
+// Bigger files first, same sizes in manifest order.
+int compareShardFiles(const void *a, const void *b) {
+	const ShardFile *x = (const ShardFile *) a;
+	const ShardFile *y = (const ShardFile *) b;
+	if(x->size != y->size) {
+		return x->size > y->size ? -1 : 1;
+	}
+	return x->index < y->index ? -1 : (x->index > y->index ? 1 : 0);
+}
+
+// Manifest indices of the files in the sparse checkout, in *indices
+// (free yourself). Returns their number.
+uint32_t findSparseFiles(BinaryManifest *bm, SparseSpec *spec, uint32_t **indices) {
+	uint32_t numFiles = bm->header->numFiles;
+	*indices = malloc(sizeof(uint32_t) * (numFiles > 0 ? numFiles : 1));
+	uint32_t i, count = 0;
+	for(i = 0; i < numFiles; i++) {
+		if(isInSparseSpec(spec, binaryManifestPath(bm, i))) {
+			(*indices)[count++] = i;
+		}
+	}
+	return count;
+}
+
+// Splits the files of the current version (in the sparse checkout, if
+// spec is set) in numShards of about the same bytes, each next biggest
+// file goes to the smallest shard. Every shard request gets the same
+// split. Returns the number of files in the shard, their manifest
+// indices are in *indices (free yourself).
+uint32_t findShardFiles(char *projectName, BinaryManifest *bm, SparseSpec *spec, int shard, int numShards, uint32_t **indices) {
+	uint32_t *sparseIndices;
+	uint32_t numFiles = findSparseFiles(bm, spec, &sparseIndices);
+	char *version = readCurrentVersion(projectName);
+	ShardFile *files = malloc(sizeof(ShardFile) * (numFiles > 0 ? numFiles : 1));
+	uint32_t i;
+	for(i = 0; i < numFiles; i++) {
+		char *path = binaryManifestPath(bm, sparseIndices[i]);
+		char *fullPath = malloc(sizeof(char) * (strlen(BASE_DIRECTORY) + strlen(projectName) + strlen(version) + strlen(path) + 5));
+		sprintf(fullPath, "%s/%s/%s/%s", BASE_DIRECTORY, projectName, version, path);
+		files[i].index = sparseIndices[i];
+		files[i].size = findFileSize(fullPath);
+		free(fullPath);
+	}
+	free(sparseIndices);
+	free(version);
+	qsort(files, numFiles, sizeof(ShardFile), compareShardFiles);
+	
+	long long *shardBytes = calloc(numShards, sizeof(long long));
+	*indices = malloc(sizeof(uint32_t) * (numFiles > 0 ? numFiles : 1));
+	uint32_t count = 0;
+	for(i = 0; i < numFiles; i++) {
+		int smallest = 0, j;
+		for(j = 1; j < numShards; j++) {
+			if(shardBytes[j] < shardBytes[smallest]) {
+				smallest = j;
+			}
+		}
+		// Empty files still count, so they are spread too.
+		shardBytes[smallest] += files[i].size + 1;
+		if(smallest == shard) {
+			(*indices)[count++] = files[i].index;
+		}
+	}
+	free(shardBytes);
+	free(files);
+	return count;
+}
+
+// Writes the checkout response of the files at the manifest indices
+// (all if NULL) to a new file of the project, with the .manifest first
+// if withManifest. Files with a hash in clientObjects (may be NULL) are
+// sent as just their hash. Returns its path, delete yourself.
+char *createCheckoutResponse(char *projectName, BinaryManifest *bm, uint32_t *indices, uint32_t count, int withManifest, HashSet *clientObjects) {
+	char buffer[100];
+	char hash[HASH_STRING_LEN + 1];
+	char *serverRespPath = malloc(sizeof(char) * (strlen(BASE_DIRECTORY) + strlen(projectName) + 50));		
+	sprintf(serverRespPath, "%s/%s/%s%lld_%d", BASE_DIRECTORY, projectName, RESPONSE_FILE, current_timestamp_millis(), rand());
+	
+	int responseFd = open(serverRespPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	
+	sprintf(buffer, "%u:", withManifest + count);
+	write(responseFd, buffer, strlen(buffer));
+	
+	if(withManifest) {
+		writeFileToSocket(responseFd, projectName, MANIFEST_FILE);
+	}
+	
+	uint32_t i;
+	for(i = 0; i < count; i++) {
+		uint32_t index = indices != NULL ? indices[i] : i;
+		digestToHex(bm->entries[index].digest, hash);
+		if(hashSetContains(clientObjects, hash)) {
+			writeObjectRefToSocket(binaryManifestPath(bm, index), hash, responseFd);
+		} else {
+			writeFileToSocket(responseFd, projectName, binaryManifestPath(bm, index));
+		}
+	}
+	close(responseFd);
+	return serverRespPath;
+}
+
+// Sends the checkout response, staged for resume if there is a transfer id.
+void sendCheckoutResponse(int sockfd, char *responseFile, char *projectName, long clientDictionary, char *transferId) {
+	if(transferId != NULL) {
+		sendStagedResponse(sockfd, responseFile, projectName, clientDictionary, transferId);
+	} else {
+		convertResponseWithDictionary(sockfd, responseFile, projectName, clientDictionary);
+	}
+}
+
 // Precodition: project exists.
 Manifest *readCurrentSeverManifest(char *projectName) {
 	
+	// Binary copy needs no parsing.
+	BinaryManifest *bm = mapCurrentServerManifest(projectName);
+	if(bm != NULL) {
+		Manifest *result = binaryToManifest(bm);
+		unmapBinaryManifest(bm);
+		return result;
+	}
+	
 	char *path = malloc(sizeof(char) * (strlen(projectName) + strlen(MANIFEST_FILE) + 50 + strlen(BASE_DIRECTORY)));
 	
 	// Read current version of project.
@@ -112,6 +499,125 @@ Manifest *readCurrentSeverManifest(char *projectName) {
 	return result;
 }
 
+// Precodition: project exists.
+// Algorithm of the hashes in current manifest.
+int currentServerHashAlgorithm(char *projectName) {
+	BinaryManifest *bm = mapCurrentServerManifest(projectName);
+	if(bm != NULL) {
+		int algorithm = bm->header->hashAlgorithm;
+		unmapBinaryManifest(bm);
+		return algorithm;
+	}
+	
+	Manifest *manifest = readCurrentSeverManifest(projectName);
+	int algorithm = manifest->hashAlgorithm;
+	freeManifest(manifest);
+	return algorithm;
+}
+
+// Checks the hashes of files received in push, taken while they were
+// written, against the .commit entries. Returns the first file which
+// does not match, NULL if all are good.
+char *findDamagedFile(char *commitPath, char **filePaths, char *hashes, int numFiles) {
+	int commitFd = open(commitPath, O_RDONLY, 0777);
+	Manifest *entries = readManifestEntries(commitFd);
+	close(commitFd);
+	
+	char *result = NULL;
+	int i;
+	for(i = 0; i < numFiles && result == NULL; i++) {
+		if(strcmp(filePaths[i], COMMIT_FILE) == 0) {
+			continue;
+		}
+		ManifestNode *node = searchFile(entries, filePaths[i]);
+		if(node == NULL || strcmp(node->md5, hashes + i * (HASH_STRING_LEN + 1)) != 0) {
+			result = filePaths[i];
+		}
+	}
+	
+	freeManifest(entries);
+	return result;
+}
+
+// Writes the manifest into the version directory, in both
+// text and binary format.
+void writeServerManifest(char *projDir, int version, Manifest *manifest) {
+	char *path = malloc(sizeof(char) * (strlen(projDir) + strlen(BINARY_MANIFEST_FILE) + 50));
+	
+	sprintf(path, "%s/%d/%s", projDir, version, MANIFEST_FILE);
+	createDirStructureIfNeeded(path);
+	int manifestFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	writeManifestToFile(manifest, manifestFd);
+	close(manifestFd);
+	
+	sprintf(path, "%s/%d/%s", projDir, version, BINARY_MANIFEST_FILE);
+	manifestFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	writeBinaryManifest(manifest, manifestFd);
+	close(manifestFd);
+	
+	sprintf(path, "%s/%d/%s", projDir, version, MANIFEST_TREE_FILE);
+	manifestFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	ManifestTree *tree = buildManifestTree(manifest);
+	writeManifestTree(tree, manifestFd);
+	freeManifestTree(tree);
+	close(manifestFd);
+	
+	free(path);
+}
+
+// Precodition: project exists.
+// Creates the directory hash tree of current manifest, if it is not
+// there yet (older versions, rollbacks).
+void prepareManifestTree(char *projectName) {
+	char *path = malloc(sizeof(char) * (strlen(projectName) + strlen(MANIFEST_TREE_FILE) + 50 + strlen(BASE_DIRECTORY)));
+	char *version = readCurrentVersion(projectName);
+	
+	sprintf(path, "%s/%s/%s/%s", BASE_DIRECTORY, projectName, version, MANIFEST_TREE_FILE);
+	if(!checkFileExists(path)) {
+		Manifest *manifest = readCurrentSeverManifest(projectName);
+		ManifestTree *tree = buildManifestTree(manifest);
+		
+		int treeFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+		writeManifestTree(tree, treeFd);
+		close(treeFd);
+		
+		freeManifestTree(tree);
+		freeManifest(manifest);
+	}
+	
+	free(version);
+	free(path);
+}
+
+// Precodition: project exists.
+// Directories of the current tree which are in the set, or whose parent
+// is, sorted as in the tree.
+ManifestTree *readTreeLevel(char *projectName, DirSet *dirs) {
+	prepareManifestTree(projectName);
+	
+	char *path = malloc(sizeof(char) * (strlen(projectName) + strlen(MANIFEST_TREE_FILE) + 50 + strlen(BASE_DIRECTORY)));
+	char *version = readCurrentVersion(projectName);
+	sprintf(path, "%s/%s/%s/%s", BASE_DIRECTORY, projectName, version, MANIFEST_TREE_FILE);
+	
+	int treeFd = open(path, O_RDONLY, 0777);
+	ManifestTree *tree = readManifestTreeBytes(treeFd, findFileSize(path));
+	close(treeFd);
+	
+	int i, kept = 0;
+	for(i = 0; i < tree->numDirs; i++) {
+		if(dirSetContainsDir(dirs, tree->dirs[i].path) || dirSetContainsFile(dirs, tree->dirs[i].path)) {
+			tree->dirs[kept++] = tree->dirs[i];
+		} else {
+			free(tree->dirs[i].path);
+		}
+	}
+	tree->numDirs = kept;
+	
+	free(version);
+	free(path);
+	return tree;
+}
+
 void appendToHistoryFile(char *projectName, char *data) {
 	
 	char *path = malloc(sizeof(char) * (strlen(projectName) + strlen(HISTORY_FILE) + 50 + strlen(BASE_DIRECTORY)));
@@ -194,7 +700,8 @@ void createProject(int sockfd, char *projectName) {
 	write(manifestFd, "\n", 1);
 	write(manifestFd, version, strlen(version));
 	write(manifestFd, "\n", 1);
-	write(manifestFd, "0", 1);  // there are no files in start 
+	write(manifestFd, "0 ", 2);  // there are no files in start 
+	write(manifestFd, hashAlgorithmName(DEFAULT_HASH_ALGORITHM), strlen(hashAlgorithmName(DEFAULT_HASH_ALGORITHM)));
 	write(manifestFd, "\n", 1);
 	close(manifestFd);
 	
@@ -222,7 +729,128 @@ void processCommand(int sockfd) {
 		return;
 	}
 	
+	// Client first names the codecs it can use, preferred first. The
+	// chosen one is used for compressed data of this connection.
+	if(strcmp(command, "codecs") == 0) {
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *codecList = readAllBuffer(socketBuffer);
+		int codec = chooseCodec(codecList);
+		setTransferCodec(codec);
+		setTransferNegotiated(1);
+		
+		sprintf(buffer, "codec:%s:", codecName(codec));
+		write(sockfd, buffer, strlen(buffer));
+		free(codecList);
+		free(command);
+		
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		command = readAllBuffer(socketBuffer);
+		if(strlen(command) == 0) {
+			free(command);
+			freeSocketBuffer(socketBuffer);
+			return;
+		}
+	}
+	
+	// Before checkout and upgrade, client names the id of its cached
+	// dictionary of the project, 0 if none. -1 if client has no support.
+	long clientDictionary = -1;
+	if(strcmp(command, "dictionary") == 0) {
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *idStr = readAllBuffer(socketBuffer);
+		clientDictionary = strtoul(idStr, NULL, 10);
+		free(idStr);
+		free(command);
+		
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		command = readAllBuffer(socketBuffer);
+		if(strlen(command) == 0) {
+			free(command);
+			freeSocketBuffer(socketBuffer);
+			return;
+		}
+	}
+	
+	// Before checkout and push, client names the id of the transfer and
+	// the bytes of it it has, so a dropped one is resumed.
+	// Format: transfer:<id>:<offset>:
+	char *transferId = NULL;
+	long transferOffset = 0;
+	if(strcmp(command, "transfer") == 0) {
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		transferId = readAllBuffer(socketBuffer);
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *offsetStr = readAllBuffer(socketBuffer);
+		transferOffset = atol(offsetStr);
+		free(offsetStr);
+		free(command);
+		if(!isTransferId(transferId)) {
+			free(transferId);
+			transferId = NULL;
+		}
+		
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		command = readAllBuffer(socketBuffer);
+		if(strlen(command) == 0) {
+			free(transferId);
+			free(command);
+			freeSocketBuffer(socketBuffer);
+			return;
+		}
+	}
+	
+	// Before checkout and upgrade of a sparse checkout, client sends its
+	// spec (lines of its .sparse file), files out of it are not sent.
+	// Format: sparse:<specLen>:<spec>
+	SparseSpec *spec = NULL;
+	if(strcmp(command, "sparse") == 0) {
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *specLen = readAllBuffer(socketBuffer);
+		readNBytes(socketBuffer, sockfd, atoi(specLen));
+		char *specText = readAllBuffer(socketBuffer);
+		spec = parseSparseSpec(specText);
+		free(specText);
+		free(specLen);
+		free(command);
+		
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		command = readAllBuffer(socketBuffer);
+		if(strlen(command) == 0) {
+			freeSparseSpec(spec);
+			free(transferId);
+			free(command);
+			freeSocketBuffer(socketBuffer);
+			return;
+		}
+	}
+	
+	// Before checkout, client names the hashes of the files it has in
+	// its content cache, those are sent as just their hash.
+	// Format: objects:<hash algorithm>:<numHashes>:<Hash1><Hash2>..
+	HashSet *clientObjects = NULL;
+	int objectsAlgorithm = -1;
+	if(strcmp(command, "objects") == 0) {
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *algorithmName = readAllBuffer(socketBuffer);
+		objectsAlgorithm = hashAlgorithmFromName(algorithmName);
+		clientObjects = readHashSet(sockfd);
+		free(algorithmName);
+		free(command);
+		
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		command = readAllBuffer(socketBuffer);
+		if(strlen(command) == 0) {
+			freeHashSet(clientObjects);
+			freeSparseSpec(spec);
+			free(transferId);
+			free(command);
+			freeSocketBuffer(socketBuffer);
+			return;
+		}
+	}
+	
 	printf("Client issued command: %s\n", command);
+	lockForCommand(command);
 	
 	if(strcmp(command, "checkout") == 0) {
 	
@@ -233,51 +861,55 @@ void processCommand(int sockfd) {
 		readNBytes(socketBuffer, sockfd, projNameLen);
 		char *projectName = readAllBuffer(socketBuffer);
 		
+		// Only paths are needed, so use the mapped binary manifest.
+		BinaryManifest *serverManifest = NULL;
+		
 		if(!checkProject(projectName)) {
 			writeErrorToSocket(sockfd, "Project does not exist.");
 			
+		} else if(resumeTransfer(sockfd, transferId, transferOffset)) {
+			// Rest of the one staged before was sent.
+			
+		} else if((serverManifest = mapCurrentServerManifest(projectName)) == NULL) {
+			writeErrorToSocket(sockfd, "Could not read project manifest.");
+			
 		} else {
 			
-			Manifest *serverManifest = readCurrentSeverManifest(projectName);
 			write(sockfd, "sendfile:", strlen("sendfile:"));
 			
 			////////////////////////////////////////////////////
 			// Compression is required now, 
 			
-			char *serverRespPath = malloc(sizeof(char) * (strlen(BASE_DIRECTORY) + strlen(projectName) + 50));		
-			sprintf(serverRespPath, "%s/%s/%s%lld_%d", BASE_DIRECTORY, projectName, RESPONSE_FILE, current_timestamp_millis(), rand());
-			
-			int responseFd = open(serverRespPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
-			
-			// Add 1 for MANIFEST_FILE
-			sprintf(buffer, "%d:", 1 + serverManifest->numFiles);
-			write(responseFd, buffer, strlen(buffer));
-			
-			writeFileToSocket(responseFd, projectName, MANIFEST_FILE);
-			
-			ManifestNode *node = serverManifest->head;
-			while(node != NULL) {
-				writeFileToSocket(responseFd, projectName, node->filePath);
-				node = node->next;
+			// .manifest comes first, all of it even for a sparse checkout.
+			uint32_t *indices = NULL;
+			uint32_t count = serverManifest->header->numFiles;
+			if(spec != NULL) {
+				count = findSparseFiles(serverManifest, spec, &indices);
 			}
-			close(responseFd);
-						
-			convertResponseToZlib(sockfd, serverRespPath, BASE_DIRECTORY);
+			// Kept with another algorithm than this version's.
+			HashSet *objects = objectsAlgorithm == (int) serverManifest->header->hashAlgorithm ? clientObjects : NULL;
+			char *serverRespPath = createCheckoutResponse(projectName, serverManifest, indices, count, 1, objects);
+			sendCheckoutResponse(sockfd, serverRespPath, projectName, clientDictionary, transferId);
 			
 			unlink(serverRespPath);
 			free(serverRespPath);
+			free(indices);
 			
 			////////////////////////////////////////////////////
 			// Compression is done now, 
 			
-			freeManifest(serverManifest);
+			unmapBinaryManifest(serverManifest);
 		}
 		
 		free(nameLen);
 		free(projectName);
 		
-	} else if(strcmp(command, "create") == 0) {
-	
+	} else if(strcmp(command, "checkoutshard") == 0) {
+		
+		// Client uses: "checkoutshard:<projectNameLength>:<projectName><version>:<shard>:<numShards>:"
+		// on each of its connections of a parallel checkout. Server sends
+		// the files of that shard like checkout does, .manifest with shard 0.
+		// If the project is not at that version any more, it fails.
 		readTillDelimiter(socketBuffer, sockfd, ':');
 		char *nameLen = readAllBuffer(socketBuffer);
 		int projNameLen = atoi(nameLen);
@@ -285,25 +917,386 @@ void processCommand(int sockfd) {
 		readNBytes(socketBuffer, sockfd, projNameLen);
 		char *projectName = readAllBuffer(socketBuffer);
 		
-		if(checkProject(projectName)) {
-			writeErrorToSocket(sockfd, "Project Already exists.");
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *version = readAllBuffer(socketBuffer);
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *shardStr = readAllBuffer(socketBuffer);
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *numShardsStr = readAllBuffer(socketBuffer);
+		int shard = atoi(shardStr);
+		int numShards = atoi(numShardsStr);
+		
+		BinaryManifest *serverManifest = NULL;
+		char *currentVersion = NULL;
+		
+		if(!checkProject(projectName)) {
+			writeErrorToSocket(sockfd, "Project does not exist.");
+			
+		} else if(numShards < 1 || numShards > MAX_CHECKOUT_SHARDS || shard < 0 || shard >= numShards) {
+			writeErrorToSocket(sockfd, "Bad shard.");
+			
+		} else if(resumeTransfer(sockfd, transferId, transferOffset)) {
+			// Rest of the one staged before was sent.
+			
+		} else if(strcmp(version, currentVersion = readCurrentVersion(projectName)) != 0) {
+			writeErrorToSocket(sockfd, "Project changed during checkout.");
+			
+		} else if((serverManifest = mapCurrentServerManifest(projectName)) == NULL) {
+			writeErrorToSocket(sockfd, "Could not read project manifest.");
 			
 		} else {
-			createProject(sockfd, projectName);
 			write(sockfd, "sendfile:", strlen("sendfile:"));
-			write(sockfd, "1:", 2);
-			writeFileToSocket(sockfd, projectName, MANIFEST_FILE);
 			
-			char *hbuffer = malloc(sizeof(char) * (strlen(projectName) + 50));
-			sprintf(hbuffer, "Project created: %s\n\n", projectName);
-			appendToHistoryFile(projectName, hbuffer);
-			free(hbuffer);
+			uint32_t *indices;
+			uint32_t count = findShardFiles(projectName, serverManifest, spec, shard, numShards, &indices);
+			
+			HashSet *objects = objectsAlgorithm == (int) serverManifest->header->hashAlgorithm ? clientObjects : NULL;
+			char *serverRespPath = createCheckoutResponse(projectName, serverManifest, indices, count, shard == 0, objects);
+			sendCheckoutResponse(sockfd, serverRespPath, projectName, clientDictionary, transferId);
+			
+			unlink(serverRespPath);
+			free(serverRespPath);
+			free(indices);
+			unmapBinaryManifest(serverManifest);
 		}
 		
+		free(currentVersion);
+		free(numShardsStr);
+		free(shardStr);
+		free(version);
 		free(nameLen);
 		free(projectName);
 		
-	} else if(strcmp(command, "currentversion") == 0) {
+	} else if(strcmp(command, "hydrate") == 0) {
+		
+		// Client uses: "hydrate:<projectNameLength>:<projectName><version>:<numFiles>:<File1NameLen>:<File1Name>.."
+		// for the files of a lazy checkout it needs. Server sends them like
+		// checkout does, without the .manifest. Unknown files are left out.
+		// If the project is not at that version any more, it fails.
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *nameLen = readAllBuffer(socketBuffer);
+		int projNameLen = atoi(nameLen);
+		
+		readNBytes(socketBuffer, sockfd, projNameLen);
+		char *projectName = readAllBuffer(socketBuffer);
+		
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *version = readAllBuffer(socketBuffer);
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *numFilesStr = readAllBuffer(socketBuffer);
+		long numFiles = atol(numFilesStr);
+		
+		// Paths are read before anything is checked, the connection is
+		// used for more commands.
+		char **filePaths = malloc(sizeof(char *) * (numFiles > 0 ? numFiles : 1));
+		long i;
+		for(i = 0; i < numFiles; i++) {
+			readTillDelimiter(socketBuffer, sockfd, ':');
+			char *pathLen = readAllBuffer(socketBuffer);
+			readNBytes(socketBuffer, sockfd, atoi(pathLen));
+			filePaths[i] = readAllBuffer(socketBuffer);
+			free(pathLen);
+		}
+		
+		BinaryManifest *serverManifest = NULL;
+		char *currentVersion = NULL;
+		
+		if(!checkProject(projectName)) {
+			writeErrorToSocket(sockfd, "Project does not exist.");
+			
+		} else if(strcmp(version, currentVersion = readCurrentVersion(projectName)) != 0) {
+			writeErrorToSocket(sockfd, "Project changed on server, please update and upgrade first.");
+			
+		} else if((serverManifest = mapCurrentServerManifest(projectName)) == NULL) {
+			writeErrorToSocket(sockfd, "Could not read project manifest.");
+			
+		} else {
+			write(sockfd, "sendfile:", strlen("sendfile:"));
+			
+			uint32_t *indices = malloc(sizeof(uint32_t) * (numFiles > 0 ? numFiles : 1));
+			uint32_t count = 0;
+			for(i = 0; i < numFiles; i++) {
+				BinaryManifestEntry *entry = searchBinaryManifest(serverManifest, filePaths[i]);
+				if(entry != NULL) {
+					indices[count++] = entry - serverManifest->entries;
+				}
+			}
+			
+			char *serverRespPath = createCheckoutResponse(projectName, serverManifest, indices, count, 0, NULL);
+			convertResponseWithDictionary(sockfd, serverRespPath, projectName, clientDictionary);
+			
+			unlink(serverRespPath);
+			free(serverRespPath);
+			free(indices);
+			unmapBinaryManifest(serverManifest);
+		}
+		
+		for(i = 0; i < numFiles; i++) {
+			free(filePaths[i]);
+		}
+		free(filePaths);
+		free(currentVersion);
+		free(numFilesStr);
+		free(version);
+		free(nameLen);
+		free(projectName);
+		
+	} else if(strcmp(command, "received") == 0) {
+		
+		// Client uses: "received:<transferId>:" once it has all of a
+		// staged checkout, which is not needed any more. No response.
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *receivedId = readAllBuffer(socketBuffer);
+		if(isTransferId(receivedId)) {
+			char *path = transferPath(receivedId);
+			unlink(path);
+			free(path);
+		}
+		free(receivedId);
+		
+	} else if(strcmp(command, "create") == 0) {
+	
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *nameLen = readAllBuffer(socketBuffer);
+		int projNameLen = atoi(nameLen);
+		
+		readNBytes(socketBuffer, sockfd, projNameLen);
+		char *projectName = readAllBuffer(socketBuffer);
+		
+		if(checkProject(projectName)) {
+			writeErrorToSocket(sockfd, "Project Already exists.");
+			
+		} else {
+			createProject(sockfd, projectName);
+			write(sockfd, "sendfile:", strlen("sendfile:"));
+			writeFileBodyToSocket(sockfd, projectName, MANIFEST_FILE, 1);
+			
+			char *hbuffer = malloc(sizeof(char) * (strlen(projectName) + 50));
+			sprintf(hbuffer, "Project created: %s\n\n", projectName);
+			appendToHistoryFile(projectName, hbuffer);
+			free(hbuffer);
+		}
+		
+		free(nameLen);
+		free(projectName);
+		
+	} else if(strcmp(command, "currentversion") == 0) {
+	
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *nameLen = readAllBuffer(socketBuffer);
+		int projNameLen = atoi(nameLen);
+		
+		readNBytes(socketBuffer, sockfd, projNameLen);
+		char *projectName = readAllBuffer(socketBuffer);
+		
+		if(!checkProject(projectName)) {
+			writeErrorToSocket(sockfd, "Project does not exist.");
+			
+		} else {
+			// Just send manifest back.
+			write(sockfd, "sendfile:", strlen("sendfile:"));
+			writeFileBodyToSocket(sockfd, projectName, MANIFEST_FILE, 1);
+		}
+		
+		free(nameLen);
+		free(projectName);
+		
+	} else if(strcmp(command, "history") == 0) {
+	
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *nameLen = readAllBuffer(socketBuffer);
+		int projNameLen = atoi(nameLen);
+		
+		readNBytes(socketBuffer, sockfd, projNameLen);
+		char *projectName = readAllBuffer(socketBuffer);
+		
+		if(!checkProject(projectName)) {
+			writeErrorToSocket(sockfd, "Project does not exist.");
+		} else {
+			
+			// TODO: Write the history file, and its size
+			// which got created while pushing project.	
+			write(sockfd, "ok:", strlen("ok:"));
+			
+			char *historyPath = malloc(sizeof(char) * (strlen(projectName) + strlen(HISTORY_FILE) + 50 + strlen(BASE_DIRECTORY)));
+			
+			sprintf(historyPath, "%s/%s/%s", BASE_DIRECTORY, projectName, HISTORY_FILE);
+			
+			// Body is <historyFileBytes>:<contents>
+			char *bodyPath;
+			int bodyFd = createBodyFile(BASE_DIRECTORY, &bodyPath);
+			long hfsize = findFileSize(historyPath);
+			sprintf(buffer, "%ld:", hfsize);
+			write(bodyFd, buffer, strlen(buffer));
+			
+			// Now write history file contents.						
+			int fileFd = open(historyPath, O_RDONLY, 0777);
+			writeNBytesToFile(hfsize, fileFd, bodyFd);
+			close(fileFd);
+			close(bodyFd);
+			writeBodyToSocket(sockfd, bodyPath, BASE_DIRECTORY);
+			free(historyPath);
+		}
+		
+		free(nameLen);
+		free(projectName);
+		
+	}  else if(strcmp(command, "destroy") == 0) {
+	
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *nameLen = readAllBuffer(socketBuffer);
+		int projNameLen = atoi(nameLen);
+		
+		readNBytes(socketBuffer, sockfd, projNameLen);
+		char *projectName = readAllBuffer(socketBuffer);
+		
+		if(!checkProject(projectName)) {
+			writeErrorToSocket(sockfd, "Project does not exist.");
+		} else {
+			char *path = malloc(sizeof(char) * (strlen(projectName) + 50 + strlen(BASE_DIRECTORY)));
+			sprintf(path, "%s/%s", BASE_DIRECTORY, projectName);
+			removeDirectoryCompletely(path);
+			free(path);
+			
+			write(sockfd, "ok:", strlen("ok:"));
+		}
+		
+		free(nameLen);
+		free(projectName);
+		
+	} else if(strcmp(command, "rollback") == 0) {
+	
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *nameLen = readAllBuffer(socketBuffer);
+		int projNameLen = atoi(nameLen);
+		
+		readNBytes(socketBuffer, sockfd, projNameLen);
+		char *projectName = readAllBuffer(socketBuffer);
+		
+		if(!checkProject(projectName)) {
+			writeErrorToSocket(sockfd, "Project does not exist.");
+			
+		} else {
+			
+			char *path = malloc(sizeof(char) * (strlen(projectName) + strlen(BASE_DIRECTORY) + 50));
+			
+			readTillDelimiter(socketBuffer, sockfd, ':');
+			char *version = readAllBuffer(socketBuffer);
+			char *currVersion = readCurrentVersion(projectName);
+			
+			// check the version, if valid.	
+			sprintf(path, "%s/%s/%s.zlib", BASE_DIRECTORY, projectName, version);
+			
+			if(strcmp(version, currVersion) == 0) {
+				writeErrorToSocket(sockfd, "Project already on provided Version.");
+			} else if(!checkFileExists(path)) {
+				writeErrorToSocket(sockfd, "Invalid Version.");
+			} else {
+				
+				printf("Server rollback requested for version %s\n", version);
+				
+				// Now we need to delete all the directories, which are
+				// having better version.
+				
+				sprintf(path, "%s/%s", BASE_DIRECTORY, projectName);
+				DIR *dir = opendir(path);
+
+				struct dirent *entry = readdir(dir);
+				
+				// iterate on directory and remove higher versions.
+				while (entry != NULL) {
+					
+					char *fName = entry->d_name;
+					
+					// The compressed directories are in format
+					// <version>.zlib
+					if((strstr(fName, "zlib") != NULL) 
+						&& (entry->d_type == DT_REG)) {
+							
+						char name[50];
+						strncpy(name, fName, strlen(fName) - 5);
+						
+						int v = atoi(version);
+						int zlibVersion = atoi(name);
+						
+						if(zlibVersion > v) {
+							sprintf(path, "%s/%s/%s", BASE_DIRECTORY, projectName, entry->d_name);
+							unlink(path);
+						}
+					}
+					
+					// Old manifests are kept as <version>.manifest.bin
+					char *suffix = strstr(fName, BINARY_MANIFEST_FILE);
+					if(suffix != NULL && suffix != fName && strcmp(suffix, BINARY_MANIFEST_FILE) == 0
+						&& (entry->d_type == DT_REG) && atoi(fName) > atoi(version)) {
+						
+						sprintf(path, "%s/%s/%s", BASE_DIRECTORY, projectName, entry->d_name);
+						unlink(path);
+					}
+
+					entry = readdir(dir);
+				}
+
+				closedir(dir);
+				
+				// Now, delete the project current version directory.
+				sprintf(path, "%s/%s/%s", BASE_DIRECTORY, projectName, currVersion);
+				removeDirectoryCompletely(path);
+				
+				// Now, uncompress the zlib for the request version.
+				sprintf(path, "%s/%s/%s.zlib", BASE_DIRECTORY, projectName, version);
+				char *uncompressZlibPath = malloc(sizeof(char) * (strlen(projectName) + strlen(BASE_DIRECTORY) + 50));
+				sprintf(uncompressZlibPath, "%s/%s/%s.zlib_tmp", BASE_DIRECTORY, projectName, version);
+				
+				decompressFile(path, uncompressZlibPath, NULL);
+				
+				// Now, reCreate the files from uncompressed zlib
+				int oldVersionZlibFd = open(uncompressZlibPath, O_RDONLY, 0777);
+	
+				readTillDelimiter(socketBuffer, oldVersionZlibFd, ':');
+				char *numFilesStr = readAllBuffer(socketBuffer);
+				long numFiles = atol(numFilesStr);
+				
+				sprintf(path, "%s/%s/%s", BASE_DIRECTORY, projectName, version);	
+				while(numFiles-- > 0) {
+					writeFileFromSocket(oldVersionZlibFd, path);
+				}
+				free(numFilesStr);
+				close(oldVersionZlibFd);
+				
+				// Now delete the zlib_tmp and zlib file.
+				unlink(uncompressZlibPath);
+				sprintf(path, "%s/%s/%s.zlib", BASE_DIRECTORY, projectName, version);
+				unlink(path);
+				
+				free(uncompressZlibPath);
+				
+				//////////////////////////////////////////////////
+				
+				char hbuffer[100];
+				sprintf(hbuffer, "Project rolled back to version: %s\n\n", version);
+				appendToHistoryFile(projectName, hbuffer);
+					
+				// Write new version in .version file
+				sprintf(path, "%s/%s/%s", BASE_DIRECTORY, projectName, VERSION_FILE);
+				createDirStructureIfNeeded(path);
+				int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+				write(fd, version, strlen(version));
+				close(fd);
+				
+				// Return response to client.
+				write(sockfd, "ok:", strlen("ok:"));
+			}
+			
+			free(version);
+			free(currVersion);
+			free(path);
+		}
+		
+		free(nameLen);
+		free(projectName);
+		
+	} else if(strcmp(command, "update") == 0) {
 	
 		readTillDelimiter(socketBuffer, sockfd, ':');
 		char *nameLen = readAllBuffer(socketBuffer);
@@ -318,15 +1311,141 @@ void processCommand(int sockfd) {
 		} else {
 			// Just send manifest back.
 			write(sockfd, "sendfile:", strlen("sendfile:"));
-			write(sockfd, "1:", 2);
-			writeFileToSocket(sockfd, projectName, MANIFEST_FILE);
+			writeFileBodyToSocket(sockfd, projectName, MANIFEST_FILE, 0);
 		}
 		
 		free(nameLen);
 		free(projectName);
 		
-	} else if(strcmp(command, "history") == 0) {
-	
+	} else if(strcmp(command, "signatures") == 0) {
+		
+		// Client uses: "signatures:<projectNameLength>:<projectName><body of <numFiles>:<file1Len>:<file1>..>"
+		// Server sends the signatures of those files of current version,
+		// client then pushes only their changes.
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *nameLen = readAllBuffer(socketBuffer);
+		int projNameLen = atoi(nameLen);
+		
+		readNBytes(socketBuffer, sockfd, projNameLen);
+		char *projectName = readAllBuffer(socketBuffer);
+		
+		int bodyFd = openBodyFromSocket(sockfd, BASE_DIRECTORY);
+		readTillDelimiter(socketBuffer, bodyFd, ':');
+		char *numFilesStr = readAllBuffer(socketBuffer);
+		int numFiles = atoi(numFilesStr);
+		
+		char **filePaths = malloc(sizeof(char *) * (numFiles > 0 ? numFiles : 1));
+		int i;
+		for(i = 0; i < numFiles; i++) {
+			readTillDelimiter(socketBuffer, bodyFd, ':');
+			char *fileLen = readAllBuffer(socketBuffer);
+			readNBytes(socketBuffer, bodyFd, atoi(fileLen));
+			filePaths[i] = readAllBuffer(socketBuffer);
+			free(fileLen);
+		}
+		close(bodyFd);
+		
+		if(!checkProject(projectName)) {
+			writeErrorToSocket(sockfd, "Project does not exist.");
+			
+		} else {
+			char *version = readCurrentVersion(projectName);
+			char *projDir = malloc(sizeof(char) * (strlen(BASE_DIRECTORY) + strlen(projectName) + 5));
+			sprintf(projDir, "%s/%s", BASE_DIRECTORY, projectName);
+			char *versionDir = malloc(sizeof(char) * (strlen(projDir) + strlen(version) + 5));
+			sprintf(versionDir, "%s/%s", projDir, version);
+			
+			write(sockfd, "sendfile:", strlen("sendfile:"));
+			char *bodyPath;
+			bodyFd = createBodyFile(projDir, &bodyPath);
+			writeSignaturesToSocket(filePaths, numFiles, versionDir, bodyFd);
+			close(bodyFd);
+			writeBodyToSocket(sockfd, bodyPath, projDir);
+			
+			free(versionDir);
+			free(projDir);
+			free(version);
+		}
+		
+		for(i = 0; i < numFiles; i++) {
+			free(filePaths[i]);
+		}
+		free(filePaths);
+		free(numFilesStr);
+		free(nameLen);
+		free(projectName);
+		
+	} else if(strcmp(command, "have") == 0) {
+		
+		// Client uses: "have:<projectNameLength>:<projectName><body of <hashAlgorithm>:<numHashes>:<hash1><hash2>..>"
+		// Server sends which of those files it has, client then pushes
+		// just the hashes of those.
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *nameLen = readAllBuffer(socketBuffer);
+		int projNameLen = atoi(nameLen);
+		
+		readNBytes(socketBuffer, sockfd, projNameLen);
+		char *projectName = readAllBuffer(socketBuffer);
+		
+		int bodyFd = openBodyFromSocket(sockfd, BASE_DIRECTORY);
+		readTillDelimiter(socketBuffer, bodyFd, ':');
+		char *algorithmName = readAllBuffer(socketBuffer);
+		HashSet *offered = readHashSet(bodyFd);
+		close(bodyFd);
+		
+		Manifest *serverManifest = NULL;
+		
+		if(!checkProject(projectName)) {
+			writeErrorToSocket(sockfd, "Project does not exist.");
+			
+		} else if((serverManifest = readCurrentSeverManifest(projectName)) == NULL) {
+			writeErrorToSocket(sockfd, "Could not read project manifest.");
+			
+		} else {
+			char *version = readCurrentVersion(projectName);
+			char *projDir = malloc(sizeof(char) * (strlen(BASE_DIRECTORY) + strlen(projectName) + 5));
+			sprintf(projDir, "%s/%s", BASE_DIRECTORY, projectName);
+			
+			// Files of current version are put in the store when asked
+			// for (renames, copies), if not there yet.
+			int hashAlgorithm = hashAlgorithmFromName(algorithmName);
+			ManifestNode *node = serverManifest->head;
+			while(node != NULL && hashAlgorithm == serverManifest->hashAlgorithm) {
+				if(hashSetContains(offered, node->md5) && !hasObject(hashAlgorithm, node->md5)) {
+					char *filePath = malloc(sizeof(char) * (strlen(projDir) + strlen(version) + strlen(node->filePath) + 3));
+					sprintf(filePath, "%s/%s/%s", projDir, version, node->filePath);
+					keepObject(filePath, hashAlgorithm, node->md5);
+					free(filePath);
+				}
+				node = node->next;
+			}
+			trimObjectStore(OBJECT_STORE_MAX_BYTES);
+			
+			HashSet *stored = findObjects(offered, hashAlgorithm);
+			
+			write(sockfd, "sendfile:", strlen("sendfile:"));
+			char *bodyPath;
+			bodyFd = createBodyFile(projDir, &bodyPath);
+			writeHashSet(stored, bodyFd);
+			close(bodyFd);
+			writeBodyToSocket(sockfd, bodyPath, projDir);
+			
+			freeHashSet(stored);
+			freeManifest(serverManifest);
+			free(projDir);
+			free(version);
+		}
+		
+		freeHashSet(offered);
+		free(algorithmName);
+		free(nameLen);
+		free(projectName);
+		
+	} else if(strcmp(command, "chunks") == 0) {
+		
+		// Client uses: "chunks:<projectNameLength>:<projectName><body of <numHashes>:<hash1><hash2>..>"
+		// Server sends which of those chunks it has, client then pushes
+		// only the data of the others.
 		readTillDelimiter(socketBuffer, sockfd, ':');
 		char *nameLen = readAllBuffer(socketBuffer);
 		int projNameLen = atoi(nameLen);
@@ -334,36 +1453,64 @@ void processCommand(int sockfd) {
 		readNBytes(socketBuffer, sockfd, projNameLen);
 		char *projectName = readAllBuffer(socketBuffer);
 		
+		int bodyFd = openBodyFromSocket(sockfd, BASE_DIRECTORY);
+		HashSet *offered = readHashSet(bodyFd);
+		close(bodyFd);
+		
+		Manifest *serverManifest = NULL;
+		
 		if(!checkProject(projectName)) {
 			writeErrorToSocket(sockfd, "Project does not exist.");
-		} else {
 			
-			// TODO: Write the history file, and its size
-			// which got created while pushing project.	
-			write(sockfd, "ok:", strlen("ok:"));
+		} else if((serverManifest = readCurrentSeverManifest(projectName)) == NULL) {
+			writeErrorToSocket(sockfd, "Could not read project manifest.");
 			
-			char *historyPath = malloc(sizeof(char) * (strlen(projectName) + strlen(HISTORY_FILE) + 50 + strlen(BASE_DIRECTORY)));
+		} else {
+			char *version = readCurrentVersion(projectName);
+			char *projDir = malloc(sizeof(char) * (strlen(BASE_DIRECTORY) + strlen(projectName) + 5));
+			sprintf(projDir, "%s/%s", BASE_DIRECTORY, projectName);
+			char *versionDir = malloc(sizeof(char) * (strlen(projDir) + strlen(version) + 5));
+			sprintf(versionDir, "%s/%s", projDir, version);
+			
+			// Big files of current version go into the store, if they
+			// are not there yet (versions pushed by older builds).
+			char **filePaths = malloc(sizeof(char *) * (serverManifest->numFiles > 0 ? serverManifest->numFiles : 1));
+			int numPaths = 0;
+			ManifestNode *node = serverManifest->head;
+			while(node != NULL) {
+				filePaths[numPaths++] = node->filePath;
+				node = node->next;
+			}
+			freeHashSet(chunkFiles(versionDir, filePaths, numPaths));
+			releaseChunkFiles();
+			free(filePaths);
 			
-			sprintf(historyPath, "%s/%s/%s", BASE_DIRECTORY, projectName, HISTORY_FILE);
+			HashSet *stored = storedChunks(offered);
 			
-			long hfsize = findFileSize(historyPath);
-			sprintf(buffer, "%ld:", hfsize);
-			write(sockfd, buffer, strlen(buffer));
+			write(sockfd, "sendfile:", strlen("sendfile:"));
+			char *bodyPath;
+			bodyFd = createBodyFile(projDir, &bodyPath);
+			writeHashSet(stored, bodyFd);
+			close(bodyFd);
+			writeBodyToSocket(sockfd, bodyPath, projDir);
 			
-			// Now write history file contents.						
-			int fileFd = open(historyPath, O_RDONLY, 0777);
-			char c;
-			while (read(fileFd, &c, 1) == 1) {
-				write(sockfd, &c, 1);
-			}
-			close(fileFd);
+			freeHashSet(stored);
+			freeManifest(serverManifest);
+			free(versionDir);
+			free(projDir);
+			free(version);
 		}
 		
+		freeHashSet(offered);
 		free(nameLen);
 		free(projectName);
 		
-	}  else if(strcmp(command, "destroy") == 0) {
-	
+	} else if(strcmp(command, "treelevel") == 0) {
+		
+		// Client uses: "treelevel:<projectNameLength>:<projectName><numDirs>:<dir1Len>:<dir1>.."
+		// Server sends the hashes of those directories and their direct sub
+		// directories, in the tree file format. The client asks for the next
+		// level only under directories whose hash differs.
 		readTillDelimiter(socketBuffer, sockfd, ':');
 		char *nameLen = readAllBuffer(socketBuffer);
 		int projNameLen = atoi(nameLen);
@@ -371,22 +1518,64 @@ void processCommand(int sockfd) {
 		readNBytes(socketBuffer, sockfd, projNameLen);
 		char *projectName = readAllBuffer(socketBuffer);
 		
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *numDirsStr = readAllBuffer(socketBuffer);
+		int numDirs = atoi(numDirsStr);
+		
+		DirSet *dirs = createDirSet();
+		int i;
+		for(i = 0; i < numDirs; i++) {
+			readTillDelimiter(socketBuffer, sockfd, ':');
+			char *dirLen = readAllBuffer(socketBuffer);
+			readNBytes(socketBuffer, sockfd, atoi(dirLen));
+			char *dir = readAllBuffer(socketBuffer);
+			addToDirSet(dirs, dir);
+			free(dir);
+			free(dirLen);
+		}
+		
 		if(!checkProject(projectName)) {
 			writeErrorToSocket(sockfd, "Project does not exist.");
+			
 		} else {
-			char *path = malloc(sizeof(char) * (strlen(projectName) + 50 + strlen(BASE_DIRECTORY)));
-			sprintf(path, "%s/%s", BASE_DIRECTORY, projectName);
-			removeDirectoryCompletely(path);
-			free(path);
+			ManifestTree *level = readTreeLevel(projectName, dirs);
 			
-			write(sockfd, "ok:", strlen("ok:"));
+			char *projDir = malloc(sizeof(char) * (strlen(BASE_DIRECTORY) + strlen(projectName) + 5));
+			sprintf(projDir, "%s/%s", BASE_DIRECTORY, projectName);
+			
+			char *respName = malloc(sizeof(char) * (strlen(RESPONSE_FILE) + 50));
+			sprintf(respName, "%s%lld_%d", RESPONSE_FILE, current_timestamp_millis(), rand());
+			
+			char *respPath = malloc(sizeof(char) * (strlen(projDir) + strlen(respName) + 5));
+			sprintf(respPath, "%s/%s", projDir, respName);
+			
+			int responseFd = open(respPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+			writeManifestTree(level, responseFd);
+			close(responseFd);
+			
+			write(sockfd, "sendfile:", strlen("sendfile:"));
+			char *bodyPath;
+			int bodyFd = createBodyFile(projDir, &bodyPath);
+			writeFileDetailsToSocket(respName, projDir, bodyFd);
+			close(bodyFd);
+			writeBodyToSocket(sockfd, bodyPath, projDir);
+			unlink(respPath);
+			
+			free(respPath);
+			free(respName);
+			free(projDir);
+			freeManifestTree(level);
 		}
 		
+		freeDirSet(dirs);
+		free(numDirsStr);
 		free(nameLen);
 		free(projectName);
 		
-	} else if(strcmp(command, "rollback") == 0) {
-	
+	} else if(strcmp(command, "entries") == 0) {
+		
+		// Client uses: "entries:<projectNameLength>:<projectName><numDirs>:<dir1Len>:<dir1>.."
+		// Server sends a manifest with only the files of those directories.
 		readTillDelimiter(socketBuffer, sockfd, ':');
 		char *nameLen = readAllBuffer(socketBuffer);
 		int projNameLen = atoi(nameLen);
@@ -394,122 +1583,69 @@ void processCommand(int sockfd) {
 		readNBytes(socketBuffer, sockfd, projNameLen);
 		char *projectName = readAllBuffer(socketBuffer);
 		
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *numDirsStr = readAllBuffer(socketBuffer);
+		int numDirs = atoi(numDirsStr);
+		
+		DirSet *dirs = createDirSet();
+		int i;
+		for(i = 0; i < numDirs; i++) {
+			readTillDelimiter(socketBuffer, sockfd, ':');
+			char *dirLen = readAllBuffer(socketBuffer);
+			readNBytes(socketBuffer, sockfd, atoi(dirLen));
+			char *dir = readAllBuffer(socketBuffer);
+			addToDirSet(dirs, dir);
+			free(dir);
+			free(dirLen);
+		}
+		
 		if(!checkProject(projectName)) {
 			writeErrorToSocket(sockfd, "Project does not exist.");
 			
 		} else {
+			Manifest *manifest = readCurrentSeverManifest(projectName);
+			Manifest *others = splitManifestByDirs(manifest, dirs);
 			
-			char *path = malloc(sizeof(char) * (strlen(projectName) + strlen(BASE_DIRECTORY) + 50));
+			char *projDir = malloc(sizeof(char) * (strlen(BASE_DIRECTORY) + strlen(projectName) + 5));
+			sprintf(projDir, "%s/%s", BASE_DIRECTORY, projectName);
 			
-			readTillDelimiter(socketBuffer, sockfd, ':');
-			char *version = readAllBuffer(socketBuffer);
-			char *currVersion = readCurrentVersion(projectName);
+			char *respName = malloc(sizeof(char) * (strlen(RESPONSE_FILE) + 50));
+			sprintf(respName, "%s%lld_%d", RESPONSE_FILE, current_timestamp_millis(), rand());
 			
-			// check the version, if valid.	
-			sprintf(path, "%s/%s/%s.zlib", BASE_DIRECTORY, projectName, version);
+			char *respPath = malloc(sizeof(char) * (strlen(projDir) + strlen(respName) + 5));
+			sprintf(respPath, "%s/%s", projDir, respName);
 			
-			if(strcmp(version, currVersion) == 0) {
-				writeErrorToSocket(sockfd, "Project already on provided Version.");
-			} else if(!checkFileExists(path)) {
-				writeErrorToSocket(sockfd, "Invalid Version.");
-			} else {
-				
-				printf("Server rollback requested for version %s\n", version);
-				
-				// Now we need to delete all the directories, which are
-				// having better version.
-				
-				sprintf(path, "%s/%s", BASE_DIRECTORY, projectName);
-				DIR *dir = opendir(path);
-
-				struct dirent *entry = readdir(dir);
-				
-				// iterate on directory and remove higher versions.
-				while (entry != NULL) {
-					
-					char *fName = entry->d_name;
-					
-					// The compressed directories are in format
-					// <version>.zlib
-					if((strstr(fName, "zlib") != NULL) 
-						&& (entry->d_type == DT_REG)) {
-							
-						char name[50];
-						strncpy(name, fName, strlen(fName) - 5);
-						
-						int v = atoi(version);
-						int zlibVersion = atoi(name);
-						
-						if(zlibVersion > v) {
-							sprintf(path, "%s/%s/%s", BASE_DIRECTORY, projectName, entry->d_name);
-							unlink(path);
-						}
-					}
-
-					entry = readdir(dir);
-				}
-
-				closedir(dir);
-				
-				// Now, delete the project current version directory.
-				sprintf(path, "%s/%s/%s", BASE_DIRECTORY, projectName, currVersion);
-				removeDirectoryCompletely(path);
-				
-				// Now, uncompress the zlib for the request version.
-				sprintf(path, "%s/%s/%s.zlib", BASE_DIRECTORY, projectName, version);
-				char *uncompressZlibPath = malloc(sizeof(char) * (strlen(projectName) + strlen(BASE_DIRECTORY) + 50));
-				sprintf(uncompressZlibPath, "%s/%s/%s.zlib_tmp", BASE_DIRECTORY, projectName, version);
-				
-				decompressFile(path, uncompressZlibPath);
-				
-				// Now, reCreate the files from uncompressed zlib
-				int oldVersionZlibFd = open(uncompressZlibPath, O_RDONLY, 0777);
-	
-				readTillDelimiter(socketBuffer, oldVersionZlibFd, ':');
-				char *numFilesStr = readAllBuffer(socketBuffer);
-				long numFiles = atol(numFilesStr);
-				
-				sprintf(path, "%s/%s/%s", BASE_DIRECTORY, projectName, version);	
-				while(numFiles-- > 0) {
-					writeFileFromSocket(oldVersionZlibFd, path);
-				}
-				free(numFilesStr);
-				close(oldVersionZlibFd);
-				
-				// Now delete the zlib_tmp and zlib file.
-				unlink(uncompressZlibPath);
-				sprintf(path, "%s/%s/%s.zlib", BASE_DIRECTORY, projectName, version);
-				unlink(path);
-				
-				free(uncompressZlibPath);
-				
-				//////////////////////////////////////////////////
-				
-				char hbuffer[100];
-				sprintf(hbuffer, "Project rolled back to version: %s\n\n", version);
-				appendToHistoryFile(projectName, hbuffer);
-					
-				// Write new version in .version file
-				sprintf(path, "%s/%s/%s", BASE_DIRECTORY, projectName, VERSION_FILE);
-				createDirStructureIfNeeded(path);
-				int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
-				write(fd, version, strlen(version));
-				close(fd);
-				
-				// Return response to client.
-				write(sockfd, "ok:", strlen("ok:"));
-			}
+			int responseFd = open(respPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+			writeManifestToFile(manifest, responseFd);
+			close(responseFd);
 			
-			free(version);
-			free(currVersion);
-			free(path);
+			write(sockfd, "sendfile:", strlen("sendfile:"));
+			char *bodyPath;
+			int bodyFd = createBodyFile(projDir, &bodyPath);
+			writeFileDetailsToSocket(respName, projDir, bodyFd);
+			close(bodyFd);
+			writeBodyToSocket(sockfd, bodyPath, projDir);
+			unlink(respPath);
+			
+			free(respPath);
+			free(respName);
+			free(projDir);
+			freeManifest(others);
+			freeManifest(manifest);
 		}
 		
+		freeDirSet(dirs);
+		free(numDirsStr);
 		free(nameLen);
 		free(projectName);
 		
-	} else if(strcmp(command, "update") == 0) {
-	
+	} else if(strcmp(command, "manifestdelta") == 0) {
+		
+		// Client uses: "manifestdelta:<projectNameLength>:<projectName><baseVersion>:"
+		// Server sends changes of manifest from baseVersion to current version
+		// delta:<FileNameLen>:<FileName><numBytes>:<changes>
+		// If manifest of baseVersion is not there, changes are from empty manifest
+		// full:<FileNameLen>:<FileName><numBytes>:<changes>
 		readTillDelimiter(socketBuffer, sockfd, ':');
 		char *nameLen = readAllBuffer(socketBuffer);
 		int projNameLen = atoi(nameLen);
@@ -517,15 +1653,61 @@ void processCommand(int sockfd) {
 		readNBytes(socketBuffer, sockfd, projNameLen);
 		char *projectName = readAllBuffer(socketBuffer);
 		
+		readTillDelimiter(socketBuffer, sockfd, ':');
+		char *baseVersion = readAllBuffer(socketBuffer);
+		
+		BinaryManifest *headManifest = NULL;
+		
 		if(!checkProject(projectName)) {
 			writeErrorToSocket(sockfd, "Project does not exist.");
 			
+		} else if((headManifest = mapCurrentServerManifest(projectName)) == NULL) {
+			writeErrorToSocket(sockfd, "Could not read project manifest.");
+			
 		} else {
-			// Just send manifest back.
-			write(sockfd, "sendfile:", strlen("sendfile:"));
-			writeFileToSocket(sockfd, projectName, MANIFEST_FILE);
+			char *projDir = malloc(sizeof(char) * (strlen(BASE_DIRECTORY) + strlen(projectName) + 5));
+			sprintf(projDir, "%s/%s", BASE_DIRECTORY, projectName);
+			
+			char *path = malloc(sizeof(char) * (strlen(projDir) + strlen(baseVersion) + strlen(BINARY_MANIFEST_FILE) + 50));
+			sprintf(path, "%s/%s%s", projDir, baseVersion, BINARY_MANIFEST_FILE);
+			
+			BinaryManifest *baseManifest = NULL;
+			if(strcmp(baseVersion, binaryManifestVersion(headManifest)) == 0) {
+				baseManifest = headManifest;
+			} else if(strlen(baseVersion) > 0 && strchr(baseVersion, '/') == NULL) {
+				baseManifest = mapBinaryManifest(path);
+			}
+			
+			char *respName = malloc(sizeof(char) * (strlen(RESPONSE_FILE) + 50));
+			sprintf(respName, "%s%lld_%d", RESPONSE_FILE, current_timestamp_millis(), rand());
+			sprintf(path, "%s/%s", projDir, respName);
+			
+			int responseFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+			writeBinaryManifestDelta(baseManifest, headManifest, responseFd);
+			close(responseFd);
+			
+			if(baseManifest == NULL) {
+				write(sockfd, "full:", strlen("full:"));
+			} else {
+				write(sockfd, "delta:", strlen("delta:"));
+			}
+			char *bodyPath;
+			int bodyFd = createBodyFile(projDir, &bodyPath);
+			writeFileDetailsToSocket(respName, projDir, bodyFd);
+			close(bodyFd);
+			writeBodyToSocket(sockfd, bodyPath, projDir);
+			unlink(path);
+			
+			if(baseManifest != NULL && baseManifest != headManifest) {
+				unmapBinaryManifest(baseManifest);
+			}
+			unmapBinaryManifest(headManifest);
+			free(respName);
+			free(path);
+			free(projDir);
 		}
 		
+		free(baseVersion);
 		free(nameLen);
 		free(projectName);
 		
@@ -538,19 +1720,59 @@ void processCommand(int sockfd) {
 		readNBytes(socketBuffer, sockfd, projNameLen);
 		char *projectName = readAllBuffer(socketBuffer);
 		
+		// We simply create the .update file locally on server.
+		char *path = malloc(sizeof(char) * (strlen(projectName) + strlen(BASE_DIRECTORY) + 50));
+		
+		// We pass the base directory path, inside which file need to be created.
+		sprintf(path, "%s/%s", BASE_DIRECTORY, projectName);
+		int bodyFd = -1;
+		
 		if(!checkProject(projectName)) {
 			writeErrorToSocket(sockfd, "Project does not exist.");
 			
+		} else if((bodyFd = openBodyFromSocket(sockfd, path)) < 0) {
+			// Without the .update, no files would be sent, and the
+			// client would take the new manifest for its old files.
+			writeErrorToSocket(sockfd, "Could not read the upgrade request.");
+			
 		} else {
 			
 			// First read the .update file now.
+			writeFileFromSocket(bodyFd, path);
+			
+			// Then signatures of client's copies of big modified files,
+			// those are sent as changes, chunks of client's tracked
+			// files, big new files are sent as their chunks, and hashes
+			// of files client has kept, those are not sent.
+			char *signatureDir = NULL;
+			HashSet *clientChunks = NULL;
+			HashSet *clientObjects = NULL;
+			if(isTransferNegotiated()) {
+				signatureDir = readSignaturesFromSocket(bodyFd, path);
+				clientChunks = readHashSet(bodyFd);
+				readTillDelimiter(socketBuffer, bodyFd, ':');
+				char *algorithmName = readAllBuffer(socketBuffer);
+				clientObjects = readHashSet(bodyFd);
+				
+				// Older builds can not build files from chunks.
+				if(clientChunks->count == 0) {
+					freeHashSet(clientChunks);
+					clientChunks = NULL;
+				}
+				
+				// Kept with another algorithm than this version's.
+				if(hashAlgorithmFromName(algorithmName) != currentServerHashAlgorithm(projectName)) {
+					freeHashSet(clientObjects);
+					clientObjects = NULL;
+				}
+				free(algorithmName);
+			}
+			close(bodyFd);
 			
-			// We simply create the .update file locally on server.
-			char *path = malloc(sizeof(char) * (strlen(projectName) + strlen(BASE_DIRECTORY) + 50));
-			
-			// We pass the base directory path, inside which file need to be created.
-			sprintf(path, "%s/%s", BASE_DIRECTORY, projectName);
-			writeFileFromSocket(sockfd, path);
+			char *version = readCurrentVersion(projectName);
+			char *versionDir = malloc(sizeof(char) * (strlen(path) + strlen(version) + 2));
+			sprintf(versionDir, "%s/%s", path, version);
+			free(version);
 			
 			// Now read the update file.
 			sprintf(path, "%s/%s/%s", BASE_DIRECTORY, projectName, UPDATE_FILE);
@@ -558,6 +1780,7 @@ void processCommand(int sockfd) {
 			typedef struct FileNode {
 				char *filePath;
 				char *code;
+				char *hash;
 				struct FileNode *next;
 			} FileNode;
 			
@@ -578,13 +1801,23 @@ void processCommand(int sockfd) {
 				FileNode *tmp = malloc(sizeof(FileNode));
 				tmp->code = code;
 				
-				// ignore file version and new hash
-				readTillDelimiter(socketBuffer, updateFd, ' ');
+				// ignore file version, keep new hash
 				readTillDelimiter(socketBuffer, updateFd, ' ');
 				clearSocketBuffer(socketBuffer);
+				readTillDelimiter(socketBuffer, updateFd, ' ');
+				tmp->hash = readAllBuffer(socketBuffer);
 				
 				readTillDelimiter(socketBuffer, updateFd, '\n');
 				tmp->filePath = readAllBuffer(socketBuffer);
+				
+				// Out of client's sparse checkout.
+				if(!isInSparseSpec(spec, tmp->filePath)) {
+					free(tmp->filePath);
+					free(tmp->hash);
+					free(tmp->code);
+					free(tmp);
+					continue;
+				}
 				tmp->next = listOfFiles;
 				listOfFiles = tmp;
 				
@@ -621,18 +1854,33 @@ void processCommand(int sockfd) {
 				FileNode *curr = start;
 				start = start->next;
 				
-				if(strcmp(curr->code, "D") != 0) {
+				if(strcmp(curr->code, "D") != 0 && hashSetContains(clientObjects, curr->hash)) {
+					writeObjectRefToSocket(curr->filePath, curr->hash, responseFd);
+				} else if(strcmp(curr->code, "A") == 0 && clientChunks != NULL && isChunkedFile(versionDir, curr->filePath)) {
+					writeFileChunksToSocket(curr->filePath, versionDir, clientChunks, responseFd);
+				} else if(strcmp(curr->code, "D") != 0 && signatureDir != NULL) {
+					writeFileDeltaDetailsToSocket(curr->filePath, versionDir, signatureDir, responseFd);
+				} else if(strcmp(curr->code, "D") != 0) {
 					writeFileToSocket(responseFd, projectName, curr->filePath);
 				}
 				
 				free(curr->filePath);
 				free(curr->code);
+				free(curr->hash);
 				free(curr);
 			}
 			
 			close(responseFd);
+			if(signatureDir != NULL) {
+				removeDirectoryCompletely(signatureDir);
+				free(signatureDir);
+			}
+			freeHashSet(clientChunks);
+			freeHashSet(clientObjects);
+			releaseChunkFiles();
+			free(versionDir);
 			
-			convertResponseToZlib(sockfd, serverRespPath, BASE_DIRECTORY);
+			convertResponseWithDictionary(sockfd, serverRespPath, projectName, clientDictionary);
 			
 			unlink(serverRespPath);
 			free(serverRespPath);
@@ -642,10 +1890,9 @@ void processCommand(int sockfd) {
 			
 			// delete the update file which we created locally
 			unlink(path);
-			
-			free(path);
 		}
 		
+		free(path);
 		free(nameLen);
 		free(projectName);
 		
@@ -664,7 +1911,7 @@ void processCommand(int sockfd) {
 		} else {
 			// Just send manifest back.
 			write(sockfd, "sendfile:", strlen("sendfile:"));
-			writeFileToSocket(sockfd, projectName, MANIFEST_FILE);
+			writeFileBodyToSocket(sockfd, projectName, MANIFEST_FILE, 0);
 		}
 		
 		free(nameLen);
@@ -687,22 +1934,25 @@ void processCommand(int sockfd) {
 			
 		} else {
 			
+			// Rest of the request is a body.
+			int bodyFd = openBodyFromSocket(sockfd, BASE_DIRECTORY);
+			
 			// ignore number of files.
-			readTillDelimiter(socketBuffer, sockfd, ':');
+			readTillDelimiter(socketBuffer, bodyFd, ':');
 			clearSocketBuffer(socketBuffer);
 			
 			// We are just doing the commit.
 			// So take the current timestamp, and append it to 
 			// the "Commit"
 						
-			readTillDelimiter(socketBuffer, sockfd, ':');
+			readTillDelimiter(socketBuffer, bodyFd, ':');
 			char *nameLenStr = readAllBuffer(socketBuffer);
 			long nameLen = atol(nameLenStr);
 			
-			readNBytes(socketBuffer, sockfd, nameLen);
+			readNBytes(socketBuffer, bodyFd, nameLen);
 			clearSocketBuffer(socketBuffer);
 			
-			readTillDelimiter(socketBuffer, sockfd, ':');
+			readTillDelimiter(socketBuffer, bodyFd, ':');
 			char *contentLenStr = readAllBuffer(socketBuffer);
 			long contentLen = atol(contentLenStr);
 			
@@ -714,16 +1964,9 @@ void processCommand(int sockfd) {
 			// Write data to the file now.
 			createDirStructureIfNeeded(fullpath);
 			int fd = open(fullpath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
-			char c;
-			long i = 0;
-			while(i++ < contentLen) {
-				read(sockfd, &c, 1);
-				if(c == '\0') {
-					break; // Socket disconnected.
-				}
-				write(fd, &c, 1);
-			}
+			writeNBytesToFile(contentLen, bodyFd, fd);
 			close(fd);	
+			close(bodyFd);
 			
 			write(sockfd, "1", 1); // Send success.
 			
@@ -748,6 +1991,10 @@ void processCommand(int sockfd) {
 		//		<File2NameLen>:<File2Name><File2LenBytes>:<File2Contents>
 		//
 		// Here, the first file is a .COMMIT_FILE		
+		//
+		// After a transfer id, server first answers sendfrom:<bytes>:
+		// with what it has of that transfer, and the compressed data
+		// comes as <totalBytes>:<offset>:<rest of it>
 		
 		// REMEMBER, this is a COMPRESSED response sent by client.
 		
@@ -758,16 +2005,15 @@ void processCommand(int sockfd) {
 		readNBytes(socketBuffer, sockfd, projNameLen);
 		char *projectName = readAllBuffer(socketBuffer);
 		
+		char *clientReqPath = NULL;
+		
 		if(!checkProject(projectName)) {
 			writeErrorToSocket(sockfd, "Project does not exist.");
 			
-		} else {
-				
-			char *clientReqPath = malloc(sizeof(char) * (strlen(projectName) + strlen(BASE_DIRECTORY) + 50));
+		} else if((clientReqPath = receiveRequestBody(sockfd, projectName, transferId)) == NULL) {
+			// Connection dropped, client pushes again to resume.
 			
-			// Now, store N bytes unencrypted into the response file.
-			sprintf(clientReqPath, "%s/%s/%s%lld_%d", BASE_DIRECTORY, projectName, REQUEST_FILE, current_timestamp_millis(), rand());
-			convertZlibToResponse(sockfd, clientReqPath, BASE_DIRECTORY);
+		} else {
 			
 			int requestFd = open(clientReqPath, O_RDONLY, 0777);
 			
@@ -796,13 +2042,36 @@ void processCommand(int sockfd) {
 			
 			// only A or U files will be sent by client.
 			// D files will be present in .Manifest.
-			while(numFiles-- > 0) {
-				writeFileFromSocket(requestFd, path); // create required files in new directory.
+			// Files are hashed while they are written, to check them with
+			// the .commit entries.
+			int hashAlgorithm = currentServerHashAlgorithm(projectName);
+			char *oldVersionDir = malloc(sizeof(char) * (strlen(projDir) + strlen(currentVersionStr) + 2));
+			sprintf(oldVersionDir, "%s/%s", projDir, currentVersionStr);
+			char **receivedPaths = malloc(sizeof(char *) * (numFiles > 0 ? numFiles : 1));
+			char *receivedHashes = malloc(sizeof(char) * (HASH_STRING_LEN + 1) * (numFiles > 0 ? numFiles : 1));
+			int numReceived;
+			for(numReceived = 0; numReceived < numFiles; numReceived++) {
+				// create required files in new directory.
+				// Changed parts of big files come against the current version.
+				receivedPaths[numReceived] = receiveFileAgainst(requestFd, path, oldVersionDir, hashAlgorithm, receivedHashes + numReceived * (HASH_STRING_LEN + 1));
 			}
+			free(oldVersionDir);
 			
 			// Now, we need to see if the .commit file matches with our copy
-			sprintf(path, "%s/%s/%d/%s", BASE_DIRECTORY, projectName, newVersion, COMMIT_FILE);
-			int status = checkForFileMatch(path, projDir, COMMIT_FILE);
+			int status = 0;
+			int i;
+			for(i = 0; i < numReceived; i++) {
+				if(strcmp(receivedPaths[i], COMMIT_FILE) == 0) {
+					status = checkForHashMatch(receivedHashes + i * (HASH_STRING_LEN + 1), hashAlgorithm, projDir, COMMIT_FILE);
+				}
+			}
+			
+			// Then, that all files came as the commit says.
+			char *damagedFile = NULL;
+			if(status != 0) {
+				sprintf(path, "%s/%s/%d/%s", BASE_DIRECTORY, projectName, newVersion, COMMIT_FILE);
+				damagedFile = findDamagedFile(path, receivedPaths, receivedHashes, numReceived);
+			}
 			
 			// Decompression code ends here.
 			close(requestFd);
@@ -810,9 +2079,17 @@ void processCommand(int sockfd) {
 			free(clientReqPath);
 			
 			
-			if(status == 0) {
-				// We could not find the matching .COMMIT_FILE 
-				writeErrorToSocket(sockfd, "No matching commit file found on server.");
+			if(status == 0 || damagedFile != NULL) {
+				if(status == 0) {
+					// We could not find the matching .COMMIT_FILE 
+					writeErrorToSocket(sockfd, "No matching commit file found on server.");
+				} else {
+					// Commit stays pending, client can push again.
+					char *reason = malloc(sizeof(char) * (strlen(damagedFile) + 100));
+					sprintf(reason, "File damaged in transfer, %s", damagedFile);
+					writeErrorToSocket(sockfd, reason);
+					free(reason);
+				}
 				
 				// remove the newly created directory.
 				sprintf(path, "%s/%s/%d", BASE_DIRECTORY, projectName, newVersion);
@@ -860,6 +2137,26 @@ void processCommand(int sockfd) {
 				// <numFiles>:
 				// <File1NameLen>:<File1Name><File1LenBytes>:<File1Contents>
 				// <File2NameLen>:<File2Name><File2LenBytes>:<File2Contents>
+				//
+				// Big files are put in the chunk store, and only their
+				// list of chunks is archived. All files are kept in the
+				// object store, for reverts to them.
+				char *archivedDir = malloc(sizeof(char) * (strlen(projDir) + strlen(currentVersionStr) + 2));
+				sprintf(archivedDir, "%s/%s", projDir, currentVersionStr);
+				char **archivedPaths = malloc(sizeof(char *) * (serverManifest->numFiles > 0 ? serverManifest->numFiles : 1));
+				int numArchived = 0;
+				node = serverManifest->head;
+				while(node != NULL) {
+					archivedPaths[numArchived++] = node->filePath;
+					char *archivedPath = malloc(sizeof(char) * (strlen(archivedDir) + strlen(node->filePath) + 2));
+					sprintf(archivedPath, "%s/%s", archivedDir, node->filePath);
+					keepObject(archivedPath, serverManifest->hashAlgorithm, node->md5);
+					free(archivedPath);
+					node = node->next;
+				}
+				trimObjectStore(OBJECT_STORE_MAX_BYTES);
+				HashSet *archivedChunks = chunkFiles(archivedDir, archivedPaths, numArchived);
+				
 				sprintf(path, "%s/%s.zlib_temp", projDir, currentVersionStr);
 				
 				int compressedTempFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
@@ -869,26 +2166,42 @@ void processCommand(int sockfd) {
 				writeFileToSocket(compressedTempFd, projectName, MANIFEST_FILE);
 				
 				// Now one by one iterate on all files of manifest.
-				node = serverManifest->head;
-				while(node != NULL) {
-					writeFileToSocket(compressedTempFd, projectName, node->filePath);
-					node = node->next;
+				for(i = 0; i < numArchived; i++) {
+					writeFileChunksToSocket(archivedPaths[i], archivedDir, archivedChunks, compressedTempFd);
 				}
 				
 				close(compressedTempFd);
+				freeHashSet(archivedChunks);
+				releaseChunkFiles();
+				free(archivedPaths);
+				free(archivedDir);
 				
 				// Now temp file is ready.. We just need to compress this.
 				char *zipFilePath = malloc(sizeof(char) * (strlen(projectName) + strlen(BASE_DIRECTORY) + 50));			
 				sprintf(zipFilePath, "%s/%s.zlib", projDir, currentVersionStr);
-				compressFile(path, zipFilePath);
+				int archived = compressPayload(path, zipFilePath, codecs[0].id, 1) == 0; // best built-in codec.
+				if(!archived) {
+					// The old version stays as a directory.
+					printf("Error: Could not archive version %s of project %s.\n", currentVersionStr, projectName);
+					unlink(zipFilePath);
+				}
 				free(zipFilePath);
 				
 				// delete temp file
 				unlink(path);
 				
+				// Keep the old manifest uncompressed, to send deltas from it.
+				char *oldManifestPath = malloc(sizeof(char) * (strlen(projDir) + strlen(BINARY_MANIFEST_FILE) + 50));
+				sprintf(path, "%s/%s/%s", projDir, currentVersionStr, BINARY_MANIFEST_FILE);
+				sprintf(oldManifestPath, "%s/%s%s", projDir, currentVersionStr, BINARY_MANIFEST_FILE);
+				copyFile(path, oldManifestPath);
+				free(oldManifestPath);
+				
 				// delete project directory old version
-				sprintf(path, "%s/%s", projDir, currentVersionStr);
-				removeDirectoryCompletely(path);
+				if(archived) {
+					sprintf(path, "%s/%s", projDir, currentVersionStr);
+					removeDirectoryCompletely(path);
+				}
 				
 				///////////////////////////////////////////////////////////////
 				///////////////////////////////////////////////////////////////
@@ -906,59 +2219,35 @@ void processCommand(int sockfd) {
 				pushFileToHistory(projectName, path);
 				
 				int commitFd = open(path, O_RDONLY, 0777);
+				Manifest *commitEntries = readManifestEntries(commitFd);
 				
-				while(1) {
-					readTillDelimiter(socketBuffer, commitFd, ' ');
-					char *code = readAllBuffer(socketBuffer);
-					if(strlen(code) == 0) {
-						free(code);
-						break;
-					}
-					
-					// ignore file version, hash	
-					readTillDelimiter(socketBuffer, commitFd, ' ');
-					char *version = readAllBuffer(socketBuffer);
-					
-					readTillDelimiter(socketBuffer, commitFd, ' ');
-					char *md5 = readAllBuffer(socketBuffer);
-					
-					// read filePath
-					readTillDelimiter(socketBuffer, commitFd, '\n');
-					char *fPath = readAllBuffer(socketBuffer);
-					
-					if(strcmp(code, "D") == 0) {
-						// We need to delete the file locally also.
-						char *fullPath = malloc(sizeof(char) * (strlen(projDir) + strlen(fPath) + 50));
-						
-						sprintf(fullPath, "%s/%d/%s", projDir, newVersion, fPath);
-						
+				// We need to delete the D files locally also.
+				ManifestNode *entry = commitEntries->head;
+				while(entry != NULL) {
+					if(entry->code == 'D') {
+						char *fullPath = malloc(sizeof(char) * (strlen(projDir) + strlen(entry->filePath) + 50));
+						sprintf(fullPath, "%s/%d/%s", projDir, newVersion, entry->filePath);
 						if(checkFileExists(fullPath)) {
 							unlink(fullPath);
 						}
 						free(fullPath);
-						
-						removeFileFromManifest(serverManifest, fPath);
-					
-					} else if(strcmp(code, "A") == 0) {
-						
-						addFileToManifest(serverManifest, strdup(md5), strdup(version), strdup(fPath));
-						
-					} else if(strcmp(code, "M") == 0) {
-						
-						// remove old entry from manifest
-						removeFileFromManifest(serverManifest, fPath);
-						
-						// make new entry in manifest with updated version and md5.
-						addFileToManifest(serverManifest, strdup(md5), strdup(version), strdup(fPath));
 					}
-							
-					free(code);
-					free(version);
-					free(md5);
-					free(fPath);
+					entry = entry->next;
 				}
+				
+				// Both lists are sorted by path, so this is a single merge-join pass.
+				applyCommitEntries(serverManifest, commitEntries);
+				freeManifest(commitEntries);
 				close(commitFd);
 				
+				// Projects of older algorithm are moved to the current one, all
+				// files of the new version are hashed again.
+				if(serverManifest->hashAlgorithm != DEFAULT_HASH_ALGORITHM) {
+					printf("Rehashing project %s with %s.\n", projectName, hashAlgorithmName(DEFAULT_HASH_ALGORITHM));
+					sprintf(path, "%s/%d", projDir, newVersion);
+					rehashManifest(serverManifest, path, DEFAULT_HASH_ALGORITHM);
+				}
+				
 				// change the current version number in .VERSION_FILE
 				sprintf(path, "%s/%s", projDir, VERSION_FILE);
 				int versionFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
@@ -968,16 +2257,11 @@ void processCommand(int sockfd) {
 				
 				// Increment project version.
 				if(serverManifest->versionNumber != NULL) {
-					free(serverManifest->versionNumber);
-					serverManifest->versionNumber = readCurrentVersion(projectName);
+					setManifestVersion(serverManifest, readCurrentVersion(projectName));
 				}
 				
-				sprintf(path, "%s/%d/%s", projDir, newVersion, MANIFEST_FILE);
 				// At last Write the modified manifest into new directory
-				createDirStructureIfNeeded(path);
-				int manifestFd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
-				writeManifestToFile(serverManifest, manifestFd);
-				close(manifestFd);
+				writeServerManifest(projDir, newVersion, serverManifest);
 				
 				// remove the .Commit file.
 				sprintf(path, "%s/%d/%s", projDir, newVersion, COMMIT_FILE);
@@ -989,9 +2273,14 @@ void processCommand(int sockfd) {
 				
 				// At last, Just send the manifest back to the client.
 				write(sockfd, "sendfile:", strlen("sendfile:"));
-				writeFileToSocket(sockfd, projectName, MANIFEST_FILE);
+				writeFileBodyToSocket(sockfd, projectName, MANIFEST_FILE, 0);
 			}
 			
+			for(i = 0; i < numReceived; i++) {
+				free(receivedPaths[i]);
+			}
+			free(receivedPaths);
+			free(receivedHashes);
 			free(path);
 			free(currentVersionStr);
 			free(projDir);
@@ -1002,6 +2291,10 @@ void processCommand(int sockfd) {
 		free(projectName);
 	}	
 	
+	unlockAfterCommand(0);
+	freeHashSet(clientObjects);
+	freeSparseSpec(spec);
+	free(transferId);
 	free(command);
 	freeSocketBuffer(socketBuffer);	
 	
@@ -1014,14 +2307,23 @@ void * socketThread(void *arg) {
 	printf("Starting Client Thread\n");
 	
 	int clientSock = *((int *)arg);
+	free(arg);
+	keepConnectionAlive(clientSock);
+	
+	// Older clients do not name codecs, till then they get zlib.
+	setTransferCodec(CODEC_ZLIB);
+	setTransferNegotiated(0);
 	
-	// Send message to the client socket
-	pthread_mutex_lock(&lock);
+	// Chunks of big files, and files pushed, of all projects are kept
+	// once. Files of versions are never changed in place, so they are
+	// linked.
+	setChunkStore(CHUNK_STORE_DIRECTORY);
+	setObjectStore(OBJECT_STORE_DIRECTORY, 1);
 	
 	// Process the command from client.
 	processCommand(clientSock);
 	
-	pthread_mutex_unlock(&lock);
+	unlockAfterCommand(1);
 	
 	printf("Terminating Client connection\n\n");
 	
@@ -1044,6 +2346,17 @@ int main(int argc, char *argv[]) {
 		createDirectory(BASE_DIRECTORY);
 	}
 	
+	// Clients which drop are seen as failed writes, not a signal.
+	signal(SIGPIPE, SIG_IGN);
+	
+	// Waiting commits and pushes go before readers which come later, so
+	// steady checkouts do not hold them off.
+	pthread_rwlockattr_t lockAttr;
+	pthread_rwlockattr_init(&lockAttr);
+	pthread_rwlockattr_setkind_np(&lockAttr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&lock, &lockAttr);
+	pthread_rwlockattr_destroy(&lockAttr);
+	
 	int serverSocket, newSocket;
 	struct sockaddr_in serverAddr;
 	struct sockaddr_storage serverStorage;
@@ -1070,27 +2383,33 @@ int main(int argc, char *argv[]) {
 	else
 		printf("Error\n");
 	
-	pthread_t tid[60];
-	int i = 0;
 	while (1) {
 		
 		//Accept call creates a new socket for the incoming connection
 		addr_size = sizeof serverStorage;
 		
 		newSocket = accept(serverSocket, (struct sockaddr *) &serverStorage, &addr_size);
+		if(newSocket < 0) {
+			continue;
+		}
 		
 		printf("After accepting:\n");
 		
+		// Each thread gets its own copy, the next accept does not
+		// change it before the thread read it.
+		int *clientSock = malloc(sizeof(int));
+		*clientSock = newSocket;
+		
 		//for each client request creates a thread and assign the client request to it to process
-		//so the main thread can entertain next request
-		if (pthread_create(&tid[i++], NULL, socketThread, &newSocket) != 0)
+		//so the main thread can entertain next request. Threads are not
+		//joined, a long connection does not hold off the others.
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, socketThread, clientSock) != 0) {
 			printf("Failed to create thread\n");
-		if (i >= 50) {
-			i = 0;
-			while (i < 50) {
-				pthread_join(tid[i++], NULL);
-			}
-			i = 0;
+			close(newSocket);
+			free(clientSock);
+		} else {
+			pthread_detach(tid);
 		}
 	}
 	return 0;
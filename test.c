@@ -4,14 +4,222 @@
 #include <sys/types.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <signal.h> 
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 void sighandle(int sig);
 
+int failures = 0;
+
+// Prints the result of a check, failures are counted for the exit status.
+void check(int passed, char *what){
+  printf("%s: %s\n", passed ? "PASS" : "FAIL", what);
+  if(!passed){
+    failures++;
+  }
+}
+
+// Waits till the server accepts connections, 0 if it never does.
+int waitForServer(int port){
+  int tries;
+  for(tries = 0; tries < 100; tries++){
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    int connected = connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+    close(sock);
+    if(connected){
+      return 1;
+    }
+    usleep(100000);
+  }
+  return 0;
+}
+
+// Forwards the connections made to port to the server on target, one at
+// a time. The first one is cut after cut bytes sent up to the server, or
+// down from it, as a dropped connection would be. Returns the pid of the
+// proxy, which runs till it is killed.
+pid_t startCutProxy(int port, int target, long cut, int up){
+  int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  if(bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listenFd, 5) != 0){
+    printf("Error: The proxy could not listen on port %d: %s\n", port, strerror(errno));
+    close(listenFd);
+    return -1;
+  }
+  
+  fflush(stdout);
+  pid_t proxy;
+  if((proxy = fork()) != 0){
+    close(listenFd);
+    return proxy;
+  }
+  addr.sin_port = htons(target);
+  char buffer[65536];
+  while(1){
+    int client = accept(listenFd, NULL, NULL);
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    if(client < 0 || connect(server, (struct sockaddr *) &addr, sizeof(addr)) != 0){
+      close(client);
+      close(server);
+      continue;
+    }
+    long counted = 0;
+    while(1){
+      fd_set readable;
+      FD_ZERO(&readable);
+      FD_SET(client, &readable);
+      FD_SET(server, &readable);
+      if(select((client > server ? client : server) + 1, &readable, NULL, NULL, NULL) < 0){
+        break;
+      }
+      int from = FD_ISSET(client, &readable) ? client : server;
+      int to = from == client ? server : client;
+      ssize_t n = read(from, buffer, sizeof(buffer));
+      if(n <= 0){
+        break;
+      }
+      if(cut > 0 && (from == client) == up && counted + n >= cut){
+        write(to, buffer, cut - counted);
+        break;
+      }
+      if((from == client) == up){
+        counted += n;
+      }
+      write(to, buffer, n);
+    }
+    close(client);
+    close(server);
+    cut = 0;
+  }
+}
+
+// Writes content to path, -1 if the file could not be opened.
+int writeFile(char *path, char *content){
+  FILE *fp = fopen(path, "w");
+  if(fp == NULL){
+    printf("Error: Could not write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  fprintf(fp, "%s", content);
+  fclose(fp);
+  return 0;
+}
+
+// Writes size random bytes to path, which do not compress.
+int writeRandomFile(char *path, long size){
+  FILE *fp = fopen(path, "w");
+  if(fp == NULL){
+    printf("Error: Could not write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  long i;
+  for(i = 0; i < size; i++){
+    fputc(rand() & 0xff, fp);
+  }
+  fclose(fp);
+  return 0;
+}
+
+// 1 if both files exist and have the same contents.
+int sameFile(char *path1, char *path2){
+  FILE *fp1 = fopen(path1, "r");
+  FILE *fp2 = fopen(path2, "r");
+  int same = fp1 != NULL && fp2 != NULL;
+  while(same){
+    int c1 = fgetc(fp1);
+    int c2 = fgetc(fp2);
+    same = c1 == c2;
+    if(c1 == EOF || c2 == EOF){
+      break;
+    }
+  }
+  if(fp1 != NULL){
+    fclose(fp1);
+  }
+  if(fp2 != NULL){
+    fclose(fp2);
+  }
+  return same;
+}
+
+// 1 if the file has text in it.
+int fileHas(char *path, char *text){
+  FILE *fp = fopen(path, "r");
+  if(fp == NULL){
+    return 0;
+  }
+  char line[4096];
+  int found = 0;
+  while(!found && fgets(line, sizeof(line), fp) != NULL){
+    found = strstr(line, text) != NULL;
+  }
+  fclose(fp);
+  return found;
+}
+
+// Runs args in dir (NULL for the current one) and waits for it. If output
+// is set, what the command prints is also kept in that file. Returns the
+// exit status.
+int runCommand(char *dir, char *args[], char *output){
+  fflush(stdout);
+  pid_t child;
+  if((child = fork()) == 0){
+    if(dir != NULL && chdir(dir) != 0){
+      perror("chdir");
+      _exit(1);
+    }
+    if(output != NULL){
+      int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+      dup2(fd, 1);
+      close(fd);
+    }
+    execv(args[0], args);
+    perror("Execv error");
+    _exit(1);
+  }
+  int status = 0;
+  waitpid(child, &status, 0);
+  if(output != NULL){
+    char path[200];
+    sprintf(path, "%s/%s", dir != NULL ? dir : ".", output);
+    FILE *fp = fopen(path, "r");
+    int c;
+    while(fp != NULL && (c = fgetc(fp)) != EOF){
+      putchar(c);
+    }
+    if(fp != NULL){
+      fclose(fp);
+    }
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
 int main(int argc, char* argv[]){
 
   signal(SIGINT, sighandle);
+  
+  // Keep the content cache of the test out of the user's home.
+  char cacheDir[4096];
+  if(getcwd(cacheDir, sizeof(cacheDir) - 20) != NULL){
+    strcat(cacheDir, "/TEST_CACHE");
+    setenv("WTF_CACHE", cacheDir, 1);
+  }
  
   printf("Running all test cases \n");
  
@@ -31,6 +239,15 @@ int main(int argc, char* argv[]){
     char *args1[] = {"./WTFserver", "17000", (char*)0};
     execv(args1[0], args1);
     perror("Execv error child_1");
+    _exit(1);
+  }
+  
+  // Commands would fail till the server listens.
+  if(!waitForServer(17000)){
+    printf("Error: The server did not start on port 17000.\n");
+    kill(child_1, SIGINT);
+    waitpid(child_1, NULL, 0);
+    return 1;
   }
 
 
@@ -51,11 +268,7 @@ int main(int argc, char* argv[]){
   printf("\n*** Test case 2: add file (file1.txt) to TESTCASE ***\n");
   char address[100];
   sprintf(address, "TESTCASE/file1.txt");
-  int filedescriptor = open(address, O_WRONLY | O_CREAT, 0777);  
-  
-  FILE *fp = fopen(address, "w");
-  fprintf(fp, "This is a test run. \n");
-  fclose(fp);
+  writeFile(address, "This is a test run. \n");
 
   pid_t child_3;
   if((child_3 = fork()) == 0 ){
@@ -92,11 +305,7 @@ int main(int argc, char* argv[]){
     
   bzero(address,100);
   sprintf(address, "TESTCASE/file2.txt");
-  filedescriptor = open(address, O_WRONLY | O_CREAT, 0777);
-
-  FILE *fp2 = fopen(address, "w");
-  fprintf(fp2, "This is a test run. File number 2. \n");
-  fclose(fp2);
+  writeFile(address, "This is a test run. File number 2. \n");
 
   pid_t child_5;
   if((child_5 = fork()) == 0 ){
@@ -118,15 +327,12 @@ int main(int argc, char* argv[]){
 
   bzero(address,100);
   sprintf(address, "TESTCASE/file3.txt");
-  filedescriptor = open(address, O_WRONLY | O_CREAT, 0777);  
-  FILE *fp3 = fopen(address, "w");
-  fprintf(fp3, "This is a test run. File number 2. \n");
-  fclose(fp3);
+  writeFile(address, "This is a test run. File number 2. \n");
   pid_t child_6;
-  if((child_5 = fork()) == 0 ){
+  if((child_6 = fork()) == 0 ){
     char *args6[] = {"./WTF", "commit", "TESTCASE", "file3.txt",(char*)0};
     execv(args6[0], args6);
-    perror("Execv error child_5");
+    perror("Execv error child_6");
   }
   waitpid(child_6, NULL, 0);
   
@@ -297,11 +503,559 @@ int main(int argc, char* argv[]){
 
 
   
-  printf("\n*** Test case 15: EXIT (SIGINT) ***\n");
-
-
-  waitpid(child_1, NULL, 0);  
-  return 0;
+  printf("\n*** Test case 15: update takes a file with the new contents as modified ***\n");
+  // Second working copy, in TEST_COPY.
+  mkdir("TEST_COPY", 0777);
+  char *configureCopy[] = {"../WTF", "configure", "localhost", "17000", (char*)0};
+  runCommand("TEST_COPY", configureCopy, NULL);
+  
+  char *createSync[] = {"./WTF", "create", "TEST_SYNC", (char*)0};
+  char *addSync[] = {"./WTF", "add", "TEST_SYNC", "a.txt", (char*)0};
+  char *commitSync[] = {"./WTF", "commit", "TEST_SYNC", (char*)0};
+  char *pushSync[] = {"./WTF", "push", "TEST_SYNC", (char*)0};
+  runCommand(NULL, createSync, NULL);
+  writeFile("TEST_SYNC/a.txt", "First version.\n");
+  runCommand(NULL, addSync, NULL);
+  runCommand(NULL, commitSync, NULL);
+  runCommand(NULL, pushSync, NULL);
+  
+  char *checkoutSync[] = {"../WTF", "checkout", "TEST_SYNC", (char*)0};
+  runCommand("TEST_COPY", checkoutSync, NULL);
+  writeFile("TEST_SYNC/a.txt", "Second version.\n");
+  runCommand(NULL, commitSync, NULL);
+  runCommand(NULL, pushSync, NULL);
+  
+  // The copy has the new contents already, its manifest the old version.
+  writeFile("TEST_COPY/TEST_SYNC/a.txt", "Second version.\n");
+  char *updateSync[] = {"../WTF", "update", "TEST_SYNC", (char*)0};
+  char *upgradeSync[] = {"../WTF", "upgrade", "TEST_SYNC", (char*)0};
+  runCommand("TEST_COPY", updateSync, "output.txt");
+  check(!fileHas("TEST_COPY/output.txt", "Conflict"), "a file with the server's contents is no conflict");
+  check(fileHas("TEST_COPY/TEST_SYNC/.update", "M "), "the file is modified by the upgrade");
+  runCommand("TEST_COPY", upgradeSync, NULL);
+  check(sameFile("TEST_SYNC/a.txt", "TEST_COPY/TEST_SYNC/a.txt"), "both copies have the pushed contents");
+  runCommand("TEST_COPY", updateSync, "output.txt");
+  check(fileHas("TEST_COPY/output.txt", "Up-To-Date"), "the copy is at the pushed version");
+  
+  
+  
+  printf("\n*** Test case 16: add a directory and a glob pattern ***\n");
+  char *createAdd[] = {"./WTF", "create", "TEST_ADD", (char*)0};
+  runCommand(NULL, createAdd, NULL);
+  mkdir("TEST_ADD/src", 0777);
+  mkdir("TEST_ADD/src/lib", 0777);
+  mkdir("TEST_ADD/docs", 0777);
+  mkdir("TEST_ADD/docs/sub", 0777);
+  writeFile("TEST_ADD/src/a.c", "int a;\n");
+  writeFile("TEST_ADD/src/b.h", "int b;\n");
+  writeFile("TEST_ADD/src/lib/c.c", "int c;\n");
+  writeFile("TEST_ADD/docs/d.txt", "Docs.\n");
+  writeFile("TEST_ADD/docs/sub/e.txt", "More docs.\n");
+  
+  // The pattern does not reach into src/lib, the directory is added whole.
+  char *addAdd[] = {"./WTF", "add", "TEST_ADD", "src/*.c", "docs", (char*)0};
+  runCommand(NULL, addAdd, "TEST_ADD.out");
+  check(fileHas("TEST_ADD.out", "3 files added"), "three files are added");
+  unlink("TEST_ADD.out");
+  
+  char *commitAdd[] = {"./WTF", "commit", "TEST_ADD", (char*)0};
+  char *pushAdd[] = {"./WTF", "push", "TEST_ADD", (char*)0};
+  char *checkoutAdd[] = {"../WTF", "checkout", "TEST_ADD", (char*)0};
+  runCommand(NULL, commitAdd, NULL);
+  runCommand(NULL, pushAdd, NULL);
+  runCommand("TEST_COPY", checkoutAdd, NULL);
+  check(sameFile("TEST_ADD/src/a.c", "TEST_COPY/TEST_ADD/src/a.c"), "src/a.c is checked out");
+  check(sameFile("TEST_ADD/docs/d.txt", "TEST_COPY/TEST_ADD/docs/d.txt"), "docs/d.txt is checked out");
+  check(sameFile("TEST_ADD/docs/sub/e.txt", "TEST_COPY/TEST_ADD/docs/sub/e.txt"), "docs/sub/e.txt is checked out");
+  check(access("TEST_COPY/TEST_ADD/src/lib/c.c", F_OK) != 0, "src/*.c does not match src/lib/c.c");
+  check(access("TEST_COPY/TEST_ADD/src/b.h", F_OK) != 0, "src/*.c does not match src/b.h");
+  
+  
+  
+  printf("\n*** Test case 17: sparse checkout with include and exclude patterns ***\n");
+  char *createSparse[] = {"./WTF", "create", "TEST_SPARSE", (char*)0};
+  runCommand(NULL, createSparse, NULL);
+  mkdir("TEST_SPARSE/src", 0777);
+  mkdir("TEST_SPARSE/src/a", 0777);
+  mkdir("TEST_SPARSE/src/b", 0777);
+  mkdir("TEST_SPARSE/src/lib", 0777);
+  mkdir("TEST_SPARSE/src/lib/deep", 0777);
+  writeFile("TEST_SPARSE/src/a/x.c", "int x;\n");
+  writeFile("TEST_SPARSE/src/a/big.bin", "binary\n");
+  writeFile("TEST_SPARSE/src/b/y.c", "int y;\n");
+  writeFile("TEST_SPARSE/src/lib/deep/z.c", "int z;\n");
+  writeFile("TEST_SPARSE/top.txt", "Top.\n");
+  char *addSparse[] = {"./WTF", "add", "TEST_SPARSE", "src", "top.txt", (char*)0};
+  char *commitSparse[] = {"./WTF", "commit", "TEST_SPARSE", (char*)0};
+  char *pushSparse[] = {"./WTF", "push", "TEST_SPARSE", (char*)0};
+  runCommand(NULL, addSparse, NULL);
+  runCommand(NULL, commitSparse, NULL);
+  runCommand(NULL, pushSparse, NULL);
+  
+  // src/l* takes src/lib with all below it, *.bin is excluded at any depth.
+  char *checkoutSparse[] = {"../WTF", "checkout", "TEST_SPARSE", "--include", "src/a", "--include", "src/l*",
+    "--exclude", "*.bin", (char*)0};
+  runCommand("TEST_COPY", checkoutSparse, NULL);
+  check(sameFile("TEST_SPARSE/src/a/x.c", "TEST_COPY/TEST_SPARSE/src/a/x.c"), "src/a/x.c is checked out");
+  check(sameFile("TEST_SPARSE/src/lib/deep/z.c", "TEST_COPY/TEST_SPARSE/src/lib/deep/z.c"), "src/lib/deep/z.c is checked out");
+  check(access("TEST_COPY/TEST_SPARSE/src/a/big.bin", F_OK) != 0, "src/a/big.bin is excluded");
+  check(access("TEST_COPY/TEST_SPARSE/src/b/y.c", F_OK) != 0, "src/b/y.c is not included");
+  check(access("TEST_COPY/TEST_SPARSE/top.txt", F_OK) != 0, "top.txt is not included");
+  
+  // Changes in and out of the checkout, only the ones in come.
+  writeFile("TEST_SPARSE/src/a/x.c", "int x = 2;\n");
+  writeFile("TEST_SPARSE/src/b/y.c", "int y = 2;\n");
+  runCommand(NULL, commitSparse, NULL);
+  runCommand(NULL, pushSparse, NULL);
+  char *updateSparse[] = {"../WTF", "update", "TEST_SPARSE", (char*)0};
+  char *upgradeSparse[] = {"../WTF", "upgrade", "TEST_SPARSE", (char*)0};
+  runCommand("TEST_COPY", updateSparse, NULL);
+  runCommand("TEST_COPY", upgradeSparse, NULL);
+  check(sameFile("TEST_SPARSE/src/a/x.c", "TEST_COPY/TEST_SPARSE/src/a/x.c"), "src/a/x.c is upgraded");
+  check(access("TEST_COPY/TEST_SPARSE/src/b/y.c", F_OK) != 0, "src/b/y.c stays out after upgrade");
+  
+  
+  
+  printf("\n*** Test case 18: commit with a watcher ***\n");
+  char *createWatch[] = {"./WTF", "create", "TEST_WATCH", (char*)0};
+  char *addWatch[] = {"./WTF", "add", "TEST_WATCH", "a.txt", "b.txt", (char*)0};
+  char *commitWatch[] = {"./WTF", "commit", "TEST_WATCH", (char*)0};
+  char *pushWatch[] = {"./WTF", "push", "TEST_WATCH", (char*)0};
+  runCommand(NULL, createWatch, NULL);
+  writeFile("TEST_WATCH/a.txt", "A.\n");
+  writeFile("TEST_WATCH/b.txt", "B.\n");
+  runCommand(NULL, addWatch, NULL);
+  runCommand(NULL, commitWatch, NULL);
+  runCommand(NULL, pushWatch, NULL);
+  
+  char *watchWatch[] = {"./WTF", "watch", "TEST_WATCH", (char*)0};
+  char *unwatchWatch[] = {"./WTF", "unwatch", "TEST_WATCH", (char*)0};
+  runCommand(NULL, watchWatch, "TEST_WATCH.out");
+  check(fileHas("TEST_WATCH.out", "Watching project"), "the watcher is started");
+  
+  // Files the watcher did not see change are not looked at.
+  writeFile("TEST_WATCH/a.txt", "A, changed.\n");
+  runCommand(NULL, commitWatch, NULL);
+  check(fileHas("TEST_WATCH/.commit", "a.txt"), "the changed file is committed");
+  check(!fileHas("TEST_WATCH/.commit", "b.txt"), "the other file is not");
+  runCommand(NULL, pushWatch, NULL);
+  check(fileHas("TEST_WATCH/.index", " watch "), "the index read the watcher's changes");
+  writeFile("TEST_WATCH/b.txt", "B, changed.\n");
+  runCommand(NULL, commitWatch, NULL);
+  check(fileHas("TEST_WATCH/.commit", "b.txt") && !fileHas("TEST_WATCH/.commit", "a.txt"),
+    "a change right after a commit is committed");
+  runCommand(NULL, pushWatch, NULL);
+  
+  runCommand(NULL, unwatchWatch, "TEST_WATCH.out");
+  check(access("TEST_WATCH/.watch", F_OK) != 0, "the watcher is stopped");
+  unlink("TEST_WATCH.out");
+  
+  
+  
+  printf("\n*** Test case 19: random data is stored, not compressed ***\n");
+  char *createStored[] = {"./WTF", "create", "TEST_STORED", (char*)0};
+  char *addStored[] = {"./WTF", "add", "TEST_STORED", "random.bin", "notes.txt", (char*)0};
+  char *commitStored[] = {"./WTF", "commit", "TEST_STORED", (char*)0};
+  char *pushStored[] = {"./WTF", "push", "TEST_STORED", (char*)0};
+  runCommand(NULL, createStored, NULL);
+  writeRandomFile("TEST_STORED/random.bin", 900 * 1024);
+  writeFile("TEST_STORED/notes.txt", "First notes.\n");
+  runCommand(NULL, addStored, NULL);
+  runCommand(NULL, commitStored, NULL);
+  runCommand(NULL, pushStored, NULL);
+  
+  char *checkoutStored[] = {"../WTF", "checkout", "TEST_STORED", (char*)0};
+  char *removeStored[] = {"/bin/rm", "-rf", "TEST_COPY/TEST_STORED", (char*)0};
+  runCommand("TEST_COPY", checkoutStored, NULL);
+  check(sameFile("TEST_STORED/random.bin", "TEST_COPY/TEST_STORED/random.bin"), "random.bin is checked out");
+  
+  // The version is archived with random.bin in stored blocks, a rollback
+  // reads them back.
+  writeFile("TEST_STORED/notes.txt", "Second notes.\n");
+  runCommand(NULL, commitStored, NULL);
+  runCommand(NULL, pushStored, NULL);
+  char *rollbackStored[] = {"./WTF", "rollback", "TEST_STORED", "2", (char*)0};
+  runCommand(NULL, rollbackStored, NULL);
+  runCommand(NULL, removeStored, NULL);
+  runCommand("TEST_COPY", checkoutStored, NULL);
+  check(sameFile("TEST_STORED/random.bin", "TEST_COPY/TEST_STORED/random.bin"), "random.bin comes back from the archive");
+  check(fileHas("TEST_COPY/TEST_STORED/notes.txt", "First notes."), "notes.txt is of the version rolled back to");
+  
+  
+  
+  printf("\n*** Test case 20: small files are compressed with the project's dictionary ***\n");
+  char *createDict[] = {"./WTF", "create", "TEST_DICT", (char*)0};
+  char *addDict[] = {"./WTF", "add", "TEST_DICT", "src", (char*)0};
+  char *commitDict[] = {"./WTF", "commit", "TEST_DICT", (char*)0};
+  char *pushDict[] = {"./WTF", "push", "TEST_DICT", (char*)0};
+  runCommand(NULL, createDict, NULL);
+  mkdir("TEST_DICT/src", 0777);
+  
+  // Alike small files, as a dictionary is trained from.
+  char dictPath[100], dictContent[1000];
+  int n;
+  for(n = 1; n <= 20; n++){
+    sprintf(dictPath, "TEST_DICT/src/f%d.c", n);
+    sprintf(dictContent, "/*\n * Copyright (c) 2020 The Example Project Authors. All rights reserved.\n"
+      " * Licensed under the Apache License, Version 2.0 (the \"License\");\n"
+      " * you may not use this file except in compliance with the License.\n"
+      " * You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0\n"
+      " */\n#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n\n"
+      "int function_%d(int argument) {\n\tint result = argument * %d;\n\tprintf(\"value %%d\\n\", result);\n"
+      "\treturn result;\n}\n", n, n * 7);
+    writeFile(dictPath, dictContent);
+  }
+  runCommand(NULL, addDict, NULL);
+  runCommand(NULL, commitDict, NULL);
+  runCommand(NULL, pushDict, NULL);
+  
+  // The server trains it for the first checkout.
+  char *checkoutDict[] = {"../WTF", "checkout", "TEST_DICT", (char*)0};
+  runCommand("TEST_COPY", checkoutDict, NULL);
+  check(access("server_repo/TEST_DICT/.dictionary", F_OK) == 0, "the server trained a dictionary");
+  check(access("TEST_COPY/TEST_DICT/.dictionary", F_OK) == 0, "checkout keeps the dictionary");
+  check(sameFile("TEST_DICT/src/f1.c", "TEST_COPY/TEST_DICT/src/f1.c")
+    && sameFile("TEST_DICT/src/f20.c", "TEST_COPY/TEST_DICT/src/f20.c"), "files are checked out");
+  
+  // The upgrade is compressed with the dictionary the copy has.
+  writeFile("TEST_DICT/src/f3.c", "int function_3(int argument) {\n\treturn argument;\n}\n");
+  runCommand(NULL, commitDict, NULL);
+  runCommand(NULL, pushDict, NULL);
+  char *updateDict[] = {"../WTF", "update", "TEST_DICT", (char*)0};
+  char *upgradeDict[] = {"../WTF", "upgrade", "TEST_DICT", (char*)0};
+  runCommand("TEST_COPY", updateDict, NULL);
+  runCommand("TEST_COPY", upgradeDict, NULL);
+  check(sameFile("TEST_DICT/src/f3.c", "TEST_COPY/TEST_DICT/src/f3.c"), "src/f3.c is upgraded");
+  
+  
+  
+  printf("\n*** Test case 21: compressed requests and responses ***\n");
+  // An .update of all 20 files is big enough to be compressed, it must
+  // not be with the dictionary, which the server does not read it with.
+  for(n = 1; n <= 20; n++){
+    sprintf(dictPath, "TEST_DICT/src/f%d.c", n);
+    sprintf(dictContent, "int function_%d(int argument) {\n\treturn argument + %d;\n}\n", n, n);
+    writeFile(dictPath, dictContent);
+  }
+  runCommand(NULL, commitDict, NULL);
+  runCommand(NULL, pushDict, NULL);
+  runCommand("TEST_COPY", updateDict, NULL);
+  runCommand("TEST_COPY", upgradeDict, NULL);
+  check(sameFile("TEST_DICT/src/f1.c", "TEST_COPY/TEST_DICT/src/f1.c")
+    && sameFile("TEST_DICT/src/f20.c", "TEST_COPY/TEST_DICT/src/f20.c"), "all files are upgraded");
+  check(sameFile("TEST_DICT/.manifest", "TEST_COPY/TEST_DICT/.manifest"), "the manifest is of the upgraded version");
+  
+  char *historyDict[] = {"../WTF", "history", "TEST_DICT", (char*)0};
+  runCommand("TEST_COPY", historyDict, "TEST_DICT.out");
+  check(fileHas("TEST_COPY/TEST_DICT.out", "src/f20.c"), "history comes back");
+  unlink("TEST_COPY/TEST_DICT.out");
+  
+  
+  
+  printf("\n*** Test case 22: a one-line change of a big file is sent as a delta ***\n");
+  char *createDelta[] = {"./WTF", "create", "TEST_DELTA", (char*)0};
+  char *addDelta[] = {"./WTF", "add", "TEST_DELTA", "big.txt", (char*)0};
+  char *commitDelta[] = {"./WTF", "commit", "TEST_DELTA", (char*)0};
+  char *pushDelta[] = {"./WTF", "push", "TEST_DELTA", (char*)0};
+  runCommand(NULL, createDelta, NULL);
+  
+  // Files of 64KB or more are sent as changes to the copy the peer has.
+  FILE *bigFp = fopen("TEST_DELTA/big.txt", "w");
+  for(n = 0; n < 4000; n++){
+    fprintf(bigFp, "Line %d of the big text file, which only one line changes in.\n", n);
+  }
+  fclose(bigFp);
+  runCommand(NULL, addDelta, NULL);
+  runCommand(NULL, commitDelta, NULL);
+  runCommand(NULL, pushDelta, NULL);
+  char *checkoutDelta[] = {"../WTF", "checkout", "TEST_DELTA", (char*)0};
+  runCommand("TEST_COPY", checkoutDelta, NULL);
+  
+  bigFp = fopen("TEST_DELTA/big.txt", "r+");
+  fseek(bigFp, 2000 * 64, SEEK_SET);
+  fprintf(bigFp, "This line is changed.");
+  fclose(bigFp);
+  runCommand(NULL, commitDelta, NULL);
+  runCommand(NULL, pushDelta, "TEST_DELTA.out");
+  check(fileHas("TEST_DELTA.out", "Sending changes of big.txt"), "only the changes of big.txt are pushed");
+  check(sameFile("TEST_DELTA/big.txt", "server_repo/TEST_DELTA/3/big.txt"), "the pushed delta is applied");
+  unlink("TEST_DELTA.out");
+  
+  char *updateDelta[] = {"../WTF", "update", "TEST_DELTA", (char*)0};
+  char *upgradeDelta[] = {"../WTF", "upgrade", "TEST_DELTA", (char*)0};
+  runCommand("TEST_COPY", updateDelta, NULL);
+  runCommand("TEST_COPY", upgradeDelta, NULL);
+  check(sameFile("TEST_DELTA/big.txt", "TEST_COPY/TEST_DELTA/big.txt"), "the upgraded delta is applied");
+  
+  
+  
+  printf("\n*** Test case 23: big files are sent in chunks the peer does not have ***\n");
+  char *createChunk[] = {"./WTF", "create", "TEST_CHUNK", (char*)0};
+  char *addChunk[] = {"./WTF", "add", "TEST_CHUNK", "big.bin", (char*)0};
+  char *addCopyChunk[] = {"./WTF", "add", "TEST_CHUNK", "copy.bin", (char*)0};
+  char *commitChunk[] = {"./WTF", "commit", "TEST_CHUNK", (char*)0};
+  char *pushChunk[] = {"./WTF", "push", "TEST_CHUNK", (char*)0};
+  runCommand(NULL, createChunk, NULL);
+  writeRandomFile("TEST_CHUNK/big.bin", 1536 * 1024);
+  runCommand(NULL, addChunk, NULL);
+  runCommand(NULL, commitChunk, NULL);
+  runCommand(NULL, pushChunk, NULL);
+  char *checkoutChunk[] = {"../WTF", "checkout", "TEST_CHUNK", (char*)0};
+  runCommand("TEST_COPY", checkoutChunk, NULL);
+  check(sameFile("TEST_CHUNK/big.bin", "TEST_COPY/TEST_CHUNK/big.bin"), "big.bin is checked out");
+  
+  // copy.bin is big.bin with some bytes put in the middle, all its other
+  // chunks are on the server already. big.bin itself is changed too.
+  FILE *bigIn = fopen("TEST_CHUNK/big.bin", "r");
+  FILE *copyOut = fopen("TEST_CHUNK/copy.bin", "w");
+  int c;
+  long offset = 0;
+  while((c = fgetc(bigIn)) != EOF){
+    if(offset++ == 700 * 1024){
+      fprintf(copyOut, "These bytes are put in the middle of the copy.");
+    }
+    fputc(c, copyOut);
+  }
+  fclose(bigIn);
+  fclose(copyOut);
+  bigFp = fopen("TEST_CHUNK/big.bin", "r+");
+  fseek(bigFp, 1000 * 1024, SEEK_SET);
+  fprintf(bigFp, "These bytes are changed.");
+  fclose(bigFp);
+  runCommand(NULL, addCopyChunk, NULL);
+  runCommand(NULL, commitChunk, NULL);
+  runCommand(NULL, pushChunk, "TEST_CHUNK.out");
+  check(fileHas("TEST_CHUNK.out", "Sending copy.bin in chunks"), "copy.bin is pushed in chunks");
+  check(sameFile("TEST_CHUNK/copy.bin", "server_repo/TEST_CHUNK/3/copy.bin")
+    && sameFile("TEST_CHUNK/big.bin", "server_repo/TEST_CHUNK/3/big.bin"), "the server builds the pushed files");
+  unlink("TEST_CHUNK.out");
+  
+  char *updateChunk[] = {"../WTF", "update", "TEST_CHUNK", (char*)0};
+  char *upgradeChunk[] = {"../WTF", "upgrade", "TEST_CHUNK", (char*)0};
+  runCommand("TEST_COPY", updateChunk, NULL);
+  runCommand("TEST_COPY", upgradeChunk, NULL);
+  check(sameFile("TEST_CHUNK/copy.bin", "TEST_COPY/TEST_CHUNK/copy.bin")
+    && sameFile("TEST_CHUNK/big.bin", "TEST_COPY/TEST_CHUNK/big.bin"), "the upgrade builds the changed files");
+  
+  
+  
+  printf("\n*** Test case 24: files the peer has are sent as their hash ***\n");
+  char *createHave[] = {"./WTF", "create", "TEST_HAVE", (char*)0};
+  char *addHave[] = {"./WTF", "add", "TEST_HAVE", "a.txt", (char*)0};
+  char *addCopyHave[] = {"./WTF", "add", "TEST_HAVE", "copy.txt", (char*)0};
+  char *commitHave[] = {"./WTF", "commit", "TEST_HAVE", (char*)0};
+  char *pushHave[] = {"./WTF", "push", "TEST_HAVE", (char*)0};
+  runCommand(NULL, createHave, NULL);
+  bigFp = fopen("TEST_HAVE/a.txt", "w");
+  for(n = 0; n < 500; n++){
+    fprintf(bigFp, "Line %d of a.txt, which is pushed again under a new name.\n", n);
+  }
+  fclose(bigFp);
+  runCommand(NULL, addHave, NULL);
+  runCommand(NULL, commitHave, NULL);
+  runCommand(NULL, pushHave, NULL);
+  char *checkoutHave[] = {"../WTF", "checkout", "TEST_HAVE", (char*)0};
+  runCommand("TEST_COPY", checkoutHave, NULL);
+  
+  // The server has the contents of copy.txt, they are not sent again.
+  char *copyHave[] = {"/bin/cp", "TEST_HAVE/a.txt", "TEST_HAVE/copy.txt", (char*)0};
+  runCommand(NULL, copyHave, NULL);
+  runCommand(NULL, addCopyHave, NULL);
+  runCommand(NULL, commitHave, NULL);
+  runCommand(NULL, pushHave, "TEST_HAVE.out");
+  check(fileHas("TEST_HAVE.out", "Sending copy.txt as its hash"), "copy.txt is pushed as its hash");
+  check(sameFile("TEST_HAVE/a.txt", "server_repo/TEST_HAVE/3/copy.txt"), "the server has copy.txt");
+  unlink("TEST_HAVE.out");
+  
+  char *updateHave[] = {"../WTF", "update", "TEST_HAVE", (char*)0};
+  char *upgradeHave[] = {"../WTF", "upgrade", "TEST_HAVE", (char*)0};
+  runCommand("TEST_COPY", updateHave, NULL);
+  runCommand("TEST_COPY", upgradeHave, NULL);
+  check(sameFile("TEST_HAVE/a.txt", "TEST_COPY/TEST_HAVE/copy.txt")
+    && sameFile("TEST_HAVE/a.txt", "TEST_COPY/TEST_HAVE/a.txt"), "the upgrade brings copy.txt");
+  
+  
+  
+  printf("\n*** Test case 25: a dropped push and checkout are resumed ***\n");
+  char *createResume[] = {"./WTF", "create", "TEST_RESUME", (char*)0};
+  char *addResume[] = {"./WTF", "add", "TEST_RESUME", "a.bin", "s.txt", (char*)0};
+  char *commitResume[] = {"./WTF", "commit", "TEST_RESUME", (char*)0};
+  char *pushResume[] = {"./WTF", "push", "TEST_RESUME", (char*)0};
+  runCommand(NULL, createResume, NULL);
+  writeRandomFile("TEST_RESUME/a.bin", 2048 * 1024);
+  writeFile("TEST_RESUME/s.txt", "Small file.\n");
+  runCommand(NULL, addResume, NULL);
+  runCommand(NULL, commitResume, NULL);
+  
+  // The push goes through a proxy which drops it after 1MB.
+  char *configureProxy[] = {"./WTF", "configure", "localhost", "17001", (char*)0};
+  char *configureServer[] = {"./WTF", "configure", "localhost", "17000", (char*)0};
+  pid_t proxy = startCutProxy(17001, 17000, 1000000, 1);
+  runCommand(NULL, configureProxy, NULL);
+  runCommand(NULL, pushResume, "TEST_RESUME.out");
+  check(fileHas("TEST_RESUME.out", "Connection lost"), "the push is dropped");
+  runCommand(NULL, pushResume, "TEST_RESUME.out");
+  check(fileHas("TEST_RESUME.out", "Server has"), "the push is resumed");
+  check(sameFile("TEST_RESUME/a.bin", "server_repo/TEST_RESUME/2/a.bin")
+    && sameFile("TEST_RESUME/s.txt", "server_repo/TEST_RESUME/2/s.txt"), "the server has the pushed files");
+  runCommand(NULL, configureServer, NULL);
+  unlink("TEST_RESUME.out");
+  kill(proxy, SIGTERM);
+  waitpid(proxy, NULL, 0);
+  
+  // The checkout, on one connection, is dropped after 1MB of the response.
+  char *configureCopyProxy[] = {"../WTF", "configure", "localhost", "17002", (char*)0};
+  char *checkoutResume[] = {"../WTF", "checkout", "TEST_RESUME", "1", (char*)0};
+  proxy = startCutProxy(17002, 17000, 1000000, 0);
+  runCommand("TEST_COPY", configureCopyProxy, NULL);
+  runCommand("TEST_COPY", checkoutResume, "TEST_RESUME.out");
+  check(fileHas("TEST_COPY/TEST_RESUME.out", "Connection lost after"), "the checkout is dropped");
+  check(access("TEST_COPY/.TEST_RESUME.transfer.part", F_OK) == 0, "what came is kept");
+  runCommand("TEST_COPY", checkoutResume, NULL);
+  check(sameFile("TEST_RESUME/a.bin", "TEST_COPY/TEST_RESUME/a.bin")
+    && sameFile("TEST_RESUME/s.txt", "TEST_COPY/TEST_RESUME/s.txt"), "the checkout is resumed");
+  check(access("TEST_COPY/.TEST_RESUME.transfer.part", F_OK) != 0, "the resumed checkout is cleaned up");
+  runCommand("TEST_COPY", configureCopy, NULL);
+  unlink("TEST_COPY/TEST_RESUME.out");
+  kill(proxy, SIGTERM);
+  waitpid(proxy, NULL, 0);
+  
+  
+  
+  printf("\n*** Test case 26: checkout over many connections ***\n");
+  char *createShard[] = {"./WTF", "create", "TEST_SHARD", (char*)0};
+  char *addShard[] = {"./WTF", "add", "TEST_SHARD", "src", (char*)0};
+  char *commitShard[] = {"./WTF", "commit", "TEST_SHARD", (char*)0};
+  char *pushShard[] = {"./WTF", "push", "TEST_SHARD", (char*)0};
+  runCommand(NULL, createShard, NULL);
+  mkdir("TEST_SHARD/src", 0777);
+  char shardPath[100], copyShardPath[100];
+  for(n = 1; n <= 6; n++){
+    sprintf(shardPath, "TEST_SHARD/src/f%d.bin", n);
+    writeRandomFile(shardPath, n * 50 * 1024);
+  }
+  runCommand(NULL, addShard, NULL);
+  runCommand(NULL, commitShard, NULL);
+  runCommand(NULL, pushShard, NULL);
+  
+  char *checkoutShard[] = {"../WTF", "checkout", "TEST_SHARD", "3", (char*)0};
+  runCommand("TEST_COPY", checkoutShard, "TEST_SHARD.out");
+  check(fileHas("TEST_COPY/TEST_SHARD.out", "over 3 connections"), "the checkout is over 3 connections");
+  int sameShards = 1;
+  for(n = 1; n <= 6; n++){
+    sprintf(shardPath, "TEST_SHARD/src/f%d.bin", n);
+    sprintf(copyShardPath, "TEST_COPY/%s", shardPath);
+    sameShards = sameShards && sameFile(shardPath, copyShardPath);
+  }
+  check(sameShards, "all files are checked out");
+  
+  // No more connections than files are made.
+  char *removeShard[] = {"/bin/rm", "-rf", "TEST_COPY/TEST_SHARD", (char*)0};
+  char *checkoutManyShard[] = {"../WTF", "checkout", "TEST_SHARD", "10", (char*)0};
+  runCommand(NULL, removeShard, NULL);
+  runCommand("TEST_COPY", checkoutManyShard, "TEST_SHARD.out");
+  check(fileHas("TEST_COPY/TEST_SHARD.out", "over 6 connections"), "no more connections than files");
+  check(sameFile("TEST_SHARD/src/f6.bin", "TEST_COPY/TEST_SHARD/src/f6.bin"), "files are checked out again");
+  unlink("TEST_COPY/TEST_SHARD.out");
+  
+  
+  
+  printf("\n*** Test case 27: lazy checkout and hydrate ***\n");
+  char *createLazy[] = {"./WTF", "create", "TEST_LAZY", (char*)0};
+  char *addLazy[] = {"./WTF", "add", "TEST_LAZY", "app", "lib", (char*)0};
+  char *commitLazy[] = {"./WTF", "commit", "TEST_LAZY", (char*)0};
+  char *pushLazy[] = {"./WTF", "push", "TEST_LAZY", (char*)0};
+  runCommand(NULL, createLazy, NULL);
+  mkdir("TEST_LAZY/app", 0777);
+  mkdir("TEST_LAZY/lib", 0777);
+  writeFile("TEST_LAZY/app/main.c", "int main(){\n\treturn 0;\n}\n");
+  writeFile("TEST_LAZY/app/other.c", "int other(){\n\treturn 1;\n}\n");
+  char lazyPath[100], lazyContent[100];
+  for(n = 1; n <= 10; n++){
+    sprintf(lazyPath, "TEST_LAZY/lib/f%d.h", n);
+    sprintf(lazyContent, "#define LIB_%d %d\n", n, n);
+    writeFile(lazyPath, lazyContent);
+  }
+  runCommand(NULL, addLazy, NULL);
+  runCommand(NULL, commitLazy, NULL);
+  runCommand(NULL, pushLazy, NULL);
+  
+  // Only the .manifest comes, files are hydrated when they are needed.
+  char *checkoutLazy[] = {"../WTF", "checkout", "TEST_LAZY", "--lazy", (char*)0};
+  runCommand("TEST_COPY", checkoutLazy, NULL);
+  check(access("TEST_COPY/TEST_LAZY/.manifest", F_OK) == 0
+    && access("TEST_COPY/TEST_LAZY/app/main.c", F_OK) != 0
+    && access("TEST_COPY/TEST_LAZY/lib/f1.h", F_OK) != 0, "the lazy checkout has no files");
+  
+  char *hydrateFile[] = {"../WTF", "hydrate", "TEST_LAZY", "app/main.c", (char*)0};
+  runCommand("TEST_COPY", hydrateFile, "TEST_LAZY.out");
+  check(fileHas("TEST_COPY/TEST_LAZY.out", "1 files hydrated"), "hydrate reports the file");
+  check(sameFile("TEST_LAZY/app/main.c", "TEST_COPY/TEST_LAZY/app/main.c")
+    && access("TEST_COPY/TEST_LAZY/app/other.c", F_OK) != 0, "a file is hydrated");
+  char *hydrateGlob[] = {"../WTF", "hydrate", "TEST_LAZY", "lib/f*.h", (char*)0};
+  runCommand("TEST_COPY", hydrateGlob, NULL);
+  check(sameFile("TEST_LAZY/lib/f1.h", "TEST_COPY/TEST_LAZY/lib/f1.h")
+    && sameFile("TEST_LAZY/lib/f10.h", "TEST_COPY/TEST_LAZY/lib/f10.h"), "a glob is hydrated");
+  unlink("TEST_COPY/TEST_LAZY.out");
+  
+  // Upgrade brings the hydrated files, and leaves the others out.
+  writeFile("TEST_LAZY/lib/f5.h", "#define LIB_5 50\n");
+  writeFile("TEST_LAZY/app/other.c", "int other(){\n\treturn 2;\n}\n");
+  runCommand(NULL, commitLazy, NULL);
+  runCommand(NULL, pushLazy, NULL);
+  char *updateLazy[] = {"../WTF", "update", "TEST_LAZY", (char*)0};
+  char *upgradeLazy[] = {"../WTF", "upgrade", "TEST_LAZY", (char*)0};
+  runCommand("TEST_COPY", updateLazy, NULL);
+  runCommand("TEST_COPY", upgradeLazy, NULL);
+  check(sameFile("TEST_LAZY/lib/f5.h", "TEST_COPY/TEST_LAZY/lib/f5.h"), "a hydrated file is upgraded");
+  check(access("TEST_COPY/TEST_LAZY/app/other.c", F_OK) != 0, "a file not hydrated is left out");
+  char *hydrateOther[] = {"../WTF", "hydrate", "TEST_LAZY", "app/other.c", (char*)0};
+  runCommand("TEST_COPY", hydrateOther, NULL);
+  check(sameFile("TEST_LAZY/app/other.c", "TEST_COPY/TEST_LAZY/app/other.c"), "a file is hydrated at the new version");
+  
+  
+  
+  printf("\n*** Test case 28: working copies share the content cache ***\n");
+  char *createShared[] = {"./WTF", "create", "TEST_SHARED", (char*)0};
+  char *addShared[] = {"./WTF", "add", "TEST_SHARED", "doc", (char*)0};
+  char *commitShared[] = {"./WTF", "commit", "TEST_SHARED", (char*)0};
+  char *pushShared[] = {"./WTF", "push", "TEST_SHARED", (char*)0};
+  runCommand(NULL, createShared, NULL);
+  mkdir("TEST_SHARED/doc", 0777);
+  char sharedPath[100], sharedContent[100];
+  for(n = 1; n <= 5; n++){
+    sprintf(sharedPath, "TEST_SHARED/doc/page%d.txt", n);
+    sprintf(sharedContent, "Page %d of the shared project.\n", n);
+    writeFile(sharedPath, sharedContent);
+  }
+  runCommand(NULL, addShared, NULL);
+  runCommand(NULL, commitShared, NULL);
+  runCommand(NULL, pushShared, NULL);
+  
+  char *checkoutShared[] = {"../WTF", "checkout", "TEST_SHARED", (char*)0};
+  runCommand("TEST_COPY", checkoutShared, "TEST_SHARED.out");
+  check(!fileHas("TEST_COPY/TEST_SHARED.out", "in the cache"), "the first checkout downloads the files");
+  unlink("TEST_COPY/TEST_SHARED.out");
+  
+  // A third working copy takes them from the cache (WTF_CACHE) of the
+  // second one.
+  mkdir("TEST_COPY2", 0777);
+  runCommand("TEST_COPY2", configureCopy, NULL);
+  runCommand("TEST_COPY2", checkoutShared, "TEST_SHARED.out");
+  check(fileHas("TEST_COPY2/TEST_SHARED.out", "5 of 5 files are in the cache"), "the second checkout finds the files in the cache");
+  check(sameFile("TEST_SHARED/doc/page1.txt", "TEST_COPY2/TEST_SHARED/doc/page1.txt")
+    && sameFile("TEST_SHARED/doc/page5.txt", "TEST_COPY2/TEST_SHARED/doc/page5.txt"), "files are built from the cache");
+  check(access("TEST_COPY2/TEST_SHARED/.objects", F_OK) != 0, "the cache is not kept in the project");
+  unlink("TEST_COPY2/TEST_SHARED.out");
+  
+  
+  
+  printf("\n*** Test case 29: EXIT (SIGINT) ***\n");
+  kill(child_1, SIGINT);
+  waitpid(child_1, NULL, 0);
+  
+  printf("\n%d checks failed.\n", failures);
+  return failures > 0;
 }
 
 void sighandle(int sig){
@@ -1,35 +1,192 @@
+#include <ctype.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include "util.h"
 #include "compressor.h"
+#include "delta.h"
+#include "chunker.h"
+#include "objects.h"
 
-void computeFileHash(char *filename, unsigned char hash[HASH_STRING_LEN]) {
+// Codec of compressed transfers on this connection.
+static __thread int transferCodec = CODEC_ZLIB;
 
-    int i;
-    FILE *inFile = fopen (filename, "rb");
-    MD5_CTX mdContext;
-    int bytes;
-    unsigned char data[1024];
+// Set when both sides named their codecs, peers of older builds get
+// bodies of responses as they are.
+static __thread int transferNegotiated = 0;
 
-    if (inFile == NULL) {
-        printf ("%s can't be opened.\n", filename);
-        return;
-    }
+// Dictionary file of compressed transfers, and if it is to be sent.
+static __thread char *transferDictionary = NULL;
+static __thread int transferDictionarySend = 0;
+
+// Store of chunks of big files (server), NULL if none.
+static __thread char *chunkStoreDir = NULL;
+
+// Chunk lists of the files last chunked in chunkedDir, see chunkFiles.
+// Without a store, their chunks are found by hash in chunkRefs.
+typedef struct ChunkRef {
+	const char *hash;
+	ChunkList *list;
+	int chunk;
+} ChunkRef;
+static __thread char *chunkedDir = NULL;
+static __thread ChunkIndex *chunkedIndex = NULL;
+static __thread ChunkRef *chunkRefs = NULL;
+static __thread long numChunkRefs = 0;
+
+// Store of whole files by hash, NULL if none. Files are linked out of
+// it if set, else copied.
+static __thread char *objectStoreDir = NULL;
+static __thread int objectStoreLinks = 0;
+static __thread long long objectStoreAdded = 0;
+
+// Two hex chars for each byte value, so a digest is encoded with
+// one table lookup per byte instead of a sprintf.
+static char hexPairs[512];
+static pthread_once_t hexPairsOnce = PTHREAD_ONCE_INIT;
+
+static void initHexPairs() {
+	static const char *digits = "0123456789abcdef";
+	int i;
+	for(i = 0; i < 256; i++) {
+		hexPairs[2*i] = digits[i >> 4];
+		hexPairs[2*i + 1] = digits[i & 0xf];
+	}
+}
+
+void encodeHex(const unsigned char *digest, int len, char *hex) {
+	pthread_once(&hexPairsOnce, initHexPairs);
+	int i;
+	for(i = 0; i < len; i++) {
+		memcpy(hex + 2*i, hexPairs + 2*digest[i], 2);
+	}
+	hex[2*len] = '\0';
+}
+
+static const char *hashAlgorithmNames[NUM_HASH_ALGORITHMS] = {"md5", "sha256", "blake2b"};
 
+const char *hashAlgorithmName(int algorithm) {
+	if(algorithm < 0 || algorithm >= NUM_HASH_ALGORITHMS) {
+		return "unknown";
+	}
+	return hashAlgorithmNames[algorithm];
+}
+
+int hashAlgorithmFromName(const char *name) {
+	int i;
+	for(i = 0; i < NUM_HASH_ALGORITHMS; i++) {
+		if(strcmp(name, hashAlgorithmNames[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static const EVP_MD *hashAlgorithmDigest(int algorithm) {
+	switch(algorithm) {
+		case HASH_SHA256:
+			return EVP_sha256();
+		case HASH_BLAKE2B:
+			return EVP_blake2b512();
+		default:
+			return EVP_md5();
+	}
+}
+
+void computeFileHashWith(char *filename, unsigned char hash[HASH_STRING_LEN], int algorithm) {
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf ("%s can't be opened.\n", filename);
+		hash[0] = '\0'; // no hash
+		return;
+	}
+	
+	// Large files are read ahead by the kernel while we hash.
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	
+	unsigned char *data = malloc(HASH_READ_SIZE);
+	EVP_MD_CTX *mdContext = EVP_MD_CTX_new();
+	ssize_t bytes;
+	
 	// read file in chunks
-    MD5_Init (&mdContext);
-    while ((bytes = fread (data, 1, 1024, inFile)) != 0)
-        MD5_Update (&mdContext, data, bytes);
+	EVP_DigestInit_ex (mdContext, hashAlgorithmDigest(algorithm), NULL);
+	while ((bytes = read (fd, data, HASH_READ_SIZE)) > 0)
+		EVP_DigestUpdate (mdContext, data, bytes);
 	
-		
-	// convert the hex
-	unsigned char tmp[MD5_DIGEST_LENGTH];
-    MD5_Final (tmp, &mdContext);
+	unsigned char tmp[EVP_MAX_MD_SIZE];
+	EVP_DigestFinal_ex (mdContext, tmp, NULL);
+	
+	// Writes HASH_STRING_LEN chars and the '\0'.
+	// Longer digests are cut, first bytes are kept.
+	encodeHex(tmp, MD5_DIGEST_LENGTH, (char *) hash);
+	
+	EVP_MD_CTX_free(mdContext);
+	free(data);
+	close (fd);
+}
+
+void computeFileHash(char *filename, unsigned char hash[HASH_STRING_LEN]) {
+	computeFileHashWith(filename, hash, HASH_MD5);
+}
+
+typedef struct HashJob {
+	char **filenames;
+	char **hashes;
+	int numFiles;
+	int algorithm;
+	int next; // next file to be picked, taken atomically.
+} HashJob;
+
+static void *hashWorker(void *arg) {
+	HashJob *job = (HashJob *) arg;
+	while(1) {
+		int i = __sync_fetch_and_add(&job->next, 1);
+		if(i >= job->numFiles) {
+			break;
+		}
+		computeFileHashWith(job->filenames[i], job->hashes[i], job->algorithm);
+		job->hashes[i][HASH_STRING_LEN] = '\0';
+	}
+	return NULL;
+}
+
+// Each worker keeps taking the next file from the list, till all are done.
+void computeFileHashes(char **filenames, char **hashes, int numFiles, int algorithm) {
+	HashJob job = {filenames, hashes, numFiles, algorithm, 0};
 	
-	// one by one convert character to hex chars.
-	for(i=0; i<MD5_DIGEST_LENGTH; i++) {
-		sprintf(hash + 2*i, "%02x", tmp[i]);
+	long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(numThreads > 32) {
+		numThreads = 32;
+	}
+	if(numThreads > numFiles) {
+		numThreads = numFiles;
 	}
 	
-    fclose (inFile);
+	// Not worth a thread.
+	if(numThreads <= 1) {
+		hashWorker(&job);
+		return;
+	}
+	
+	pthread_t tid[32];
+	int started = 0;
+	int i;
+	// Calling thread is also a worker.
+	for(i = 1; i < numThreads; i++) {
+		if(pthread_create(&tid[started], NULL, hashWorker, &job) == 0) {
+			started++;
+		}
+	}
+	
+	// Help the workers, also covers the case of no thread started.
+	hashWorker(&job);
+	
+	for(i = 0; i < started; i++) {
+		pthread_join(tid[i], NULL);
+	}
 }
 
 long long current_timestamp() {
@@ -140,7 +297,7 @@ Manifest file format:
 The filePaths are relative to the manifest file.
 */
 void writeFileDetailsInManifest(int manifestFd, char *filePath) {
-	unsigned char fileHash[HASH_STRING_LEN];
+	unsigned char fileHash[HASH_STRING_LEN + 1];
 	computeFileHash(filePath, fileHash);
 	
 	write(manifestFd, fileHash, HASH_STRING_LEN);
@@ -157,6 +314,139 @@ void writeFileDetailsInManifest(int manifestFd, char *filePath) {
 
 
 
+static int compareChunkHashes(const void *a, const void *b) {
+	return memcmp(a, b, HASH_STRING_LEN);
+}
+
+static int compareChunkRefs(const void *a, const void *b) {
+	return memcmp(((const ChunkRef *) a)->hash, ((const ChunkRef *) b)->hash, HASH_STRING_LEN);
+}
+
+// Reads the chunk from the store, or from a chunked file. Returns its
+// length, -1 if it is not there (or the file changed since).
+static long loadChunk(const char *hash, unsigned char *buffer) {
+	if(chunkStoreDir != NULL) {
+		return loadStoredChunk(chunkStoreDir, hash, buffer);
+	}
+	if(numChunkRefs == 0) {
+		return -1;
+	}
+	
+	ChunkRef key = { hash, NULL, 0 };
+	ChunkRef *ref = bsearch(&key, chunkRefs, numChunkRefs, sizeof(ChunkRef), compareChunkRefs);
+	if(ref == NULL) {
+		return -1;
+	}
+	ChunkList *list = ref->list;
+	if(list->fd < 0) {
+		char *path = malloc(sizeof(char) * (strlen(chunkedDir) + strlen(list->filePath) + 2));
+		sprintf(path, "%s/%s", chunkedDir, list->filePath);
+		list->fd = open(path, O_RDONLY, 0777);
+		free(path);
+	}
+	
+	uint32_t length = list->length[ref->chunk];
+	char check[HASH_STRING_LEN + 1];
+	if(list->fd < 0 || length > CHUNK_MAX_LENGTH
+			|| pread(list->fd, buffer, length, list->offset[ref->chunk]) != length) {
+		return -1;
+	}
+	hashChunk(buffer, length, check);
+	return memcmp(check, hash, HASH_STRING_LEN) == 0 ? length : -1;
+}
+
+// Before a chunked file is written over, it is opened, and removed so
+// the new one is another file. Its chunks are read from the old one.
+static void keepChunkSource(char *filePath, char *fullPath) {
+	if(numChunkRefs == 0) {
+		return;
+	}
+	int found;
+	int i = findChunkListPosition(chunkedIndex, filePath, &found);
+	ChunkList *list = found ? chunkedIndex->files[i] : NULL;
+	if(list != NULL && list->fd < 0) {
+		list->fd = open(fullPath, O_RDONLY, 0777);
+		if(list->fd >= 0) {
+			unlink(fullPath);
+		}
+	}
+}
+
+// Reads a chunked file of length bytes:
+// <numChunks>:<hash><'=' if receiver has it, else '+'><length>:<data if '+'>..
+// and writes it, hashing into mdContext (may be NULL). New chunks are
+// saved in the store. Returns -1 if a chunk is missing or damaged.
+static int receiveChunks(int readFd, long long length, int writeFd, EVP_MD_CTX *mdContext) {
+	SocketBuffer *socketBuffer = createBuffer();
+	unsigned char *buffer = malloc(CHUNK_MAX_LENGTH);
+	int status = 0;
+	
+	readTillDelimiter(socketBuffer, readFd, ':');
+	char *numChunksStr = readAllBuffer(socketBuffer);
+	long numChunks = atol(numChunksStr);
+	length -= strlen(numChunksStr) + 1;
+	free(numChunksStr);
+	
+	while(numChunks-- > 0 && length > 0) {
+		char hash[HASH_STRING_LEN + 2];
+		if(readFully(readFd, hash, HASH_STRING_LEN + 1) != HASH_STRING_LEN + 1) {
+			status = -1;
+			break;
+		}
+		char flag = hash[HASH_STRING_LEN];
+		hash[HASH_STRING_LEN] = '\0';
+		
+		readTillDelimiter(socketBuffer, readFd, ':');
+		char *chunkLenStr = readAllBuffer(socketBuffer);
+		long chunkLen = atol(chunkLenStr);
+		length -= HASH_STRING_LEN + 1 + strlen(chunkLenStr) + 1;
+		free(chunkLenStr);
+		if(chunkLen < 0 || chunkLen > CHUNK_MAX_LENGTH) {
+			status = -1;
+			break;
+		}
+		
+		if(flag == '+') {
+			ssize_t n = readFully(readFd, buffer, chunkLen);
+			length -= n;
+			if(n != chunkLen) {
+				status = -1;
+				break;
+			}
+			
+			// Only good chunks go into the store.
+			char check[HASH_STRING_LEN + 1];
+			hashChunk(buffer, chunkLen, check);
+			if(strcmp(check, hash) != 0) {
+				status = -1;
+			} else if(chunkStoreDir != NULL) {
+				storeChunk(chunkStoreDir, hash, buffer, chunkLen);
+			}
+		} else if(loadChunk(hash, buffer) != chunkLen) {
+			status = -1;
+			memset(buffer, 0, chunkLen); // Keeps the file length, its hash shows it.
+		}
+		
+		write(writeFd, buffer, chunkLen);
+		if(mdContext != NULL) {
+			EVP_DigestUpdate(mdContext, buffer, chunkLen);
+		}
+	}
+	
+	// Rest of a bad record is skipped, the next file starts after it.
+	while(length > 0) {
+		ssize_t n = read(readFd, buffer, length < CHUNK_MAX_LENGTH ? length : CHUNK_MAX_LENGTH);
+		if(n <= 0) {
+			break;
+		}
+		length -= n;
+	}
+	
+	free(buffer);
+	freeSocketBuffer(socketBuffer);
+	return status;
+}
+
 /*
 This is helper method to write the contents to the file, which are sent
 back from server.
@@ -165,7 +455,67 @@ Format:
 
 Precondition: This method is called once we are sure that server is going to supply the contents.
 */
-void writeFileFromSocket(int sockToRead, char *baseDir) {
+char *receiveFileFromSocket(int sockToRead, char *baseDir, int hashAlgorithm, char hash[]) {
+	return receiveFileAgainst(sockToRead, baseDir, baseDir, hashAlgorithm, hash);
+}
+
+// Builds the file from the object with the hash. Returns 1 if it was
+// linked or cloned, 0 if it was copied (and hashed into mdContext), -1
+// if the store does not have it. Copies are checked, a damaged object
+// is removed from the store.
+static int receiveObject(const char *objectHash, int hashAlgorithm, char *fullPath, EVP_MD_CTX *mdContext) {
+	if(objectStoreDir == NULL || hashAlgorithm < 0 || strlen(objectHash) != HASH_STRING_LEN) {
+		return -1;
+	}
+	char *objPath = objectPath(objectStoreDir, hashAlgorithm, objectHash);
+	
+	unlink(fullPath);
+	if(objectStoreLinks && link(objPath, fullPath) == 0) {
+		free(objPath);
+		return 1;
+	}
+	
+	// A clone shares the blocks till either copy is changed.
+	if(!objectStoreLinks && cloneFile(objPath, fullPath)) {
+		free(objPath);
+		return 1;
+	}
+	
+	int readFd = open(objPath, O_RDONLY, 0777);
+	if(readFd < 0) {
+		free(objPath);
+		return -1;
+	}
+	int writeFd = open(fullPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	EVP_MD_CTX *checkContext = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(checkContext, hashAlgorithmDigest(hashAlgorithm), NULL);
+	
+	char *data = malloc(HASH_READ_SIZE);
+	ssize_t n;
+	while((n = read(readFd, data, HASH_READ_SIZE)) > 0) {
+		write(writeFd, data, n);
+		EVP_DigestUpdate(checkContext, data, n);
+		if(mdContext != NULL) {
+			EVP_DigestUpdate(mdContext, data, n);
+		}
+	}
+	close(writeFd);
+	close(readFd);
+	free(data);
+	
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	char check[HASH_STRING_LEN + 1];
+	EVP_DigestFinal_ex(checkContext, digest, NULL);
+	EVP_MD_CTX_free(checkContext);
+	encodeHex(digest, MD5_DIGEST_LENGTH, check);
+	if(strcmp(check, objectHash) != 0) {
+		unlink(objPath);
+	}
+	free(objPath);
+	return 0;
+}
+
+char *receiveFileAgainst(int sockToRead, char *baseDir, char *deltaBaseDir, int hashAlgorithm, char hash[]) {
 	SocketBuffer *socketBuffer = createBuffer();
 
 	readTillDelimiter(socketBuffer, sockToRead, ':');
@@ -177,7 +527,10 @@ void writeFileFromSocket(int sockToRead, char *baseDir) {
 	
 	readTillDelimiter(socketBuffer, sockToRead, ':');
 	char *contentLenStr = readAllBuffer(socketBuffer);
-	long contentLen = atol(contentLenStr);
+	int isDelta = contentLenStr[0] == 'd';
+	int isChunked = contentLenStr[0] == 'c';
+	int isObject = contentLenStr[0] == 'h';
+	long contentLen = atol(contentLenStr + (isDelta || isChunked || isObject));
 		
 	char *fullpath = malloc(sizeof(char) * (strlen(filePath) + 15 + strlen(baseDir)));
 	sprintf(fullpath, "%s/%s", baseDir, filePath);
@@ -185,25 +538,102 @@ void writeFileFromSocket(int sockToRead, char *baseDir) {
 	// Create the directory structure if needed.
 	createDirStructureIfNeeded(fullpath);
 	
-	// Write data to the file now.
-	int fd = open(fullpath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
-	char c;
-	long i = 0;
-	while(i++ < contentLen) {
-		read(sockToRead, &c, 1);
-		if(c == '\0') {
-			break; // Socket disconnected.
+	EVP_MD_CTX *mdContext = NULL;
+	if(hashAlgorithm >= 0) {
+		mdContext = EVP_MD_CTX_new();
+		EVP_DigestInit_ex(mdContext, hashAlgorithmDigest(hashAlgorithm), NULL);
+	}
+	
+	// Chunks of the old file may still be needed.
+	if(!isDelta) {
+		keepChunkSource(filePath, fullpath);
+	}
+	
+	int linkedObject = 0;
+	char objectHash[HASH_STRING_LEN + 1];
+	
+	if(isObject) {
+		ssize_t n = readFully(sockToRead, objectHash, contentLen < HASH_STRING_LEN ? contentLen : HASH_STRING_LEN);
+		objectHash[n > 0 ? n : 0] = '\0';
+		writeNBytesToFile(contentLen - (n > 0 ? n : 0), sockToRead, -1);
+		
+		linkedObject = receiveObject(objectHash, hashAlgorithm, fullpath, mdContext);
+		if(linkedObject < 0) {
+			printf("Error: %s is not in the object store.\n", filePath);
+		}
+		
+	} else if(isChunked) {
+		char *tmpPath = malloc(sizeof(char) * (strlen(fullpath) + 20));
+		sprintf(tmpPath, "%s.chunk_tmp", fullpath);
+		
+		int fd = open(tmpPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+		if(receiveChunks(sockToRead, contentLen, fd, mdContext) != 0) {
+			printf("Error: Could not build %s from its chunks.\n", filePath);
+		}
+		close(fd);
+		rename(tmpPath, fullpath);
+		free(tmpPath);
+		
+	} else if(isDelta) {
+		// The old copy can be this same file, so the new one is built
+		// aside, and then moved over it.
+		char *basePath = malloc(sizeof(char) * (strlen(filePath) + strlen(deltaBaseDir) + 2));
+		sprintf(basePath, "%s/%s", deltaBaseDir, filePath);
+		char *tmpPath = malloc(sizeof(char) * (strlen(fullpath) + 20));
+		sprintf(tmpPath, "%s.delta_tmp", fullpath);
+		
+		int fd = open(tmpPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+		if(applyDelta(sockToRead, contentLen, basePath, fd, mdContext) != 0) {
+			printf("Error: Could not apply the changes of %s.\n", filePath);
+		}
+		close(fd);
+		rename(tmpPath, fullpath);
+		
+		free(tmpPath);
+		free(basePath);
+	} else {
+		// Write data to the file now, and hash the same bytes.
+		// It is a new file, the old one may be in an object store.
+		unlink(fullpath);
+		int fd = open(fullpath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+		char *data = malloc(HASH_READ_SIZE);
+		while(contentLen > 0) {
+			ssize_t n = read(sockToRead, data, contentLen < HASH_READ_SIZE ? contentLen : HASH_READ_SIZE);
+			if(n <= 0) {
+				break; // Socket disconnected.
+			}
+			write(fd, data, n);
+			if(mdContext != NULL) {
+				EVP_DigestUpdate(mdContext, data, n);
+			}
+			contentLen -= n;
+		}
+		close(fd);
+		free(data);
+	}
+	
+	if(mdContext != NULL) {
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		EVP_DigestFinal_ex(mdContext, digest, NULL);
+		encodeHex(digest, MD5_DIGEST_LENGTH, hash);
+		EVP_MD_CTX_free(mdContext);
+		
+		// Objects are stored by their hash.
+		if(linkedObject > 0) {
+			strcpy(hash, objectHash);
 		}
-		write(fd, &c, 1);
 	}
-	close(fd);	
 	
 	// de-allocate memory
 	freeSocketBuffer(socketBuffer);
 	free(nameLenStr);
-	free(filePath);
 	free(contentLenStr);
 	free(fullpath);
+	return filePath;
+}
+
+void writeFileFromSocket(int sockToRead, char *baseDir) {
+	free(receiveFileFromSocket(sockToRead, baseDir, -1, NULL));
 }
 
 /*
@@ -225,17 +655,400 @@ void writeFileDetailsToSocket(char *filePath, char *baseDir, int socket) {
 	// write size bytes from file to socket.
 	int fd = open(path, O_RDONLY, 0777);
 	
-	char c;
-	long i = 0;
-	while(i++ < size) {
-		read(fd, &c, 1);
-		if(c == '\0') {
-			break; // Socket disconnected.
+	// Contents can have '\0' bytes, exactly size bytes are sent.
+	char *data = malloc(HASH_READ_SIZE);
+	while(size > 0) {
+		ssize_t n = read(fd, data, size < HASH_READ_SIZE ? size : HASH_READ_SIZE);
+		if(n <= 0) {
+			break;
+		}
+		write(socket, data, n);
+		size -= n;
+	}
+	free(data);
+	
+	close(fd);
+	free(path);
+}
+
+void writeFileDeltaDetailsToSocket(char *filePath, char *baseDir, char *signatureDir, int socket) {
+	char *path = malloc(sizeof(char) * (strlen(filePath) + strlen(baseDir) + strlen(signatureDir) + 50));
+	sprintf(path, "%s/%s", signatureDir, filePath);
+	DeltaSignature *sig = loadDeltaSignature(path);
+	if(sig == NULL) {
+		writeFileDetailsToSocket(filePath, baseDir, socket);
+		free(path);
+		return;
+	}
+	
+	// Delta is made aside first, its length comes before it.
+	char *deltaPath = malloc(sizeof(char) * (strlen(signatureDir) + 50));
+	sprintf(deltaPath, "%s/.delta%lld_%d", signatureDir, current_timestamp_millis(), rand());
+	int deltaFd = open(deltaPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	sprintf(path, "%s/%s", baseDir, filePath);
+	int status = writeDelta(path, sig, deltaFd);
+	close(deltaFd);
+	freeDeltaSignature(sig);
+	
+	long deltaSize = findFileSize(deltaPath);
+	long size = findFileSize(path);
+	if(status != 0 || deltaSize >= size) {
+		// Nothing much in common, whole file is smaller.
+		writeFileDetailsToSocket(filePath, baseDir, socket);
+	} else {
+		printf("Sending changes of %s, %ld of %ld bytes.\n", filePath, deltaSize, size);
+		char buffer[100];
+		sprintf(buffer, "%d:", strlen(filePath));
+		write(socket, buffer, strlen(buffer));
+		write(socket, filePath, strlen(filePath));
+		sprintf(buffer, "d%ld:", deltaSize);
+		write(socket, buffer, strlen(buffer));
+		
+		deltaFd = open(deltaPath, O_RDONLY, 0777);
+		writeNBytesToFile(deltaSize, deltaFd, socket);
+		close(deltaFd);
+	}
+	
+	unlink(deltaPath);
+	free(deltaPath);
+	free(path);
+}
+
+void writeSignaturesToSocket(char **filePaths, int numFiles, char *baseDir, int socket) {
+	char buffer[100];
+	char *sigPath = malloc(sizeof(char) * (strlen(baseDir) + 50));
+	sprintf(sigPath, "%s/.signature%lld_%d", baseDir, current_timestamp_millis(), rand());
+	
+	size_t maxPathLength = 0;
+	int i, numSendable = 0;
+	for(i = 0; i < numFiles; i++) {
+		maxPathLength = strlen(filePaths[i]) > maxPathLength ? strlen(filePaths[i]) : maxPathLength;
+	}
+	char *path = malloc(sizeof(char) * (strlen(baseDir) + maxPathLength + 2));
+	
+	int *sendable = malloc(sizeof(int) * (numFiles > 0 ? numFiles : 1));
+	for(i = 0; i < numFiles; i++) {
+		sprintf(path, "%s/%s", baseDir, filePaths[i]);
+		sendable[i] = findFileSize(path) >= DELTA_MIN_SIZE;
+		numSendable += sendable[i];
+	}
+	
+	sprintf(buffer, "%d:", numSendable);
+	write(socket, buffer, strlen(buffer));
+	
+	for(i = 0; i < numFiles; i++) {
+		if(!sendable[i]) {
+			continue;
+		}
+		sprintf(path, "%s/%s", baseDir, filePaths[i]);
+		int sigFd = open(sigPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+		writeDeltaSignature(path, sigFd);
+		close(sigFd);
+		
+		long size = findFileSize(sigPath);
+		sprintf(buffer, "%d:", strlen(filePaths[i]));
+		write(socket, buffer, strlen(buffer));
+		write(socket, filePaths[i], strlen(filePaths[i]));
+		sprintf(buffer, "%ld:", size);
+		write(socket, buffer, strlen(buffer));
+		
+		sigFd = open(sigPath, O_RDONLY, 0777);
+		writeNBytesToFile(size, sigFd, socket);
+		close(sigFd);
+	}
+	
+	unlink(sigPath);
+	free(sigPath);
+	free(sendable);
+	free(path);
+}
+
+char *readSignaturesFromSocket(int sockToRead, char *baseDir) {
+	SocketBuffer *socketBuffer = createBuffer();
+	readTillDelimiter(socketBuffer, sockToRead, ':');
+	char *numFilesStr = readAllBuffer(socketBuffer);
+	long numFiles = atol(numFilesStr);
+	free(numFilesStr);
+	freeSocketBuffer(socketBuffer);
+	
+	if(numFiles <= 0) {
+		return NULL;
+	}
+	
+	char *signatureDir = malloc(sizeof(char) * (strlen(baseDir) + 50));
+	sprintf(signatureDir, "%s/.signatures%lld_%d", baseDir, current_timestamp_millis(), rand());
+	createDirectory(signatureDir);
+	while(numFiles-- > 0) {
+		writeFileFromSocket(sockToRead, signatureDir);
+	}
+	return signatureDir;
+}
+
+void setObjectStore(char *storeDir, int linkFiles) {
+	objectStoreDir = storeDir;
+	objectStoreLinks = linkFiles;
+	objectStoreAdded = 0;
+}
+
+int hasObject(int hashAlgorithm, const char *hash) {
+	if(objectStoreDir == NULL || hashAlgorithm < 0) {
+		return 0;
+	}
+	char *objPath = objectPath(objectStoreDir, hashAlgorithm, hash);
+	int result = checkFileExists(objPath);
+	free(objPath);
+	return result;
+}
+
+void keepObject(char *path, int hashAlgorithm, const char *hash) {
+	if(objectStoreDir != NULL) {
+		objectStoreAdded += storeObject(objectStoreDir, path, hashAlgorithm, hash, objectStoreLinks);
+	}
+}
+
+int restoreObject(char *path, int hashAlgorithm, const char *hash) {
+	if(!hasObject(hashAlgorithm, hash)) {
+		return 0;
+	}
+	createDirStructureIfNeeded(path);
+	
+	// A damaged object is removed from the store while it is copied.
+	return receiveObject(hash, hashAlgorithm, path, NULL) >= 0 && hasObject(hashAlgorithm, hash);
+}
+
+void trimObjectStore(long long maxBytes) {
+	if(objectStoreDir != NULL) {
+		trimObjects(objectStoreDir, objectStoreAdded, maxBytes);
+		objectStoreAdded = 0;
+	}
+}
+
+HashSet *findObjects(HashSet *offered, int hashAlgorithm) {
+	char *hashes = malloc(offered->count * HASH_STRING_LEN + 1);
+	long i, count = 0;
+	char hash[HASH_STRING_LEN + 1];
+	for(i = 0; i < offered->count; i++) {
+		memcpy(hash, offered->hashes + i * HASH_STRING_LEN, HASH_STRING_LEN);
+		hash[HASH_STRING_LEN] = '\0';
+		if(hasObject(hashAlgorithm, hash)) {
+			memcpy(hashes + count++ * HASH_STRING_LEN, hash, HASH_STRING_LEN);
+		}
+	}
+	return createHashSet(hashes, count);
+}
+
+void writeObjectRefToSocket(char *filePath, const char *hash, int socket) {
+	printf("Sending %s as its hash, the other side has it.\n", filePath);
+	char buffer[100];
+	sprintf(buffer, "%d:", strlen(filePath));
+	write(socket, buffer, strlen(buffer));
+	write(socket, filePath, strlen(filePath));
+	sprintf(buffer, "h%d:", HASH_STRING_LEN);
+	write(socket, buffer, strlen(buffer));
+	write(socket, hash, HASH_STRING_LEN);
+}
+
+void setChunkStore(char *storeDir) {
+	chunkStoreDir = storeDir;
+}
+
+HashSet *createHashSet(char *hashes, long count) {
+	qsort(hashes, count, HASH_STRING_LEN, compareChunkHashes);
+	long i, unique = 0;
+	for(i = 0; i < count; i++) {
+		if(unique == 0 || memcmp(hashes + (unique - 1) * HASH_STRING_LEN, hashes + i * HASH_STRING_LEN, HASH_STRING_LEN) != 0) {
+			memmove(hashes + unique * HASH_STRING_LEN, hashes + i * HASH_STRING_LEN, HASH_STRING_LEN);
+			unique++;
+		}
+	}
+	
+	HashSet *set = malloc(sizeof(HashSet));
+	set->hashes = hashes;
+	set->count = unique;
+	return set;
+}
+
+int hashSetContains(HashSet *set, const char *hash) {
+	return set != NULL && set->count > 0
+		&& bsearch(hash, set->hashes, set->count, HASH_STRING_LEN, compareChunkHashes) != NULL;
+}
+
+void writeHashSet(HashSet *set, int fd) {
+	char buffer[100];
+	sprintf(buffer, "%ld:", set != NULL ? set->count : 0);
+	write(fd, buffer, strlen(buffer));
+	if(set != NULL && set->count > 0) {
+		write(fd, set->hashes, set->count * HASH_STRING_LEN);
+	}
+}
+
+HashSet *readHashSet(int fd) {
+	SocketBuffer *socketBuffer = createBuffer();
+	readTillDelimiter(socketBuffer, fd, ':');
+	char *countStr = readAllBuffer(socketBuffer);
+	long count = atol(countStr);
+	free(countStr);
+	freeSocketBuffer(socketBuffer);
+	
+	count = count > 0 ? count : 0;
+	char *hashes = malloc(count * HASH_STRING_LEN + 1);
+	count = readFully(fd, hashes, count * HASH_STRING_LEN) / (HASH_STRING_LEN);
+	return createHashSet(hashes, count);
+}
+
+void freeHashSet(HashSet *set) {
+	if(set != NULL) {
+		free(set->hashes);
+		free(set);
+	}
+}
+
+HashSet *storedChunks(HashSet *offered) {
+	char *hashes = malloc(offered->count * HASH_STRING_LEN + 1);
+	long i, count = 0;
+	char hash[HASH_STRING_LEN + 1];
+	for(i = 0; i < offered->count; i++) {
+		memcpy(hash, offered->hashes + i * HASH_STRING_LEN, HASH_STRING_LEN);
+		hash[HASH_STRING_LEN] = '\0';
+		if(chunkStoreDir != NULL && hasStoredChunk(chunkStoreDir, hash)) {
+			memcpy(hashes + count++ * HASH_STRING_LEN, hash, HASH_STRING_LEN);
+		}
+	}
+	return createHashSet(hashes, count);
+}
+
+int isChunkedFile(char *baseDir, char *filePath) {
+	char *path = malloc(sizeof(char) * (strlen(baseDir) + strlen(filePath) + 2));
+	sprintf(path, "%s/%s", baseDir, filePath);
+	int result = findFileSize(path) >= CHUNK_MIN_FILE;
+	free(path);
+	return result;
+}
+
+void releaseChunkFiles() {
+	if(chunkedIndex != NULL && chunkedIndex->changed) {
+		saveChunkIndex(chunkedIndex, chunkedDir);
+	}
+	freeChunkIndex(chunkedIndex);
+	free(chunkedDir);
+	free(chunkRefs);
+	chunkedIndex = NULL;
+	chunkedDir = NULL;
+	chunkRefs = NULL;
+	numChunkRefs = 0;
+}
+
+HashSet *chunkFiles(char *baseDir, char **filePaths, int numFiles) {
+	releaseChunkFiles();
+	chunkedDir = strdup(baseDir);
+	chunkedIndex = loadChunkIndex(baseDir);
+	
+	ChunkList **lists = malloc(sizeof(ChunkList *) * (numFiles > 0 ? numFiles : 1));
+	long numChunks = 0;
+	int i, numLists = 0;
+	for(i = 0; i < numFiles; i++) {
+		if(!isChunkedFile(baseDir, filePaths[i])) {
+			continue;
+		}
+		ChunkList *list = findFileChunks(chunkedIndex, baseDir, filePaths[i], chunkStoreDir);
+		if(list != NULL) {
+			lists[numLists++] = list;
+			numChunks += list->count;
+		}
+	}
+	if(chunkedIndex->changed) {
+		saveChunkIndex(chunkedIndex, chunkedDir);
+	}
+	
+	char *hashes = malloc(numChunks * HASH_STRING_LEN + 1);
+	if(chunkStoreDir == NULL) {
+		chunkRefs = malloc(sizeof(ChunkRef) * (numChunks > 0 ? numChunks : 1));
+	}
+	long c = 0;
+	int j;
+	for(i = 0; i < numLists; i++) {
+		for(j = 0; j < lists[i]->count; j++, c++) {
+			memcpy(hashes + c * HASH_STRING_LEN, lists[i]->hashes + j * (HASH_STRING_LEN + 1), HASH_STRING_LEN);
+			if(chunkRefs != NULL) {
+				chunkRefs[c].hash = lists[i]->hashes + j * (HASH_STRING_LEN + 1);
+				chunkRefs[c].list = lists[i];
+				chunkRefs[c].chunk = j;
+			}
 		}
-		write(socket, &c, 1);
+	}
+	if(chunkRefs != NULL) {
+		numChunkRefs = numChunks;
+		qsort(chunkRefs, numChunkRefs, sizeof(ChunkRef), compareChunkRefs);
+	}
+	free(lists);
+	return createHashSet(hashes, numChunks);
+}
+
+void writeFileChunksToSocket(char *filePath, char *baseDir, HashSet *have, int socket) {
+	char *path = malloc(sizeof(char) * (strlen(filePath) + strlen(baseDir) + 2));
+	sprintf(path, "%s/%s", baseDir, filePath);
+	
+	// Chunk lists of the last chunked files are used, if from here.
+	ChunkIndex *index = NULL;
+	if(findFileSize(path) >= CHUNK_MIN_FILE) {
+		index = chunkedIndex != NULL && strcmp(chunkedDir, baseDir) == 0 ? chunkedIndex : loadChunkIndex(baseDir);
+	}
+	ChunkList *list = index != NULL ? findFileChunks(index, baseDir, filePath, chunkStoreDir) : NULL;
+	int fd = list != NULL ? open(path, O_RDONLY, 0777) : -1;
+	if(fd < 0) {
+		writeFileDetailsToSocket(filePath, baseDir, socket);
+		if(index != NULL && index != chunkedIndex) {
+			freeChunkIndex(index);
+		}
+		free(path);
+		return;
 	}
 	
+	char buffer[100];
+	long long length = sprintf(buffer, "%d:", list->count);
+	long long newBytes = 0;
+	int i;
+	for(i = 0; i < list->count; i++) {
+		int has = hashSetContains(have, list->hashes + i * (HASH_STRING_LEN + 1));
+		length += HASH_STRING_LEN + 1 + sprintf(buffer, "%u:", list->length[i]);
+		if(!has) {
+			length += list->length[i];
+			newBytes += list->length[i];
+		}
+	}
+	printf("Sending %s in chunks, %lld of %lld bytes are new.\n", filePath, newBytes, list->size);
+	
+	sprintf(buffer, "%d:", strlen(filePath));
+	write(socket, buffer, strlen(buffer));
+	write(socket, filePath, strlen(filePath));
+	sprintf(buffer, "c%lld:%d:", length, list->count);
+	write(socket, buffer, strlen(buffer));
+	
+	unsigned char *data = malloc(CHUNK_MAX_LENGTH);
+	for(i = 0; i < list->count; i++) {
+		char *hash = list->hashes + i * (HASH_STRING_LEN + 1);
+		int has = hashSetContains(have, hash);
+		write(socket, hash, HASH_STRING_LEN);
+		sprintf(buffer, "%c%u:", has ? '=' : '+', list->length[i]);
+		write(socket, buffer, strlen(buffer));
+		if(!has) {
+			ssize_t n = pread(fd, data, list->length[i], list->offset[i]);
+			if(n < (ssize_t) list->length[i]) {
+				// Changed since chunked, length is kept, its hash shows it.
+				memset(data + (n > 0 ? n : 0), 0, list->length[i] - (n > 0 ? n : 0));
+			}
+			write(socket, data, list->length[i]);
+		}
+	}
+	free(data);
 	close(fd);
+	
+	if(index != chunkedIndex) {
+		if(index->changed) {
+			saveChunkIndex(index, baseDir);
+		}
+		freeChunkIndex(index);
+	}
 	free(path);
 }
 
@@ -300,13 +1113,16 @@ int removeDirectoryCompletely(char *path) {
 This function searches for any file
 */
 int checkForFileMatch(char *filePath, char *dirToSearch, char *prefix) {
+	char hash[HASH_STRING_LEN + 1];
+	computeFileHash(filePath, hash);
+	return checkForHashMatch(hash, HASH_MD5, dirToSearch, prefix);
+}
+
+int checkForHashMatch(char *hash, int hashAlgorithm, char *dirToSearch, char *prefix) {
 	
-	char buffer1[100], buffer2[100];
-	
-	char *path = malloc(sizeof(char) * (strlen(dirToSearch) + 25));
+	char buffer2[100];
 	
-	computeFileHash(filePath, buffer1);
-	buffer1[HASH_STRING_LEN] = '\0';	
+	char *path = malloc(sizeof(char) * (strlen(dirToSearch) + 300));
 	
     DIR *d;
     struct dirent *dir;
@@ -322,11 +1138,11 @@ int checkForFileMatch(char *filePath, char *dirToSearch, char *prefix) {
 				// if file starts with prefix.
 				if(strstr(fName, prefix) == fName) {
 					
-					computeFileHash(path, buffer2);
+					computeFileHashWith(path, buffer2, hashAlgorithm);
 					buffer2[HASH_STRING_LEN] = '\0';	
 					
 					// same file
-					if(strcmp(buffer1, buffer2) == 0) {
+					if(strcmp(hash, buffer2) == 0) {
 						return 1;
 					}
 					
@@ -343,7 +1159,7 @@ int checkForFileMatch(char *filePath, char *dirToSearch, char *prefix) {
 
 void deleteFilesWithPrefix(char *dirToSearch, char *prefix) {
 	
-	char *path = malloc(sizeof(char) * (strlen(dirToSearch) + 25));
+	char *path = malloc(sizeof(char) * (strlen(dirToSearch) + 300));
 	
     DIR *d;
     struct dirent *dir;
@@ -388,13 +1204,39 @@ void copyFile(char *srcFilePath, char *destFilePath) {
     close(dst_fd);	
 }
 
+int cloneFile(char *srcFilePath, char *destFilePath) {
+#ifdef FICLONE
+	int srcFd = open(srcFilePath, O_RDONLY);
+	if(srcFd < 0) {
+		return 0;
+	}
+	int destFd = open(destFilePath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	int cloned = destFd >= 0 && ioctl(destFd, FICLONE, srcFd) == 0;
+	if(destFd >= 0) {
+		close(destFd);
+	}
+	close(srcFd);
+	if(!cloned) {
+		unlink(destFilePath);
+	}
+	return cloned;
+#else
+	return 0;
+#endif
+}
+
 
 void writeNBytesToFile(long nBytes, int sockToRead, int sockToWrite) {	
-	while(nBytes-- > 0) {
-		char c;
-		read(sockToRead, &c, 1);
-		write(sockToWrite, &c, 1);
+	char *data = malloc(HASH_READ_SIZE);
+	while(nBytes > 0) {
+		ssize_t n = read(sockToRead, data, nBytes < HASH_READ_SIZE ? nBytes : HASH_READ_SIZE);
+		if(n <= 0) {
+			break; // Disconnected.
+		}
+		write(sockToWrite, data, n);
+		nBytes -= n;
 	}
+	free(data);
 }
 
 
@@ -405,16 +1247,30 @@ void writeNBytesToFile(long nBytes, int sockToRead, int sockToWrite) {
 // 
 // The server Format is below:
 // numBytes:<content>
+// or for small ones, not compressed: r<numBytes>:<content>
 //
 // Error checking is done before calling this function
-void convertZlibToResponse(int sockFd, char *responseFile, char *baseDir) {
+int convertZlibToResponse(int sockFd, char *responseFile, char *baseDir) {
 	SocketBuffer *socketBuffer = createBuffer();
 	readTillDelimiter(socketBuffer, sockFd, ':');
 	char *numBytesStr = readAllBuffer(socketBuffer);
-	long numBytes = atol(numBytesStr);
+	int raw = numBytesStr[0] == 'r';
+	long numBytes = atol(numBytesStr + raw);
 	
 	printf("Reading %ld bytes from socket\n", numBytes); fflush(stdout);
 	
+	// Small ones come as they are.
+	if(raw) {
+		createDirStructureIfNeeded(responseFile);
+		int writeFd = open(responseFile, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+		writeNBytesToFile(numBytes, sockFd, writeFd);
+		close(writeFd);
+		
+		free(numBytesStr);
+		freeSocketBuffer(socketBuffer);
+		return 0;
+	}
+	
 	char path[100];
 	sprintf(path, "%s/tmp_res%lld_%d", baseDir, current_timestamp(), rand());
 	createDirStructureIfNeeded(path);
@@ -425,31 +1281,378 @@ void convertZlibToResponse(int sockFd, char *responseFile, char *baseDir) {
 	close(writeFd);
 	
 	// now unecrypt data from this file, and write to response file.
-	decompressFile(path, responseFile);
+	int result = decompressFile(path, responseFile, transferDictionary);
 	
 	// delete temp file.
 	unlink(path);
 	
 	free(numBytesStr);
 	freeSocketBuffer(socketBuffer);
+	return result;
 }
 
 
 
 
+void setTransferCodec(int codec) {
+	transferCodec = codec;
+}
+
+void setTransferNegotiated(int negotiated) {
+	transferNegotiated = negotiated;
+}
+
+int isTransferNegotiated() {
+	return transferNegotiated;
+}
+
+int createBodyFile(char *baseDir, char **bodyPath) {
+	*bodyPath = malloc(sizeof(char) * (strlen(baseDir) + 50));
+	sprintf(*bodyPath, "%s/.body%lld_%d", baseDir, current_timestamp_millis(), rand());
+	createDirStructureIfNeeded(*bodyPath);
+	return open(*bodyPath, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+}
+
+void writeBodyToSocket(int sockFd, char *bodyPath, char *baseDir) {
+	if(transferNegotiated) {
+		// Bodies never use the payload dictionary, they are read without.
+		char *dictionary = transferDictionary;
+		transferDictionary = NULL;
+		convertResponseToZlib(sockFd, bodyPath, baseDir);
+		transferDictionary = dictionary;
+	} else {
+		int readFd = open(bodyPath, O_RDONLY, 0777);
+		writeNBytesToFile(findFileSize(bodyPath), readFd, sockFd);
+		close(readFd);
+	}
+	unlink(bodyPath);
+	free(bodyPath);
+}
+
+int openBodyFromSocket(int sockFd, char *baseDir) {
+	if(!transferNegotiated) {
+		return dup(sockFd);
+	}
+	
+	char *path = malloc(sizeof(char) * (strlen(baseDir) + 50));
+	sprintf(path, "%s/.body%lld_%d", baseDir, current_timestamp_millis(), rand());
+	char *dictionary = transferDictionary;
+	transferDictionary = NULL;
+	int result = convertZlibToResponse(sockFd, path, baseDir);
+	transferDictionary = dictionary;
+	
+	// Stays readable till closed.
+	int fd = result == 0 ? open(path, O_RDONLY, 0777) : -1;
+	unlink(path);
+	free(path);
+	return fd;
+}
+
+void createTransferId(char id[]) {
+	sprintf(id, "%012llx%04x%08x", current_timestamp_millis() & 0xffffffffffffLL, getpid() & 0xffff, rand());
+	id[TRANSFER_ID_LEN] = '\0';
+}
+
+int isTransferId(const char *id) {
+	if(strlen(id) != TRANSFER_ID_LEN) {
+		return 0;
+	}
+	int i;
+	for(i = 0; i < TRANSFER_ID_LEN; i++) {
+		if(!isxdigit((unsigned char) id[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int writeStagedToSocket(int sockFd, char *stagedPath, long offset) {
+	long total = findFileSize(stagedPath);
+	if(offset < 0 || offset > total) {
+		offset = 0;
+	}
+
+	char buffer[100];
+	sprintf(buffer, "%ld:%ld:", total, offset);
+	if(write(sockFd, buffer, strlen(buffer)) != strlen(buffer)) {
+		return 0;
+	}
+
+	int readFd = open(stagedPath, O_RDONLY, 0777);
+	lseek(readFd, offset, SEEK_SET);
+	char *data = malloc(HASH_READ_SIZE);
+	long left = total - offset;
+	while(left > 0) {
+		ssize_t n = read(readFd, data, left < HASH_READ_SIZE ? left : HASH_READ_SIZE);
+		if(n <= 0 || write(sockFd, data, n) != n) {
+			break; // Disconnected.
+		}
+		left -= n;
+	}
+	free(data);
+	close(readFd);
+	return left == 0;
+}
+
+int readStagedFromSocket(int sockFd, char *partPath) {
+	SocketBuffer *socketBuffer = createBuffer();
+	readTillDelimiter(socketBuffer, sockFd, ':');
+	char *totalStr = readAllBuffer(socketBuffer);
+	readTillDelimiter(socketBuffer, sockFd, ':');
+	char *offsetStr = readAllBuffer(socketBuffer);
+	long total = atol(totalStr);
+	long offset = atol(offsetStr);
+	int complete = strlen(totalStr) > 0 && strlen(offsetStr) > 0;
+	free(totalStr);
+	free(offsetStr);
+	freeSocketBuffer(socketBuffer);
+	if(!complete) {
+		return 0;
+	}
+
+	if(offset > 0) {
+		printf("Resuming transfer at %ld of %ld bytes\n", offset, total); fflush(stdout);
+	}
+
+	createDirStructureIfNeeded(partPath);
+	int writeFd = open(partPath, O_CREAT | O_WRONLY, 0777);
+	ftruncate(writeFd, offset);
+	lseek(writeFd, offset, SEEK_SET);
+
+	// Every block is written as it comes, all of it is kept on a drop.
+	char *data = malloc(HASH_READ_SIZE);
+	long left = total - offset;
+	while(left > 0) {
+		ssize_t n = read(sockFd, data, left < HASH_READ_SIZE ? left : HASH_READ_SIZE);
+		if(n <= 0) {
+			break; // Disconnected.
+		}
+		write(writeFd, data, n);
+		left -= n;
+	}
+	free(data);
+	close(writeFd);
+	return left == 0;
+}
+
+int unstageTransfer(char *stagedPath, char *responseFile, char *baseDir) {
+	int fd = open(stagedPath, O_RDONLY, 0777);
+	int result = convertZlibToResponse(fd, responseFile, baseDir);
+	close(fd);
+	return result;
+}
+
+void keepConnectionAlive(int sockFd) {
+	int on = 1;
+	setsockopt(sockFd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+	// Probe after 30 idle seconds, give up after 6 unanswered ones.
+	int idle = 30, interval = 10, count = 6;
+	setsockopt(sockFd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(sockFd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+	setsockopt(sockFd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+
+	// Same for data which is sent, and never acknowledged.
+	unsigned int timeout = 90 * 1000;
+	setsockopt(sockFd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+}
+
+void setTransferDictionary(char *dictionaryFile, int send) {
+	transferDictionary = dictionaryFile;
+	transferDictionarySend = send;
+}
+
+unsigned int dictionaryId(char *dictionaryFile) {
+	Dictionary *dict = loadDictionary(dictionaryFile);
+	unsigned int id = dict != NULL ? dict->id : 0;
+	freeDictionary(dict);
+	return id;
+}
+
+void listCodecs(char *preferred, char *buffer) {
+	buffer[0] = '\0';
+	if(preferred != NULL && findCodecByName(preferred) != NULL) {
+		strcpy(buffer, preferred);
+	}
+	
+	int i;
+	for(i = 0; i < NUM_CODECS; i++) {
+		if(preferred != NULL && strcmp(codecs[i].name, preferred) == 0) {
+			continue;
+		}
+		if(buffer[0] != '\0') {
+			strcat(buffer, ",");
+		}
+		strcat(buffer, codecs[i].name);
+	}
+}
+
+int chooseCodec(char *names) {
+	char *copy = strdup(names);
+	char *saveptr = NULL;
+	char *name = strtok_r(copy, ",", &saveptr);
+	int result = CODEC_ZLIB;
+	while(name != NULL) {
+		Codec *codec = findCodecByName(name);
+		if(codec != NULL) {
+			result = codec->id;
+			break;
+		}
+		name = strtok_r(NULL, ",", &saveptr);
+	}
+	free(copy);
+	return result;
+}
+
+const char *codecName(int codec) {
+	Codec *c = findCodec(codec);
+	return c == NULL ? "zlib" : c->name;
+}
+
+int codecFromName(char *name) {
+	Codec *codec = findCodecByName(name);
+	return codec == NULL ? -1 : codec->id;
+}
+
+// Files of these types are compressed already, they are stored as they are.
+static const char *storedExtensions[] = {
+	"zip", "gz", "tgz", "bz2", "xz", "zst", "lz4", "7z", "rar",
+	"jar", "war", "apk", "whl", "docx", "xlsx", "pptx", "odt",
+	"png", "jpg", "jpeg", "gif", "webp", "heic",
+	"mp3", "mp4", "m4a", "mkv", "avi", "mov", "webm", "ogg", "flac",
+	"woff", "woff2", NULL
+};
+
+// Smaller files are left to the block sampling.
+#define STORED_ENTRY_MIN (64 * 1024)
+
+static int hasStoredExtension(char *filePath) {
+	char *name = strrchr(filePath, '/');
+	name = name == NULL ? filePath : name + 1;
+	char *dot = strrchr(name, '.');
+	if(dot == NULL || dot == name) {
+		return 0;
+	}
+
+	int i;
+	for(i = 0; storedExtensions[i] != NULL; i++) {
+		if(strcasecmp(dot + 1, storedExtensions[i]) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Finds the contents of compressed file types in a payload of
+// <numFiles>:<FileNameLen>:<FileName><FileLenBytes>:<FileContents>..
+// With perEntry, every file also starts and ends on block edges.
+static void findPayloadRanges(char *payloadFile, BlockRanges *ranges, int perEntry) {
+	int fd = open(payloadFile, O_RDONLY, 0777);
+	if(fd < 0) {
+		return;
+	}
+	long long size = findFileSize(payloadFile);
+
+	// SocketBuffer reads one byte at a time, so the file offset is
+	// always right after what was read.
+	SocketBuffer *socketBuffer = createBuffer();
+	readTillDelimiter(socketBuffer, fd, ':');
+	char *numFilesStr = readAllBuffer(socketBuffer);
+	long numFiles = atol(numFilesStr);
+	free(numFilesStr);
+
+	long i;
+	for(i = 0; i < numFiles; i++) {
+		long long entryStart = lseek(fd, 0, SEEK_CUR);
+		readTillDelimiter(socketBuffer, fd, ':');
+		char *nameLenStr = readAllBuffer(socketBuffer);
+		long nameLen = atol(nameLenStr);
+		int ended = strlen(nameLenStr) == 0;
+		free(nameLenStr);
+		if(ended) {
+			break; // not a payload.
+		}
+
+		readNBytes(socketBuffer, fd, nameLen);
+		char *filePath = readAllBuffer(socketBuffer);
+
+		readTillDelimiter(socketBuffer, fd, ':');
+		char *contentLenStr = readAllBuffer(socketBuffer);
+		int isEncoded = contentLenStr[0] == 'd' || contentLenStr[0] == 'c' || contentLenStr[0] == 'h';
+		long contentLen = atol(contentLenStr + isEncoded);
+		free(contentLenStr);
+
+		long long start = lseek(fd, 0, SEEK_CUR);
+		if(start < 0 || contentLen < 0 || start + contentLen > size) {
+			free(filePath);
+			break; // not a payload.
+		}
+		if(!isEncoded && contentLen >= STORED_ENTRY_MIN && hasStoredExtension(filePath)) {
+			if(perEntry) {
+				addBlockRange(ranges, entryStart, start, 0);
+			}
+			addBlockRange(ranges, start, start + contentLen, 1);
+		} else if(perEntry) {
+			addBlockRange(ranges, entryStart, start + contentLen, 0);
+		}
+		free(filePath);
+		lseek(fd, contentLen, SEEK_CUR);
+	}
+
+	freeSocketBuffer(socketBuffer);
+	close(fd);
+}
+
+// With a dictionary, every file is compressed on its own, so small
+// files gain from it, and any one can be read without the others.
+static int compressPayloadWith(char *payloadFile, char *outFile, int codec, int archive, Dictionary *dict) {
+	BlockRanges ranges;
+	memset(&ranges, 0, sizeof(ranges));
+	findPayloadRanges(payloadFile, &ranges, dict != NULL);
+
+	int result = compressFile(payloadFile, outFile, codec, archive, &ranges, dict);
+
+	freeBlockRanges(&ranges);
+	return result;
+}
+
+int compressPayload(char *payloadFile, char *outFile, int codec, int archive) {
+	return compressPayloadWith(payloadFile, outFile, codec, archive, NULL);
+}
+
 // This function reads the response file
 // And writes to socket in below format:
 // <contentLen>:<compressed data>
-void convertResponseToZlib(int sockFd, char *responseFile, char *baseDir) {
+// If it does not compress, an empty body is sent, which the peer fails
+// to decompress.
+int convertResponseToZlib(int sockFd, char *responseFile, char *baseDir) {
 	
 	char *path = malloc(sizeof(char) * (strlen(baseDir) + 50));		
+	char buffer[100];
+	
+	// Small ones are not worth compressing, send them as they are.
+	long responseSize = findFileSize(responseFile);
+	if(transferNegotiated && responseSize < RAW_TRANSFER_MAX) {
+		sprintf(buffer, "r%ld:", responseSize);
+		write(sockFd, buffer, strlen(buffer));
+		
+		int readFd = open(responseFile, O_RDONLY, 0777);
+		writeNBytesToFile(responseSize, readFd, sockFd);
+		close(readFd);
+		free(path);
+		return 0;
+	}
 	
 	// convert response file to zlib compressed.
-	char buffer[100];
 	sprintf(path, "%s/tmp_res%lld_%d", baseDir, current_timestamp_millis(), rand());
 	
-	compressFile(responseFile, path);
-	long numBytes = findFileSize(path);
+	Dictionary *dict = transferDictionary != NULL ? loadDictionary(transferDictionary) : NULL;
+	if(dict != NULL) {
+		dict->send = transferDictionarySend;
+	}
+	int result = compressPayloadWith(responseFile, path, transferCodec, 0, dict);
+	freeDictionary(dict);
+	long numBytes = result == 0 ? findFileSize(path) : 0;
 	
 	int readFd = open(path, O_RDONLY, 0777);
 	
@@ -462,6 +1665,7 @@ void convertResponseToZlib(int sockFd, char *responseFile, char *baseDir) {
 	close(readFd);
 	unlink(path);
 	free(path);
+	return result;
 }
 
 
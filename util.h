@@ -5,12 +5,15 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <openssl/md5.h>
+#include <openssl/evp.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
+#include <pthread.h>
 #include "socketBuffer.h"
 
 #define MAX_MSG_SIZE 1024
@@ -20,8 +23,43 @@
 
 static char *MANIFEST_FILE = ".manifest";
 
+// Compression dictionary of a project, on server and client.
+static char *DICTIONARY_FILE = ".dictionary";
+
+// Files are read in blocks of this size for hashing.
+#define HASH_READ_SIZE (256 * 1024)
+
+// Content hash algorithms, the manifest records which one its hashes use.
+// Digests are cut to MD5_DIGEST_LENGTH bytes, so a hash is always
+// HASH_STRING_LEN hex chars whatever the algorithm.
+#define HASH_MD5 0
+#define HASH_SHA256 1
+#define HASH_BLAKE2B 2
+#define NUM_HASH_ALGORITHMS 3
+
+// New projects, and projects pushed to, use this one.
+// SHA-256 has hardware support on current CPUs, and is faster than MD5.
+#define DEFAULT_HASH_ALGORITHM HASH_SHA256
+
+const char *hashAlgorithmName(int algorithm);
+
+// Returns -1 for unknown names.
+int hashAlgorithmFromName(const char *name);
+
+// hex must have space for 2 * len + 1 chars.
+void encodeHex(const unsigned char *digest, int len, char *hex);
+
+// hash must have space for HASH_STRING_LEN + 1 chars.
+// It is left empty if the file can not be opened.
+void computeFileHashWith(char *filename, unsigned char hash[], int algorithm);
+
+// MD5, same as computeFileHashWith(filename, hash, HASH_MD5).
 void computeFileHash(char *filename, unsigned char hash[]);
 
+// Hashes many files on a pool of worker threads.
+// hashes[i] must have space for HASH_STRING_LEN + 1 chars.
+void computeFileHashes(char **filenames, char **hashes, int numFiles, int algorithm);
+
 long long current_timestamp();
 long long current_timestamp_millis();
 
@@ -48,14 +86,222 @@ Format:
 */
 void writeFileFromSocket(int sockToRead, char *baseDir);
 
+// Same, and the contents are hashed with the algorithm while they are
+// written (no hashing if algorithm is -1). Returns the file path, which
+// is relative to baseDir, delete yourself.
+// hash must have space for HASH_STRING_LEN + 1 chars.
+char *receiveFileFromSocket(int sockToRead, char *baseDir, int hashAlgorithm, char hash[]);
+
+// Same, and a file sent as changes (see writeFileDeltaDetailsToSocket)
+// is built from the old copy at the same path in deltaBaseDir.
+char *receiveFileAgainst(int sockToRead, char *baseDir, char *deltaBaseDir, int hashAlgorithm, char hash[]);
+
 void writeFileDetailsToSocket(char *filePath, char *baseDir, int socket);
 
+// Smaller files are always sent whole.
+#define DELTA_MIN_SIZE (64 * 1024)
+
+/*
+Delta transfers (see delta.h). The receiver of modified files first
+sends the signatures of its copies which are big enough:
+<numFiles>:<File1NameLen>:<File1Name><SignatureLenBytes>:<Signature>..
+The sender saves them in a temp directory, and then sends those files
+as the changes against the receiver's copy:
+<FileNameLen>:<FileName>d<DeltaLenBytes>:<Delta>
+*/
+void writeSignaturesToSocket(char **filePaths, int numFiles, char *baseDir, int socket);
+
+// Returns the temp directory in baseDir with the signatures, NULL if
+// there were none. Remove with removeDirectoryCompletely and free.
+char *readSignaturesFromSocket(int sockToRead, char *baseDir);
+
+// Files without a signature in signatureDir are sent whole, like
+// writeFileDetailsToSocket does.
+void writeFileDeltaDetailsToSocket(char *filePath, char *baseDir, char *signatureDir, int socket);
+
+// Set of hashes, sent as <numHashes>:<Hash1><Hash2>..
+typedef struct HashSet {
+	char *hashes;   // HASH_STRING_LEN chars each, sorted.
+	long count;
+} HashSet;
+
+// Takes the malloced hashes (HASH_STRING_LEN chars each), sorts them
+// and drops repeated ones.
+HashSet *createHashSet(char *hashes, long count);
+
+int hashSetContains(HashSet *set, const char *hash);
+void writeHashSet(HashSet *set, int fd);
+
+// Returns an empty set if there is nothing more to read.
+HashSet *readHashSet(int fd);
+void freeHashSet(HashSet *set);
+
+// Smaller files are sent whole, or as changes.
+#define CHUNK_MIN_FILE (1024 * 1024)
+
+/*
+Chunked transfers (see chunker.h). Big files are cut into content
+defined chunks, and the receiver first says which of their hashes it
+already has (in a store, or in files it has). The sender then sends
+those files as their list of chunks, with the data of only the chunks
+the receiver does not have:
+<FileNameLen>:<FileName>c<LenBytes>:<numChunks>:<Hash><'='|'+'><ChunkLen>:<data if '+'>..
+*/
+// Chunks are saved in, and read from, this store (thread local, NULL
+// for none). Keep the path till it is reset.
+void setChunkStore(char *storeDir);
+
+// Chunks the files (relative to baseDir) which are big enough, using
+// the chunk index of baseDir. Without a store, received chunks are read
+// from these files till releaseChunkFiles. Returns their chunks.
+HashSet *chunkFiles(char *baseDir, char **filePaths, int numFiles);
+void releaseChunkFiles();
+
+// Whether the file is big enough to be sent as chunks.
+int isChunkedFile(char *baseDir, char *filePath);
+
+// Chunks of the set which are in the store.
+HashSet *storedChunks(HashSet *offered);
+
+// Sends the file as its chunks, with the data of those not in have
+// (may be NULL). Smaller files are sent whole.
+void writeFileChunksToSocket(char *filePath, char *baseDir, HashSet *have, int socket);
+
+/*
+Object stores (see objects.h). The receiver says which content hashes
+of the files to send it has in its store, and those are sent as just
+their hash:
+<FileNameLen>:<FileName>h<HashLen>:<Hash>
+*/
+
+// Whole files are kept in this store (thread local, NULL for none).
+// With linkFiles, files are hard linked into it and out of it, else
+// they are cloned or copied (files which can be changed in place).
+// Keep the path till it is reset.
+void setObjectStore(char *storeDir, int linkFiles);
+
+int hasObject(int hashAlgorithm, const char *hash);
+
+// Keeps the file in the store. If hard linked, it must not be changed
+// in place afterwards.
+void keepObject(char *path, int hashAlgorithm, const char *hash);
+
+// Builds the file from the object with the hash, linked or copied as
+// set. Returns 0 if the store does not have it, or it was damaged.
+int restoreObject(char *path, int hashAlgorithm, const char *hash);
+
+// Removes the objects kept first, if the store has more bytes.
+void trimObjectStore(long long maxBytes);
+
+// Hashes of the set which are in the store.
+HashSet *findObjects(HashSet *offered, int hashAlgorithm);
+
+void writeObjectRefToSocket(char *filePath, const char *hash, int socket);
+
+// Copies nBytes from one fd to the other.
+void writeNBytesToFile(long nBytes, int sockToRead, int sockToWrite);
+
 int removeDirectoryCompletely(char *path);
 void copyFile(char *srcFilePath, char *destFilePath);
+
+// Copy on write clone of the file (reflink), on file systems which
+// have them. Returns 0 if it could not be cloned.
+int cloneFile(char *srcFilePath, char *destFilePath);
 void deleteFilesWithPrefix(char *dirToSearch, char *prefix);
 int checkForFileMatch(char *filePath, char *dirToSearch, char *prefix);
 
-void convertZlibToResponse(int sockFd, char *responseFile, char *baseDir);
-void convertResponseToZlib(int sockFd, char *responseFile, char *baseDir);
+// Same, for a file whose hash is already known.
+int checkForHashMatch(char *hash, int hashAlgorithm, char *dirToSearch, char *prefix);
+
+// Compressed transfers of this connection use the codec (thread local).
+void setTransferCodec(int codec);
+
+// Set once both sides of this connection named their codecs (thread
+// local). Bodies are then sent compressed, see writeBodyToSocket.
+void setTransferNegotiated(int negotiated);
+int isTransferNegotiated();
+
+// Smaller transfers are sent as they are: r<numBytes>:<data>
+#define RAW_TRANSFER_MAX 1024
+
+/*
+Bodies of responses and requests (manifests, history, .commit and
+.update files) are written to a temp file first, which is sent as
+<numBytes>:<compressed body> (see convertResponseToZlib). To peers of
+older builds, just the body is sent.
+*/
+int createBodyFile(char *baseDir, char **bodyPath);
+
+// Sends the body, the file and bodyPath are deleted.
+void writeBodyToSocket(int sockFd, char *bodyPath, char *baseDir);
+
+// Returns a fd to read the body from, close yourself. -1 if the body
+// could not be decompressed.
+int openBodyFromSocket(int sockFd, char *baseDir);
+
+/*
+Resumable transfers. Checkout and push bodies are staged compressed in
+a file (as convertResponseToZlib sends them) under an id the client
+picks, and sent as
+<totalBytes>:<offset>:<bytes from offset>
+The receiver appends them to a part file. If the connection drops, the
+client names the id again on the next one, and only the rest is sent.
+*/
+#define TRANSFER_ID_LEN 24
+
+// id must have space for TRANSFER_ID_LEN + 1 chars.
+void createTransferId(char id[]);
+
+// Ids are hex chars only, so they can be used in paths.
+int isTransferId(const char *id);
+
+// Sends the staged file from offset. Returns 1 if all of it was written.
+int writeStagedToSocket(int sockFd, char *stagedPath, long offset);
+
+// Adds what is sent to the part file, cut to the offset first.
+// Returns 1 once it has all bytes.
+int readStagedFromSocket(int sockFd, char *partPath);
+
+// Reads the staged body the same as convertZlibToResponse.
+int unstageTransfer(char *stagedPath, char *responseFile, char *baseDir);
+
+// Parallel checkouts use up to this many connections, each gets a
+// shard of the files of about the same bytes.
+#define MAX_CHECKOUT_SHARDS 16
+
+// Dead peers (dropped VPN links) are noticed in a few minutes, instead
+// of the connection hanging till the system gives up on it.
+void keepConnectionAlive(int sockFd);
+
+// Checkout and upgrade payloads of this connection are compressed per
+// file with the dictionary in this file (thread local, NULL for none).
+// Compressing, it is also sent if send is set. Decompressing, a sent
+// dictionary is saved there. Keep the path till it is reset.
+void setTransferDictionary(char *dictionaryFile, int send);
+
+// Id of the dictionary in the file, 0 if there is none.
+unsigned int dictionaryId(char *dictionaryFile);
+
+// Comma separated names of the built-in codecs, preferred one first.
+// buffer must have space for 100 chars.
+void listCodecs(char *preferred, char *buffer);
+
+// First codec in the comma separated list which is built in, zlib if none.
+int chooseCodec(char *names);
+
+const char *codecName(int codec);
+
+// Returns -1 if the codec is not built in.
+int codecFromName(char *name);
+
+// Compresses a payload of files (<numFiles>:<file>..) with the codec.
+// Contents of compressed file types are stored as they are.
+// Returns -1 if it could not be compressed.
+int compressPayload(char *payloadFile, char *outFile, int codec, int archive);
+
+// Returns -1 if the response could not be decompressed.
+int convertZlibToResponse(int sockFd, char *responseFile, char *baseDir);
+// Returns -1 if the response could not be compressed.
+int convertResponseToZlib(int sockFd, char *responseFile, char *baseDir);
 
 #endif
\ No newline at end of file
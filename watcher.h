@@ -0,0 +1,521 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include "manifest.h"
+
+/*
+Watcher of a client project (WTF watch <project>). It runs in the
+background, and appends to .dirty the files changed in the project
+directory, one line each:
+<file path>
+*           anything could have changed (events lost, directory moved)
+!<path>     path is not watched (symlink, or directory inotify refused),
+            files under it are looked at with stat
+@<token> <generation>
+            sync mark, asked for by a client command
+
+Its pid is in .watch. Before commit and update look at files, they
+write <token> <generation> <offset> into .watch.sync and wait for the
+mark in .dirty, so every change made till then is in the file. The
+.index records up to where .dirty was read: index entries of paths
+after that are hashed again, other files are not even looked at. The
+! lines are written again before every sync mark, as long as the path
+is not watched.
+
+The offset of the sync request is where the .index read .dirty up to.
+Once it is WATCH_DIRTY_COMPACT bytes, and of the watcher's generation,
+the watcher drops that part of the file, so .dirty starts at the
+offset, and counts one generation up.
+*/
+
+static char *WATCH_FILE = ".watch";
+static char *DIRTY_FILE = ".dirty";
+static char *WATCH_SYNC_FILE = ".watch.sync";
+
+// How long a client command waits for the watcher's sync mark, in ms.
+#define WATCH_SYNC_TIMEOUT 2000
+
+// More paths than this which are not watched, and * is written instead.
+#define WATCH_MAX_UNWATCHED 64
+
+// Read part of .dirty is dropped once it is this big.
+#define WATCH_DIRTY_COMPACT (64 * 1024)
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE \
+	| IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct Watcher {
+	char *project;
+	int inotifyFd;
+	int dirtyFd;
+	int generation; // times the read part of .dirty was dropped.
+	char **dirs; // watch descriptor -> directory path, "" for project root.
+	int numDirs;
+	PathPool written; // paths written since the last sync mark.
+	PathPool unwatched; // symlinks and directories without a watch.
+} Watcher;
+
+// Returns pid of the project's watcher, 0 if it is not running.
+int readWatcherPid(char *project) {
+	char *path = malloc(sizeof(char) * (strlen(project) + strlen(WATCH_FILE) + 5));
+	sprintf(path, "%s/%s", project, WATCH_FILE);
+
+	int pid = 0;
+	FILE *fp = fopen(path, "r");
+	if(fp != NULL) {
+		if(fscanf(fp, "%d", &pid) != 1 || pid <= 0 || kill(pid, 0) != 0) {
+			pid = 0;
+		}
+		fclose(fp);
+	}
+
+	free(path);
+	return pid;
+}
+
+void writeDirtyLine(Watcher *watcher, char *line) {
+	// One write per line, so readers never see half of it.
+	int len = strlen(line);
+	char *data = malloc(len + 2);
+	memcpy(data, line, len);
+	data[len] = '\n';
+	write(watcher->dirtyFd, data, len + 1);
+	free(data);
+}
+
+void markDirty(Watcher *watcher, char *filePath) {
+	int count = watcher->written.count;
+	findPathInPool(&watcher->written, filePath, 1);
+	if(watcher->written.count > count) {
+		writeDirtyLine(watcher, filePath);
+	}
+}
+
+// Watches the directory and everything under it. Files already in it
+// are marked dirty if markFiles is set (directory was just created).
+void watchDirectory(Watcher *watcher, char *relDir, int markFiles) {
+	char *fullPath = malloc(sizeof(char) * (strlen(watcher->project) + strlen(relDir) + 2));
+	sprintf(fullPath, "%s/%s", watcher->project, relDir);
+
+	int wd = inotify_add_watch(watcher->inotifyFd, fullPath, WATCH_EVENTS | IN_ONLYDIR);
+	if(wd < 0) {
+		// No room for more watches (ENOSPC), or no access.
+		findPathInPool(&watcher->unwatched, relDir, 1);
+		free(fullPath);
+		return;
+	}
+	if(wd >= watcher->numDirs) {
+		int newSize = (wd + 1) * 2;
+		watcher->dirs = realloc(watcher->dirs, sizeof(char *) * newSize);
+		memset(watcher->dirs + watcher->numDirs, 0, sizeof(char *) * (newSize - watcher->numDirs));
+		watcher->numDirs = newSize;
+	}
+	free(watcher->dirs[wd]);
+	watcher->dirs[wd] = strdup(relDir);
+
+	DIR *dir = opendir(fullPath);
+	struct dirent *ent;
+	while(dir != NULL && (ent = readdir(dir)) != NULL) {
+		if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+		char *childPath = malloc(sizeof(char) * (strlen(relDir) + strlen(ent->d_name) + 2));
+		if(relDir[0] == '\0') {
+			strcpy(childPath, ent->d_name);
+		} else {
+			sprintf(childPath, "%s/%s", relDir, ent->d_name);
+		}
+
+		int type = ent->d_type;
+		struct stat st;
+		if(type == DT_UNKNOWN && fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+		}
+
+		// add follows symlinks, but changes behind them are not seen.
+		if(type == DT_LNK) {
+			findPathInPool(&watcher->unwatched, childPath, 1);
+		}
+		if(type == DT_DIR) {
+			watchDirectory(watcher, childPath, markFiles);
+		} else if(markFiles) {
+			markDirty(watcher, childPath);
+		}
+		free(childPath);
+	}
+	if(dir != NULL) {
+		closedir(dir);
+	}
+	free(fullPath);
+}
+
+// Watch descriptor of a moved directory still has its old path. Adding
+// a watch again gives the same descriptor, so walking the project again
+// sets the new paths, and keeps the queued events.
+void refreshWatches(Watcher *watcher) {
+	clearPathPool(&watcher->unwatched);
+	watchDirectory(watcher, "", 0);
+}
+
+// Writes the part of .dirty after readOffset to a new file, which
+// takes its place. readOffset is right after a sync mark.
+void compactDirtyFile(Watcher *watcher, long long readOffset) {
+	long long size = lseek(watcher->dirtyFd, 0, SEEK_END);
+	char last;
+	if(readOffset < WATCH_DIRTY_COMPACT || readOffset > size
+		|| pread(watcher->dirtyFd, &last, 1, readOffset - 1) != 1 || last != '\n') {
+		return;
+	}
+
+	char *path = malloc(sizeof(char) * (strlen(watcher->project) + strlen(DIRTY_FILE) + 10));
+	char *tmpPath = malloc(sizeof(char) * (strlen(watcher->project) + strlen(DIRTY_FILE) + 10));
+	sprintf(path, "%s/%s", watcher->project, DIRTY_FILE);
+	sprintf(tmpPath, "%s.tmp", path);
+
+	int fd = open(tmpPath, O_CREAT | O_RDWR | O_TRUNC | O_APPEND, 0777);
+	char *data = malloc(size - readOffset + 1);
+	ssize_t n = pread(watcher->dirtyFd, data, size - readOffset, readOffset);
+	if(fd >= 0 && n == size - readOffset && write(fd, data, n) == n && rename(tmpPath, path) == 0) {
+		close(watcher->dirtyFd);
+		watcher->dirtyFd = fd;
+		watcher->generation++;
+	} else if(fd >= 0) {
+		close(fd);
+		unlink(tmpPath);
+	}
+
+	free(data);
+	free(tmpPath);
+	free(path);
+}
+
+void writeSyncMark(Watcher *watcher) {
+	char *path = malloc(sizeof(char) * (strlen(watcher->project) + strlen(WATCH_SYNC_FILE) + 5));
+	sprintf(path, "%s/%s", watcher->project, WATCH_SYNC_FILE);
+	char *request = readFileContents(path);
+	free(path);
+	char token[100];
+	int generation;
+	long long readOffset;
+	if(request == NULL || sscanf(request, "%99s %d %lld", token, &generation, &readOffset) != 3) {
+		free(request);
+		return;
+	}
+	free(request);
+
+	if(generation == watcher->generation) {
+		compactDirtyFile(watcher, readOffset);
+	}
+
+	// Paths not watched are not trusted by this client command either.
+	int i;
+	if(watcher->unwatched.count > WATCH_MAX_UNWATCHED) {
+		writeDirtyLine(watcher, "*");
+	}
+	for(i = 0; i < watcher->unwatched.count && watcher->unwatched.count <= WATCH_MAX_UNWATCHED; i++) {
+		char *unwatchedLine = malloc(sizeof(char) * (strlen(watcher->unwatched.paths[i]) + 2));
+		sprintf(unwatchedLine, "!%s", watcher->unwatched.paths[i]);
+		writeDirtyLine(watcher, unwatchedLine);
+		free(unwatchedLine);
+	}
+
+	char *line = malloc(sizeof(char) * (strlen(token) + 50));
+	sprintf(line, "@%s %d", token, watcher->generation);
+	writeDirtyLine(watcher, line);
+	free(line);
+
+	// Paths are written again after the mark, when changed.
+	clearPathPool(&watcher->written);
+}
+
+// Files of the client itself, changed by every command.
+int isWatcherIgnoredFile(char *name) {
+	return strcmp(name, DIRTY_FILE) == 0 || strcmp(name, WATCH_FILE) == 0
+		|| strncmp(name, INDEX_FILE, strlen(INDEX_FILE)) == 0;
+}
+
+// Reads inotify events till the project directory goes away.
+void runWatcher(Watcher *watcher) {
+	char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while(1) {
+		ssize_t len = read(watcher->inotifyFd, buffer, sizeof(buffer));
+		if(len <= 0) {
+			return;
+		}
+
+		char *ptr = buffer;
+		while(ptr < buffer + len) {
+			struct inotify_event *event = (struct inotify_event *) ptr;
+			ptr += sizeof(struct inotify_event) + event->len;
+
+			if(event->mask & IN_Q_OVERFLOW) {
+				writeDirtyLine(watcher, "*");
+				continue;
+			}
+			if(event->wd < 0 || event->wd >= watcher->numDirs || watcher->dirs[event->wd] == NULL) {
+				continue;
+			}
+			char *dirPath = watcher->dirs[event->wd];
+			int isRoot = dirPath[0] == '\0';
+
+			if(event->len == 0) {
+				if(isRoot && (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))) {
+					return; // project is gone.
+				}
+				if(event->mask & IN_IGNORED) {
+					free(watcher->dirs[event->wd]);
+					watcher->dirs[event->wd] = NULL;
+				}
+				continue;
+			}
+
+			if(isRoot && strcmp(event->name, WATCH_SYNC_FILE) == 0) {
+				if(event->mask & IN_CLOSE_WRITE) {
+					writeSyncMark(watcher);
+				}
+				continue;
+			}
+			if(isRoot && isWatcherIgnoredFile(event->name)) {
+				continue;
+			}
+
+			char *filePath = malloc(sizeof(char) * (strlen(dirPath) + strlen(event->name) + 2));
+			if(isRoot) {
+				strcpy(filePath, event->name);
+			} else {
+				sprintf(filePath, "%s/%s", dirPath, event->name);
+			}
+
+			if(event->mask & IN_ISDIR) {
+				if(event->mask & (IN_MOVED_FROM | IN_MOVED_TO)) {
+					writeDirtyLine(watcher, "*");
+					refreshWatches(watcher);
+				}
+				if(event->mask & IN_CREATE) {
+					watchDirectory(watcher, filePath, 1);
+				}
+			} else {
+				// New symlinks are not watched behind either.
+				struct stat st;
+				char *fullPath = malloc(sizeof(char) * (strlen(watcher->project) + strlen(filePath) + 2));
+				sprintf(fullPath, "%s/%s", watcher->project, filePath);
+				if((event->mask & (IN_CREATE | IN_MOVED_TO)) && lstat(fullPath, &st) == 0 && S_ISLNK(st.st_mode)) {
+					findPathInPool(&watcher->unwatched, filePath, 1);
+				}
+				free(fullPath);
+				markDirty(watcher, filePath);
+			}
+			free(filePath);
+		}
+	}
+}
+
+// Starts the watcher in background. Returns its pid once it watches
+// the project, or -1.
+int startWatcher(char *project) {
+	fflush(stdout);
+	int pid = fork();
+	if(pid < 0) {
+		return -1;
+	}
+
+	if(pid == 0) {
+		setsid();
+		int nullFd = open("/dev/null", O_RDWR);
+		dup2(nullFd, 0);
+		dup2(nullFd, 1);
+		dup2(nullFd, 2);
+		close(nullFd);
+
+		Watcher watcher;
+		watcher.project = project;
+		watcher.inotifyFd = inotify_init();
+		watcher.generation = 0;
+		watcher.dirs = NULL;
+		watcher.numDirs = 0;
+		memset(&watcher.written, 0, sizeof(PathPool));
+		memset(&watcher.unwatched, 0, sizeof(PathPool));
+
+		char *path = malloc(sizeof(char) * (strlen(project) + 50));
+		sprintf(path, "%s/%s", project, DIRTY_FILE);
+		watcher.dirtyFd = open(path, O_CREAT | O_RDWR | O_TRUNC | O_APPEND, 0777);
+
+		if(watcher.inotifyFd >= 0 && watcher.dirtyFd >= 0) {
+			watchDirectory(&watcher, "", 0);
+
+			// Watches are in place, now clients can use it.
+			char pidStr[50];
+			sprintf(pidStr, "%d\n", getpid());
+			sprintf(path, "%s/%s", project, WATCH_FILE);
+			int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+			write(fd, pidStr, strlen(pidStr));
+			close(fd);
+
+			runWatcher(&watcher);
+			unlink(path);
+		}
+		exit(0);
+	}
+
+	long long start = current_timestamp_millis();
+	while(current_timestamp_millis() - start < WATCH_SYNC_TIMEOUT) {
+		if(readWatcherPid(project) == pid) {
+			return pid;
+		}
+		usleep(1000);
+	}
+	return -1;
+}
+
+// Asks the watcher for a sync mark, and returns offset in .dirty right
+// after it. -1 if the watcher did not answer. generation is the one of
+// readOffset, and is set to the one of the mark.
+long long syncWithWatcher(char *project, int *generation, long long readOffset) {
+	char *path = malloc(sizeof(char) * (strlen(project) + 50));
+	char token[100];
+	sprintf(token, "%d_%lld_%d", getpid(), current_timestamp_millis(), rand());
+	char *mark = malloc(sizeof(char) * (strlen(token) + 5));
+	sprintf(mark, "@%s ", token);
+
+	sprintf(path, "%s/%s", project, DIRTY_FILE);
+	struct stat st;
+	long long scanFrom = stat(path, &st) == 0 ? st.st_size : -1;
+	ino_t inode = st.st_ino;
+
+	char request[200];
+	sprintf(request, "%s %d %lld", token, *generation, readOffset);
+	sprintf(path, "%s/%s", project, WATCH_SYNC_FILE);
+	int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	write(fd, request, strlen(request));
+	close(fd);
+
+	long long result = -1;
+	sprintf(path, "%s/%s", project, DIRTY_FILE);
+	long long start = current_timestamp_millis();
+	while(result < 0 && scanFrom >= 0 && current_timestamp_millis() - start < WATCH_SYNC_TIMEOUT) {
+		usleep(500);
+
+		int dirtyFd = open(path, O_RDONLY);
+		if(dirtyFd < 0) {
+			break;
+		}
+		fstat(dirtyFd, &st);
+		// The watcher dropped the read part, the mark is in the new file.
+		if(st.st_ino != inode) {
+			inode = st.st_ino;
+			scanFrom = 0;
+		}
+		long long size = st.st_size;
+		if(size > scanFrom) {
+			char *data = malloc(size - scanFrom + 1);
+			ssize_t n = pread(dirtyFd, data, size - scanFrom, scanFrom);
+			data[n > 0 ? n : 0] = '\0';
+
+			// Lines are written whole, so scanFrom is at a line start.
+			char *line = data;
+			char *nl;
+			while((nl = strchr(line, '\n')) != NULL) {
+				if(strncmp(line, mark, strlen(mark)) == 0) {
+					*generation = atoi(line + strlen(mark));
+					result = scanFrom + (nl + 1 - data);
+					break;
+				}
+				line = nl + 1;
+			}
+			free(data);
+		}
+		close(dirtyFd);
+	}
+
+	free(mark);
+	free(path);
+	return result;
+}
+
+// Syncs with the project's watcher, and marks index entries of files
+// changed since the index last read .dirty to be hashed again. Other
+// entries can then be used without stat.
+void loadWatcherDirtySet(FileIndex *index) {
+	int pid = readWatcherPid(index->project);
+	long long readOffset = index->watcherPid == pid ? index->dirtyOffset : 0;
+	int generation = index->dirtyGeneration;
+	long long offset = pid == 0 ? -1 : syncWithWatcher(index->project, &generation, readOffset);
+	if(offset < 0) {
+		if(index->watcherPid != 0) {
+			index->watcherPid = 0;
+			index->changed = 1;
+		}
+		return;
+	}
+
+	// The part the index read was dropped, .dirty starts where it was.
+	if(index->watcherPid == pid && generation == index->dirtyGeneration + 1 && readOffset >= WATCH_DIRTY_COMPACT) {
+		index->dirtyOffset = 0;
+		index->dirtyGeneration = generation;
+		index->changed = 1;
+	}
+
+	int watched = index->watcherPid == pid && index->dirtyGeneration == generation && index->dirtyOffset <= offset;
+	if(watched && index->dirtyOffset < offset) {
+		char *path = malloc(sizeof(char) * (strlen(index->project) + 50));
+		sprintf(path, "%s/%s", index->project, DIRTY_FILE);
+		int fd = open(path, O_RDONLY);
+		free(path);
+
+		long long len = offset - index->dirtyOffset;
+		char *data = malloc(len + 1);
+		ssize_t n = fd < 0 ? -1 : pread(fd, data, len, index->dirtyOffset);
+		data[n > 0 ? n : 0] = '\0';
+		if(fd >= 0) {
+			close(fd);
+		}
+		if(n != len) {
+			watched = 0;
+		}
+
+		char *line = data;
+		while(watched && *line != '\0') {
+			char *nl = strchr(line, '\n');
+			if(nl == NULL) {
+				break;
+			}
+			*nl = '\0';
+
+			if(strcmp(line, "*") == 0) {
+				watched = 0;
+			} else if(line[0] == '!') {
+				addUnwatchedPath(index, line + 1);
+			} else if(line[0] != '@') {
+				IndexEntry *entry = findIndexEntry(index, findInternedPath(line));
+				if(entry != NULL) {
+					entry->mtimeNs = -1;
+					index->changed = 1;
+				}
+			}
+			line = nl + 1;
+		}
+		free(data);
+	}
+
+	if(index->dirtyGeneration != generation) {
+		index->changed = 1;
+	}
+	index->watcherPid = pid;
+	index->dirtyOffset = offset;
+	index->dirtyGeneration = generation;
+	index->watched = watched;
+
+	// Without a usable dirty set, files are looked at with stat, and
+	// those which are not could have changed before the watcher.
+	if(!watched) {
+		index->watchStarted = 1;
+		index->changed = 1;
+	}
+}
+
+#endif